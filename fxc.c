@@ -32,11 +32,22 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <poll.h>
+#include <time.h>
+#include <malloc.h>
 
 #include "winnt_types.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "log.h"
+#include "vfs.h"
+#include "slab.h"
+
+// mallinfo2() first appeared in glibc 2.33.
+#if defined(__GLIBC_PREREQ)
+# if __GLIBC_PREREQ(2, 33)
+#  define HAVE_MALLINFO2
+# endif
+#endif
 
 // Any usage limits to prevent bugs disrupting system.
 const struct rlimit kUsageLimits[] = {
@@ -193,6 +204,133 @@ HRESULT (WINAPI* D3DDisassemble)(
     ID3DBlob **ppDisassembly
 );
 
+// Phases reported by -timings, in the order they run. Include I/O happens
+// during preprocessing or compilation, so it's counted in both.
+enum {
+    PHASE_LOAD,
+    PHASE_LINK,
+    PHASE_DLLMAIN,
+    PHASE_READ,
+    PHASE_INCLUDE,
+    PHASE_PREPROCESS,
+    PHASE_COMPILE,
+    PHASE_DISASSEMBLE,
+    PHASE_WRITE,
+    PHASE_COUNT,
+};
+
+static struct {
+    const char *name;
+    unsigned count;
+    uint64_t wall;
+    uint64_t cpu;
+} Phases[PHASE_COUNT] = {
+    [PHASE_LOAD]        = { "pe_load_library" },
+    [PHASE_LINK]        = { "link_pe_images" },
+    [PHASE_DLLMAIN]     = { "DllMain" },
+    [PHASE_READ]        = { "source_read" },
+    [PHASE_INCLUDE]     = { "include_io" },
+    [PHASE_PREPROCESS]  = { "D3DPreprocess" },
+    [PHASE_COMPILE]     = { "D3DCompile" },
+    [PHASE_DISASSEMBLE] = { "D3DDisassemble" },
+    [PHASE_WRITE]       = { "output_write" },
+};
+
+typedef struct {
+    uint64_t wall;
+    uint64_t cpu;
+} PHASE_CLOCK;
+
+static enum { TIMINGS_NONE, TIMINGS_TEXT, TIMINGS_JSON } Timings;
+
+static unsigned IncludeOpens;
+static uint64_t IncludeBytes;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void phase_begin(PHASE_CLOCK *start)
+{
+    if (Timings == TIMINGS_NONE)
+        return;
+
+    start->wall = clock_ns(CLOCK_MONOTONIC);
+    start->cpu  = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void phase_end(unsigned phase, const PHASE_CLOCK *start)
+{
+    if (Timings == TIMINGS_NONE)
+        return;
+
+    Phases[phase].wall += clock_ns(CLOCK_MONOTONIC) - start->wall;
+    Phases[phase].cpu  += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - start->cpu;
+    Phases[phase].count++;
+}
+
+// Written to stderr at exit, so failed compiles are reported too.
+static void print_timings(void)
+{
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+#else
+    // The older interface has int fields, which is fine on a 32-bit host.
+    struct mallinfo info = mallinfo();
+#endif
+    struct rusage usage;
+    uint64_t heap;
+    bool first = true;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    heap = (size_t) info.uordblks + (size_t) info.hblkhd + slab_mapped();
+
+    if (Timings == TIMINGS_JSON) {
+        fprintf(stderr, "{\"phases\":{");
+        for (unsigned i = 0; i < PHASE_COUNT; i++) {
+            if (Phases[i].count == 0)
+                continue;
+            fprintf(stderr, "%s\"%s\":{\"calls\":%u,\"wall_ns\":%llu,\"cpu_ns\":%llu}",
+                    first ? "" : ",",
+                    Phases[i].name,
+                    Phases[i].count,
+                    (unsigned long long) Phases[i].wall,
+                    (unsigned long long) Phases[i].cpu);
+            first = false;
+        }
+        fprintf(stderr, "},\"peak_rss_kb\":%ld,\"heap_bytes\":%llu,\"include_opens\":%u,\"include_bytes\":%llu}\n",
+                usage.ru_maxrss,
+                (unsigned long long) heap,
+                IncludeOpens,
+                (unsigned long long) IncludeBytes);
+        return;
+    }
+
+    fprintf(stderr, "%-16s %6s %12s %12s\n", "phase", "calls", "wall ms", "cpu ms");
+
+    for (unsigned i = 0; i < PHASE_COUNT; i++) {
+        if (Phases[i].count == 0)
+            continue;
+        fprintf(stderr, "%-16s %6u %12.3f %12.3f\n",
+                Phases[i].name,
+                Phases[i].count,
+                Phases[i].wall / 1e6,
+                Phases[i].cpu / 1e6);
+    }
+
+    fprintf(stderr, "peak rss %ld KB, heap %llu bytes, %u includes opened (%llu bytes)\n",
+            usage.ru_maxrss,
+            (unsigned long long) heap,
+            IncludeOpens,
+            (unsigned long long) IncludeBytes);
+}
+
 void print_usage()
 {
     printf("Usage: fxc <options> <files>\n");
@@ -244,6 +382,7 @@ void print_usage()
 //  printf("\n");
     printf("   -D <id>=<text>      define macro\n");
     printf("   -LD <version>       Load specified D3DCompiler version\n");
+    printf("   -timings[=json]     report time and memory used by each phase to stderr\n");
 //  printf("   -nologo             suppress copyright message\n");
     printf("\n");
     printf("   <profile>: cs_4_0 cs_4_1 cs_5_0 ds_5_0 fx_2_0 fx_4_0 fx_4_1 fx_5_0 gs_4_0\n");
@@ -356,10 +495,19 @@ PVOID read_stream(INT fd, SIZE_T* pSize)
 
 PVOID read_file(INT dir, LPCSTR pFileName, SIZE_T* pSize)
 {
-    int file = openat(dir, pFileName, O_RDONLY);
+    const VFS_ENTRY *entry;
     PBYTE data = NULL;
-    
-    if (file == -1)
+    int file;
+
+    // Files in the pack are relative to the working directory, and are
+    // returned straight out of the mapping.
+    if (dir == AT_FDCWD && (entry = vfs_lookup(pFileName))) {
+        if (pSize)
+            *pSize = entry->size;
+        return (PVOID) vfs_data(entry);
+    }
+
+    if ((file = openat(dir, pFileName, O_RDONLY)) == -1)
         return NULL;
     
     data = read_stream(file, pSize);
@@ -367,6 +515,12 @@ PVOID read_file(INT dir, LPCSTR pFileName, SIZE_T* pSize)
     return data;
 }
 
+VOID free_file(PVOID pData)
+{
+    if (!vfs_contains(pData))
+        free(pData);
+}
+
 INT create_file(PCHAR pFileName)
 {
     if (!pFileName)
@@ -386,6 +540,10 @@ HRESULT WINAPI include_open(ID3D10Include* This, D3D_INCLUDE_TYPE IncludeType, L
     if (!ppData)
         return STATUS_INVALID_PARAMETER;
 
+    PHASE_CLOCK start;
+
+    phase_begin(&start);
+
     // TODO: Change working directory to the directory of the parent include file
     for (int i = 0; i < FXC_MAX_INCLUDES && This->includeDirs[i] != -1; i++) {
         SIZE_T size;
@@ -393,16 +551,20 @@ HRESULT WINAPI include_open(ID3D10Include* This, D3D_INCLUDE_TYPE IncludeType, L
         if (*ppData) {
             if (pBytes)
                 *pBytes = (UINT)size;
+            IncludeOpens++;
+            IncludeBytes += size;
+            phase_end(PHASE_INCLUDE, &start);
             return STATUS_SUCCESS;
         }
     }
 
+    phase_end(PHASE_INCLUDE, &start);
     return STATUS_FAILURE;
 }
 
 HRESULT WINAPI include_close(ID3D10Include* This, PVOID pData)
 {
-    free(pData);
+    free_file(pData);
     return STATUS_SUCCESS;
 }
 
@@ -416,10 +578,18 @@ HRESULT WINAPI pipe_include_open(ID3D10Include* This, D3D_INCLUDE_TYPE IncludeTy
     printf(IncludeType == D3D_INCLUDE_LOCAL ? "#include \"%s\"\n" : "#include <%s>\n", pFileName);
 
     SIZE_T size;
+    PHASE_CLOCK start;
+
+    phase_begin(&start);
+
     *ppData = read_stream(STDIN_FILENO, &size);
+    phase_end(PHASE_INCLUDE, &start);
+
     if (*ppData) {
         if (pBytes)
             *pBytes = (UINT)size;
+        IncludeOpens++;
+        IncludeBytes += size;
         return STATUS_SUCCESS;
     }
 
@@ -443,6 +613,7 @@ int main(int argc, char **argv)
     ID3DBlob *pCode = NULL, *pError = NULL;
     D3D_SHADER_MACRO defines[FXC_MAX_MACROS + 1] = { { NULL, NULL } };
     ID3DInclude includer = { &include_vtbl, { AT_FDCWD, -1 } };
+    PHASE_CLOCK start;
 
     struct pe_image image = {
         .entry  = NULL,
@@ -471,6 +642,8 @@ int main(int argc, char **argv)
 
         {"Cc", no_argument, &flagsBitAsm, D3D_DISASM_ENABLE_COLOR_CODE},
         {"Ni", no_argument, &flagsBitAsm, D3D_DISASM_ENABLE_INSTRUCTION_NUMBERING},
+
+        {"timings", optional_argument, NULL, 't'},
         {0, 0, 0, 0}
     };
 
@@ -546,6 +719,16 @@ int main(int argc, char **argv)
                 print_error("Too many macros defined (%d)", defineIndex);
             }
             break;
+            case 't':
+                if (Timings == TIMINGS_NONE)
+                    atexit(print_timings);
+                if (optarg && strcmp(optarg, "json") == 0)
+                    Timings = TIMINGS_JSON;
+                else if (optarg && strcmp(optarg, "text") != 0)
+                    print_error("Unknown timings format '%s'", optarg);
+                else
+                    Timings = TIMINGS_TEXT;
+            break;
             case '?':
                 print_usage();
             break;
@@ -584,13 +767,17 @@ int main(int argc, char **argv)
         assemblyFile = STDOUT_FILENO;
 
     // Load the D3DCompiler module.
+    phase_begin(&start);
     if (pe_load_library(image.name, &image.image, &image.size) == false) {
         LogMessage("You must add the dll and vdm files to the engine directory");
         return EXIT_FAILURE;
     }
+    phase_end(PHASE_LOAD, &start);
 
     // Handle relocations, imports, etc.
+    phase_begin(&start);
     link_pe_images(&image, 1);
+    phase_end(PHASE_LINK, &start);
 
     if (get_export("D3DCompile", &D3DCompile) == -1) {
         if (get_export("D3DCompileFromMemory", &D3DCompile) == -1) {
@@ -627,7 +814,9 @@ int main(int argc, char **argv)
     setup_nt_threadinfo(ExceptionHandler);
 
     // Call DllMain()
+    phase_begin(&start);
     image.entry("FXC", DLL_PROCESS_ATTACH, NULL);
+    phase_end(PHASE_DLLMAIN, &start);
 
     // Install usage limits to prevent system crash.
     setrlimit(RLIMIT_CORE, &kUsageLimits[RLIMIT_CORE]);
@@ -644,11 +833,17 @@ int main(int argc, char **argv)
         print_error("Too many files specified ('%s' was the last one)", argv[argc - 1]);
     else {
         SIZE_T srcSize;
-        PVOID srcData = read_file(AT_FDCWD, argv[optind], &srcSize);
-        
+        PVOID srcData;
+
+        phase_begin(&start);
+        srcData = read_file(AT_FDCWD, argv[optind], &srcSize);
+        phase_end(PHASE_READ, &start);
+
         if (!srcData)
             fprintf(stderr, "failed to open file: %s\n", argv[optind]);
 
+        phase_begin(&start);
+
         if (processFile != -1) {
             hr = D3DPreprocess(
                 srcData,
@@ -674,8 +869,10 @@ int main(int argc, char **argv)
                 &pError
             );
         }
-        
-        free(srcData);
+
+        phase_end(processFile != -1 ? PHASE_PREPROCESS : PHASE_COMPILE, &start);
+
+        free_file(srcData);
     }
 
     if (pError) {
@@ -690,6 +887,8 @@ int main(int argc, char **argv)
         PBYTE out = (PBYTE)ID3D10Blob_GetBufferPointer(pCode);
         SIZE_T size = ID3D10Blob_GetBufferSize(pCode);
 
+        phase_begin(&start);
+
         if (headerFile != -1) {
             dprintf(headerFile, "const unsigned char g_%s[] =\n{\n    ", entryPoint);
             for (SIZE_T i = 0; i < size; i++) {
@@ -722,16 +921,22 @@ int main(int argc, char **argv)
                 close(processFile);
         }
 
+        phase_end(PHASE_WRITE, &start);
+
         if (assemblyFile != -1) {
             ID3DBlob *disassm;
+            phase_begin(&start);
             hr = D3DDisassemble(out, size, flagsAsm, cmdLine, &disassm);
+            phase_end(PHASE_DISASSEMBLE, &start);
             if (hr != 0 || !pCode) {
                 fprintf(stderr, "disassembly failed; no disassembly produced\n");
             } else {
                 out = (PBYTE)ID3D10Blob_GetBufferPointer(disassm);
                 size = ID3D10Blob_GetBufferSize(disassm);
+                phase_begin(&start);
                 SIZE_T wrote = write(assemblyFile, out, size);
                 assert(wrote == size);
+                phase_end(PHASE_WRITE, &start);
                 ID3D10Blob_Release(disassm);
             }
             if (assemblyFile != STDOUT_FILENO)
@@ -1,12 +1,18 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/user.h>
 #include "libdis.h"
 #include "hook.h"
+#include "stats.h"
 
 // Routines to intercept or redirect routines.
 // Author: Tavis Ormandy
@@ -21,53 +27,93 @@
 // instruction (where 16 is the longest possible instruction intel allows).
 #define MAX_REDIRECT_LENGTH 24
 
+// Set in the encoded size if the fixup saves registers for HOOK_FASTCALL.
+#define ENCODED_SIZE_FASTCALL 0x100
+
+static const uint8_t FastcallSave[]     = { X86_OPCODE_PUSH_EAX, X86_OPCODE_PUSH_ECX, X86_OPCODE_PUSH_EDX };
+static const uint8_t FastcallRestore[]  = { X86_OPCODE_POP_EDX, X86_OPCODE_POP_ECX, X86_OPCODE_POP_EAX };
+
+static DECLARE_STATS_GAUGE(HooksActive, "hooks.active");
+
 static void __attribute__((constructor)) init(void)
 {
     // Initialize libdisasm.
     x86_init(opt_none, NULL, NULL);
 }
 
-// Intercept calls to this function and execute redirect first. Depending on
-// flags, you can either replace this function, or simply be inserted into the
-// call chain.
-//  function    The address of the function you want intercepted.
-//  redirect    Your callback function. The prototype should be the same as
-//              function, except an additional first parameter which you can
-//              ignore (it's the return address for the caller).
-//  flags       Options, see header file for flags available. Use HOOK_DEFAULT
-//              if you don't need any.
-//
-// Remember to add an additional parameter to your redirect, e.g. if you were
-// expecting tcp_input(struct mbuf *m, int len), your redirect should be:
+// Size of each mapping that fixups are carved from.
+#define TRAMPOLINE_CHUNK_SIZE   (256 * 1024)
+
+// Fixups are packed into dedicated mappings rather than the heap, so no data
+// page is ever made executable. Outside of a batch, the whole arena is read
+// and execute only.
+static struct {
+    uint8_t *next;
+    uint8_t *end;
+} TrampolineArena;
+
+static pthread_mutex_t TrampolineLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reserve size contiguous bytes of the arena, the lock must be held.
+static uint8_t *trampoline_reserve(size_t size)
+{
+    uint8_t *chunk;
+    size_t chunksize;
+
+    if (TrampolineArena.next == NULL || TrampolineArena.end - TrampolineArena.next < size) {
+        chunksize = (size + TRAMPOLINE_CHUNK_SIZE - 1) & ~(TRAMPOLINE_CHUNK_SIZE - 1);
+        chunk     = mmap(NULL, chunksize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (chunk == MAP_FAILED) {
+            printf("error: failed to map %u bytes for redirect fixups, %m\n", chunksize);
+            return NULL;
+        }
+
+        // The remainder of the old chunk is abandoned.
+        TrampolineArena.next = chunk;
+        TrampolineArena.end  = chunk + chunksize;
+    }
+
+    chunk = TrampolineArena.next;
+
+    TrampolineArena.next += size;
+
+    return chunk;
+}
+
+// Change the protection of every page in [start, start + size).
+static bool trampoline_protect(uint8_t *start, size_t size, int prot)
+{
+    uintptr_t first = (uintptr_t)(start) & PAGE_MASK;
+    uintptr_t last  = ((uintptr_t)(start) + size + PAGE_SIZE - 1) & PAGE_MASK;
+
+    if (mprotect((void *) first, last - first, prot) != 0) {
+        printf("mprotect() failed on fixups => %p (%m), try `sudo setenforce 0`\n", start);
+        return false;
+    }
+
+    return true;
+}
+
+// Keep disassembling until I have enough bytes of code to store my redirect,
+// five bytes for the redirect call, and four bytes to record the length to
+// restore when we're unloaded. Returns the number of bytes, or zero if the
+// function can't be redirected.
 //
-// my_tcp_input(intptr_t retaddr, struct mbuf *m, int len);
+// XXX: If there is a branch target or return within the first 9 bytes, I'm
+//      screwed. Seems unlikely though, so I'm not worrying about it right
+//      now. I could at least check for rets?
 //
-// *UNLESS* You are using the flag HOOK_REPLACE_FUNCTION, in which case the
-// prototype is the same, as you literally become the function instead of
-// intercepting it.
-bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
+static size_t redirect_length(void *function, uint32_t flags)
 {
-    size_t              redirectsize    = 0;
-    unsigned            insncount       = 0;
-    struct branch      *fixup;
-    struct branch      *callsite;
-    struct branch      *restore;
-    struct encodedsize *savedoffset;
+    size_t redirectsize;
 
-    // Keep disassembling until I have enough bytes of code to store my
-    // redirect, five bytes for the redirect call, and four bytes to record the
-    // length to restore when we're unloaded.
-    //
-    // XXX: If there is a branch target or return within the first 9 bytes, I'm
-    //      screwed. Seems unlikely though, so I'm not worrying about it right
-    //      now. I could at least check for rets?
-    //
-    for (redirectsize = 0; redirectsize < sizeof(struct branch) + sizeof(struct encodedsize); insncount++) {
-        x86_insn_t      insn            = {0};
+    for (redirectsize = 0; redirectsize < sizeof(struct branch) + sizeof(struct encodedsize); ) {
+        x86_lean_insn_t insn;
         ssize_t         insnlength      =  0;
 
         // Test if libdisasm understood the instruction
-        if ((insnlength = x86_disasm(function, MAX_REDIRECT_LENGTH, (uintptr_t)(function), redirectsize, &insn))) {
+        if ((insnlength = x86_disasm_lean(function, MAX_REDIRECT_LENGTH, (uintptr_t)(function), redirectsize, &insn))) {
 
             // Valid, increment size.
             redirectsize += insnlength;
@@ -75,20 +121,14 @@ bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
             // Check for branches just to be safe, as these instructions are
             // relative and cannot be relocated safely (there are others of
             // course, but these are the most likely).
-            if (insn.group == insn_controlflow && flags != HOOK_REPLACE_FUNCTION) {
+            if (insn.group == insn_controlflow && !(flags & HOOK_REPLACE_FUNCTION)) {
                 printf("error: refusing to redirect function %p due to early controlflow manipulation (+%u)\n",
                        function,
                        redirectsize);
 
-                // Clean up.
-                x86_oplist_free(&insn);
-
-                return false;
+                return 0;
             }
 
-            // Clean up.
-            x86_oplist_free(&insn);
-
             // Next instuction.
             continue;
         }
@@ -99,48 +139,75 @@ bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
                function,
                redirectsize);
 
-        return false;
+        return 0;
     }
 
-    // We need to create a fixup, a small chunk of code that repairs the damage
-    // we did redirecting the function. This basically handles calling the
-    // redirect, then fixes the damage and restores execution. So it's going to be
-    // redirectsize + 2 * sizeof(struct branch) bytes, which looks like this:
-    //
-    // call      your_routine              ; 5 bytes
-    // <code clobbered to get here>             ; redirectsize bytes
-    // jmp       original_routine+redirectsize  ; 5 bytes
-    //
-    // Your routine will get an extra first argument which you should
-    // ignore, e.g.
-    //
-    //  void your_routine(uintptr_t retaddr, int expected_arg1, void *expected_arg2, etc);
-    //
-    // If you replace the function instead of redirect it, you don't get the extra
-    // parameter, because we literally just jmp to your routine instead of call
-    // it. The call operand is a relative, displaced address, hence the
-    // calculation.
-    //
+    return redirectsize;
+}
+
+static inline bool fixup_saves_registers(uint32_t flags)
+{
+    return (flags & HOOK_FASTCALL) && !(flags & HOOK_REPLACE_FUNCTION);
+}
+
+// Where the clobbered code starts within a fixup.
+static inline size_t fixup_code_offset(bool fastcall)
+{
+    return sizeof(struct branch) + (fastcall ? sizeof FastcallSave + sizeof FastcallRestore : 0);
+}
+
+static inline size_t fixup_length(size_t redirectsize, uint32_t flags)
+{
+    return fixup_code_offset(fixup_saves_registers(flags)) + redirectsize + sizeof(struct branch);
+}
+
+// We need to create a fixup, a small chunk of code that repairs the damage
+// we did redirecting the function. This basically handles calling the
+// redirect, then fixes the damage and restores execution. So it's going to be
+// redirectsize + 2 * sizeof(struct branch) bytes, which looks like this:
+//
+// call      your_routine              ; 5 bytes
+// <code clobbered to get here>             ; redirectsize bytes
+// jmp       original_routine+redirectsize  ; 5 bytes
+//
+// Your routine will get an extra first argument which you should
+// ignore, e.g.
+//
+//  void your_routine(uintptr_t retaddr, int expected_arg1, void *expected_arg2, etc);
+//
+// If you replace the function instead of redirect it, you don't get the extra
+// parameter, because we literally just jmp to your routine instead of call
+// it. The call operand is a relative, displaced address, hence the
+// calculation.
+//
+// HOOK_FASTCALL fixups wrap the call with three pushes and pops, see
+// struct hook_registers.
+//
+static void install_redirect(void *function, void *redirect, uint32_t flags, size_t redirectsize, uint8_t *fixup)
+{
+    bool                fastcall        = fixup_saves_registers(flags);
+    struct branch      *call;
+    struct branch      *callsite;
+    struct branch      *restore;
+    struct encodedsize *savedoffset;
+    uint8_t            *code;
+
+    call = (struct branch *)(fastcall ? mempcpy(fixup, FastcallSave, sizeof FastcallSave) : fixup);
 
-    fixup               = calloc(redirectsize + sizeof(struct branch) * 2, 1);
-    fixup->opcode       = flags & HOOK_REPLACE_FUNCTION
+    call->opcode        = flags & HOOK_REPLACE_FUNCTION
                                 ? X86_OPCODE_JMP_NEAR
                                 : X86_OPCODE_CALL_NEAR;
-    fixup->operand.i    = (uintptr_t)(redirect)
-                        - (uintptr_t)(fixup)
+    call->operand.i     = (uintptr_t)(redirect)
+                        - (uintptr_t)(call)
                         - (uintptr_t)(sizeof(struct branch));
 
-    // Fix permissions on the redirect.
-    if (mprotect((void *)((uintptr_t) fixup & PAGE_MASK), PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
-        printf("mprotect() failed on stub => %p (%m), try `sudo setenforce 0`\n", fixup);
-        return false;
-    }
+    code = fastcall ? mempcpy(call->data, FastcallRestore, sizeof FastcallRestore) : call->data;
 
     // Copy over the code we are going to clobber by installing the redirect.
-    memcpy(&fixup->data, function, redirectsize);
+    memcpy(code, function, redirectsize);
 
     // And install a branch to restore execution to the rest of the original routine.
-    restore             = (void *)(fixup->data + redirectsize);
+    restore             = (void *)(code + redirectsize);
     restore->opcode     = X86_OPCODE_JMP_NEAR;
     restore->operand.i  = (uintptr_t)(function)
                         + (uintptr_t)(redirectsize)
@@ -174,7 +241,7 @@ bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
     savedoffset          = (void *)(callsite->data);
     savedoffset->prefix  = X86_PREFIX_DATA16;
     savedoffset->opcode  = X86_OPCODE_MOV_EAX_IMM;
-    savedoffset->operand = redirectsize;
+    savedoffset->operand = redirectsize | (fastcall ? ENCODED_SIZE_FASTCALL : 0);
 
     // Clean up the left over slack bytes (not acutally needed, as we're careful to
     // restore execution to the next valid instructions, but intended to make
@@ -190,7 +257,116 @@ bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
     //       redirect,
     //       fixup);
 
-    return true;
+    stats_inc(&HooksActive);
+}
+
+// Install a batch of redirects, see insert_function_redirect() for the
+// details. The fixups are packed together and the arena is only made writable
+// once for the whole batch. Returns the number installed, requests that
+// failed have installed set to false, including any that repeat a function
+// already in the batch.
+size_t insert_function_redirects(struct redirect_request *requests, size_t count)
+{
+    uint8_t    *fixups;
+    size_t      total       = 0;
+    size_t      installed   = 0;
+    uint8_t    *lengths;
+
+    if (count == 0)
+        return 0;
+
+    if ((lengths = calloc(count, sizeof *lengths)) == NULL)
+        return 0;
+
+    // Work out how much code each redirect clobbers first, so the fixups can
+    // be allocated in one go.
+    for (size_t i = 0; i < count; i++) {
+        bool duplicate = false;
+
+        requests[i].installed   = false;
+
+        // Lengths are measured before anything is installed, so a second
+        // request for the same function would copy the first one's branch.
+        for (size_t j = 0; j < i; j++)
+            duplicate |= requests[j].function == requests[i].function;
+
+        if (duplicate) {
+            printf("error: function %p appears more than once in a batch of redirects\n",
+                   requests[i].function);
+            continue;
+        }
+
+        lengths[i]              = redirect_length(requests[i].function, requests[i].flags);
+
+        if (lengths[i])
+            total += fixup_length(lengths[i], requests[i].flags);
+    }
+
+    if (total == 0)
+        goto finished;
+
+    pthread_mutex_lock(&TrampolineLock);
+
+    // Pages might already hold live fixups, so they stay executable while
+    // we're writing.
+    if ((fixups = trampoline_reserve(total)) == NULL
+     || !trampoline_protect(fixups, total, PROT_READ | PROT_WRITE | PROT_EXEC)) {
+        pthread_mutex_unlock(&TrampolineLock);
+        goto finished;
+    }
+
+    for (size_t i = 0, offset = 0; i < count; i++) {
+        if (lengths[i] == 0)
+            continue;
+
+        install_redirect(requests[i].function,
+                         requests[i].redirect,
+                         requests[i].flags,
+                         lengths[i],
+                         fixups + offset);
+
+        requests[i].installed = true;
+
+        offset += fixup_length(lengths[i], requests[i].flags);
+        installed++;
+    }
+
+    trampoline_protect(fixups, total, PROT_READ | PROT_EXEC);
+
+    pthread_mutex_unlock(&TrampolineLock);
+
+  finished:
+    free(lengths);
+    return installed;
+}
+
+// Intercept calls to this function and execute redirect first. Depending on
+// flags, you can either replace this function, or simply be inserted into the
+// call chain.
+//  function    The address of the function you want intercepted.
+//  redirect    Your callback function. The prototype should be the same as
+//              function, except an additional first parameter which you can
+//              ignore (it's the return address for the caller).
+//  flags       Options, see header file for flags available. Use HOOK_DEFAULT
+//              if you don't need any.
+//
+// Remember to add an additional parameter to your redirect, e.g. if you were
+// expecting tcp_input(struct mbuf *m, int len), your redirect should be:
+//
+// my_tcp_input(intptr_t retaddr, struct mbuf *m, int len);
+//
+// *UNLESS* You are using the flag HOOK_REPLACE_FUNCTION, in which case the
+// prototype is the same, as you literally become the function instead of
+// intercepting it.
+bool insert_function_redirect(void *function, void *redirect, uint32_t flags)
+{
+    struct redirect_request request = {
+        .function   = function,
+        .redirect   = redirect,
+        .flags      = flags,
+    };
+
+    return insert_function_redirects(&request, 1) == 1;
 }
 
 // This routine will simply remove a previously inserted redirect. It's careful
@@ -211,7 +387,7 @@ bool remove_function_redirect(void *function)
     //  * From this, calculate the fixup address.
     //  * Restore the clobbered data from the fixup to the function using the
     //    size I recorded in the original function.
-    //  * FREE() the fixup.
+    //  * Abandon the fixup, the arena doesn't reuse space.
     //
     // And that's it, so let's grab the branch instruction.
     callsite            = function;
@@ -231,7 +407,7 @@ bool remove_function_redirect(void *function)
     // Check the encoded size looks sane.
     if (savedsize->opcode != X86_OPCODE_MOV_EAX_IMM
      || savedsize->prefix != X86_PREFIX_DATA16
-     || savedsize->operand > MAX_REDIRECT_LENGTH) {
+     || (savedsize->operand & ~ENCODED_SIZE_FASTCALL) > MAX_REDIRECT_LENGTH) {
         printf("error: tried to remove function hook from %p, but encoded size did not validate { %02x %02x %04x }\n",
                function,
                savedsize->prefix,
@@ -243,7 +419,9 @@ bool remove_function_redirect(void *function)
     // Restore clobbered code. Remember the fixup contains two branches, the
     // call at the start and the jmp at the end, we only want to restore the
     // clobbered data in the middle.
-    memcpy(function, fixup + sizeof(struct branch), savedsize->operand);
+    memcpy(function,
+           fixup + fixup_code_offset(savedsize->operand & ENCODED_SIZE_FASTCALL),
+           savedsize->operand & ~ENCODED_SIZE_FASTCALL);
 
     // Check it looks sane.
     if (callsite->opcode != X86_OPCODE_PUSH_EBP) {
@@ -256,8 +434,7 @@ bool remove_function_redirect(void *function)
            function,
            fixup);
 
-    // Release memory.
-    free(fixup);
+    stats_dec(&HooksActive);
 
     return true;
 }
@@ -281,27 +458,23 @@ bool redirect_call_within_function(void *function, void *target, void *redirect)
     struct branch  *callsite    = NULL;
 
     while (true) {
-        x86_insn_t      insn;
+        x86_lean_insn_t insn;
         ssize_t         insnlength;
 
         // Test if libdisasm understood the instruction
-        if ((insnlength = x86_disasm(function, MAX_FUNCTION_LENGTH, (uintptr_t)(function), offset, &insn))) {
+        if ((insnlength = x86_disasm_lean(function, MAX_FUNCTION_LENGTH, (uintptr_t)(function), offset, &insn))) {
 
             // Examine the instuction found to see if it matches the call we
             // want to replace.
-            if (insn.type == insn_call) {
-                if (x86_get_rel_offset(&insn) == (uintptr_t)(target)
-                                               - (uintptr_t)(function + offset)
-                                               - (uintptr_t)(insnlength)) {
+            if (insn.type == insn_call && insn.has_rel) {
+                if (insn.target == (uint32_t)(uintptr_t)(target)) {
                     // Success, this is the location the caller wants us to patch.
                     callsite = (struct branch *)(function + offset);
 
                     // Let's move on to patching.
-                    printf("info: found a call at %p, the target is %#x\n", callsite, x86_get_rel_offset(&insn));
-
-                    // Clean up, then exit disassembly.
-                    x86_oplist_free(&insn);
+                    printf("info: found a call at %p, the target is %#x\n", callsite, insn.rel_offset);
 
+                    // Exit disassembly.
                     break;
                 }
             }
@@ -309,9 +482,6 @@ bool redirect_call_within_function(void *function, void *target, void *redirect)
             // Valid, but not interesting. Increment size.
             offset += insnlength;
 
-            // Clean up.
-            x86_oplist_free(&insn);
-
             // Next instuction.
             continue;
         }
@@ -340,3 +510,410 @@ bool redirect_call_within_function(void *function, void *target, void *redirect)
     // Complete.
     return true;
 }
+
+// A direct call in an indexed range of code. Both are offsets from the start
+// of the range, the target wraps around if it's below it, which is fine on a
+// 32-bit address space.
+struct callsite {
+    uint32_t    target;
+    uint32_t    site;
+};
+
+#define CALLSITE_MAGIC "LLCALLS1"
+
+// The file written by callsite_index_save(), followed by count callsites.
+struct callsite_header {
+    char        magic[8];
+    uint32_t    size;
+    uint32_t    count;
+    uint64_t    checksum;               // Of the code, so stale files are rebuilt.
+};
+
+struct callsite_index {
+    uint8_t            *code;
+    size_t              size;
+    size_t              count;
+    size_t              capacity;
+    bool                sorted;
+    struct callsite    *sites;
+};
+
+static int compare_callsites(const void *a, const void *b)
+{
+    const struct callsite *x = a;
+    const struct callsite *y = b;
+
+    if (x->target != y->target)
+        return x->target < y->target ? -1 : 1;
+
+    return x->site < y->site ? -1 : x->site > y->site;
+}
+
+static uint64_t callsite_checksum(const uint8_t *code, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (size--) {
+        hash ^= *code++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void callsite_index_sort(struct callsite_index *index)
+{
+    if (!index->sorted) {
+        qsort(index->sites, index->count, sizeof *index->sites, compare_callsites);
+        index->sorted = true;
+    }
+}
+
+// Returns the first callsite for target, or the end of the index.
+static struct callsite *callsite_index_first(struct callsite_index *index, uint32_t target)
+{
+    size_t low  = 0;
+    size_t high = index->count;
+
+    callsite_index_sort(index);
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if (index->sites[middle].target < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return index->sites + low;
+}
+
+// A section of a PE image that holds code, as offsets from the image base.
+struct callsite_range {
+    uint32_t    start;
+    uint32_t    end;
+};
+
+#define IMAGE_SCN_CNT_CODE          0x00000020
+#define IMAGE_SCN_MEM_EXECUTE       0x20000000
+#define CALLSITE_MAX_RANGES         96
+
+// If code is the base of a mapped PE image, fill ranges with its executable
+// sections and return how many there are. Otherwise the whole range is
+// assumed to be code, and the result is one range covering it.
+static size_t callsite_code_ranges(const uint8_t *code, size_t size, struct callsite_range *ranges)
+{
+    uint32_t    pe;
+    uint16_t    sections;
+    uint16_t    optional;
+    size_t      count = 0;
+
+    ranges[0].start = 0;
+    ranges[0].end   = size;
+
+    if (size < 0x40 || code[0] != 'M' || code[1] != 'Z')
+        return 1;
+
+    memcpy(&pe, code + 0x3c, sizeof pe);
+
+    if (pe > size - 24 || memcmp(code + pe, "PE\0\0", 4) != 0)
+        return 1;
+
+    memcpy(&sections, code + pe + 6, sizeof sections);
+    memcpy(&optional, code + pe + 20, sizeof optional);
+
+    // The section table follows the signature, file and optional headers.
+    for (size_t i = 0, header = pe + 24 + optional; i < sections && count < CALLSITE_MAX_RANGES; i++, header += 40) {
+        uint32_t length, address, flags;
+
+        if (header > size - 40)
+            break;
+
+        memcpy(&length, code + header + 8, sizeof length);
+        memcpy(&address, code + header + 12, sizeof address);
+        memcpy(&flags, code + header + 36, sizeof flags);
+
+        if (!(flags & (IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE)) || address >= size)
+            continue;
+
+        ranges[count].start = address;
+        ranges[count].end   = length > size - address ? size : address + length;
+        count++;
+    }
+
+    return count;
+}
+
+static bool callsite_in_ranges(uint32_t offset, const struct callsite_range *ranges, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (offset >= ranges[i].start && offset < ranges[i].end)
+            return true;
+    }
+
+    return false;
+}
+
+// Make a single linear sweep over size bytes of code, recording every direct
+// near call that lands inside the same range. Bytes that don't disassemble
+// (padding, jump tables, and so on) are skipped one at a time, so a sweep can
+// resynchronise with the instruction stream rather than giving up like
+// redirect_call_within_function() does. If code is a whole PE image, only
+// executable sections are swept, and calls must land in one of them. The
+// code must not change while the index is in use, except via
+// redirect_calls(). Returns NULL if there's not enough memory.
+struct callsite_index *callsite_index_build(void *code, size_t size)
+{
+    struct callsite_index *index = calloc(1, sizeof *index);
+    struct callsite_range ranges[CALLSITE_MAX_RANGES];
+    size_t count;
+
+    if (index == NULL)
+        return NULL;
+
+    index->code   = code;
+    index->size   = size;
+    index->sorted = true;
+
+    count = callsite_code_ranges(code, size, ranges);
+
+    for (size_t i = 0; i < count; i++) {
+        for (size_t offset = ranges[i].start; offset < ranges[i].end; ) {
+            x86_lean_insn_t insn;
+            ssize_t         insnlength;
+            struct branch  *call;
+            uint32_t        target;
+
+            if ((insnlength = x86_disasm_lean(code, ranges[i].end, (uintptr_t)(code), offset, &insn)) == 0) {
+                offset++;
+                continue;
+            }
+
+            call = (struct branch *)(index->code + offset);
+
+            if (call->opcode != X86_OPCODE_CALL_NEAR || insnlength != sizeof(struct branch)) {
+                offset += insnlength;
+                continue;
+            }
+
+            target = offset + insnlength + call->operand.i;
+
+            if (target < size && callsite_in_ranges(target, ranges, count)) {
+                if (index->count == index->capacity) {
+                    size_t capacity = index->capacity ? index->capacity * 2 : 1024;
+                    struct callsite *sites = realloc(index->sites, capacity * sizeof *sites);
+
+                    if (sites == NULL) {
+                        callsite_index_free(index);
+                        return NULL;
+                    }
+
+                    index->sites    = sites;
+                    index->capacity = capacity;
+                }
+
+                index->sites[index->count].target = target;
+                index->sites[index->count].site   = offset;
+                index->count++;
+            }
+
+            offset += insnlength;
+        }
+    }
+
+    // The sweep visits sites in order, but not targets.
+    index->sorted = false;
+
+    callsite_index_sort(index);
+
+    return index;
+}
+
+// Load the index written by callsite_index_save() for this code, or return
+// NULL if it's missing or doesn't match.
+static struct callsite_index *callsite_index_load(void *code, size_t size, const char *path)
+{
+    struct callsite_header header;
+    struct callsite_index *index;
+    struct stat buf;
+    size_t i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (read(fd, &header, sizeof header) != sizeof header
+     || memcmp(header.magic, CALLSITE_MAGIC, sizeof header.magic) != 0
+     || header.size != size
+     || header.checksum != callsite_checksum(code, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    // The count must describe exactly the rest of the file, which also keeps
+    // the allocation below from overflowing.
+    if (fstat(fd, &buf) != 0
+     || buf.st_size < (off_t) sizeof header
+     || (buf.st_size - sizeof header) % sizeof(struct callsite) != 0
+     || header.count != (buf.st_size - sizeof header) / sizeof(struct callsite)) {
+        printf("warning: the callsite index %s is truncated, ignoring it\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    if ((index = calloc(1, sizeof *index)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    index->code     = code;
+    index->size     = size;
+    index->count    = header.count;
+    index->capacity = header.count;
+    index->sites    = malloc(header.count * sizeof *index->sites);
+    index->sorted   = false;
+
+    if (index->sites == NULL && header.count != 0)
+        goto error;
+
+    if (read(fd, index->sites, header.count * sizeof *index->sites) != header.count * sizeof *index->sites) {
+        printf("warning: the callsite index %s is truncated, ignoring it\n", path);
+        goto error;
+    }
+
+    for (i = 0; i < index->count; i++) {
+        if (index->sites[i].site > size - sizeof(struct branch) || index->sites[i].target >= size) {
+            printf("warning: the callsite index %s is corrupt, ignoring it\n", path);
+            goto error;
+        }
+    }
+
+    close(fd);
+
+    callsite_index_sort(index);
+
+    return index;
+
+  error:
+    close(fd);
+    callsite_index_free(index);
+    return NULL;
+}
+
+bool callsite_index_save(struct callsite_index *index, const char *path)
+{
+    struct callsite_header header = {
+        .size       = index->size,
+        .count      = index->count,
+        .checksum   = callsite_checksum(index->code, index->size),
+    };
+    int fd;
+
+    memcpy(header.magic, CALLSITE_MAGIC, sizeof header.magic);
+
+    callsite_index_sort(index);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("warning: failed to create callsite index %s, %m\n", path);
+        return false;
+    }
+
+    if (write(fd, &header, sizeof header) != sizeof header
+     || write(fd, index->sites, index->count * sizeof *index->sites) != index->count * sizeof *index->sites) {
+        printf("warning: failed to write callsite index %s, %m\n", path);
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+// Use the index saved at path if it matches the code, otherwise build one and
+// save it there for next time. Pass a NULL path to always build.
+struct callsite_index *callsite_index_open(void *code, size_t size, const char *path)
+{
+    struct callsite_index *index;
+
+    if (path && (index = callsite_index_load(code, size, path)))
+        return index;
+
+    // Without an index, callers can still use redirect_call_within_function().
+    if ((index = callsite_index_build(code, size)) == NULL)
+        return NULL;
+
+    if (path)
+        callsite_index_save(index, path);
+
+    return index;
+}
+
+void callsite_index_free(struct callsite_index *index)
+{
+    if (index) {
+        free(index->sites);
+        free(index);
+    }
+}
+
+// Store up to max call sites of target in sites, returns the total number.
+size_t callsite_index_lookup(struct callsite_index *index, void *target, void **sites, size_t max)
+{
+    uint32_t offset = (uintptr_t)(target) - (uintptr_t)(index->code);
+    struct callsite *callsite = callsite_index_first(index, offset);
+    size_t count;
+
+    for (count = 0; callsite < index->sites + index->count && callsite->target == offset; callsite++, count++) {
+        if (count < max) {
+            sites[count] = index->code + callsite->site;
+        }
+    }
+
+    return count;
+}
+
+// Redirect every call to target within the indexed code to redirect, or just
+// the ones filter returns true for. This is like calling
+// redirect_call_within_function() on each caller, but costs a lookup rather
+// than a disassembly per site. Sites are checked before they're patched, so a
+// call that has been changed behind our back is left alone. The index is
+// updated, so the calls can be restored by swapping target and redirect.
+// Returns the number of calls redirected.
+size_t redirect_calls(struct callsite_index *index,
+                      void *target,
+                      void *redirect,
+                      callsite_filter_t filter,
+                      void *context)
+{
+    uint32_t offset = (uintptr_t)(target) - (uintptr_t)(index->code);
+    struct callsite *callsite = callsite_index_first(index, offset);
+    size_t count = 0;
+
+    for (; callsite < index->sites + index->count && callsite->target == offset; callsite++) {
+        struct branch *call = (struct branch *)(index->code + callsite->site);
+
+        if (call->opcode != X86_OPCODE_CALL_NEAR
+         || (uintptr_t)(call) + sizeof(struct branch) + call->operand.i != (uintptr_t)(target)) {
+            printf("warning: the call at %p has changed since it was indexed, skipping\n", call);
+            continue;
+        }
+
+        if (filter && !filter(call, context))
+            continue;
+
+        call->operand.i  = (uintptr_t)(redirect)
+                         - (uintptr_t)(call)
+                         - (uintptr_t)(sizeof(struct branch));
+
+        callsite->target = (uintptr_t)(redirect) - (uintptr_t)(index->code);
+
+        index->sorted    = false;
+
+        count++;
+    }
+
+    return count;
+}
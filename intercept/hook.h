@@ -1,10 +1,41 @@
 #ifndef __HOOK_H
 #define __HOOK_H
 
+// A redirect for insert_function_redirects(), installed is set on success.
+struct redirect_request {
+    void       *function;
+    void       *redirect;
+    uint32_t    flags;
+    bool        installed;
+};
+
 bool insert_function_redirect(void *function, void *redirect, uint32_t flags);
+size_t insert_function_redirects(struct redirect_request *requests, size_t count);
 bool remove_function_redirect(void *function);
 bool redirect_call_within_function(void *function, void *target, void *redirect);
 
+// An index of the direct calls within a range of code, either an executable
+// section or a whole loaded image (then only its executable sections are
+// swept), built with one linear sweep and optionally saved alongside the
+// image, e.g. "engine.dll.calls". With an index, every call to a function can
+// be redirected without disassembling the callers. Building returns NULL if
+// memory runs out, use redirect_call_within_function() instead.
+struct callsite_index;
+
+// Return false to leave the call at callsite alone.
+typedef bool (*callsite_filter_t)(void *callsite, void *context);
+
+struct callsite_index *callsite_index_build(void *code, size_t size);
+struct callsite_index *callsite_index_open(void *code, size_t size, const char *path);
+bool callsite_index_save(struct callsite_index *index, const char *path);
+void callsite_index_free(struct callsite_index *index);
+size_t callsite_index_lookup(struct callsite_index *index, void *target, void **sites, size_t max);
+size_t redirect_calls(struct callsite_index *index,
+                      void *target,
+                      void *redirect,
+                      callsite_filter_t filter,
+                      void *context);
+
 // Flags recognised by insert_function_redirect.
 enum {
     HOOK_DEFAULT            = 0,
@@ -12,6 +43,21 @@ enum {
     HOOK_FASTCALL           = (1 << 1),     // Try to minimize damage to registers.
 };
 
+// With HOOK_FASTCALL, a redirect that doesn't replace the function is called
+// with eax, ecx and edx saved, and they're restored before the function runs.
+// The saved values are passed before the return address, so the redirect can
+// see the this pointer or register arguments, e.g.
+//
+//  void my_hook(struct hook_registers regs, uintptr_t retaddr, int arg1, ...);
+//
+// The redirect must not modify regs. A redirect that replaces the function is
+// jumped to with every register intact anyway, so the flag changes nothing.
+struct hook_registers {
+    uintptr_t   edx;
+    uintptr_t   ecx;
+    uintptr_t   eax;
+};
+
 // Convenient representation of an x86 near call. The immediate operand is the
 // relative, displaced branch target, thus actual address is something like:
 //
@@ -33,6 +79,12 @@ struct __attribute__((packed)) branch {
 #define X86_OPCODE_RET          0xC3
 #define X86_OPCODE_MOV_EAX_IMM  0xB8
 #define X86_OPCODE_PUSH_EBP     0x55
+#define X86_OPCODE_PUSH_EAX     0x50
+#define X86_OPCODE_PUSH_ECX     0x51
+#define X86_OPCODE_PUSH_EDX     0x52
+#define X86_OPCODE_POP_EAX      0x58
+#define X86_OPCODE_POP_ECX      0x59
+#define X86_OPCODE_POP_EDX      0x5A
 
 #define X86_PREFIX_DATA16       0x66
 
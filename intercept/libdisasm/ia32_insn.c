@@ -623,3 +623,75 @@ size_t ia32_disasm_addr( unsigned char * buf, size_t buf_len,
 	insn->size = size;
 	return size;		/* return size of instruction in bytes */
 }
+
+/* lean equivalent of ia32_disasm_addr: uses the same table lookup, but only
+ * determines the size, type and group of the instruction and any relative
+ * branch offset. Nothing is allocated, so there is nothing to free.
+ * Returns the size of the instruction in bytes, or 0 if it is invalid. */
+size_t ia32_disasm_lean( unsigned char * buf, size_t buf_len,
+		x86_lean_insn_t *insn ) {
+	ia32_insn_t *raw_insn = NULL, *sfx_insn = NULL;
+	unsigned int prefixes = 0, sfx_prefixes = 0;
+	unsigned int op_size, addr_size, type;
+	size_t size, op_len;
+
+	if ( (ia32_settings.options & opt_ignore_nulls) && buf_len > 3 &&
+	    !buf[0] && !buf[1] && !buf[2] && !buf[3]) {
+		return 0;
+	}
+
+	size = ia32_table_lookup(buf, buf_len, idx_Main, &raw_insn, &prefixes);
+	if ( size == INVALID_INSN || size > buf_len || raw_insn->mnem_flag == INS_INVALID ) {
+		return 0;
+	}
+
+	if (ia32_settings.options & opt_16_bit) {
+		op_size = ( prefixes & PREFIX_OP_SIZE ) ? 4 : 2;
+		addr_size = ( prefixes & PREFIX_ADDR_SIZE ) ? 4 : 2;
+	} else {
+		op_size = ( prefixes & PREFIX_OP_SIZE ) ? 2 : 4;
+		addr_size = ( prefixes & PREFIX_ADDR_SIZE ) ? 2 : 4;
+	}
+
+	type = raw_insn->mnem_flag & ~INS_FLAG_MASK;
+
+	/* operands are laid out in the same order ia32_decode_insn uses */
+	buf += size;
+	buf_len -= size;
+
+	op_len = ia32_decode_operand_lean( buf, buf_len, insn,
+				raw_insn->dest_flag, op_size, addr_size );
+	buf += op_len;
+	buf_len -= op_len;
+	size += op_len;
+
+	op_len = ia32_decode_operand_lean( buf, buf_len, insn,
+				raw_insn->src_flag, op_size, addr_size );
+	buf += op_len;
+	buf_len -= op_len;
+	size += op_len;
+
+	op_len = ia32_decode_operand_lean( buf, buf_len, insn,
+				raw_insn->aux_flag, op_size, addr_size );
+	buf += op_len;
+	buf_len -= op_len;
+	size += op_len;
+
+	if ( raw_insn->mnem_flag & INS_FLAG_SUFFIX ) {
+		/* AMD 3DNow! suffix -- the suffix byte decides the type */
+		op_len = ia32_table_lookup( buf, buf_len, raw_insn->table,
+				&sfx_insn, &sfx_prefixes );
+		if ( op_len == INVALID_INSN || sfx_insn->mnem_flag == INS_INVALID ) {
+			return 0;
+		}
+
+		type = sfx_insn->mnem_flag & ~INS_FLAG_MASK;
+		size += 1;
+	}
+
+	insn->group = (enum x86_insn_group) (INS_GROUP(type)) >> 12;
+	insn->type = (enum x86_insn_type) INS_TYPE(type);
+	insn->size = size;
+
+	return size;
+}
@@ -36,6 +36,9 @@
 size_t ia32_disasm_addr( unsigned char * buf, size_t buf_len, 
 		x86_insn_t *insn);
 
+size_t ia32_disasm_lean( unsigned char * buf, size_t buf_len,
+		x86_lean_insn_t *insn);
+
 
 /* --------------------------------------------------------- Table Lookup */
 /* IA32 Instruction defintion for ia32_opcodes.c */
@@ -298,6 +298,53 @@ size_t ia32_modrm_decode( unsigned char *buf, unsigned int buf_len,
 	return size;		/* number of bytes found in instruction */
 }
 
+/* lean equivalent of ia32_modrm_decode: returns the number of bytes used by
+ * the ModR/M byte, SIB byte and displacement without decoding them */
+size_t ia32_modrm_size( unsigned char *buf, unsigned int buf_len,
+			unsigned int addr_size ) {
+	struct modRM_byte modrm;
+	struct SIB_byte sib;
+	size_t size = 1;	/* # of bytes decoded [1 for modR/M byte] */
+
+	byte_decode(*buf, &modrm);	/* get bitfields */
+
+	if ( modrm.mod == MODRM_MOD_NOEA ) {
+		return 1;
+	}
+
+	if ( addr_size == 2 ) {
+		/* same as modrm_decode16 */
+		if ( modrm.mod == MOD16_MOD_DISP8 ) {
+			size += sizeof(char);
+		} else if ( modrm.mod == MOD16_MOD_DISP16 ) {
+			size += sizeof(short);
+		}
+		return size;
+	}
+
+	/* move to byte after ModR/M */
+	++buf;
+	--buf_len;
+
+	if ( modrm.rm == MODRM_RM_SIB && buf_len >= 1 ) {
+		/* same as sib_decode */
+		byte_decode( *buf, (struct modRM_byte *)(void*)&sib );
+		size += ( sib.base == SIB_BASE_EBP && ! modrm.mod ) ? 5 : 1;
+	}
+
+	if ( modrm.mod == MODRM_MOD_NODISP ) {
+		if ( modrm.rm == MODRM_RM_NOREG ) {
+			size += 4;
+		}
+	} else if ( modrm.mod == MODRM_MOD_DISP8 ) {
+		size += 1;
+	} else {
+		size += 4;
+	}
+
+	return size;
+}
+
 void ia32_reg_decode( unsigned char byte, x86_op_t *op, size_t gen_regs ) {
 	struct modRM_byte modrm;
 	byte_decode( byte, &modrm );	/* get bitfields */
@@ -8,6 +8,9 @@ size_t ia32_modrm_decode( unsigned char *buf, unsigned int buf_len,
 			    x86_op_t *op, x86_insn_t *insn,
 			    size_t gen_regs );
 
+size_t ia32_modrm_size( unsigned char *buf, unsigned int buf_len,
+			unsigned int addr_size );
+
 void ia32_reg_decode( unsigned char byte, x86_op_t *op, size_t gen_regs );
 
 #endif
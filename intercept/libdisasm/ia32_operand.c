@@ -423,3 +423,91 @@ size_t ia32_decode_operand( unsigned char *buf, size_t buf_len,
 
 	return size;		/* return number of bytes in instruction */
 }
+
+/* lean equivalent of decode_operand_size: only the encoded size is needed */
+static size_t lean_operand_size( unsigned int op_type, unsigned int op_size,
+				 unsigned int addr_size ) {
+	switch (op_type) {
+		case OPTYPE_c:
+			return (op_size == 4) ? 2 : 1;
+		case OPTYPE_a:
+			return (op_size == 4) ? 8 : 4;
+		case OPTYPE_v:
+			return (op_size == 4) ? 4 : 2;
+		case OPTYPE_p:
+			return (addr_size == 4) ? 6 : 4;
+		case OPTYPE_b:
+			return 1;
+		case OPTYPE_w:
+			return 2;
+		case OPTYPE_d: case OPTYPE_si: case OPTYPE_fs:
+			return 4;
+		case OPTYPE_s:
+			return 6;
+		case OPTYPE_q: case OPTYPE_pi: case OPTYPE_fd:
+			return 8;
+		case OPTYPE_dq: case OPTYPE_ps: case OPTYPE_pd:
+		case OPTYPE_ss: case OPTYPE_sd:
+			return 16;
+		case OPTYPE_fe: case OPTYPE_fb: case OPTYPE_fp:
+			return 10;
+		case OPTYPE_fv:
+			return (addr_size == 4) ? 28 : 14;
+		case OPTYPE_ft:
+			return (addr_size == 4) ? 108 : 94;
+		case OPTYPE_fx:
+			return 512;
+		case OPTYPE_m:
+			return addr_size;
+		case OPTYPE_none:
+			return 0;
+		case 0:
+		default:
+			return op_size;
+	}
+}
+
+/* lean equivalent of ia32_decode_operand: returns the number of bytes the
+ * operand occupies in the instruction, and records a relative branch
+ * offset in insn. No operand is allocated. */
+size_t ia32_decode_operand_lean( unsigned char *buf, size_t buf_len,
+				 x86_lean_insn_t *insn, unsigned int raw_flags,
+				 unsigned int op_size, unsigned int addr_size ) {
+	size_t size;
+
+	if ( raw_flags == ARG_NONE ) {
+		return 0;
+	}
+
+	size = lean_operand_size( raw_flags & OPTYPE_MASK, op_size,
+				  addr_size );
+
+	switch (raw_flags & ADDRMETH_MASK) {
+		case ADDRMETH_E: case ADDRMETH_M: case ADDRMETH_Q:
+		case ADDRMETH_R: case ADDRMETH_W:
+			return ia32_modrm_size( buf, buf_len, addr_size );
+		case ADDRMETH_A:
+			return (addr_size == 4) ? 6 : 4;
+		case ADDRMETH_I:
+			return size;
+		case ADDRMETH_J:
+			/* the first relative operand wins, as in
+			 * x86_get_rel_offset */
+			if ( ! insn->has_rel && size <= buf_len ) {
+				insn->has_rel = 1;
+				if ( size == 1 ) {
+					insn->rel_offset = *((signed char *) buf);
+				} else if ( size == 2 ) {
+					insn->rel_offset = *((signed short *) buf);
+				} else {
+					insn->rel_offset = *((int32_t *) buf);
+				}
+			}
+			return size;
+		case ADDRMETH_O:
+			return addr_size;
+		default:
+			/* register and hard-coded operands take no space */
+			return 0;
+	}
+}
@@ -8,4 +8,8 @@ size_t ia32_decode_operand( unsigned char *buf, size_t buf_len,
 			      x86_insn_t *insn, unsigned int raw_op, 
 			      unsigned int raw_flags, unsigned int prefixes,
 			      unsigned char modrm );
+
+size_t ia32_decode_operand_lean( unsigned char *buf, size_t buf_len,
+				 x86_lean_insn_t *insn, unsigned int raw_flags,
+				 unsigned int op_size, unsigned int addr_size );
 #endif
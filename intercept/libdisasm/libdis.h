@@ -828,6 +828,32 @@ size_t x86_invariant_disasm( unsigned char *buf, int buf_len,
  * this used x86_invariant_disasm since it faster than x86_disasm */
 size_t x86_size_disasm( unsigned char *buf, unsigned int buf_len );
 
+
+/* ================================== Lean Instruction Decoding */
+/* The lean decoder uses the same opcode tables as x86_disasm, and agrees
+ * with it on the size of every instruction, but only reports the size,
+ * type and group of an instruction and the target of a relative branch.
+ * No x86_insn_t or operand list is built, so nothing is allocated and there
+ * is nothing to free. This is intended for code that only needs to walk an
+ * instruction stream, e.g. to find instruction boundaries or call sites. */
+typedef struct {
+	uint32_t addr;			/* load address of insn */
+	unsigned int size;		/* number of bytes in insn */
+        enum x86_insn_group group;      /* meta-type, e.g. INS_EXEC */
+        enum x86_insn_type type;        /* type, e.g. INS_BRANCH */
+	int has_rel;			/* insn has a relative operand */
+	int32_t rel_offset;		/* same as x86_get_rel_offset */
+	uint32_t target;		/* addr + size + rel_offset */
+} x86_lean_insn_t;
+
+/* x86_disasm_lean: Decode a single instruction from a buffer of bytes.
+ *             Takes the same arguments as x86_disasm and returns the size
+ *             of the instruction in bytes, or 0 if it is invalid.
+ */
+unsigned int x86_disasm_lean( unsigned char *buf, unsigned int buf_len,
+                	      uint32_t buf_rva, unsigned int offset,
+                	      x86_lean_insn_t *insn );
+
 #ifdef __cplusplus
 }
 #endif
@@ -70,6 +70,62 @@ unsigned int x86_disasm( unsigned char *buf, unsigned int buf_len,
         return size;
 }
 
+unsigned int x86_disasm_lean( unsigned char *buf, unsigned int buf_len,
+                uint32_t buf_rva, unsigned int offset,
+                x86_lean_insn_t *insn ){
+        unsigned int len, size;
+	unsigned char bytes[MAX_INSTRUCTION_SIZE], *code;
+
+        if ( ! buf || ! insn || ! buf_len ) {
+                return 0;
+        }
+
+        insn->addr = buf_rva + offset;
+        insn->size = 0;
+	insn->type = insn_invalid;
+	insn->group = insn_none;
+        insn->has_rel = 0;
+        insn->rel_offset = 0;
+        insn->target = 0;
+
+        if ( offset >= buf_len ) {
+                x86_report_error(report_disasm_bounds, (void*)(long)buf_rva+offset);
+                return 0;
+        }
+
+        len = buf_len - offset;
+        code = &buf[offset];
+
+	/* only copy the bytes when the instruction could run off the end of
+	 * the buffer, otherwise decode them in place */
+        if ( len < MAX_INSTRUCTION_SIZE ) {
+		memset( bytes, 0, MAX_INSTRUCTION_SIZE );
+		memcpy( bytes, code, len );
+		code = bytes;
+        }
+
+        size = ia32_disasm_lean( code, len, insn );
+
+        if (! size ) {
+                x86_report_error(report_invalid_insn, (void*)(long)buf_rva+offset );
+                return 0;
+        }
+
+        if ( size > len ) {
+                x86_report_error( report_insn_bounds, (void*)(long)buf_rva + offset );
+                insn->size = 1;
+                insn->type = insn_invalid;
+                insn->group = insn_none;
+		return 0;
+	}
+
+        if ( insn->has_rel ) {
+                insn->target = insn->addr + size + insn->rel_offset;
+        }
+
+        return size;
+}
+
 unsigned int x86_disasm_range( unsigned char *buf, uint32_t buf_rva,
                       unsigned int offset, unsigned int len,
                       DISASM_CALLBACK func, void *arg ) {
@@ -0,0 +1,214 @@
+//
+// Decode a trace written by the loader with LL_TRACE set.
+//
+//  $ LL_TRACE=calls.trace ./mpclient ...
+//  $ ./lltrace calls.trace
+//
+// Records from every thread are merged by time. Each line shows the time
+// since tracing started, the thread, the traced function, where it was
+// called from and the first few raw stack arguments (-a to change how many).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+} IMAGE;
+
+typedef struct {
+    uint32_t tid;
+    const TRACE_RECORD *record;
+} EVENT;
+
+static char *Data;
+static size_t DataSize;
+static size_t Position;
+
+// Returns a pointer to the next size bytes of the trace, or NULL if it's truncated.
+static const void *take(size_t size)
+{
+    const void *result = Data + Position;
+
+    if (size > DataSize - Position)
+        return NULL;
+
+    Position += size;
+    return result;
+}
+
+static const char *take_string(void)
+{
+    const char *result = Data + Position;
+    const char *end = memchr(result, '\0', DataSize - Position);
+
+    if (end == NULL)
+        return NULL;
+
+    Position += end - result + 1;
+    return result;
+}
+
+static bool read_file(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    size_t count;
+
+    if (in == NULL)
+        return false;
+
+    for (size_t max = 0;; DataSize += count) {
+        if (DataSize == max) {
+            max  = max ? max * 2 : 1 << 20;
+            Data = realloc(Data, max);
+        }
+
+        if ((count = fread(Data + DataSize, 1, max - DataSize, in)) == 0)
+            break;
+    }
+
+    fclose(in);
+    return true;
+}
+
+static int compare_events(const void *a, const void *b)
+{
+    const EVENT *x = a;
+    const EVENT *y = b;
+
+    if (x->record->timestamp == y->record->timestamp)
+        return x->record < y->record ? -1 : x->record > y->record;
+
+    return x->record->timestamp < y->record->timestamp ? -1 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const TRACE_HEADER *header;
+    const char **sites;
+    IMAGE *images;
+    EVENT *events = NULL;
+    size_t count = 0;
+    double nsec_per_cycle = 0;
+    int args = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:")) != -1) {
+        switch (opt) {
+            case 'a':
+                args = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-a args] <trace>\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-a args] <trace>\n", argv[0]);
+        return 1;
+    }
+
+    if (args < 0 || args > TRACE_ARGS)
+        args = TRACE_ARGS;
+
+    if (!read_file(argv[optind])) {
+        fprintf(stderr, "failed to read %s\n", argv[optind]);
+        return 1;
+    }
+
+    if ((header = take(sizeof *header)) == NULL
+     || memcmp(header->magic, TRACE_MAGIC, sizeof header->magic) != 0
+     || header->record_size != sizeof(TRACE_RECORD)) {
+        fprintf(stderr, "%s is not a trace from this version\n", argv[optind]);
+        return 1;
+    }
+
+    if (header->end_cycles > header->start_cycles) {
+        nsec_per_cycle = (double)(header->end_nsec - header->start_nsec)
+                       / (double)(header->end_cycles - header->start_cycles);
+    }
+
+    sites  = calloc(header->site_count, sizeof *sites);
+    images = calloc(header->image_count, sizeof *images);
+
+    for (uint32_t i = 0; i < header->site_count; i++) {
+        if ((sites[i] = take_string()) == NULL)
+            goto truncated;
+    }
+
+    for (uint32_t i = 0; i < header->image_count; i++) {
+        const TRACE_IMAGE *image;
+
+        if ((image = take(sizeof *image)) == NULL || (images[i].name = take_string()) == NULL)
+            goto truncated;
+
+        images[i].base = image->base;
+        images[i].size = image->size;
+    }
+
+    for (uint32_t i = 0; i < header->thread_count; i++) {
+        const TRACE_THREAD *thread;
+        const TRACE_RECORD *records;
+
+        if ((thread = take(sizeof *thread)) == NULL
+         || (records = take(thread->count * sizeof(TRACE_RECORD))) == NULL)
+            goto truncated;
+
+        if (thread->dropped) {
+            fprintf(stderr, "thread %u: %llu older records were overwritten\n",
+                            thread->tid,
+                            (unsigned long long) thread->dropped);
+        }
+
+        events = realloc(events, (count + thread->count) * sizeof *events);
+
+        for (uint32_t j = 0; j < thread->count; j++) {
+            events[count].tid    = thread->tid;
+            events[count].record = &records[j];
+            count++;
+        }
+    }
+
+    qsort(events, count, sizeof *events, compare_events);
+
+    for (size_t i = 0; i < count; i++) {
+        const TRACE_RECORD *record = events[i].record;
+        const char *site = record->site < header->site_count ? sites[record->site] : "?";
+        double elapsed = (int64_t)(record->timestamp - header->start_cycles) * nsec_per_cycle / 1e9;
+        char caller[128];
+
+        snprintf(caller, sizeof caller, "%#llx", (unsigned long long) record->caller);
+
+        for (uint32_t j = 0; j < header->image_count; j++) {
+            if (record->caller >= images[j].base && record->caller < images[j].base + images[j].size) {
+                snprintf(caller, sizeof caller, "%s+%#llx",
+                                 images[j].name,
+                                 (unsigned long long)(record->caller - images[j].base));
+                break;
+            }
+        }
+
+        printf("%12.6f %6u %-32s %-28s", elapsed, events[i].tid, site, caller);
+
+        for (int j = 0; j < args; j++)
+            printf(" %08x", record->args[j]);
+
+        putchar('\n');
+    }
+
+    return 0;
+
+truncated:
+    fprintf(stderr, "%s is truncated\n", argv[optind]);
+    return 1;
+}
@@ -0,0 +1,87 @@
+//
+// Compile symbol maps into an index the loader can map directly.
+//
+//  $ ./mksymidx mpengine.map mpengine.idx
+//  $ ./mksymidx pdbsymbols.txt more.map mpengine.idx
+//
+// Inputs are IDA .map files or lists of hexadecimal addresses and names, one
+// per line. Use the index anywhere a map is accepted.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "symindex.h"
+
+static SYMINDEX_INPUT *Symbols;
+static size_t SymbolCount;
+static size_t SymbolMax;
+
+static bool read_map(const char *path)
+{
+    SYMINDEX_INPUT symbol;
+    size_t length = 0;
+    char *line = NULL;
+    FILE *in;
+
+    if ((in = fopen(path, "r")) == NULL)
+        return false;
+
+    while (getline(&line, &length, in) > 0) {
+        if (!symindex_parse_line(line, &symbol))
+            continue;
+
+        if (SymbolCount == SymbolMax) {
+            SymbolMax = SymbolMax ? SymbolMax * 2 : 65536;
+            Symbols   = realloc(Symbols, SymbolMax * sizeof(SYMINDEX_INPUT));
+        }
+
+        Symbols[SymbolCount].address = symbol.address;
+        Symbols[SymbolCount].name    = strdup(symbol.name);
+        SymbolCount++;
+    }
+
+    free(line);
+    fclose(in);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    SYMINDEX *index;
+    FILE *out;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <map>... <index>\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc - 1; i++) {
+        if (!read_map(argv[i])) {
+            fprintf(stderr, "failed to read %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if ((index = symindex_build(Symbols, SymbolCount)) == NULL) {
+        fprintf(stderr, "too many symbols to index\n");
+        return 1;
+    }
+
+    if ((out = fopen(argv[argc - 1], "wb")) == NULL) {
+        fprintf(stderr, "failed to create index %s\n", argv[argc - 1]);
+        return 1;
+    }
+
+    if (fwrite(index, index->size, 1, out) != 1 || fclose(out) != 0) {
+        fprintf(stderr, "failed to write index %s\n", argv[argc - 1]);
+        return 1;
+    }
+
+    printf("indexed %zu symbols into %s\n", SymbolCount, argv[argc - 1]);
+    return 0;
+}
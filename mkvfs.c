@@ -0,0 +1,194 @@
+//
+// Build a pack of files for the loader's virtual filesystem.
+//
+//  $ ./mkvfs inputs inputs.pack
+//  $ LL_VFS=inputs.pack ./fxc ...
+//
+// Paths in the pack are relative to the directory given, so run the loader
+// from the equivalent directory.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "vfs.h"
+
+typedef struct {
+    char *path;         // Host path.
+    char *name;         // Name in the pack.
+    uint64_t size;
+} PACK_FILE;
+
+static PACK_FILE *Files;
+static size_t FileCount;
+static size_t FileMax;
+static size_t RootLength;
+
+static int add_file(const char *path, const struct stat *buf, int type, struct FTW *ftw)
+{
+    char *name;
+
+    if (type != FTW_F || !S_ISREG(buf->st_mode))
+        return 0;
+
+    if (FileCount == FileMax) {
+        FileMax = FileMax ? FileMax * 2 : 1024;
+        Files   = realloc(Files, FileMax * sizeof(PACK_FILE));
+    }
+
+    // Names are matched case-insensitively by lowering both sides.
+    name = strdup(path + RootLength);
+
+    for (char *p = name; *p; p++) {
+        if (*p >= 'A' && *p <= 'Z')
+            *p += 'a' - 'A';
+    }
+
+    Files[FileCount].path = strdup(path);
+    Files[FileCount].name = name;
+    Files[FileCount].size = buf->st_size;
+    FileCount++;
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp(((const PACK_FILE *) a)->name, ((const PACK_FILE *) b)->name);
+}
+
+static uint64_t align_data(uint64_t offset, uint64_t size)
+{
+    uint64_t alignment = size >= VFS_PAGE_ALIGN_THRESHOLD ? getpagesize() : VFS_DATA_ALIGN;
+
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+static bool copy_file(FILE *out, const char *path, uint64_t size)
+{
+    char buffer[65536];
+    FILE *in = fopen(path, "rb");
+    size_t count;
+
+    if (in == NULL)
+        return false;
+
+    while (size && (count = fread(buffer, 1, sizeof buffer < size ? sizeof buffer : size, in)) > 0) {
+        if (fwrite(buffer, 1, count, out) != count)
+            break;
+        size -= count;
+    }
+
+    fclose(in);
+    return size == 0;
+}
+
+int main(int argc, char **argv)
+{
+    VFS_HEADER header = { VFS_MAGIC };
+    VFS_ENTRY entry;
+    uint64_t contents;
+    uint64_t offset;
+    FILE *out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <directory> <pack>\n", argv[0]);
+        return 1;
+    }
+
+    RootLength = strlen(argv[1]);
+
+    while (RootLength > 1 && argv[1][RootLength - 1] == '/')
+        argv[1][--RootLength] = '\0';
+
+    // Skip the separator after the root too.
+    RootLength++;
+
+    if (nftw(argv[1], add_file, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "failed to scan directory %s\n", argv[1]);
+        return 1;
+    }
+
+    qsort(Files, FileCount, sizeof(PACK_FILE), compare_files);
+
+    for (size_t i = 1; i < FileCount; i++) {
+        if (strcmp(Files[i - 1].name, Files[i].name) == 0) {
+            fprintf(stderr, "%s and %s only differ in case\n", Files[i - 1].path, Files[i].path);
+            return 1;
+        }
+    }
+
+    // The names follow the index, then the contents. Work out where
+    // everything goes first, so a tree too large for the format is refused
+    // before anything is written.
+    contents = sizeof header + (uint64_t) FileCount * sizeof(VFS_ENTRY);
+
+    for (size_t i = 0; i < FileCount; i++)
+        contents += strlen(Files[i].name) + 1;
+
+    offset = contents;
+
+    for (size_t i = 0; i < FileCount && offset <= VFS_MAX_SIZE; i++)
+        offset = align_data(offset, Files[i].size) + Files[i].size;
+
+    if (offset > VFS_MAX_SIZE) {
+        fprintf(stderr, "the pack would be %llu bytes, the limit is %llu\n",
+                (unsigned long long) offset,
+                (unsigned long long) VFS_MAX_SIZE);
+        return 1;
+    }
+
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+        fprintf(stderr, "failed to create pack %s\n", argv[2]);
+        return 1;
+    }
+
+    header.count = FileCount;
+
+    fwrite(&header, sizeof header, 1, out);
+
+    offset = contents;
+
+    for (size_t i = 0, name = sizeof header + FileCount * sizeof(VFS_ENTRY); i < FileCount; i++) {
+        offset       = align_data(offset, Files[i].size);
+        entry.name   = name;
+        entry.length = strlen(Files[i].name);
+        entry.offset = offset;
+        entry.size   = Files[i].size;
+
+        fwrite(&entry, sizeof entry, 1, out);
+
+        name   += entry.length + 1;
+        offset += entry.size;
+    }
+
+    for (size_t i = 0; i < FileCount; i++)
+        fwrite(Files[i].name, strlen(Files[i].name) + 1, 1, out);
+
+    for (size_t i = 0; i < FileCount; i++) {
+        offset = align_data(ftello(out), Files[i].size);
+
+        while (ftello(out) < offset)
+            fputc(0, out);
+
+        if (!copy_file(out, Files[i].path, Files[i].size)) {
+            fprintf(stderr, "failed to read %s\n", Files[i].path);
+            return 1;
+        }
+    }
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "failed to write pack %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("packed %zu files into %s\n", FileCount, argv[2]);
+    return 0;
+}
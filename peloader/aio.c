@@ -0,0 +1,329 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "util.h"
+#include "aio.h"
+#include "metadata.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+# include <linux/io_uring.h>
+# define HAVE_IO_URING 1
+#endif
+
+#define AIO_RING_ENTRIES    256
+#define AIO_WORKER_THREADS  4
+
+static pthread_once_t AioOnce = PTHREAD_ONCE_INIT;
+
+// Requests waiting for a worker thread when io_uring isn't available, or the
+// ring is full.
+static pthread_mutex_t QueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QueueReady = PTHREAD_COND_INITIALIZER;
+static pthread_once_t WorkerOnce = PTHREAD_ONCE_INIT;
+static AIO_REQUEST *QueueHead;
+static AIO_REQUEST **QueueTail = &QueueHead;
+
+// Internal threads never run Windows code, so keep signals away from them.
+static bool aio_thread_create(void *(*routine)(void *))
+{
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result;
+
+    sigfillset(&all);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    result = pthread_create(&thread, &attr, routine, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (result != 0) {
+        l_warning("failed to create i/o thread, %s", strerror(result));
+        return false;
+    }
+
+    return true;
+}
+
+static void *aio_worker(void *unused)
+{
+    AIO_REQUEST *request;
+    ssize_t result;
+
+    while (true) {
+        pthread_mutex_lock(&QueueLock);
+
+        while (QueueHead == NULL)
+            pthread_cond_wait(&QueueReady, &QueueLock);
+
+        request = QueueHead;
+
+        if ((QueueHead = request->next) == NULL)
+            QueueTail = &QueueHead;
+
+        pthread_mutex_unlock(&QueueLock);
+
+        if (request->write) {
+            result = file_pwrite(request->file, request->iov.iov_base, request->iov.iov_len, request->offset);
+        } else {
+            result = file_pread(request->file, request->iov.iov_base, request->iov.iov_len, request->offset);
+        }
+
+        request->result = result < 0 ? -errno : result;
+
+        if (request->write)
+            metadata_invalidate_file(request->file);
+
+        request->complete(request);
+    }
+
+    return NULL;
+}
+
+static void aio_worker_init(void)
+{
+    for (int i = 0; i < AIO_WORKER_THREADS; i++) {
+        if (!aio_thread_create(aio_worker) && i == 0) {
+            l_error("no i/o threads available, overlapped requests will not complete");
+        }
+    }
+}
+
+static bool aio_queue(AIO_REQUEST *request)
+{
+    pthread_once(&WorkerOnce, aio_worker_init);
+
+    request->next = NULL;
+
+    pthread_mutex_lock(&QueueLock);
+    *QueueTail = request;
+    QueueTail  = &request->next;
+    pthread_cond_signal(&QueueReady);
+    pthread_mutex_unlock(&QueueLock);
+
+    return true;
+}
+
+#ifdef HAVE_IO_URING
+static struct {
+    int fd;
+    unsigned entries;
+    unsigned inflight;
+    unsigned limit;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Ring = { .fd = -1 };
+
+static pthread_mutex_t RingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+// Wait for completions and hand them back, this is the only consumer of the
+// completion queue so no locking is required.
+static void *aio_reaper(void *unused)
+{
+    struct io_uring_cqe *cqe;
+    AIO_REQUEST *request;
+    unsigned head;
+
+    while (true) {
+        if (io_uring_enter(Ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            l_error("io_uring_enter failed, %m");
+            usleep(1000);
+        }
+
+        head = *Ring.cq_head;
+
+        while (head != __atomic_load_n(Ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe             = &Ring.cqes[head & *Ring.cq_mask];
+            request         = (AIO_REQUEST *)(uintptr_t) cqe->user_data;
+            request->result = cqe->res;
+
+            __atomic_store_n(Ring.cq_head, ++head, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&Ring.inflight, 1, __ATOMIC_RELAXED);
+
+            if (request->write)
+                metadata_invalidate_file(request->file);
+
+            request->complete(request);
+        }
+    }
+
+    return NULL;
+}
+
+static bool aio_ring_init(void)
+{
+    struct io_uring_params params = {0};
+    size_t sqsize, cqsize;
+    void *sq, *cq;
+
+    if ((Ring.fd = syscall(__NR_io_uring_setup, AIO_RING_ENTRIES, &params)) < 0) {
+        l_debug("io_uring unavailable (%m), using i/o threads");
+        return false;
+    }
+
+    sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with a single mmap().
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqsize = cqsize = MAX(sqsize, cqsize);
+
+    sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring.fd, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED)
+        goto error;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring.fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED)
+            goto error;
+    }
+
+    Ring.sqes = mmap(NULL,
+                     params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     Ring.fd,
+                     IORING_OFF_SQES);
+
+    if (Ring.sqes == MAP_FAILED)
+        goto error;
+
+    Ring.entries  = params.sq_entries;
+    Ring.limit    = params.cq_entries;
+    Ring.sq_head  = (unsigned *)((uint8_t *) sq + params.sq_off.head);
+    Ring.sq_tail  = (unsigned *)((uint8_t *) sq + params.sq_off.tail);
+    Ring.sq_mask  = (unsigned *)((uint8_t *) sq + params.sq_off.ring_mask);
+    Ring.sq_array = (unsigned *)((uint8_t *) sq + params.sq_off.array);
+    Ring.cq_head  = (unsigned *)((uint8_t *) cq + params.cq_off.head);
+    Ring.cq_tail  = (unsigned *)((uint8_t *) cq + params.cq_off.tail);
+    Ring.cq_mask  = (unsigned *)((uint8_t *) cq + params.cq_off.ring_mask);
+    Ring.cqes     = (struct io_uring_cqe *)((uint8_t *) cq + params.cq_off.cqes);
+
+    if (!aio_thread_create(aio_reaper))
+        goto error;
+
+    l_debug("io_uring ready, %u entries", Ring.entries);
+    return true;
+
+error:
+    // The mappings are small, and we only get here once.
+    l_warning("failed to initialize io_uring, %m");
+    close(Ring.fd);
+    Ring.fd = -1;
+    return false;
+}
+
+// Returns false if the ring is full, the caller should use a thread instead.
+static bool aio_ring_submit(AIO_REQUEST *request)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+    int result;
+
+    // Never allow more requests in flight than the completion queue can hold.
+    if (__atomic_add_fetch(&Ring.inflight, 1, __ATOMIC_RELAXED) > Ring.limit) {
+        __atomic_sub_fetch(&Ring.inflight, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    pthread_mutex_lock(&RingLock);
+
+    tail = *Ring.sq_tail;
+
+    if (tail - __atomic_load_n(Ring.sq_head, __ATOMIC_ACQUIRE) >= Ring.entries) {
+        pthread_mutex_unlock(&RingLock);
+        __atomic_sub_fetch(&Ring.inflight, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    index = tail & *Ring.sq_mask;
+    sqe   = &Ring.sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+
+    sqe->opcode    = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = request->file->fd;
+    sqe->addr      = (uintptr_t) &request->iov;
+    sqe->len       = 1;
+    sqe->off       = request->offset;
+    sqe->user_data = (uintptr_t) request;
+
+    Ring.sq_array[index] = index;
+
+    __atomic_store_n(Ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // If an earlier submission failed, its entry is still in the ring and is
+    // picked up here.
+    do {
+        result = io_uring_enter(Ring.fd, tail + 1 - __atomic_load_n(Ring.sq_head, __ATOMIC_ACQUIRE), 0, 0);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0)
+        l_warning("io_uring_enter failed, %m, will retry on next submission");
+
+    pthread_mutex_unlock(&RingLock);
+    return true;
+}
+#endif
+
+static void aio_init(void)
+{
+#ifdef HAVE_IO_URING
+    if (getenv("LL_URING_DISABLE") == NULL)
+        aio_ring_init();
+#endif
+}
+
+bool aio_submit(AIO_REQUEST *request)
+{
+    pthread_once(&AioOnce, aio_init);
+
+    if (request->write)
+        file_stat_invalidate(request->file);
+
+#ifdef HAVE_IO_URING
+    // Pipes, terminals and in-memory files go to a thread, as do temporary
+    // files because file_pwrite() decides when they move to disk.
+    if (Ring.fd >= 0
+     && request->file->fd >= 0
+     && request->file->seekable
+     && !request->file->temporary
+     && aio_ring_submit(request))
+        return true;
+#endif
+
+    return aio_queue(request);
+}
@@ -0,0 +1,32 @@
+#ifndef __AIO_H
+#define __AIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "handles.h"
+
+// Asynchronous reads and writes for overlapped file handles.
+//
+// Requests are submitted to io_uring where the kernel supports it, otherwise
+// they're handed to a small pool of threads that use pread() and pwrite().
+// Either way, complete() is called on an internal thread when the request
+// finishes, with result set to the number of bytes transferred or -errno.
+//
+// Set LL_URING_DISABLE in the environment to always use the thread pool.
+
+typedef struct aio_request {
+    struct aio_request *next;
+    FILE_OBJECT *file;          // The caller must hold a reference.
+    struct iovec iov;
+    uint64_t offset;
+    bool write;
+    int32_t result;
+    void (*complete)(struct aio_request *request);
+    void *context;
+} AIO_REQUEST;
+
+bool aio_submit(AIO_REQUEST *request);
+
+#endif
@@ -0,0 +1,372 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+#include "log.h"
+#include "util.h"
+#include "symbols.h"
+#include "callprof.h"
+
+#define CALLPROF_BUCKETS    48          // Powers of two cycles.
+#define CALLPROF_DEPTH      256         // Nested calls tracked per thread.
+#define CALLPROF_ARENA_SIZE 0x10000
+
+typedef struct callprof_slot {
+    void *target;
+    char *module;
+    const char *dll;
+    const char *name;
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t histogram[CALLPROF_BUCKETS];
+    struct callprof_slot *next;
+} CALLPROF_SLOT;
+
+typedef struct callprof_frame {
+    CALLPROF_SLOT *slot;
+    void **retaddr;             // Where the return address was on the stack.
+    void *caller;
+    uint64_t start;
+} CALLPROF_FRAME;
+
+bool CallProfEnabled;
+
+static CALLPROF_SLOT *CallProfSlots;
+static char *CallProfPath;
+static uint8_t *ArenaNext;
+static uint8_t *ArenaEnd;
+
+// Calls in progress on this thread, the thunk replaces the return address
+// of each call with callprof_exit and remembers the real one here.
+static __thread CALLPROF_FRAME CallStack[CALLPROF_DEPTH];
+static __thread unsigned CallDepth;
+
+static void callprof_exit_handler(void);
+
+// Calls that never returned through callprof_exit, e.g. because an exception
+// unwound past them, leave a frame behind. The stack has been reused if a new
+// call puts its return address at or above theirs, so they're discarded.
+// This keeps the frames in stack order.
+static inline void callprof_unwind(void **retaddr)
+{
+    while (CallDepth && CallStack[CallDepth - 1].retaddr <= retaddr)
+        CallDepth--;
+}
+
+static void __constructor callprof_init(void)
+{
+    if (getenv("LL_CALLPROF") == NULL)
+        return;
+
+#ifdef __i386__
+    CallProfPath    = strdup(getenv("LL_CALLPROF"));
+    CallProfEnabled = true;
+
+    atexit(callprof_exit_handler);
+#else
+    l_warning("LL_CALLPROF is only supported on i386");
+#endif
+}
+
+#ifdef __i386__
+// Defined in assembly below.
+extern void callprof_thunk(void) __attribute__((visibility("hidden")));
+extern void callprof_exit(void) __attribute__((visibility("hidden")));
+
+// Called by the entry thunk with the slot and the location of the return
+// address, returns where to go next. These are called from assembly, so they
+// can't be static or gcc might change the calling convention.
+__attribute__((visibility("hidden"), regparm(0)))
+void *callprof_enter(CALLPROF_SLOT *slot, void **retaddr)
+{
+    CALLPROF_FRAME *frame;
+
+    __atomic_add_fetch(&slot->calls, 1, __ATOMIC_RELAXED);
+
+    callprof_unwind(retaddr);
+
+    // Too deep to track, just count it.
+    if (CallDepth >= CALLPROF_DEPTH)
+        return slot->target;
+
+    frame          = &CallStack[CallDepth++];
+    frame->slot    = slot;
+    frame->retaddr = retaddr;
+    frame->caller  = *retaddr;
+
+    *retaddr       = callprof_exit;
+    frame->start   = __rdtsc();
+
+    return slot->target;
+}
+
+// Called when the function returns to callprof_exit with the stack pointer
+// after the return, returns the real return address.
+__attribute__((visibility("hidden"), regparm(0)))
+void *callprof_leave(void **stack)
+{
+    uint64_t cycles = __rdtsc();
+    CALLPROF_FRAME *frame = NULL;
+    unsigned bucket;
+
+    // A stdcall function also pops its parameters, so the return address
+    // was somewhere below the stack pointer. Every frame below it has
+    // returned, the outermost of those is this call and the rest were
+    // abandoned.
+    while (CallDepth && CallStack[CallDepth - 1].retaddr < stack)
+        frame = &CallStack[--CallDepth];
+
+    cycles -= frame->start;
+    bucket  = cycles ? MIN(63 - __builtin_clzll(cycles), CALLPROF_BUCKETS - 1) : 0;
+
+    __atomic_add_fetch(&frame->slot->cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frame->slot->histogram[bucket], 1, __ATOMIC_RELAXED);
+
+    return frame->caller;
+}
+
+// The thunk for each slot is push $slot; jmp callprof_thunk. We save the
+// registers that might hold fastcall or thiscall parameters, then "return"
+// into the target so the stack is exactly as the caller left it.
+//
+// callprof_exit preserves the return value in eax:edx. Floating point
+// results are left in st(0), which callprof_leave doesn't touch.
+__asm__(
+    ".pushsection .text                 \n"
+    "callprof_thunk:                    \n"
+    "   push    %eax                    \n"
+    "   push    %ecx                    \n"
+    "   push    %edx                    \n"
+    "   lea     16(%esp), %eax          \n"     // &retaddr
+    "   push    %eax                    \n"
+    "   push    16(%esp)                \n"     // slot
+    "   call    callprof_enter          \n"
+    "   add     $8, %esp                \n"
+    "   mov     %eax, 12(%esp)          \n"     // Replace slot with target.
+    "   pop     %edx                    \n"
+    "   pop     %ecx                    \n"
+    "   pop     %eax                    \n"
+    "   ret                             \n"
+    "callprof_exit:                     \n"
+    "   sub     $4, %esp                \n"     // Room for the return address.
+    "   push    %eax                    \n"
+    "   push    %ecx                    \n"
+    "   push    %edx                    \n"
+    "   lea     16(%esp), %eax          \n"     // Stack pointer after the return.
+    "   push    %eax                    \n"
+    "   call    callprof_leave          \n"
+    "   add     $4, %esp                \n"
+    "   mov     %eax, 12(%esp)          \n"
+    "   pop     %edx                    \n"
+    "   pop     %ecx                    \n"
+    "   pop     %eax                    \n"
+    "   ret                             \n"
+    ".popsection                        \n"
+);
+
+static void *thunk_create(CALLPROF_SLOT *slot)
+{
+    uint8_t *thunk;
+
+    if (ArenaNext == NULL || ArenaEnd - ArenaNext < 10) {
+        ArenaNext = mmap(NULL,
+                         CALLPROF_ARENA_SIZE,
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+
+        if (ArenaNext == MAP_FAILED) {
+            ArenaNext = NULL;
+            return NULL;
+        }
+
+        ArenaEnd = ArenaNext + CALLPROF_ARENA_SIZE;
+    }
+
+    thunk = ArenaNext;
+
+    // push imm32
+    thunk[0] = 0x68;
+    memcpy(&thunk[1], &slot, sizeof(uint32_t));
+
+    // jmp rel32
+    thunk[5] = 0xE9;
+    *(int32_t *)(&thunk[6]) = (uintptr_t) callprof_thunk - (uintptr_t)(&thunk[10]);
+
+    ArenaNext += 10;
+    return thunk;
+}
+#else
+static void *thunk_create(CALLPROF_SLOT *slot)
+{
+    return NULL;
+}
+#endif
+
+// Imports resolved to another PE image might be data, only shims are counted.
+static bool is_image_address(void *address)
+{
+    const char *name;
+    uintptr_t base;
+    size_t size;
+
+    for (unsigned i = 0; symbols_image(i, &name, &base, &size); i++) {
+        if ((uintptr_t) address >= base && (uintptr_t) address < base + size)
+            return true;
+    }
+
+    return false;
+}
+
+void *callprof_bind(const char *module, const char *dll, const char *name, void *target)
+{
+    CALLPROF_SLOT *slot;
+    char *path;
+    void *thunk;
+
+    if (is_image_address(target))
+        return target;
+
+    slot = calloc(1, sizeof *slot);
+    path = strdup(module);
+
+    slot->target = target;
+    slot->module = strdup(basename(path));
+    slot->dll    = dll;
+    slot->name   = name;
+
+    free(path);
+
+    if ((thunk = thunk_create(slot)) == NULL) {
+        l_warning("failed to create thunk for %s, it won't be counted", name);
+        free(slot->module);
+        free(slot);
+        return target;
+    }
+
+    slot->next    = CallProfSlots;
+    CallProfSlots = slot;
+
+    return thunk;
+}
+
+// The smallest power of two cycles that covers fraction of the calls.
+static uint64_t percentile(const uint64_t *histogram, uint64_t total, double fraction)
+{
+    uint64_t count = 0;
+
+    for (unsigned i = 0; i < CALLPROF_BUCKETS; i++) {
+        if ((count += histogram[i]) >= total * fraction)
+            return 2ULL << i;
+    }
+
+    return 0;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+    const CALLPROF_SLOT *x = *(CALLPROF_SLOT **) a;
+    const CALLPROF_SLOT *y = *(CALLPROF_SLOT **) b;
+
+    if (x->cycles != y->cycles)
+        return x->cycles > y->cycles ? -1 : 1;
+
+    return x->calls > y->calls ? -1 : x->calls < y->calls;
+}
+
+static void print_slot(FILE *out, const CALLPROF_SLOT *slot, const char *module)
+{
+    uint64_t timed = 0;
+
+    for (unsigned i = 0; i < CALLPROF_BUCKETS; i++)
+        timed += slot->histogram[i];
+
+    fprintf(out, "%12llu %16llu %10llu %10llu %10llu  %s!%s%s%s\n",
+                 (unsigned long long) slot->calls,
+                 (unsigned long long) slot->cycles,
+                 (unsigned long long)(timed ? slot->cycles / timed : 0),
+                 (unsigned long long) percentile(slot->histogram, timed, 0.5),
+                 (unsigned long long) percentile(slot->histogram, timed, 0.99),
+                 slot->dll,
+                 slot->name,
+                 module ? " in " : "",
+                 module ? module : "");
+}
+
+static void callprof_exit_handler(void)
+{
+    CALLPROF_SLOT **sorted;
+    CALLPROF_SLOT *totals;
+    size_t count = 0;
+    size_t functions = 0;
+    FILE *out = stderr;
+
+    if (strcmp(CallProfPath, "-") != 0 && (out = fopen(CallProfPath, "w")) == NULL) {
+        l_warning("failed to open %s for call profile, %m", CallProfPath);
+        return;
+    }
+
+    for (CALLPROF_SLOT *slot = CallProfSlots; slot; slot = slot->next)
+        count++;
+
+    sorted = calloc(count, sizeof *sorted);
+    totals = calloc(count, sizeof *totals);
+
+    // Merge the slots for each function across modules.
+    for (CALLPROF_SLOT *slot = CallProfSlots; slot; slot = slot->next) {
+        size_t i;
+
+        for (i = 0; i < functions; i++) {
+            if (totals[i].target == slot->target && strcmp(totals[i].name, slot->name) == 0)
+                break;
+        }
+
+        if (i == functions) {
+            totals[functions].target = slot->target;
+            totals[functions].dll    = slot->dll;
+            totals[functions].name   = slot->name;
+            functions++;
+        }
+
+        totals[i].calls  += slot->calls;
+        totals[i].cycles += slot->cycles;
+
+        for (unsigned j = 0; j < CALLPROF_BUCKETS; j++)
+            totals[i].histogram[j] += slot->histogram[j];
+    }
+
+    fprintf(out, "%12s %16s %10s %10s %10s  %s\n", "calls", "cycles", "mean", "p50", "p99", "function");
+
+    for (size_t i = 0; i < functions; i++)
+        sorted[i] = &totals[i];
+
+    qsort(sorted, functions, sizeof *sorted, compare_slots);
+
+    for (size_t i = 0; i < functions && sorted[i]->calls; i++)
+        print_slot(out, sorted[i], NULL);
+
+    fprintf(out, "\n%12s %16s %10s %10s %10s  %s\n", "calls", "cycles", "mean", "p50", "p99", "function in module");
+
+    count = 0;
+
+    for (CALLPROF_SLOT *slot = CallProfSlots; slot; slot = slot->next)
+        sorted[count++] = slot;
+
+    qsort(sorted, count, sizeof *sorted, compare_slots);
+
+    for (size_t i = 0; i < count && sorted[i]->calls; i++)
+        print_slot(out, sorted[i], sorted[i]->module);
+
+    free(totals);
+    free(sorted);
+
+    if (out != stderr)
+        fclose(out);
+}
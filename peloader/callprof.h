@@ -0,0 +1,26 @@
+#ifndef __CALLPROF_H
+#define __CALLPROF_H
+
+#include <stdbool.h>
+
+// Optional call counting for imported functions.
+//
+// Set LL_CALLPROF=<path> (or - for stderr) and import() binds each IAT slot
+// to a small generated thunk rather than the function itself. The thunk
+// counts calls and records a histogram of the cycles spent in each call,
+// for each function and importing module. A report sorted by total time is
+// written at exit.
+//
+// Times are inclusive. Calls that never return through the thunk, like
+// ExitProcess, or RaiseException and _CxxThrowException when a handler
+// unwinds past them, are counted but not timed. Their frames are discarded
+// by the next profiled call or return on that thread that finds the stack
+// has been unwound past them. Nothing changes when this isn't enabled, the
+// IAT points straight at the shims.
+
+extern bool CallProfEnabled;
+
+// Returns the address to store in the IAT slot for target.
+void *callprof_bind(const char *module, const char *dll, const char *name, void *target);
+
+#endif
@@ -46,6 +46,7 @@
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "crt_exports.h"
+#include "winstrings.h"
 
 #define EXIT2(stmt) do { stmt; } while (0)
 #define TRACE2(a,b,...)
@@ -228,67 +229,50 @@ noregparm char *WIN_FUNC(_win_strncat,3)
 noregparm INT WIN_FUNC(_win_wcscmp,2)
         (const wchar_t *s1, const wchar_t *s2)
 {
-        while (*s1 && *s1 == *s2) {
-                s1++;
-                s2++;
-        }
-        return *s1 - *s2;
+        return wide_strcmp(s1, s2);
 }
 
 noregparm INT WIN_FUNC(_win_wcsicmp,2)
         (const wchar_t *s1, const wchar_t *s2)
 {
-        while (*s1 && tolower((char)*s1) == tolower((char)*s2)) {
-                s1++;
-                s2++;
-        }
-        return tolower((char)*s1) - tolower((char)*s2);
+        return wide_stricmp(s1, s2);
 }
 
 noregparm SIZE_T WIN_FUNC(_win_wcslen,1)
         (const wchar_t *s)
 {
-        const wchar_t *t = s;
-        while (*t)
-                t++;
-        return t - s;
+        return wide_strlen(s);
 }
 
 noregparm wchar_t *WIN_FUNC(_win_wcsncpy,3)
         (wchar_t *dest, const wchar_t *src, SIZE_T n)
 {
-        const wchar_t *s;
-        wchar_t *d;
-        s = src + n;
-        d = dest;
-        while (src < s && (*d++ = *src++))
-                ;
-        if (s > src)
-                memset(d, 0, (s - src) * sizeof(wchar_t));
+        SIZE_T len = wide_strnlen(src, n);
+
+        memcpy(dest, src, len * sizeof(wchar_t));
+        memset(dest + len, 0, (n - len) * sizeof(wchar_t));
         return dest;
 }
 
 noregparm wchar_t *WIN_FUNC(_win_wcscpy,2)
         (wchar_t *dest, const wchar_t *src)
 {
-        wchar_t *d = dest;
-        while ((*d++ = *src++))
-                ;
-        return dest;
+        return memcpy(dest, src, (wide_strlen(src) + 1) * sizeof(wchar_t));
 }
 
 noregparm wchar_t *WIN_FUNC(_win_wcscat,2)
         (wchar_t *dest, const wchar_t *src)
 {
-        wchar_t *d;
-        d = dest;
-        while (*d)
-                d++;
-        while ((*d++ = *src++))
-                ;
+        memcpy(dest + wide_strlen(dest), src, (wide_strlen(src) + 1) * sizeof(wchar_t));
         return dest;
 }
 
+noregparm wchar_t *WIN_FUNC(_win_wcschr,2)
+        (const wchar_t *s, wchar_t c)
+{
+        return wide_strchr(s, c);
+}
+
 noregparm INT WIN_FUNC(_win_towupper,1)
         (wchar_t c)
 {
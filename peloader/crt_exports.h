@@ -45,6 +45,8 @@ noregparm wchar_t *WIN_FUNC(_win_wcscpy,2)
         (wchar_t *dest, const wchar_t *src);
 noregparm wchar_t *WIN_FUNC(_win_wcscat,2)
         (wchar_t *dest, const wchar_t *src);
+noregparm wchar_t *WIN_FUNC(_win_wcschr,2)
+        (const wchar_t *s, wchar_t c);
 noregparm INT WIN_FUNC(_win_towupper,1)
         (wchar_t c);
 noregparm INT WIN_FUNC(_win_towlower,1)
@@ -158,6 +160,7 @@ struct wrap_export crt_exports[] = {
 	WIN_WIN_SYMBOL(_vsnwprintf, 4),
 	WIN_WIN_SYMBOL(vsprintf, 3),
 	WIN_WIN_SYMBOL(wcscat, 2),
+	WIN_WIN_SYMBOL(wcschr, 2),
 	WIN_WIN_SYMBOL(wcscmp, 2),
 	WIN_WIN_SYMBOL(wcscpy, 2),
 	WIN_WIN_SYMBOL(wcsicmp, 2),
@@ -19,53 +19,167 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <search.h>
-#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "winnt_types.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
+#include "log.h"
 #include "util.h"
+#include "symbols.h"
+#include "symindex.h"
 
-#define MAX_EXTRA_EXPORTS 65535
+#define MAX_EXTRA_INDEXES 32
 
-struct wrap_export extra_exports[MAX_EXTRA_EXPORTS];
-extern struct hsearch_data extraexports;
+static struct {
+    const SYMINDEX *index;
+    size_t          size;
+    bool            mapped;     // Otherwise it was built from a text map.
+    uintptr_t       base;
+} ExtraIndexes[MAX_EXTRA_INDEXES];
+
+static unsigned NumExtraIndexes;
 
 static void __destructor cleanup_extra_exports(void)
 {
-    hdestroy_r(&extraexports);
+    for (unsigned i = 0; i < NumExtraIndexes; i++) {
+        if (ExtraIndexes[i].mapped) {
+            munmap((void *) ExtraIndexes[i].index, ExtraIndexes[i].size);
+        } else {
+            free((void *) ExtraIndexes[i].index);
+        }
+    }
 }
 
-// This code is designed to parse a .MAP file produced by IDA.
-bool process_extra_exports(void *imagebase, size_t base, const char *filename)
+// A compiled index from mksymidx is used where it is.
+static const SYMINDEX *map_symbol_index(int fd, const char *filename, size_t *size)
 {
-    char *name;
-    uintptr_t address;
-    size_t num = 0;
-    FILE *exports;
+    struct stat buf;
+    void *index;
 
-    if ((exports = fopen(filename, "r")) == NULL) {
-        return false;
+    if (fstat(fd, &buf) != 0)
+        return NULL;
+
+    if ((index = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        l_warning("failed to map symbol index %s, %m", filename);
+        return NULL;
     }
 
-    hcreate_r(MAX_EXTRA_EXPORTS, &extraexports);
-
-    while (!feof(exports)) {
-        if (fscanf(exports, "%*X:%X %m[^\n]", &address, &name) == 2) {
-            ENTRY e, *ep;
-            e.key   = name;
-            e.data  = (void *)((uintptr_t)(imagebase) + address + base);
-            hsearch_r(e, ENTER, &ep, &extraexports);
-            if (++num >= MAX_EXTRA_EXPORTS) {
-                warn("large number of extra symbols in %s, increase MAX_EXTRA_EXPORTS and rebuild", filename);
-                break;
+    if (!symindex_validate(index, buf.st_size)) {
+        l_warning("symbol index %s is corrupt", filename);
+        munmap(index, buf.st_size);
+        return NULL;
+    }
+
+    *size = buf.st_size;
+    return index;
+}
+
+// Otherwise it's a .MAP file produced by IDA, or a list of addresses and
+// names, which is compiled in memory.
+static const SYMINDEX *parse_symbol_map(int fd, const char *filename, size_t *size)
+{
+    SYMINDEX_INPUT *symbols = NULL;
+    size_t count = 0, max = 0, length = 0;
+    SYMINDEX *index = NULL;
+    char *line = NULL;
+    FILE *map;
+
+    if ((map = fdopen(dup(fd), "r")) == NULL)
+        return NULL;
+
+    while (getline(&line, &length, map) > 0) {
+        SYMINDEX_INPUT symbol;
+
+        if (!symindex_parse_line(line, &symbol))
+            continue;
+
+        if (count == max) {
+            SYMINDEX_INPUT *resized;
+
+            max = max ? max * 2 : 1024;
+
+            if ((resized = realloc(symbols, max * sizeof *symbols)) == NULL) {
+                l_error("failed to allocate memory for %zu symbols from %s", max, filename);
+                goto finished;
             }
-        } else {
-            fgetc(exports);
+
+            symbols = resized;
         }
+
+        symbols[count].address = symbol.address;
+        symbols[count].name    = strdup(symbol.name);
+        count++;
+    }
+
+    if ((index = symindex_build(symbols, count)) == NULL) {
+        l_error("failed to build an index of %zu symbols from %s", count, filename);
+        goto finished;
+    }
+
+    *size = index->size;
+
+finished:
+    for (size_t i = 0; i < count; i++)
+        free((char *) symbols[i].name);
+
+    free(symbols);
+    free(line);
+    fclose(map);
+    return index;
+}
+
+bool process_extra_exports(void *imagebase, size_t base, const char *filename)
+{
+    const SYMINDEX *index;
+    char magic[sizeof index->magic];
+    size_t size;
+    bool mapped;
+    int fd;
+
+    if (NumExtraIndexes >= MAX_EXTRA_INDEXES) {
+        l_warning("too many symbol maps, ignoring %s", filename);
+        return false;
+    }
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
     }
 
-    fclose(exports);
+    mapped = pread(fd, magic, sizeof magic, 0) == sizeof magic
+          && memcmp(magic, SYMINDEX_MAGIC, sizeof magic) == 0;
+
+    index = mapped ? map_symbol_index(fd, filename, &size)
+                   : parse_symbol_map(fd, filename, &size);
+
+    close(fd);
+
+    if (index == NULL)
+        return false;
+
+    ExtraIndexes[NumExtraIndexes].index  = index;
+    ExtraIndexes[NumExtraIndexes].size   = size;
+    ExtraIndexes[NumExtraIndexes].mapped = mapped;
+    ExtraIndexes[NumExtraIndexes].base   = (uintptr_t)(imagebase) + base;
+
+    symbols_add_index(index, (void *) ExtraIndexes[NumExtraIndexes].base);
+
+    NumExtraIndexes++;
     return true;
 }
+
+bool get_extra_export(const char *name, void **address)
+{
+    uint32_t offset;
+
+    for (unsigned i = 0; i < NumExtraIndexes; i++) {
+        if (symindex_find(ExtraIndexes[i].index, name, &offset)) {
+            *address = (void *)(ExtraIndexes[i].base + offset);
+            return true;
+        }
+    }
+
+    return false;
+}
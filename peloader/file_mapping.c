@@ -1,69 +1,148 @@
 #include <stdlib.h>
+#include <search.h>
 #include "file_mapping.h"
+#include "stats.h"
 
+static DECLARE_STATS_GAUGE(MappedViews, "mapping.views");
+static DECLARE_STATS_GAUGE(MappedBytes, "mapping.view_bytes");
 
-void AddMappedView(MappedFileView *mapped_view, MappedFileViewList **pList)
+// Views are kept in a balanced tree keyed by base address, overlapping views
+// compare equal so that a one byte key finds the view containing an address.
+static int compare_views(const void *a, const void *b)
 {
-    MappedFileView *current;
-    MappedFileViewList *list = *pList;
-    if (list == NULL) {
-        list = (MappedFileViewList *) malloc(sizeof(MappedFileViewList));
-        list->head = mapped_view;
-        *pList = list;
-        return;
-    }
+    const MappedFileView *x = a;
+    const MappedFileView *y = b;
 
-    if (list->head == NULL) {
-        list->head = mapped_view;
-        return;
-    }
+    if ((uintptr_t) x->base + x->size <= (uintptr_t) y->base)
+        return -1;
+    if ((uintptr_t) y->base + y->size <= (uintptr_t) x->base)
+        return 1;
+    return 0;
+}
 
-    current = list->head;
+static int compare_sources(const void *a, const void *b)
+{
+    const MappedFileView *x = a;
+    const MappedFileView *y = b;
 
-    while(current->next != NULL) {
-        current = current->next;
-    }
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    if (x->prot != y->prot)
+        return x->prot < y->prot ? -1 : 1;
+    return 0;
+}
+
+void AddMappedView(MappedFileView *mapped_view, MappedFileViewList *list)
+{
+    pthread_mutex_lock(&list->lock);
+
+    mapped_view->refcount = 1;
+
+    tsearch(mapped_view, &list->views, compare_views);
 
-    current->next = mapped_view;
+    // If there's already a reusable view of the same source, keep that one.
+    if (mapped_view->reusable)
+        tsearch(mapped_view, &list->sources, compare_sources);
+
+    list->count++;
+
+    pthread_mutex_unlock(&list->lock);
+
+    stats_inc(&MappedViews);
+    stats_add(&MappedBytes, mapped_view->size);
 }
 
-bool DeleteMappedView(MappedFileView *mapped_file, MappedFileViewList *list)
+// Drop a reference to the view containing address, which doesn't have to be
+// the base. If it was the last one, the view is removed and returned in
+// unmapped, the caller should unmap and free it.
+bool ReleaseMappedView(void *address, MappedFileViewList *list, MappedFileView **unmapped)
 {
-    MappedFileView *to_delete = NULL;
-    MappedFileView *current;
+    MappedFileView key = { .base = address, .size = 1 };
+    MappedFileView **node;
+    MappedFileView *view;
+
+    *unmapped = NULL;
 
     if (list == NULL)
         return false;
 
-    current = list->head;
+    pthread_mutex_lock(&list->lock);
+
+    node = tfind(&key, &list->views, compare_views);
 
-    // mapped_file is the first in the list
-    if (current == mapped_file) {
-        to_delete = current;
-        list->head = NULL;
-        free(to_delete);
-        return true;
+    if (node == NULL) {
+        pthread_mutex_unlock(&list->lock);
+        return false;
     }
 
-    while(current != NULL) {
-        if (current->next == mapped_file) {
-            to_delete = current->next;
-            current->next = to_delete->next;
-            free(to_delete);
-            return true;
-        }
-        current = current->next;
+    view = *node;
+
+    if (--view->refcount == 0) {
+        tdelete(view, &list->views, compare_views);
+
+        // Only remove it from the sources tree if it's the one in there.
+        node = tfind(view, &list->sources, compare_sources);
+
+        if (node && *node == view)
+            tdelete(view, &list->sources, compare_sources);
+
+        list->count--;
+
+        stats_dec(&MappedViews);
+        stats_sub(&MappedBytes, view->size);
+
+        *unmapped = view;
     }
 
-    return false;
+    pthread_mutex_unlock(&list->lock);
+    return true;
 }
 
 MappedFileView* SearchMappedViews(void *base, MappedFileViewList *list)
 {
+    MappedFileView *view = SearchMappedViewsContaining(base, list);
+
+    return view && view->base == base ? view : NULL;
+}
+
+MappedFileView* SearchMappedViewsContaining(void *address, MappedFileViewList *list)
+{
+    MappedFileView key = { .base = address, .size = 1 };
+    MappedFileView **node;
+
     if (list == NULL)
         return NULL;
-    MappedFileView *current = list->head;
-    while(current->base != base && current->next != NULL)
-        current = current->next;
-    return base == current->base ? current : NULL;
+
+    pthread_mutex_lock(&list->lock);
+    node = tfind(&key, &list->views, compare_views);
+    pthread_mutex_unlock(&list->lock);
+
+    return node ? *node : NULL;
+}
+
+// Find an existing view of the same file range with the same protection and
+// take a reference to it.
+MappedFileView* AcquireMappedView(const MappedFileView *source, MappedFileViewList *list)
+{
+    MappedFileView **node;
+    MappedFileView *view = NULL;
+
+    if (list == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&list->lock);
+
+    if ((node = tfind(source, &list->sources, compare_sources))) {
+        view = *node;
+        view->refcount++;
+    }
+
+    pthread_mutex_unlock(&list->lock);
+    return view;
 }
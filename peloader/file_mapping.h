@@ -3,19 +3,36 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 typedef struct mapped_file_view {
-    void *next;
     void *base;
     size_t size;
+
+    // Where the view came from, so that identical requests can share it.
+    dev_t dev;
+    ino_t ino;
+    uint64_t offset;
+    int prot;
+    bool reusable;
+    unsigned refcount;
 } MappedFileView;
 
 typedef struct mapped_file_view_list {
-    MappedFileView *head;
+    pthread_mutex_t lock;
+    void *views;    // Ordered by base address.
+    void *sources;  // Reusable views ordered by (dev, ino, offset, size, prot).
+    size_t count;
 } MappedFileViewList;
 
-void AddMappedView(MappedFileView *mapped_view, MappedFileViewList **list);
-bool DeleteMappedView(MappedFileView *mapped_view, MappedFileViewList *list);
+// Lists are statically initialised, so nothing races to create them.
+#define MAPPED_VIEW_LIST_INITIALIZER { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void AddMappedView(MappedFileView *mapped_view, MappedFileViewList *list);
+bool ReleaseMappedView(void *address, MappedFileViewList *list, MappedFileView **unmapped);
 MappedFileView* SearchMappedViews(void *base, MappedFileViewList *list);
+MappedFileView* SearchMappedViewsContaining(void *address, MappedFileViewList *list);
+MappedFileView* AcquireMappedView(const MappedFileView *source, MappedFileViewList *list);
 
 #endif //LOADLIBRARY_FILE_MAPPING_H
@@ -0,0 +1,433 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "util.h"
+#include "stats.h"
+#include "handles.h"
+
+#define HANDLE_TABLE_SIZE   65536
+#define HANDLE_TABLE_BASE   0x1000      // Windows handles are multiples of four.
+
+#define TEMP_FILE_LIMIT     (64 << 20)  // Default LL_TEMP_LIMIT.
+
+static HANDLE_OBJECT *HandleTable[HANDLE_TABLE_SIZE];
+static unsigned HandleNext;
+static pthread_mutex_t HandleLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Temporary files larger than this are moved from memory to disk.
+static uint64_t TempFileLimit = TEMP_FILE_LIMIT;
+static pthread_mutex_t TempFileLock = PTHREAD_MUTEX_INITIALIZER;
+
+static DECLARE_STATS_COUNTER(TempFilesCreated, "temp.files_created");
+static DECLARE_STATS_COUNTER(TempBytesWritten, "temp.bytes_written");
+static DECLARE_STATS_COUNTER(TempFilesSpilled, "temp.files_spilled");
+static DECLARE_STATS_COUNTER(TempBytesSpilled, "temp.bytes_spilled");
+static DECLARE_STATS_GAUGE(HandlesOpen, "handles.open");
+static DECLARE_STATS_GAUGE(FilesOpen, "handles.files");
+
+// GetStdHandle() returns 0, 1 and 2, so they can be used with ReadFile() and
+// WriteFile() without being in the table.
+static FILE_OBJECT StdFiles[] = {
+    { .header = { HANDLE_TYPE_FILE, 1, NULL }, .fd = STDIN_FILENO },
+    { .header = { HANDLE_TYPE_FILE, 1, NULL }, .fd = STDOUT_FILENO },
+    { .header = { HANDLE_TYPE_FILE, 1, NULL }, .fd = STDERR_FILENO },
+};
+
+static HANDLE handle_insert(HANDLE_OBJECT *object)
+{
+    HANDLE handle = NULL;
+
+    pthread_mutex_lock(&HandleLock);
+
+    // Round robin, so that a stale handle is unlikely to find a new object.
+    for (unsigned i = 0; i < HANDLE_TABLE_SIZE; i++) {
+        unsigned index = (HandleNext + i) % HANDLE_TABLE_SIZE;
+
+        if (HandleTable[index] == NULL) {
+            __atomic_store_n(&HandleTable[index], object, __ATOMIC_RELEASE);
+            HandleNext = index + 1;
+            handle     = (HANDLE)(HANDLE_TABLE_BASE + index * 4);
+            stats_inc(&HandlesOpen);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&HandleLock);
+
+    if (handle == NULL)
+        l_error("handle table exhausted");
+
+    return handle;
+}
+
+static unsigned handle_index(HANDLE handle)
+{
+    uintptr_t value = (uintptr_t) handle;
+
+    if (value < HANDLE_TABLE_BASE || value & 3)
+        return HANDLE_TABLE_SIZE;
+
+    return MIN((value - HANDLE_TABLE_BASE) / 4, HANDLE_TABLE_SIZE);
+}
+
+HANDLE handle_create(HANDLE_OBJECT *object, unsigned type, void (*destroy)(HANDLE_OBJECT *object))
+{
+    object->type     = type;
+    object->refcount = 1;
+    object->destroy  = destroy;
+
+    return handle_insert(object);
+}
+
+// The object is returned with a reference held, so that a concurrent
+// CloseHandle() can't free it under us. Callers must handle_release() it.
+HANDLE_OBJECT *handle_lookup(HANDLE handle, unsigned type)
+{
+    unsigned index = handle_index(handle);
+    HANDLE_OBJECT *object;
+
+    if (index >= HANDLE_TABLE_SIZE)
+        return NULL;
+
+    pthread_mutex_lock(&HandleLock);
+
+    object = HandleTable[index];
+
+    if (object && type != HANDLE_TYPE_ANY && object->type != type)
+        object = NULL;
+
+    if (object)
+        handle_retain(object);
+
+    pthread_mutex_unlock(&HandleLock);
+
+    return object;
+}
+
+HANDLE handle_duplicate(HANDLE handle)
+{
+    HANDLE_OBJECT *object;
+    HANDLE duplicate;
+
+    if ((object = handle_lookup(handle, HANDLE_TYPE_ANY)) == NULL)
+        return NULL;
+
+    // The reference from handle_lookup() now belongs to the duplicate.
+    if ((duplicate = handle_insert(object)) == NULL)
+        handle_release(object);
+
+    return duplicate;
+}
+
+bool handle_close(HANDLE handle)
+{
+    unsigned index = handle_index(handle);
+    HANDLE_OBJECT *object;
+
+    if (index >= HANDLE_TABLE_SIZE)
+        return false;
+
+    pthread_mutex_lock(&HandleLock);
+    object = HandleTable[index];
+    HandleTable[index] = NULL;
+    pthread_mutex_unlock(&HandleLock);
+
+    if (object == NULL)
+        return false;
+
+    stats_dec(&HandlesOpen);
+
+    handle_release(object);
+    return true;
+}
+
+// Objects can hold references to other objects, e.g. a mapping keeps the file
+// open even after the file handle is closed.
+void handle_retain(HANDLE_OBJECT *object)
+{
+    __sync_fetch_and_add(&object->refcount, 1);
+}
+
+void handle_release(HANDLE_OBJECT *object)
+{
+    if (__sync_sub_and_fetch(&object->refcount, 1) == 0 && object->destroy)
+        object->destroy(object);
+}
+
+static void file_destroy(HANDLE_OBJECT *object)
+{
+    FILE_OBJECT *file = (FILE_OBJECT *) object;
+
+    if (file->port)
+        handle_release(file->port);
+
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file);
+
+    stats_dec(&FilesOpen);
+}
+
+HANDLE file_handle_create(int fd)
+{
+    FILE_OBJECT *file = calloc(1, sizeof(FILE_OBJECT));
+    HANDLE handle;
+
+    if (file == NULL)
+        return NULL;
+
+    file->fd       = fd;
+    file->seekable = true;
+
+    if ((handle = handle_create(&file->header, HANDLE_TYPE_FILE, file_destroy)) == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    stats_inc(&FilesOpen);
+    return handle;
+}
+
+// A read-only file backed by memory that outlives the handle.
+HANDLE file_handle_create_memory(const void *data, const struct stat64 *stat)
+{
+    FILE_OBJECT *file = calloc(1, sizeof(FILE_OBJECT));
+    HANDLE handle;
+
+    if (file == NULL)
+        return NULL;
+
+    file->fd         = -1;
+    file->data       = data;
+    file->seekable   = true;
+    file->stat       = *stat;
+    file->stat_valid = true;
+
+    if ((handle = handle_create(&file->header, HANDLE_TYPE_FILE, file_destroy)) == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    stats_inc(&FilesOpen);
+    return handle;
+}
+
+static void __constructor temp_file_init(void)
+{
+    if (getenv("LL_TEMP_LIMIT"))
+        TempFileLimit = strtoull(getenv("LL_TEMP_LIMIT"), NULL, 0);
+}
+
+// A temporary file that's deleted when closed, nobody else can ever open it
+// by name. It lives in memory until it exceeds LL_TEMP_LIMIT bytes.
+HANDLE file_handle_create_temporary(const char *name)
+{
+    FILE_OBJECT *file;
+    HANDLE handle;
+    int fd;
+
+    if ((fd = memfd_create(name, MFD_CLOEXEC)) < 0)
+        return NULL;
+
+    if ((handle = file_handle_create(fd)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    file = file_from_handle(handle);
+    file->temporary = true;
+    handle_release(&file->header);
+
+    stats_inc(&TempFilesCreated);
+
+    return handle;
+}
+
+// Move a temporary file to disk, keeping the same descriptor number so that
+// nothing else needs to know.
+static bool temp_file_spill(FILE_OBJECT *file)
+{
+    char template[] = "lltempXXXXXX";
+    struct stat64 buf;
+    off64_t offset = 0;
+    ssize_t count;
+    bool result = false;
+    int fd;
+
+    pthread_mutex_lock(&TempFileLock);
+
+    // Somebody else got here first.
+    if (file->spilled) {
+        pthread_mutex_unlock(&TempFileLock);
+        return true;
+    }
+
+    if ((fd = open(".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0) {
+        // Not all filesystems support O_TMPFILE.
+        if ((fd = mkostemp(template, O_CLOEXEC)) < 0) {
+            l_warning("failed to create file for temporary data, %m");
+            goto finished;
+        }
+
+        unlink(template);
+    }
+
+    if (fstat64(file->fd, &buf) != 0)
+        goto error;
+
+    while (offset < buf.st_size) {
+        if ((count = sendfile64(fd, file->fd, &offset, buf.st_size - offset)) <= 0) {
+            if (count < 0 && errno == EINTR)
+                continue;
+            goto error;
+        }
+    }
+
+    if (dup3(fd, file->fd, O_CLOEXEC) < 0)
+        goto error;
+
+    file->spilled = true;
+
+    stats_inc(&TempFilesSpilled);
+    stats_add(&TempBytesSpilled, buf.st_size);
+
+    result = true;
+
+error:
+    if (!result)
+        l_warning("failed to move temporary data to disk, %m");
+
+    close(fd);
+
+finished:
+    pthread_mutex_unlock(&TempFileLock);
+    return result;
+}
+
+// Like handle_lookup(), the caller must release the result. The standard
+// handles are never destroyed, but are counted anyway so callers needn't care.
+FILE_OBJECT *file_from_handle(HANDLE handle)
+{
+    if ((uintptr_t) handle < ARRAY_SIZE(StdFiles)) {
+        handle_retain(&StdFiles[(uintptr_t) handle].header);
+        return &StdFiles[(uintptr_t) handle];
+    }
+
+    return (FILE_OBJECT *) handle_lookup(handle, HANDLE_TYPE_FILE);
+}
+
+// The size of files rarely changes while we have them open, and callers
+// tend to query it repeatedly, so we only fstat() again after writes.
+const struct stat64 *file_stat(FILE_OBJECT *file)
+{
+    if (!file->stat_valid) {
+        if (fstat64(file->fd, &file->stat) != 0)
+            return NULL;
+        file->stat_valid = true;
+    }
+
+    return &file->stat;
+}
+
+ssize_t file_pread(FILE_OBJECT *file, void *buf, size_t count, uint64_t offset)
+{
+    ssize_t result;
+
+    if (file->data) {
+        if (offset >= file->stat.st_size)
+            return 0;
+
+        count = MIN(count, file->stat.st_size - offset);
+        memcpy(buf, file->data + offset, count);
+        return count;
+    }
+
+    if (file->seekable) {
+        do {
+            result = pread64(file->fd, buf, count, offset);
+        } while (result < 0 && errno == EINTR);
+
+        if (result >= 0 || errno != ESPIPE)
+            return result;
+
+        // Pipes and terminals have no file pointer.
+        file->seekable = false;
+    }
+
+    do {
+        result = read(file->fd, buf, count);
+    } while (result < 0 && errno == EINTR);
+
+    return result;
+}
+
+ssize_t file_pwrite(FILE_OBJECT *file, const void *buf, size_t count, uint64_t offset)
+{
+    ssize_t result;
+
+    if (file->data) {
+        errno = EBADF;
+        return -1;
+    }
+
+    file_stat_invalidate(file);
+
+    // If this fails, the data stays in memory.
+    if (file->temporary && !file->spilled && offset + count > TempFileLimit)
+        temp_file_spill(file);
+
+    if (file->seekable) {
+        do {
+            result = pwrite64(file->fd, buf, count, offset);
+        } while (result < 0 && errno == EINTR);
+
+        if (result > 0 && file->temporary)
+            stats_add(&TempBytesWritten, result);
+
+        if (result >= 0 || errno != ESPIPE)
+            return result;
+
+        file->seekable = false;
+    }
+
+    do {
+        result = write(file->fd, buf, count);
+    } while (result < 0 && errno == EINTR);
+
+    return result;
+}
+
+// Read or write at the file pointer, and advance it.
+ssize_t file_read(FILE_OBJECT *file, void *buf, size_t count)
+{
+    ssize_t result = file_pread(file, buf, count, file->offset);
+
+    if (result > 0)
+        file->offset += result;
+
+    return result;
+}
+
+ssize_t file_write(FILE_OBJECT *file, const void *buf, size_t count)
+{
+    ssize_t result = file_pwrite(file, buf, count, file->offset);
+
+    if (result > 0)
+        file->offset += result;
+
+    return result;
+}
@@ -0,0 +1,106 @@
+#ifndef __HANDLES_H
+#define __HANDLES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Kernel objects handed to Windows code as HANDLE values.
+//
+// A handle is an index into a fixed size table scaled to look like a real
+// Windows handle, so they never collide with NULL, the standard handles or
+// the magic values we return for unimplemented objects ('EVNT', 'HEAP', etc).
+
+enum {
+    HANDLE_TYPE_ANY,
+    HANDLE_TYPE_FILE,
+    HANDLE_TYPE_MAPPING,
+    HANDLE_TYPE_COMPLETION_PORT,
+    HANDLE_TYPE_FIND,
+};
+
+typedef struct handle_object {
+    unsigned type;
+    unsigned refcount;
+    void (*destroy)(struct handle_object *object);
+} HANDLE_OBJECT;
+
+// A file is a raw descriptor with an explicit file pointer, reads and writes
+// use pread() and pwrite() so nothing is buffered behind our back.
+typedef struct file_handle_object {
+    HANDLE_OBJECT header;
+    int fd;
+    const uint8_t *data;        // Contents of an in-memory file, fd is -1.
+    bool seekable;
+    bool stat_valid;
+    bool temporary;     // Deleted on close, see file_handle_create_temporary().
+    bool spilled;       // A temporary file that grew too large for memory.
+    bool overlapped;    // Opened with FILE_FLAG_OVERLAPPED.
+    uint64_t offset;
+    struct stat64 stat;
+    struct handle_object *port; // Completion port associated with the file.
+    uintptr_t key;              // Completion key for packets sent to port.
+} FILE_OBJECT;
+
+typedef struct mapping_object {
+    HANDLE_OBJECT header;
+    FILE_OBJECT *file;  // A reference to the file, or NULL if anonymous.
+    uint64_t size;      // Maximum size, zero means the size of the file.
+    DWORD protect;
+} MAPPING_OBJECT;
+
+typedef struct completion_packet {
+    struct completion_packet *next;
+    uintptr_t key;
+    void *overlapped;
+    uint32_t status;
+    uint32_t bytes;
+} COMPLETION_PACKET;
+
+typedef struct completion_port_object {
+    HANDLE_OBJECT header;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    COMPLETION_PACKET *head;
+    COMPLETION_PACKET **tail;
+} COMPLETION_PORT;
+
+// A directory search from FindFirstFile(), entries are read from the
+// directory in large batches and matched against the pattern in user space.
+typedef struct find_object {
+    HANDLE_OBJECT header;
+    int fd;             // The directory, or -1 if there's nothing left to read.
+    char *pattern;      // Wildcard in the final component of the search.
+    bool directories;   // Only return subdirectories.
+    size_t position;    // Offset of the next record in buffer.
+    size_t length;      // Bytes returned by the last getdents64().
+    uint8_t *buffer;
+} FIND_OBJECT;
+
+HANDLE handle_create(HANDLE_OBJECT *object, unsigned type, void (*destroy)(HANDLE_OBJECT *object));
+HANDLE_OBJECT *handle_lookup(HANDLE handle, unsigned type);
+HANDLE handle_duplicate(HANDLE handle);
+bool handle_close(HANDLE handle);
+void handle_retain(HANDLE_OBJECT *object);
+void handle_release(HANDLE_OBJECT *object);
+
+HANDLE file_handle_create(int fd);
+HANDLE file_handle_create_memory(const void *data, const struct stat64 *stat);
+HANDLE file_handle_create_temporary(const char *name);
+FILE_OBJECT *file_from_handle(HANDLE handle);
+const struct stat64 *file_stat(FILE_OBJECT *file);
+ssize_t file_pread(FILE_OBJECT *file, void *buf, size_t count, uint64_t offset);
+ssize_t file_pwrite(FILE_OBJECT *file, const void *buf, size_t count, uint64_t offset);
+ssize_t file_read(FILE_OBJECT *file, void *buf, size_t count);
+ssize_t file_write(FILE_OBJECT *file, const void *buf, size_t count);
+
+static inline void file_stat_invalidate(FILE_OBJECT *file)
+{
+    // In-memory files are read-only, their stat can't change.
+    if (file->data == NULL)
+        file->stat_valid = false;
+}
+
+#endif
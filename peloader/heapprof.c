@@ -0,0 +1,272 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <signal.h>
+#include <x86intrin.h>
+
+#include "log.h"
+#include "util.h"
+#include "slab.h"
+#include "symbols.h"
+#include "heapprof.h"
+
+// Allocation sites are tracked in a fixed size open addressed table keyed by
+// return address, and every profiled block is prefixed with a small header
+// recording which site allocated it and when.
+//
+// Everything on the allocation path is lock free, the only shared writes are
+// atomic counter updates on the site entry.
+
+#define HEAPPROF_SITE_BITS  12
+#define HEAPPROF_MAX_SITES  (1 << HEAPPROF_SITE_BITS)
+#define HEAPPROF_MAX_PROBE  64
+#define HEAPPROF_BUCKETS    24          // Lifetime buckets, each a factor of four in cycles.
+#define HEAPPROF_MAGIC      'HP'
+
+struct heapprof_header {
+    uint16_t    magic;
+    uint16_t    site;
+    uint32_t    size;
+    uint64_t    stamp;
+};
+
+struct heapprof_site {
+    uintptr_t   caller;
+    uint32_t    allocs;
+    uint32_t    frees;
+    uint64_t    bytes;
+    int64_t     live;
+    uint32_t    lifetime[HEAPPROF_BUCKETS];
+};
+
+bool HeapProfEnabled;
+
+// Site zero collects anything that didn't fit in the table.
+static struct heapprof_site HeapProfSites[HEAPPROF_MAX_SITES];
+static char *HeapProfPath;
+static volatile sig_atomic_t HeapProfDumpPending;
+
+static void heapprof_signal(int signum)
+{
+    HeapProfDumpPending = true;
+}
+
+static void __constructor heapprof_init(void)
+{
+    struct sigaction action = {
+        .sa_handler = heapprof_signal,
+        .sa_flags   = SA_RESTART,
+    };
+
+    if (getenv("LL_HEAPPROF") == NULL)
+        return;
+
+    // We need the slab to tell profiled blocks apart from foreign pointers.
+    if (getenv("LL_SLAB_DISABLE")) {
+        l_warning("LL_HEAPPROF requires the slab allocator, profiling disabled");
+        return;
+    }
+
+    HeapProfPath    = strdup(getenv("LL_HEAPPROF"));
+    HeapProfEnabled = true;
+
+    sigaction(SIGUSR2, &action, NULL);
+
+    // This runs before the destructors, so symbol tables are still intact.
+    atexit(heapprof_dump);
+}
+
+static unsigned site_lookup(uintptr_t caller)
+{
+    unsigned index = (uint32_t)(caller * 0x9E3779B1U) >> (32 - HEAPPROF_SITE_BITS);
+
+    for (unsigned probe = 0; probe < HEAPPROF_MAX_PROBE; probe++) {
+        struct heapprof_site *site;
+
+        index = (index + probe) & (HEAPPROF_MAX_SITES - 1) ?: 1;
+        site  = &HeapProfSites[index];
+
+        if (site->caller == caller)
+            return index;
+
+        if (site->caller == 0) {
+            if (__sync_bool_compare_and_swap(&site->caller, 0, caller))
+                return index;
+
+            // Somebody else claimed it, check if it was for us.
+            if (site->caller == caller)
+                return index;
+        }
+    }
+
+    return 0;
+}
+
+static struct heapprof_header *block_header(void *ptr)
+{
+    struct heapprof_header *header = (struct heapprof_header *)(ptr) - 1;
+
+    // Our blocks never start at a span boundary, so the header is readable.
+    if (!slab_owns(ptr) || ((uintptr_t)(ptr) & (SLAB_SPAN_SIZE - 1)) < sizeof *header)
+        return NULL;
+
+    if (header->magic != HEAPPROF_MAGIC || header->site >= HEAPPROF_MAX_SITES)
+        return NULL;
+
+    return header;
+}
+
+void *heapprof_alloc(void *caller, size_t size, bool zero)
+{
+    struct heapprof_header *header;
+    struct heapprof_site *site;
+    unsigned index;
+
+    if (__builtin_expect(HeapProfDumpPending, false)) {
+        if (__sync_bool_compare_and_swap(&HeapProfDumpPending, true, false)) {
+            heapprof_dump();
+        }
+    }
+
+    if (size > UINT32_MAX - sizeof *header)
+        return NULL;
+
+    if (zero) {
+        header = slab_calloc(size + sizeof *header, 1);
+    } else {
+        header = slab_alloc(size + sizeof *header);
+    }
+
+    if (header == NULL)
+        return NULL;
+
+    index = site_lookup((uintptr_t) caller);
+    site  = &HeapProfSites[index];
+
+    header->magic = HEAPPROF_MAGIC;
+    header->site  = index;
+    header->size  = size;
+    header->stamp = __rdtsc();
+
+    __sync_fetch_and_add(&site->allocs, 1);
+    __sync_fetch_and_add(&site->bytes, size);
+    __sync_fetch_and_add(&site->live, size);
+
+    return header + 1;
+}
+
+void heapprof_free(void *ptr)
+{
+    struct heapprof_header *header;
+    struct heapprof_site *site;
+    uint64_t lifetime;
+    unsigned bucket;
+
+    if (ptr == NULL)
+        return;
+
+    if ((header = block_header(ptr)) == NULL)
+        return slab_free(ptr);
+
+    site     = &HeapProfSites[header->site];
+    lifetime = __rdtsc() - header->stamp;
+    bucket   = (63 - __builtin_clzll(lifetime | 1)) / 2;
+
+    __sync_fetch_and_add(&site->frees, 1);
+    __sync_fetch_and_sub(&site->live, header->size);
+    __sync_fetch_and_add(&site->lifetime[MIN(bucket, HEAPPROF_BUCKETS - 1)], 1);
+
+    // Make sure a double free is noticed.
+    header->magic = 0;
+
+    slab_free(header);
+}
+
+void *heapprof_realloc(void *caller, void *ptr, size_t size)
+{
+    struct heapprof_header *header;
+    void *block;
+
+    if (ptr == NULL)
+        return heapprof_alloc(caller, size, false);
+
+    if ((header = block_header(ptr)) == NULL)
+        return slab_realloc(ptr, size);
+
+    // Always move, so that the new size is attributed to this caller.
+    if ((block = heapprof_alloc(caller, size, false)) == NULL)
+        return NULL;
+
+    memcpy(block, ptr, MIN(size, header->size));
+
+    heapprof_free(ptr);
+
+    return block;
+}
+
+size_t heapprof_usable_size(void *ptr)
+{
+    struct heapprof_header *header;
+
+    if ((header = block_header(ptr)) == NULL)
+        return slab_usable_size(ptr);
+
+    return header->size;
+}
+
+void heapprof_dump(void)
+{
+    char sitepath[PATH_MAX];
+    char name[512];
+    FILE *collapsed;
+    FILE *sites;
+
+    snprintf(sitepath, sizeof sitepath, "%s.sites", HeapProfPath);
+
+    if ((collapsed = fopen(HeapProfPath, "w")) == NULL) {
+        l_warning("failed to open heap profile %s", HeapProfPath);
+        return;
+    }
+
+    if ((sites = fopen(sitepath, "w")) == NULL) {
+        l_warning("failed to open heap profile %s", sitepath);
+        fclose(collapsed);
+        return;
+    }
+
+    fprintf(sites, "# site\tallocs\tfrees\tbytes\tlive\tlifetime histogram (log4 cycles)\n");
+
+    for (unsigned i = 0; i < HEAPPROF_MAX_SITES; i++) {
+        struct heapprof_site *site = &HeapProfSites[i];
+
+        if (site->allocs == 0)
+            continue;
+
+        if (i == 0) {
+            snprintf(name, sizeof name, "[other]");
+        } else {
+            symbol_format((void *) site->caller, name, sizeof name);
+        }
+
+        fprintf(collapsed, "%s %llu\n", name, (unsigned long long) site->bytes);
+        fprintf(sites, "%s\t%u\t%u\t%llu\t%lld\t",
+                       name,
+                       site->allocs,
+                       site->frees,
+                       (unsigned long long) site->bytes,
+                       (long long) site->live);
+
+        for (unsigned bucket = 0; bucket < HEAPPROF_BUCKETS; bucket++) {
+            fprintf(sites, "%s%u", bucket ? "," : "", site->lifetime[bucket]);
+        }
+
+        fputc('\n', sites);
+    }
+
+    fclose(collapsed);
+    fclose(sites);
+}
@@ -0,0 +1,59 @@
+#ifndef __HEAPPROF_H
+#define __HEAPPROF_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "slab.h"
+
+// Optional allocation profiler for the heap shims.
+//
+// Set LL_HEAPPROF=<path> to record the caller of every HeapAlloc(), malloc()
+// and operator new. Per call site counts, bytes, live bytes and lifetimes
+// are written to <path> as collapsed stacks (for flamegraph.pl) and to
+// <path>.sites in more detail, at exit or when SIGUSR2 is received.
+//
+// The shims call the heap_* wrappers below, which cost a single predictable
+// branch when profiling is not enabled.
+
+extern bool HeapProfEnabled;
+
+void *heapprof_alloc(void *caller, size_t size, bool zero);
+void *heapprof_realloc(void *caller, void *ptr, size_t size);
+void heapprof_free(void *ptr);
+size_t heapprof_usable_size(void *ptr);
+void heapprof_dump(void);
+
+static inline void *heap_alloc(void *caller, size_t size, bool zero)
+{
+    if (__builtin_expect(HeapProfEnabled, false))
+        return heapprof_alloc(caller, size, zero);
+
+    return zero ? slab_calloc(size, 1) : slab_alloc(size);
+}
+
+static inline void *heap_realloc(void *caller, void *ptr, size_t size)
+{
+    if (__builtin_expect(HeapProfEnabled, false))
+        return heapprof_realloc(caller, ptr, size);
+
+    return slab_realloc(ptr, size);
+}
+
+static inline void heap_free(void *ptr)
+{
+    if (__builtin_expect(HeapProfEnabled, false))
+        return heapprof_free(ptr);
+
+    slab_free(ptr);
+}
+
+static inline size_t heap_size(void *ptr)
+{
+    if (__builtin_expect(HeapProfEnabled, false))
+        return heapprof_usable_size(ptr);
+
+    return slab_usable_size(ptr);
+}
+
+#endif
@@ -16,18 +16,42 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <stdbool.h>
+#include <string.h>
 
 #include "log.h"
+#include "util.h"
+
+// Format the whole line first, stderr is unbuffered so every call would be
+// a separate write.
+static void log_write(const char *function, const char *format, va_list ap)
+{
+    char line[1024];
+    int length;
+    int result;
+
+    // A negative result is an encoding error, keep whatever came before it.
+    if ((length = snprintf(line, sizeof line, "%s(): ", function)) < 0)
+        length = 0;
+
+    if (length < sizeof line && (result = vsnprintf(line + length, sizeof line - length, format, ap)) > 0)
+        length += result;
+
+    // Truncated lines still get a newline.
+    length = MIN(length, sizeof line - 1);
+
+    line[length++] = '\n';
+
+    fwrite(line, length, 1, stderr);
+}
 
 void l_message_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s(): ", function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        log_write(function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
 
@@ -35,14 +59,9 @@ void l_warning_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s(): ", function);
-
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        log_write(function, format, ap);
     va_end(ap);
-
-    fputc('\n', stderr);
-
     return;
 }
 
@@ -50,11 +69,9 @@ void l_error_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s(): ", function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        log_write(function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
 
@@ -62,10 +79,8 @@ void l_debug_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s(): ", function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        log_write(function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
@@ -4,14 +4,20 @@
 #ifdef _WIN32
 # define LogMessage(fmt, ...) fprintf(stderr, fmt, __VA_ARGS__), fputc('\n', stderr), fflush(stderr)
 #else
+# include "trace.h"
+
+// DebugLog() is also a trace point, see trace.h.
 # ifdef NDEBUG
 #  define l_debug(format...)
-#  define DebugLog
+#  define DebugLog(format...) TRACE_POINT()
 # else
 #  define l_debug(format...) do {               \
          l_debug_(__FUNCTION__, ## format);     \
      } while (false)
-#  define DebugLog l_debug
+#  define DebugLog(format...) do {              \
+         TRACE_POINT();                         \
+         l_debug(format);                       \
+     } while (false)
 # endif
 
 # define l_message(format...) do {              \
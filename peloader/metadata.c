@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "util.h"
+#include "handles.h"
+#include "vfs.h"
+#include "stats.h"
+#include "metadata.h"
+
+#define METADATA_CACHE_MAX      4096    // Entries cached before we start again.
+#define METADATA_DEFAULT_TTL    1000    // Milliseconds.
+
+typedef struct metadata_entry {
+    char *path;             // NULL if this entry is keyed by inode.
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t expires;
+    uint64_t generation;    // MetadataWrites when this was cached.
+    int error;              // Non-zero if the path doesn't exist.
+    FILE_METADATA data;
+} METADATA_ENTRY;
+
+static DECLARE_STATS_COUNTER(PathHits, "metadata.path_hits");
+static DECLARE_STATS_COUNTER(PathMisses, "metadata.path_misses");
+static DECLARE_STATS_COUNTER(InodeHits, "metadata.inode_hits");
+static DECLARE_STATS_COUNTER(InodeMisses, "metadata.inode_misses");
+
+static void *MetadataCache;
+static size_t MetadataCount;
+static uint64_t MetadataTtl = METADATA_DEFAULT_TTL;
+static pthread_mutex_t MetadataLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Incremented by every write to a host file. We don't know the paths of open
+// files, so this is how path entries for regular files notice writes.
+static uint64_t MetadataWrites;
+
+static void __constructor metadata_init(void)
+{
+    if (getenv("LL_METADATA_TTL"))
+        MetadataTtl = strtoull(getenv("LL_METADATA_TTL"), NULL, 0);
+}
+
+static uint64_t metadata_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+// Entries keyed by path sort before entries keyed by inode.
+static int compare_entries(const void *a, const void *b)
+{
+    const METADATA_ENTRY *x = a;
+    const METADATA_ENTRY *y = b;
+
+    if (x->path && y->path)
+        return strcmp(x->path, y->path);
+
+    if (x->path || y->path)
+        return x->path ? -1 : 1;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static void entry_free(void *node)
+{
+    METADATA_ENTRY *entry = node;
+
+    free(entry->path);
+    free(entry);
+}
+
+// Returns a copy of a current entry matching key, the lock must be held.
+static bool cache_find(const METADATA_ENTRY *key, METADATA_ENTRY *result)
+{
+    METADATA_ENTRY **node;
+
+    if ((node = tfind(key, &MetadataCache, compare_entries)) == NULL)
+        return false;
+
+    if ((*node)->expires <= metadata_now())
+        return false;
+
+    // The size or times of a file might have changed.
+    if ((*node)->path
+     && (*node)->error == 0
+     && S_ISREG((*node)->data.mode)
+     && (*node)->generation != __atomic_load_n(&MetadataWrites, __ATOMIC_RELAXED))
+        return false;
+
+    *result = **node;
+    return true;
+}
+
+// Add or replace the entry for key, the lock must be held.
+static void cache_insert(const METADATA_ENTRY *key, int error, const FILE_METADATA *data)
+{
+    METADATA_ENTRY **node, *entry;
+
+    if ((node = tfind(key, &MetadataCache, compare_entries))) {
+        entry = *node;
+    } else {
+        if (MetadataCount >= METADATA_CACHE_MAX) {
+            tdestroy(MetadataCache, entry_free);
+            MetadataCache = NULL;
+            MetadataCount = 0;
+        }
+
+        entry       = calloc(1, sizeof *entry);
+        entry->path = key->path ? strdup(key->path) : NULL;
+        entry->dev  = key->dev;
+        entry->ino  = key->ino;
+
+        tsearch(entry, &MetadataCache, compare_entries);
+        MetadataCount++;
+    }
+
+    entry->expires    = metadata_now() + MetadataTtl;
+    entry->generation = __atomic_load_n(&MetadataWrites, __ATOMIC_RELAXED);
+    entry->error      = error;
+
+    if (data)
+        entry->data = *data;
+}
+
+static inline struct timespec timespec_from_statx(struct statx_timestamp timestamp)
+{
+    return (struct timespec) {
+        .tv_sec  = timestamp.tv_sec,
+        .tv_nsec = timestamp.tv_nsec,
+    };
+}
+
+static bool metadata_statx(int dirfd, const char *path, int flags, FILE_METADATA *result)
+{
+    struct statx buf;
+
+    if (statx(dirfd, path, flags | AT_STATX_DONT_SYNC, STATX_BASIC_STATS | STATX_BTIME, &buf) != 0)
+        return false;
+
+    result->mode   = buf.stx_mode;
+    result->links  = buf.stx_nlink;
+    result->size   = buf.stx_size;
+    result->dev    = makedev(buf.stx_dev_major, buf.stx_dev_minor);
+    result->ino    = buf.stx_ino;
+    result->access = timespec_from_statx(buf.stx_atime);
+    result->write  = timespec_from_statx(buf.stx_mtime);
+    result->change = timespec_from_statx(buf.stx_ctime);
+
+    // Not every filesystem records a birth time, the mtime is the best guess.
+    if (buf.stx_mask & STATX_BTIME) {
+        result->creation = timespec_from_statx(buf.stx_btime);
+    } else {
+        result->creation = result->write;
+    }
+
+    return true;
+}
+
+static void metadata_from_stat(const struct stat64 *buf, FILE_METADATA *result)
+{
+    result->mode     = buf->st_mode;
+    result->links    = buf->st_nlink;
+    result->size     = buf->st_size;
+    result->dev      = buf->st_dev;
+    result->ino      = buf->st_ino;
+    result->access   = buf->st_atim;
+    result->write    = buf->st_mtim;
+    result->change   = buf->st_ctim;
+    result->creation = buf->st_mtim;
+}
+
+void metadata_invalidate(const char *path)
+{
+    METADATA_ENTRY key = { .path = (char *) path }, **node, *entry;
+
+    pthread_mutex_lock(&MetadataLock);
+
+    if ((node = tfind(&key, &MetadataCache, compare_entries))) {
+        entry = *node;
+        tdelete(entry, &MetadataCache, compare_entries);
+        entry_free(entry);
+        MetadataCount--;
+    }
+
+    pthread_mutex_unlock(&MetadataLock);
+}
+
+void metadata_invalidate_file(FILE_OBJECT *file)
+{
+    // Nothing else can see temporary or in-memory files by path.
+    if (file->temporary || file->data)
+        return;
+
+    __atomic_add_fetch(&MetadataWrites, 1, __ATOMIC_RELAXED);
+}
+
+bool metadata_path(const char *path, FILE_METADATA *result)
+{
+    METADATA_ENTRY key = { .path = (char *) path }, entry;
+    struct stat64 buf;
+
+    // The pack is already in memory.
+    if (vfs_stat(path, &buf)) {
+        metadata_from_stat(&buf, result);
+        return true;
+    }
+
+    if (MetadataTtl == 0)
+        return metadata_statx(AT_FDCWD, path, 0, result);
+
+    pthread_mutex_lock(&MetadataLock);
+
+    if (cache_find(&key, &entry)) {
+        pthread_mutex_unlock(&MetadataLock);
+        stats_inc(&PathHits);
+
+        if (entry.error) {
+            errno = entry.error;
+            return false;
+        }
+
+        *result = entry.data;
+        return true;
+    }
+
+    pthread_mutex_unlock(&MetadataLock);
+    stats_inc(&PathMisses);
+
+    // Don't hold the lock across the system call.
+    if (metadata_statx(AT_FDCWD, path, 0, result)) {
+        pthread_mutex_lock(&MetadataLock);
+        cache_insert(&key, 0, result);
+        pthread_mutex_unlock(&MetadataLock);
+        return true;
+    }
+
+    // Only cache answers that won't change without the filesystem changing.
+    if (errno == ENOENT || errno == ENOTDIR) {
+        int error = errno;
+
+        pthread_mutex_lock(&MetadataLock);
+        cache_insert(&key, error, NULL);
+        pthread_mutex_unlock(&MetadataLock);
+
+        errno = error;
+    }
+
+    return false;
+}
+
+bool metadata_file(FILE_OBJECT *file, FILE_METADATA *result)
+{
+    METADATA_ENTRY key = {0}, entry;
+    const struct stat64 *buf;
+
+    // The handle caches its own stat until the next write.
+    if ((buf = file_stat(file)) == NULL)
+        return false;
+
+    // In-memory files have nothing more to offer.
+    if (file->data) {
+        metadata_from_stat(buf, result);
+        return true;
+    }
+
+    key.dev = buf->st_dev;
+    key.ino = buf->st_ino;
+
+    if (MetadataTtl == 0)
+        return metadata_statx(file->fd, "", AT_EMPTY_PATH, result);
+
+    pthread_mutex_lock(&MetadataLock);
+
+    if (cache_find(&key, &entry)
+     && entry.data.size == buf->st_size
+     && entry.data.write.tv_sec == buf->st_mtim.tv_sec
+     && entry.data.write.tv_nsec == buf->st_mtim.tv_nsec) {
+        pthread_mutex_unlock(&MetadataLock);
+        stats_inc(&InodeHits);
+
+        *result = entry.data;
+        return true;
+    }
+
+    pthread_mutex_unlock(&MetadataLock);
+    stats_inc(&InodeMisses);
+
+    if (!metadata_statx(file->fd, "", AT_EMPTY_PATH, result))
+        return false;
+
+    pthread_mutex_lock(&MetadataLock);
+    cache_insert(&key, 0, result);
+    pthread_mutex_unlock(&MetadataLock);
+
+    return true;
+}
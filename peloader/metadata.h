@@ -0,0 +1,42 @@
+#ifndef __METADATA_H
+#define __METADATA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "handles.h"
+
+// File metadata for GetFileAttributes(), GetFileTime() and friends.
+//
+// Results are cached by path and by inode for LL_METADATA_TTL milliseconds
+// (default 1000, zero disables the cache), so programs that repeatedly query
+// the same file don't pay for a statx() each time. Paths that don't exist
+// are cached too. Entries for open files are also checked against the size
+// and mtime from the handle. Shims that create, delete or rename a path must
+// call metadata_invalidate(), and shims that write to or truncate a file must
+// call metadata_invalidate_file(), so our own changes are seen immediately.
+
+typedef struct file_metadata {
+    uint32_t mode;
+    uint32_t links;
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    struct timespec creation;   // Birth time if the filesystem records it.
+    struct timespec access;
+    struct timespec write;
+    struct timespec change;
+} FILE_METADATA;
+
+// These return false and set errno on failure.
+bool metadata_path(const char *path, FILE_METADATA *result);
+bool metadata_file(FILE_OBJECT *file, FILE_METADATA *result);
+
+// Forget anything cached about path.
+void metadata_invalidate(const char *path);
+
+// The contents of file changed, forget what's cached by path for any file.
+void metadata_invalidate_file(FILE_OBJECT *file);
+
+#endif
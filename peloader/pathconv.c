@@ -0,0 +1,324 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <search.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "util.h"
+#include "winstrings.h"
+#include "pathconv.h"
+
+#define DIR_CACHE_MAX   1024    // Directories cached before we start again.
+
+typedef struct dir_cache {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t count;
+    char **names;               // Sorted by compare_names().
+} DIR_CACHE;
+
+static char *DriveMap[26];
+static void *DirCache;
+static size_t DirCacheCount;
+static pthread_mutex_t DirCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void __constructor path_init(void)
+{
+    char name[] = "LL_DRIVE_A";
+
+    for (int i = 0; i < 26; i++) {
+        name[sizeof name - 2] = 'A' + i;
+
+        if (getenv(name))
+            DriveMap[i] = strdup(getenv(name));
+    }
+}
+
+static inline char fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static int compare_folded(const char *a, const char *b)
+{
+    while (*a && fold(*a) == fold(*b))
+        a++, b++;
+
+    return (unsigned char) fold(*a) - (unsigned char) fold(*b);
+}
+
+// Names that only differ in case are adjacent, so that an exact match can be
+// preferred.
+static int compare_names(const void *a, const void *b)
+{
+    const char *x = *(const char **) a;
+    const char *y = *(const char **) b;
+
+    return compare_folded(x, y) ?: strcmp(x, y);
+}
+
+static int compare_dirs(const void *a, const void *b)
+{
+    return strcmp(((const DIR_CACHE *) a)->path, ((const DIR_CACHE *) b)->path);
+}
+
+static void dir_free(void *node)
+{
+    DIR_CACHE *dir = node;
+
+    for (size_t i = 0; i < dir->count; i++)
+        free(dir->names[i]);
+
+    free(dir->names);
+    free(dir->path);
+    free(dir);
+}
+
+static bool dir_load(DIR_CACHE *dir, const struct stat64 *buf)
+{
+    size_t capacity = 0;
+    struct dirent *entry;
+    DIR *stream;
+
+    for (size_t i = 0; i < dir->count; i++)
+        free(dir->names[i]);
+
+    dir->count = 0;
+
+    if ((stream = opendir(dir->path)) == NULL)
+        return false;
+
+    while ((entry = readdir(stream))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if (dir->count == capacity) {
+            capacity   = capacity ? capacity * 2 : 64;
+            dir->names = realloc(dir->names, capacity * sizeof(char *));
+        }
+
+        dir->names[dir->count++] = strdup(entry->d_name);
+    }
+
+    closedir(stream);
+
+    qsort(dir->names, dir->count, sizeof(char *), compare_names);
+
+    dir->dev   = buf->st_dev;
+    dir->ino   = buf->st_ino;
+    dir->mtime = buf->st_mtim;
+    return true;
+}
+
+// Find the real name of an entry in directory path, which must be a name the
+// host understands.
+static bool dir_lookup(const char *path, const char *name, char *actual)
+{
+    DIR_CACHE key = { .path = (char *) path };
+    DIR_CACHE **node, *dir;
+    struct stat64 buf;
+    const char *match = NULL;
+    size_t low = 0, high;
+    bool result = false;
+
+    if (stat64(path, &buf) != 0 || !S_ISDIR(buf.st_mode))
+        return false;
+
+    pthread_mutex_lock(&DirCacheLock);
+
+    if ((node = tfind(&key, &DirCache, compare_dirs))) {
+        dir = *node;
+    } else {
+        if (DirCacheCount >= DIR_CACHE_MAX) {
+            tdestroy(DirCache, dir_free);
+            DirCache      = NULL;
+            DirCacheCount = 0;
+        }
+
+        dir       = calloc(1, sizeof(DIR_CACHE));
+        dir->path = strdup(path);
+
+        tsearch(dir, &DirCache, compare_dirs);
+        DirCacheCount++;
+    }
+
+    // Any change to the directory updates the mtime.
+    if (dir->names == NULL
+     || dir->dev != buf.st_dev
+     || dir->ino != buf.st_ino
+     || dir->mtime.tv_sec != buf.st_mtim.tv_sec
+     || dir->mtime.tv_nsec != buf.st_mtim.tv_nsec) {
+        if (!dir_load(dir, &buf))
+            goto finished;
+    }
+
+    high = dir->count;
+
+    // Find the first name that matches, then look for an exact match.
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if (compare_folded(name, dir->names[middle]) > 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    for (size_t i = low; i < dir->count && compare_folded(name, dir->names[i]) == 0; i++) {
+        match = match ?: dir->names[i];
+
+        if (strcmp(name, dir->names[i]) == 0) {
+            match = dir->names[i];
+            break;
+        }
+    }
+
+    if (match) {
+        strcpy(actual, match);
+        result = true;
+    }
+
+finished:
+    pthread_mutex_unlock(&DirCacheLock);
+    return result;
+}
+
+// Convert separators, strip prefixes and apply drive mappings.
+static bool path_normalize(const char *path, char *result, size_t size)
+{
+    size_t length = 0;
+
+    if (strncmp(path, "\\\\?\\", 4) == 0
+     || strncmp(path, "\\\\.\\", 4) == 0
+     || strncmp(path, "\\??\\", 4) == 0) {
+        path += 4;
+    }
+
+    if (((*path >= 'a' && *path <= 'z') || (*path >= 'A' && *path <= 'Z')) && path[1] == ':') {
+        const char *drive = DriveMap[fold(*path) - 'a'];
+
+        if (drive) {
+            if ((length = strlen(drive)) + 2 >= size)
+                return false;
+
+            memcpy(result, drive, length);
+        } else {
+            result[length++] = fold(*path);
+            result[length++] = ':';
+        }
+
+        path += 2;
+
+        // Make sure there's a separator after the drive.
+        if (*path && *path != '\\' && *path != '/')
+            result[length++] = '/';
+    }
+
+    for (; *path; path++) {
+        char c = *path == '\\' ? '/' : *path;
+
+        if (c == '/' && length && result[length - 1] == '/')
+            continue;
+
+        if (length + 1 >= size)
+            return false;
+
+        result[length++] = c;
+    }
+
+    result[length] = '\0';
+    return true;
+}
+
+static char *path_resolve(const char *path)
+{
+    const char *original = path;
+    char result[PATH_MAX];
+    char component[NAME_MAX + 1];
+    char actual[NAME_MAX + 1];
+    size_t length = 0;
+    bool missing = false;
+
+    // The common case is that the path already exists exactly as written.
+    if (access(path, F_OK) == 0)
+        return strdup(path);
+
+    if (*path == '/')
+        result[length++] = *path++;
+
+    result[length] = '\0';
+
+    while (*path) {
+        const char *end = strchrnul(path, '/');
+        size_t count = end - path;
+        const char *name = component;
+
+        if (count > NAME_MAX || length + count + 2 >= sizeof result)
+            return strdup(original);
+
+        memcpy(component, path, count);
+        component[count] = '\0';
+
+        // Once something is missing, nothing after it can exist.
+        if (!missing && strcmp(component, ".") != 0 && strcmp(component, "..") != 0) {
+            if (dir_lookup(length ? result : ".", component, actual)) {
+                name = actual;
+            } else {
+                missing = true;
+            }
+        }
+
+        length += sprintf(result + length, "%s%s", name, *end ? "/" : "");
+        path    = *end ? end + 1 : end;
+    }
+
+    return strdup(result);
+}
+
+char *path_translate(const char *path)
+{
+    char normalized[PATH_MAX];
+
+    if (path == NULL)
+        return NULL;
+
+    if (!path_normalize(path, normalized, sizeof normalized)) {
+        l_warning("path too long, %.64s...", path);
+        return NULL;
+    }
+
+    return path_resolve(normalized);
+}
+
+char *path_translate_wide(const uint16_t *path)
+{
+    char utf8[PATH_MAX];
+    size_t length;
+    size_t size;
+
+    // Callers used to accept a NULL name, they check for failure anyway.
+    if (path == NULL)
+        return NULL;
+
+    length = CountWideChars(path);
+
+    if ((size = string_utf16_to_utf8(path, length, utf8, sizeof utf8 - 1, NULL)) >= sizeof utf8) {
+        l_warning("path too long");
+        return NULL;
+    }
+
+    utf8[size] = '\0';
+
+    return path_translate(utf8);
+}
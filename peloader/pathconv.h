@@ -0,0 +1,20 @@
+#ifndef __PATHCONV_H
+#define __PATHCONV_H
+
+#include <stdint.h>
+
+// Translate Windows paths into host paths.
+//
+// Separators are converted, the \\?\, \\.\ and \??\ prefixes are removed and
+// drive letters are replaced with the directory in LL_DRIVE_<letter>, if set.
+// Each component is then matched case-insensitively against the host
+// filesystem, using a cache of directory listings that's refreshed whenever
+// the directory mtime changes. Components that don't exist are left as they
+// are, so the result can be used to create files.
+//
+// These return a string that should be released with free().
+
+char *path_translate(const char *path);
+char *path_translate_wide(const uint16_t *path);
+
+#endif
@@ -40,6 +40,9 @@
 #include "ntoskernel.h"
 #include "util.h"
 #include "log.h"
+#include "symbols.h"
+#include "callprof.h"
+#include "sampler.h"
 
 struct pe_exports {
         char *dll;
@@ -100,7 +103,6 @@ static RTL_BITMAP TlsBitmap = {
     .Buffer = (PVOID) &TlsBitmapData[0],
 };
 
-struct hsearch_data extraexports;
 struct hsearch_data crtexports;
 
 void __destructor clearexports(void)
@@ -140,11 +142,8 @@ int get_export(const char *name, void *result)
             }
         }
 
-        if (extraexports.size) {
-            if (hsearch_r(key, FIND, &item, &extraexports)) {
-                *func = item->data;
-                return 0;
-            }
+        if (get_extra_export(name, func)) {
+            return 0;
         }
 
         // Search the ndiswrapper crt
@@ -247,7 +246,7 @@ static int check_nt_hdr(IMAGE_NT_HEADERS *nt_hdr)
         return -EINVAL;
 }
 
-static int import(void *image, IMAGE_IMPORT_DESCRIPTOR *dirent, char *dll)
+static int import(const char *module, void *image, IMAGE_IMPORT_DESCRIPTOR *dirent, char *dll)
 {
         ULONG_PTR *lookup_tbl, *address_tbl;
         char *symname = NULL;
@@ -289,6 +288,10 @@ static int import(void *image, IMAGE_IMPORT_DESCRIPTOR *dirent, char *dll)
                         //          dll, symname, adr, (uint64_t)address_tbl[i]);
                         address_tbl[i] = (ULONG_PTR)adr;
                 }
+
+                if (CallProfEnabled) {
+                        address_tbl[i] = (ULONG_PTR) callprof_bind(module, dll, symname, adr);
+                }
         }
 
         return 0;
@@ -340,6 +343,9 @@ static int read_exports(struct pe_image *pe)
                 pe_exports[num_pe_exports].name = pe->image + *name_table;
                 pe_exports[num_pe_exports].addr = pe->image + address;
 
+                symbols_add(pe_exports[num_pe_exports].name,
+                            pe_exports[num_pe_exports].addr);
+
                 num_pe_exports++;
                 name_table++;
                 ordinal_table++;
@@ -347,7 +353,7 @@ static int read_exports(struct pe_image *pe)
         return 0;
 }
 
-static int fixup_imports(void *image, IMAGE_NT_HEADERS *nt_hdr)
+static int fixup_imports(const char *module, void *image, IMAGE_NT_HEADERS *nt_hdr)
 {
         int i;
         char *name;
@@ -366,7 +372,7 @@ static int fixup_imports(void *image, IMAGE_NT_HEADERS *nt_hdr)
                 name = RVA2VA(image, dirent[i].Name, char*);
 
                 DBGLINKER("imports from dll: %s", name);
-                ret += import(image, &dirent[i], name);
+                ret += import(module, image, &dirent[i], name);
         }
         return ret;
 }
@@ -560,6 +566,8 @@ int link_pe_images(struct pe_image *pe_image, unsigned short n)
                         TRACE1("read exports failed");
                         return -EINVAL;
                 }
+
+                symbols_add_image(pe->name, pe->image, pe->size);
         }
 
         for (i = 0; i < n; i++) {
@@ -569,7 +577,7 @@ int link_pe_images(struct pe_image *pe_image, unsigned short n)
                         TRACE1("fixup reloc failed");
                         return -EINVAL;
                 }
-                if (fixup_imports(pe->image, pe->nt_hdr)) {
+                if (fixup_imports(pe->name, pe->image, pe->nt_hdr)) {
                         TRACE1("fixup imports failed");
                         return -EINVAL;
                 }
@@ -703,6 +711,9 @@ bool setup_nt_threadinfo(PEXCEPTION_HANDLER ExceptionHandler)
     // Install descriptor
     asm("mov %[segment], %%fs" :: [segment] "r"(pebdescriptor.entry_number*8+3));
 
+    // Every thread that runs Windows code comes through here.
+    sampler_thread_start();
+
     return true;
 }
 
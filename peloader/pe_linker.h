@@ -1104,6 +1104,7 @@ int get_data_export(char *name, uint32_t base, void *result);
 bool setup_nt_threadinfo(PEXCEPTION_HANDLER handler);
 bool setup_kuser_shared_data(void);
 bool process_extra_exports(void *imagebase, size_t base, const char *filename);
+bool get_extra_export(const char *name, void **address);
 
 extern PKUSER_SHARED_DATA SharedUserData;
 
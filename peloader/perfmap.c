@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "util.h"
+#include "symbols.h"
+#include "perfmap.h"
+
+// The jitdump format is described in tools/perf/Documentation/jitdump-specification.txt.
+#define JITDUMP_MAGIC       0x4A695444
+#define JITDUMP_VERSION     1
+#define JIT_CODE_LOAD       0
+
+struct jitdump_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jitdump_code_load {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+bool PerfMapEnabled;
+
+static int JitDumpFd = -1;
+static uint64_t JitDumpIndex;
+static pthread_mutex_t JitDumpLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t perfmap_timestamp(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void perfmap_exit(void)
+{
+    char path[PATH_MAX];
+    FILE *out;
+
+    snprintf(path, sizeof path, "/tmp/perf-%d.map", getpid());
+
+    if ((out = fopen(path, "w")) == NULL) {
+        l_warning("failed to create %s, %m", path);
+        return;
+    }
+
+    symbols_write_perf_map(out);
+    fclose(out);
+}
+
+static void jitdump_open(void)
+{
+    struct jitdump_header header = {
+        .magic      = JITDUMP_MAGIC,
+        .version    = JITDUMP_VERSION,
+        .total_size = sizeof header,
+#ifdef __i386__
+        .elf_mach   = EM_386,
+#else
+        .elf_mach   = EM_X86_64,
+#endif
+        .pid        = getpid(),
+        .timestamp  = perfmap_timestamp(),
+    };
+    char path[PATH_MAX];
+    void *marker;
+
+    snprintf(path, sizeof path, "/tmp/jit-%d.dump", getpid());
+
+    if ((JitDumpFd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666)) < 0) {
+        l_warning("failed to create %s, %m", path);
+        return;
+    }
+
+    if (write(JitDumpFd, &header, sizeof header) != sizeof header) {
+        l_warning("failed to write %s, %m", path);
+        close(JitDumpFd);
+        JitDumpFd = -1;
+        return;
+    }
+
+    // perf finds the dump by looking for an executable mapping of it.
+    marker = mmap(NULL, getpagesize(), PROT_READ | PROT_EXEC, MAP_PRIVATE, JitDumpFd, 0);
+
+    if (marker == MAP_FAILED) {
+        l_warning("failed to map %s, perf won't find it", path);
+    }
+}
+
+static void __constructor perfmap_init(void)
+{
+    if (getenv("LL_PERF") == NULL)
+        return;
+
+    PerfMapEnabled = true;
+
+    jitdump_open();
+
+    atexit(perfmap_exit);
+}
+
+void perfmap_code_load(const void *address, size_t size, const char *name)
+{
+    struct jitdump_code_load record = {
+        .id         = JIT_CODE_LOAD,
+        .timestamp  = perfmap_timestamp(),
+        .pid        = getpid(),
+        .tid        = syscall(SYS_gettid),
+        .vma        = (uintptr_t) address,
+        .code_addr  = (uintptr_t) address,
+        .code_size  = size,
+    };
+    char symbol[64];
+
+    if (JitDumpFd < 0)
+        return;
+
+    snprintf(symbol, sizeof symbol, "%s@%p", name, address);
+
+    record.total_size = sizeof record + strlen(symbol) + 1 + size;
+
+    pthread_mutex_lock(&JitDumpLock);
+
+    record.code_index = JitDumpIndex++;
+
+    // The code follows the name, perf inject uses it to build an ELF image.
+    if (write(JitDumpFd, &record, sizeof record) != sizeof record
+     || write(JitDumpFd, symbol, strlen(symbol) + 1) != strlen(symbol) + 1
+     || write(JitDumpFd, address, size) != size) {
+        l_warning("failed to record code at %p, closing jitdump", address);
+        close(JitDumpFd);
+        JitDumpFd = -1;
+    }
+
+    pthread_mutex_unlock(&JitDumpLock);
+}
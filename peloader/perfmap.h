@@ -0,0 +1,26 @@
+#ifndef __PERFMAP_H
+#define __PERFMAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Help perf symbolise code in loaded images, which are anonymous mappings.
+//
+// Set LL_PERF=1 and /tmp/perf-<pid>.map is written at exit, naming every
+// export and IDA map symbol in each image. Memory made executable with
+// VirtualProtect() is also recorded in /tmp/jit-<pid>.dump, use perf
+// record -k mono and perf inject --jit to pick those up. Our own
+// shims are in the executable, so perf finds those itself.
+
+extern bool PerfMapEnabled;
+
+void perfmap_code_load(const void *address, size_t size, const char *name);
+
+// Record code that just became executable.
+static inline void perfmap_code(const void *address, size_t size, const char *name)
+{
+    if (__builtin_expect(PerfMapEnabled, false))
+        perfmap_code_load(address, size, name);
+}
+
+#endif
@@ -0,0 +1,1046 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <search.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "util.h"
+#include "registry.h"
+
+#define REGISTRY_HANDLE_BASE    0x08000000  // Well clear of the handle table.
+
+// Used when LL_REGISTRY isn't set.
+static const char DefaultHive[] =
+    "REGEDIT4\n"
+    "\n"
+    "[HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\Shell Folders]\n"
+    "\"Common AppData\"=\"C:\\\\ProgramData\"\n"
+    "\n"
+    "[HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Explorer\\User Shell Folders]\n"
+    "\"Common AppData\"=\"C:\\\\ProgramData\"\n"
+    "\n"
+    "[HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\ProfileList]\n"
+    "\"Default\"=\"C:\\\\Users\\\\Default\"\n"
+    "\"ProfilesDirectory\"=\"C:\\\\Users\"\n"
+    "\"ProgramData\"=\"C:\\\\ProgramData\"\n"
+    "\"Public\"=\"C:\\\\Users\\\\Public\"\n"
+    "\n"
+    "[HKEY_CURRENT_USER\\Software\\Microsoft\\Windows\\CurrentVersion\\Explorer\\Shell Folders]\n"
+    "\"AppData\"=\"C:\\\\Users\\\\Default\\\\AppData\\\\Roaming\"\n"
+    "\"Common AppData\"=\"C:\\\\ProgramData\"\n"
+    "\"Local AppData\"=\"C:\\\\Users\\\\Default\\\\AppData\\\\Local\"\n"
+    "\n"
+    "[HKEY_CURRENT_USER\\Software\\Microsoft\\Windows\\CurrentVersion\\Explorer\\User Shell Folders]\n"
+    "\"AppData\"=\"C:\\\\Users\\\\Default\\\\AppData\\\\Roaming\"\n"
+    "\"Common AppData\"=\"C:\\\\ProgramData\"\n"
+    "\"Local AppData\"=\"C:\\\\Users\\\\Default\\\\AppData\\\\Local\"\n";
+
+// The order matches the predefined handles, HKEY_CLASSES_ROOT is 0x80000000.
+static const char *PredefinedKeys[REGISTRY_PREDEFINED_COUNT][2] = {
+    { "HKEY_CLASSES_ROOT",      "HKCR" },
+    { "HKEY_CURRENT_USER",      "HKCU" },
+    { "HKEY_LOCAL_MACHINE",     "HKLM" },
+    { "HKEY_USERS",             "HKU"  },
+    { "HKEY_PERFORMANCE_DATA",  NULL   },
+    { "HKEY_CURRENT_CONFIG",    "HKCC" },
+};
+
+static const REG_HIVE *Hive;
+static const REG_KEY *Keys;
+static const REG_VALUE *Values;
+static const uint32_t *KeyTable;
+static const uint32_t *ValueTable;
+static REG_KEY VolatileKey;
+static pthread_once_t RegistryOnce = PTHREAD_ONCE_INIT;
+
+static inline uint16_t fold(uint16_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static uint32_t hash_name(const uint16_t *name, size_t length)
+{
+    uint32_t hash = 2166136261;
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ fold(name[i])) * 16777619;
+
+    return hash;
+}
+
+// Names are only unique within their parent.
+static inline uint32_t hash_slot(uint32_t hash, uint32_t parent)
+{
+    return hash ^ (parent * 0x9E3779B1);
+}
+
+static bool names_equal(const uint16_t *a, const uint16_t *b, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (fold(a[i]) != fold(b[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// Decode UTF-8, returning the number of UTF-16 characters. If output is
+// NULL, they're just counted.
+static size_t utf8_to_utf16(const char *input, uint16_t *output)
+{
+    const uint8_t *s = (const uint8_t *) input;
+    size_t length = 0;
+
+    while (*s) {
+        uint32_t c = *s++;
+
+        if (c >= 0xF0 && s[0] && s[1] && s[2]) {
+            c = (c & 0x07) << 18 | (s[0] & 0x3F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+            s += 3;
+        } else if (c >= 0xE0 && s[0] && s[1]) {
+            c = (c & 0x0F) << 12 | (s[0] & 0x3F) << 6 | (s[1] & 0x3F);
+            s += 2;
+        } else if (c >= 0xC0 && s[0]) {
+            c = (c & 0x1F) << 6 | (s[0] & 0x3F);
+            s += 1;
+        } else if (c >= 0x80) {
+            c = 0xFFFD;
+        }
+
+        if (c >= 0x10000) {
+            if (output) {
+                output[length + 0] = 0xD800 + ((c - 0x10000) >> 10);
+                output[length + 1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+            }
+            length += 2;
+        } else {
+            if (output)
+                output[length] = c;
+            length += 1;
+        }
+    }
+
+    return length;
+}
+
+//
+// Building a hive from a .reg file.
+//
+
+typedef struct build_value {
+    char *name;
+    uint32_t type;
+    uint32_t size;
+    uint8_t *data;
+    struct build_value *next;
+} BUILD_VALUE;
+
+typedef struct build_key {
+    char *name;
+    void *lookup;                   // Tree of children, for the parser.
+    struct build_key **children;
+    uint32_t child_count;
+    uint32_t child_capacity;
+    BUILD_VALUE *values;
+    BUILD_VALUE **tail;
+    uint32_t value_count;
+} BUILD_KEY;
+
+typedef struct {
+    BUILD_KEY *root;
+    BUILD_KEY *current;     // NULL if values should be ignored.
+    bool ansi;              // REGEDIT4 files use ANSI for hex(2) and hex(7).
+    unsigned line;
+} PARSER;
+
+static int compare_build_keys(const void *a, const void *b)
+{
+    return strcasecmp(((const BUILD_KEY *) a)->name, ((const BUILD_KEY *) b)->name);
+}
+
+static int compare_children(const void *a, const void *b)
+{
+    return compare_build_keys(*(const BUILD_KEY **) a, *(const BUILD_KEY **) b);
+}
+
+static BUILD_KEY *build_key_create(const char *name)
+{
+    BUILD_KEY *key = calloc(1, sizeof *key);
+
+    key->name = strdup(name);
+    key->tail = &key->values;
+    return key;
+}
+
+static BUILD_KEY *build_key_child(BUILD_KEY *parent, const char *name)
+{
+    BUILD_KEY search = { .name = (char *) name };
+    BUILD_KEY **node, *child;
+
+    if ((node = tfind(&search, &parent->lookup, compare_build_keys)))
+        return *node;
+
+    child = build_key_create(name);
+
+    tsearch(child, &parent->lookup, compare_build_keys);
+
+    if (parent->child_count == parent->child_capacity) {
+        parent->child_capacity = parent->child_capacity ? parent->child_capacity * 2 : 8;
+        parent->children       = realloc(parent->children, parent->child_capacity * sizeof(BUILD_KEY *));
+    }
+
+    parent->children[parent->child_count++] = child;
+    return child;
+}
+
+static void ignore_node(void *node)
+{
+}
+
+static void build_key_free(BUILD_KEY *key)
+{
+    BUILD_VALUE *value, *next;
+
+    for (uint32_t i = 0; i < key->child_count; i++)
+        build_key_free(key->children[i]);
+
+    for (value = key->values; value; value = next) {
+        next = value->next;
+        free(value->name);
+        free(value->data);
+        free(value);
+    }
+
+    // The nodes are owned by the children array.
+    tdestroy(key->lookup, ignore_node);
+    free(key->children);
+    free(key->name);
+    free(key);
+}
+
+// Later definitions of a value replace earlier ones, as they would in regedit.
+static void build_value_set(BUILD_KEY *key, const char *name, uint32_t type, uint8_t *data, uint32_t size)
+{
+    BUILD_VALUE *value;
+
+    for (value = key->values; value; value = value->next) {
+        if (strcasecmp(value->name, name) == 0)
+            break;
+    }
+
+    if (value == NULL) {
+        value       = calloc(1, sizeof *value);
+        value->name = strdup(name);
+        *key->tail  = value;
+        key->tail   = &value->next;
+        key->value_count++;
+    }
+
+    free(value->data);
+
+    value->type = type;
+    value->data = data;
+    value->size = size;
+}
+
+// Decode a quoted string in place, leaving cursor after the closing quote.
+static char *parse_string(char **cursor)
+{
+    char *input = *cursor + 1;
+    char *output = input;
+    char *result = input;
+
+    if (**cursor != '"')
+        return NULL;
+
+    for (; *input != '"'; input++) {
+        if (*input == '\0')
+            return NULL;
+
+        if (*input == '\\' && input[1])
+            input++;
+
+        *output++ = *input;
+    }
+
+    *output = '\0';
+    *cursor = input + 1;
+    return result;
+}
+
+static bool parse_key(PARSER *parser, char *path)
+{
+    char *component, *saveptr;
+    BUILD_KEY *key = NULL;
+
+    // Deleting keys isn't meaningful here, but skip their values.
+    if (*path == '-') {
+        parser->current = NULL;
+        return true;
+    }
+
+    if ((component = strtok_r(path, "\\", &saveptr)) == NULL)
+        return false;
+
+    for (int i = 0; i < REGISTRY_PREDEFINED_COUNT; i++) {
+        if (strcasecmp(component, PredefinedKeys[i][0]) == 0
+         || (PredefinedKeys[i][1] && strcasecmp(component, PredefinedKeys[i][1]) == 0)) {
+            key = parser->root->children[i];
+            break;
+        }
+    }
+
+    if (key == NULL)
+        return false;
+
+    while ((component = strtok_r(NULL, "\\", &saveptr)))
+        key = build_key_child(key, component);
+
+    parser->current = key;
+    return true;
+}
+
+static bool parse_hex(PARSER *parser, char *input, uint32_t type, uint8_t **data, uint32_t *size)
+{
+    size_t capacity = strlen(input) / 2 + 2;
+    uint8_t *bytes = malloc(capacity);
+    uint32_t count = 0;
+    char *end;
+
+    while (*input) {
+        unsigned long byte;
+
+        if (*input == ',' || *input == ' ' || *input == '\t') {
+            input++;
+            continue;
+        }
+
+        byte = strtoul(input, &end, 16);
+
+        if (end == input || byte > 0xFF) {
+            free(bytes);
+            return false;
+        }
+
+        bytes[count++] = byte;
+        input          = end;
+    }
+
+    // Old files store strings as ANSI, but we always want UTF-16.
+    if (parser->ansi && (type == REG_EXPAND_SZ || type == REG_MULTI_SZ)) {
+        uint16_t *wide = malloc(count * sizeof(uint16_t) + sizeof(uint16_t));
+
+        for (uint32_t i = 0; i < count; i++)
+            wide[i] = bytes[i];
+
+        free(bytes);
+
+        bytes = (uint8_t *) wide;
+        count = count * sizeof(uint16_t);
+    }
+
+    *data = bytes;
+    *size = count;
+    return true;
+}
+
+static bool parse_value(PARSER *parser, char *line)
+{
+    uint32_t type, size;
+    uint8_t *data;
+    char *name;
+
+    if (*line == '@') {
+        name = "";
+        line++;
+    } else if ((name = parse_string(&line)) == NULL) {
+        return false;
+    }
+
+    if (*line++ != '=')
+        return false;
+
+    // Deleted values and values of deleted keys.
+    if (*line == '-' || parser->current == NULL)
+        return true;
+
+    if (*line == '"') {
+        char *string = parse_string(&line);
+        size_t length;
+
+        if (string == NULL)
+            return false;
+
+        length = utf8_to_utf16(string, NULL);
+        type   = REG_SZ;
+        size   = (length + 1) * sizeof(uint16_t);
+        data   = malloc(size);
+
+        utf8_to_utf16(string, (uint16_t *) data);
+
+        ((uint16_t *) data)[length] = 0;
+    } else if (strncasecmp(line, "dword:", 6) == 0) {
+        uint32_t value = strtoul(line + 6, NULL, 16);
+
+        type = REG_DWORD;
+        size = sizeof value;
+        data = malloc(size);
+
+        memcpy(data, &value, size);
+    } else if (strncasecmp(line, "hex", 3) == 0) {
+        char *end;
+
+        type  = REG_BINARY;
+        line += 3;
+
+        if (*line == '(') {
+            type = strtoul(line + 1, &end, 16);
+
+            if (*end != ')')
+                return false;
+
+            line = end + 1;
+        }
+
+        if (*line++ != ':' || !parse_hex(parser, line, type, &data, &size))
+            return false;
+    } else {
+        return false;
+    }
+
+    build_value_set(parser->current, name, type, data, size);
+    return true;
+}
+
+static void parse_line(PARSER *parser, char *line)
+{
+    char *end;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if (*line == '\0' || *line == ';')
+        return;
+
+    if (strcmp(line, "REGEDIT4") == 0) {
+        parser->ansi = true;
+        return;
+    }
+
+    if (strncmp(line, "Windows Registry Editor", 23) == 0)
+        return;
+
+    if (*line == '[') {
+        if ((end = strrchr(line, ']')) == NULL) {
+            l_warning("registry line %u, unterminated key", parser->line);
+            return;
+        }
+
+        *end = '\0';
+
+        if (!parse_key(parser, line + 1)) {
+            l_warning("registry line %u, unknown root key", parser->line);
+            parser->current = NULL;
+        }
+
+        return;
+    }
+
+    if (!parse_value(parser, line))
+        l_warning("registry line %u, could not parse value", parser->line);
+}
+
+// Files exported by modern regedit are UTF-16, convert those to UTF-8 so
+// that there's only one parser.
+static char *parse_decode(const uint8_t *text, size_t size)
+{
+    char *result, *output;
+
+    if (size >= 2 && text[0] == 0xFF && text[1] == 0xFE) {
+        output = result = malloc(size / 2 * 3 + 1);
+
+        for (size_t i = 2; i + 1 < size; i += 2) {
+            uint32_t c = text[i] | text[i + 1] << 8;
+
+            if (c >= 0xD800 && c <= 0xDBFF && i + 3 < size) {
+                uint32_t low = text[i + 2] | text[i + 3] << 8;
+
+                if (low >= 0xDC00 && low <= 0xDFFF) {
+                    c  = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    i += 2;
+                }
+            }
+
+            if (c == 0) {
+                break;
+            } else if (c < 0x80) {
+                *output++ = c;
+            } else if (c < 0x800) {
+                *output++ = 0xC0 | c >> 6;
+                *output++ = 0x80 | (c & 0x3F);
+            } else if (c < 0x10000) {
+                *output++ = 0xE0 | c >> 12;
+                *output++ = 0x80 | (c >> 6 & 0x3F);
+                *output++ = 0x80 | (c & 0x3F);
+            } else {
+                *output++ = 0xF0 | c >> 18;
+                *output++ = 0x80 | (c >> 12 & 0x3F);
+                *output++ = 0x80 | (c >> 6 & 0x3F);
+                *output++ = 0x80 | (c & 0x3F);
+            }
+        }
+
+        *output = '\0';
+        return result;
+    }
+
+    if (size >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0) {
+        text += 3;
+        size -= 3;
+    }
+
+    return strndup((const char *) text, size);
+}
+
+static BUILD_KEY *parse_hive(const uint8_t *text, size_t size)
+{
+    PARSER parser = {0};
+    char *buffer = parse_decode(text, size);
+    char *line, *next, *end;
+
+    parser.root = build_key_create("");
+
+    for (int i = 0; i < REGISTRY_PREDEFINED_COUNT; i++)
+        build_key_child(parser.root, PredefinedKeys[i][0]);
+
+    for (line = buffer; line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = '\0';
+
+        parser.line++;
+
+        // Long hex values are continued with a trailing backslash.
+        for (end = line + strlen(line); end > line && (end[-1] == '\r' || end[-1] == ' '); )
+            *--end = '\0';
+
+        while (end > line && end[-1] == '\\' && end - line >= 2 && end[-2] == ',' && next) {
+            char *continued = next;
+
+            if ((next = strchr(continued, '\n')))
+                *next++ = '\0';
+
+            parser.line++;
+
+            while (*continued == ' ' || *continued == '\t')
+                continued++;
+
+            // The buffer only ever gets shorter, so this is in place.
+            memmove(end - 1, continued, strlen(continued) + 1);
+
+            for (end = line + strlen(line); end > line && (end[-1] == '\r' || end[-1] == ' '); )
+                *--end = '\0';
+        }
+
+        parse_line(&parser, line);
+    }
+
+    free(buffer);
+    return parser.root;
+}
+
+//
+// Compiling the parsed keys into a hive image.
+//
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t capacity;
+} IMAGE;
+
+static uint32_t image_reserve(IMAGE *image, size_t size, size_t align)
+{
+    size_t offset = (image->size + align - 1) & ~(align - 1);
+
+    if (offset + size > image->capacity) {
+        size_t capacity = MAX(MAX(image->capacity * 2, offset + size), 65536);
+
+        image->base = realloc(image->base, capacity);
+
+        memset(image->base + image->capacity, 0, capacity - image->capacity);
+
+        image->capacity = capacity;
+    }
+
+    image->size = offset + size;
+    return offset;
+}
+
+static uint32_t image_string(IMAGE *image, const char *string, uint32_t *length)
+{
+    uint32_t offset;
+
+    *length = utf8_to_utf16(string, NULL);
+    offset  = image_reserve(image, (*length + 1) * sizeof(uint16_t), sizeof(uint16_t));
+
+    utf8_to_utf16(string, (uint16_t *)(image->base + offset));
+    return offset;
+}
+
+static uint32_t table_size(uint32_t count)
+{
+    uint32_t size = 16;
+
+    while (size < count * 2)
+        size *= 2;
+
+    return size;
+}
+
+static void table_insert(uint32_t *table, uint32_t size, uint32_t hash, uint32_t index)
+{
+    for (uint32_t slot = hash & (size - 1); ; slot = (slot + 1) & (size - 1)) {
+        if (table[slot] == 0) {
+            table[slot] = index + 1;
+            return;
+        }
+    }
+}
+
+static REG_HIVE *hive_compile(BUILD_KEY *root)
+{
+    IMAGE image = {0};
+    BUILD_KEY **order;
+    uint32_t key_count = 0, value_count = 0, value_index = 0;
+    uint32_t header, keys, values, key_table, value_table;
+    REG_HIVE *hive;
+
+    // Number the keys breadth first, so the predefined keys are 1 to 6.
+    order    = malloc(sizeof(BUILD_KEY *));
+    order[0] = root;
+
+    for (uint32_t i = 0, count = 1; i < count; i++) {
+        BUILD_KEY *key = order[i];
+
+        // Subkeys are enumerated in order, like Windows.
+        if (key != root)
+            qsort(key->children, key->child_count, sizeof(BUILD_KEY *), compare_children);
+
+        order = realloc(order, (count + key->child_count) * sizeof(BUILD_KEY *));
+
+        memcpy(&order[count], key->children, key->child_count * sizeof(BUILD_KEY *));
+
+        count      += key->child_count;
+        key_count   = count;
+        value_count += key->value_count;
+    }
+
+    header      = image_reserve(&image, sizeof(REG_HIVE), 8);
+    keys        = image_reserve(&image, key_count * sizeof(REG_KEY), 8);
+    values      = image_reserve(&image, value_count * sizeof(REG_VALUE), 8);
+    key_table   = image_reserve(&image, table_size(key_count) * sizeof(uint32_t), 8);
+    value_table = image_reserve(&image, table_size(value_count) * sizeof(uint32_t), 8);
+
+    for (uint32_t i = 0, child = 1; i < key_count; i++) {
+        BUILD_KEY *build = order[i];
+        REG_KEY key = {0};
+        uint32_t *subkeys;
+
+        key.name         = image_string(&image, build->name, &key.length);
+        key.hash         = hash_name((uint16_t *)(image.base + key.name), key.length);
+        key.subkeys      = image_reserve(&image, build->child_count * sizeof(uint32_t), sizeof(uint32_t));
+        key.subkey_count = build->child_count;
+        key.value_index  = value_index;
+        key.value_count  = build->value_count;
+
+        subkeys = (uint32_t *)(image.base + key.subkeys);
+
+        // Children were numbered in the same order they were queued.
+        for (uint32_t j = 0; j < build->child_count; j++) {
+            REG_KEY *subkey = (REG_KEY *)(image.base + keys) + child;
+
+            subkeys[j]     = child++;
+            subkey->parent = i;
+        }
+
+        for (BUILD_VALUE *build_value = build->values; build_value; build_value = build_value->next) {
+            REG_VALUE value = {0};
+
+            value.name = image_string(&image, build_value->name, &value.length);
+            value.hash = hash_name((uint16_t *)(image.base + value.name), value.length);
+            value.key  = i;
+            value.type = build_value->type;
+            value.size = build_value->size;
+            value.data = image_reserve(&image, value.size, sizeof(uint32_t));
+
+            memcpy(image.base + value.data, build_value->data, value.size);
+
+            key.max_value_name_length = MAX(key.max_value_name_length, value.length);
+            key.max_value_size        = MAX(key.max_value_size, value.size);
+
+            ((REG_VALUE *)(image.base + values))[value_index++] = value;
+        }
+
+        for (uint32_t j = 0; j < build->child_count; j++)
+            key.max_subkey_length = MAX(key.max_subkey_length, utf8_to_utf16(build->children[j]->name, NULL));
+
+        // The parent was filled in when the parent was compiled.
+        key.parent = ((REG_KEY *)(image.base + keys))[i].parent;
+
+        ((REG_KEY *)(image.base + keys))[i] = key;
+    }
+
+    for (uint32_t i = 1; i < key_count; i++) {
+        const REG_KEY *key = (REG_KEY *)(image.base + keys) + i;
+
+        table_insert((uint32_t *)(image.base + key_table), table_size(key_count), hash_slot(key->hash, key->parent), i);
+    }
+
+    for (uint32_t i = 0; i < value_count; i++) {
+        const REG_VALUE *value = (REG_VALUE *)(image.base + values) + i;
+
+        table_insert((uint32_t *)(image.base + value_table), table_size(value_count), hash_slot(value->hash, value->key), i);
+    }
+
+    hive = (REG_HIVE *)(image.base + header);
+
+    memcpy(hive->magic, REGISTRY_MAGIC, sizeof hive->magic);
+
+    hive->size             = image.size;
+    hive->key_count        = key_count;
+    hive->value_count      = value_count;
+    hive->keys             = keys;
+    hive->values           = values;
+    hive->key_table        = key_table;
+    hive->key_table_size   = table_size(key_count);
+    hive->value_table      = value_table;
+    hive->value_table_size = table_size(value_count);
+
+    free(order);
+    return hive;
+}
+
+//
+// Loading and checking hives.
+//
+
+static inline bool range_valid(const REG_HIVE *hive, uint64_t offset, uint64_t size)
+{
+    return offset <= hive->size && size <= hive->size - offset;
+}
+
+// A compiled hive is untrusted input, so check everything once rather than
+// on each lookup.
+static bool hive_validate(const REG_HIVE *hive, size_t size)
+{
+    const REG_KEY *keys = (const REG_KEY *)((const uint8_t *) hive + hive->keys);
+    const REG_VALUE *values = (const REG_VALUE *)((const uint8_t *) hive + hive->values);
+    const uint32_t *key_table = (const uint32_t *)((const uint8_t *) hive + hive->key_table);
+    const uint32_t *value_table = (const uint32_t *)((const uint8_t *) hive + hive->value_table);
+    uint32_t empty_keys = 0, empty_values = 0;
+
+    if (size < sizeof(REG_HIVE) || memcmp(hive->magic, REGISTRY_MAGIC, sizeof hive->magic) != 0)
+        return false;
+
+    if (hive->size != size || hive->key_count <= REGISTRY_PREDEFINED_COUNT)
+        return false;
+
+    if ((hive->keys | hive->values | hive->key_table | hive->value_table) & 3)
+        return false;
+
+    if (!range_valid(hive, hive->keys, (uint64_t) hive->key_count * sizeof(REG_KEY))
+     || !range_valid(hive, hive->values, (uint64_t) hive->value_count * sizeof(REG_VALUE))
+     || !range_valid(hive, hive->key_table, (uint64_t) hive->key_table_size * sizeof(uint32_t))
+     || !range_valid(hive, hive->value_table, (uint64_t) hive->value_table_size * sizeof(uint32_t)))
+        return false;
+
+    if (hive->key_table_size & (hive->key_table_size - 1) || hive->key_table_size == 0)
+        return false;
+    if (hive->value_table_size & (hive->value_table_size - 1) || hive->value_table_size == 0)
+        return false;
+
+    for (uint32_t i = 0; i < hive->key_count; i++) {
+        const uint32_t *subkeys = (const uint32_t *)((const uint8_t *) hive + keys[i].subkeys);
+
+        if (!range_valid(hive, keys[i].name, ((uint64_t) keys[i].length + 1) * sizeof(uint16_t)) || keys[i].name & 1)
+            return false;
+        if (!range_valid(hive, keys[i].subkeys, (uint64_t) keys[i].subkey_count * sizeof(uint32_t)) || keys[i].subkeys & 3)
+            return false;
+        if (keys[i].parent >= hive->key_count)
+            return false;
+        if (keys[i].value_index > hive->value_count || keys[i].value_count > hive->value_count - keys[i].value_index)
+            return false;
+
+        for (uint32_t j = 0; j < keys[i].subkey_count; j++) {
+            if (subkeys[j] >= hive->key_count)
+                return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < hive->value_count; i++) {
+        if (!range_valid(hive, values[i].name, ((uint64_t) values[i].length + 1) * sizeof(uint16_t)) || values[i].name & 1)
+            return false;
+        if (!range_valid(hive, values[i].data, values[i].size) || values[i].key >= hive->key_count)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < hive->key_table_size; i++) {
+        if (key_table[i] > hive->key_count)
+            return false;
+        if (key_table[i] == 0)
+            empty_keys++;
+    }
+
+    for (uint32_t i = 0; i < hive->value_table_size; i++) {
+        if (value_table[i] > hive->value_count)
+            return false;
+        if (value_table[i] == 0)
+            empty_values++;
+    }
+
+    // Lookups only stop at an empty slot, so there must be at least one. The
+    // sizes alone don't prove that, a slot can repeat an index.
+    return empty_keys && empty_values;
+}
+
+static const REG_HIVE *hive_map(int fd, size_t size)
+{
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (!hive_validate(base, size)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    return base;
+}
+
+static const REG_HIVE *hive_parse(const uint8_t *text, size_t size)
+{
+    BUILD_KEY *root = parse_hive(text, size);
+    REG_HIVE *hive = hive_compile(root);
+    const char *snapshot = getenv("LL_REGISTRY_SNAPSHOT");
+    FILE *out;
+
+    build_key_free(root);
+
+    if (snapshot) {
+        if ((out = fopen(snapshot, "wb")) == NULL || fwrite(hive, hive->size, 1, out) != 1) {
+            l_warning("failed to write registry snapshot %s, %m", snapshot);
+        } else {
+            l_debug("wrote registry snapshot to %s", snapshot);
+        }
+
+        if (out)
+            fclose(out);
+    }
+
+    return hive;
+}
+
+static const REG_HIVE *hive_load(const char *path)
+{
+    const REG_HIVE *hive = NULL;
+    struct stat64 buf;
+    uint8_t *text;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        l_warning("failed to open registry %s, %m", path);
+        return NULL;
+    }
+
+    if (fstat64(fd, &buf) != 0 || buf.st_size > UINT32_MAX) {
+        l_warning("registry %s is not valid", path);
+        goto finished;
+    }
+
+    // Compiled hives are mapped, anything else is parsed.
+    if (buf.st_size >= sizeof(REG_HIVE)) {
+        char magic[sizeof(REGISTRY_MAGIC) - 1];
+
+        if (pread(fd, magic, sizeof magic, 0) == sizeof magic && memcmp(magic, REGISTRY_MAGIC, sizeof magic) == 0) {
+            if ((hive = hive_map(fd, buf.st_size)) == NULL)
+                l_warning("registry %s is corrupt", path);
+            goto finished;
+        }
+    }
+
+    if ((text = malloc(buf.st_size)) == NULL) {
+        l_warning("not enough memory to read registry %s", path);
+        goto finished;
+    }
+
+    if (pread(fd, text, buf.st_size, 0) == buf.st_size) {
+        hive = hive_parse(text, buf.st_size);
+    } else {
+        l_warning("failed to read registry %s, %m", path);
+    }
+
+    free(text);
+
+finished:
+    close(fd);
+    return hive;
+}
+
+static void registry_init(void)
+{
+    const char *path = getenv("LL_REGISTRY");
+
+    if (path && (Hive = hive_load(path)) == NULL)
+        l_warning("using the default registry instead of %s", path);
+
+    if (Hive == NULL)
+        Hive = hive_parse((const uint8_t *) DefaultHive, sizeof DefaultHive - 1);
+
+    Keys       = (const REG_KEY *)((const uint8_t *) Hive + Hive->keys);
+    Values     = (const REG_VALUE *)((const uint8_t *) Hive + Hive->values);
+    KeyTable   = (const uint32_t *)((const uint8_t *) Hive + Hive->key_table);
+    ValueTable = (const uint32_t *)((const uint8_t *) Hive + Hive->value_table);
+
+    // An empty key with an index no other key uses.
+    VolatileKey.name = Keys[0].name;
+
+    l_debug("registry has %u keys and %u values", Hive->key_count, Hive->value_count);
+}
+
+//
+// Lookups.
+//
+
+static inline uint32_t key_index(const REG_KEY *key)
+{
+    return key == &VolatileKey ? Hive->key_count : key - Keys;
+}
+
+const REG_KEY *registry_from_handle(void *handle)
+{
+    uintptr_t value = (uintptr_t) handle;
+
+    pthread_once(&RegistryOnce, registry_init);
+
+    if (value >= REGISTRY_PREDEFINED_BASE && value < REGISTRY_PREDEFINED_BASE + REGISTRY_PREDEFINED_COUNT)
+        return &Keys[value - REGISTRY_PREDEFINED_BASE + 1];
+
+    if (value < REGISTRY_HANDLE_BASE || value & 3)
+        return NULL;
+
+    value = (value - REGISTRY_HANDLE_BASE) / 4;
+
+    if (value == Hive->key_count)
+        return &VolatileKey;
+
+    return value < Hive->key_count ? &Keys[value] : NULL;
+}
+
+void *registry_handle(const REG_KEY *key)
+{
+    return (void *)(REGISTRY_HANDLE_BASE + key_index(key) * 4);
+}
+
+const REG_KEY *registry_volatile_key(void)
+{
+    pthread_once(&RegistryOnce, registry_init);
+
+    return &VolatileKey;
+}
+
+static const REG_KEY *registry_child(uint32_t parent, const uint16_t *name, size_t length)
+{
+    uint32_t hash = hash_name(name, length);
+    uint32_t mask = Hive->key_table_size - 1;
+
+    for (uint32_t slot = hash_slot(hash, parent) & mask; KeyTable[slot]; slot = (slot + 1) & mask) {
+        const REG_KEY *key = &Keys[KeyTable[slot] - 1];
+
+        if (key->parent == parent
+         && key->hash == hash
+         && key->length == length
+         && names_equal(registry_key_name(key), name, length))
+            return key;
+    }
+
+    return NULL;
+}
+
+const REG_KEY *registry_open(const REG_KEY *key, const uint16_t *path, size_t length)
+{
+    const uint16_t *end = path + length;
+
+    while (key && path < end) {
+        const uint16_t *component = path;
+
+        while (path < end && *path != '\\')
+            path++;
+
+        // Leading, trailing and repeated separators are ignored.
+        if (path > component)
+            key = registry_child(key_index(key), component, path - component);
+
+        if (path < end)
+            path++;
+    }
+
+    return key;
+}
+
+const REG_KEY *registry_subkey(const REG_KEY *key, uint32_t index)
+{
+    const uint32_t *subkeys = (const uint32_t *)((const uint8_t *) Hive + key->subkeys);
+
+    return index < key->subkey_count ? &Keys[subkeys[index]] : NULL;
+}
+
+const REG_VALUE *registry_value(const REG_KEY *key, const uint16_t *name, size_t length)
+{
+    uint32_t hash = hash_name(name, length);
+    uint32_t mask = Hive->value_table_size - 1;
+    uint32_t index = key_index(key);
+
+    for (uint32_t slot = hash_slot(hash, index) & mask; ValueTable[slot]; slot = (slot + 1) & mask) {
+        const REG_VALUE *value = &Values[ValueTable[slot] - 1];
+
+        if (value->key == index
+         && value->hash == hash
+         && value->length == length
+         && names_equal(registry_value_name(value), name, length))
+            return value;
+    }
+
+    return NULL;
+}
+
+const REG_VALUE *registry_value_index(const REG_KEY *key, uint32_t index)
+{
+    return index < key->value_count ? &Values[key->value_index + index] : NULL;
+}
+
+const uint16_t *registry_key_name(const REG_KEY *key)
+{
+    return (const uint16_t *)((const uint8_t *) Hive + key->name);
+}
+
+const uint16_t *registry_value_name(const REG_VALUE *value)
+{
+    return (const uint16_t *)((const uint8_t *) Hive + value->name);
+}
+
+const void *registry_value_data(const REG_VALUE *value)
+{
+    return (const uint8_t *) Hive + value->data;
+}
@@ -0,0 +1,82 @@
+#ifndef __REGISTRY_H
+#define __REGISTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A read-only registry hive, loaded on first use from the file in
+// LL_REGISTRY. That can be a .reg file in the format regedit exports, or a
+// compiled hive written by a previous run with LL_REGISTRY_SNAPSHOT set. If
+// LL_REGISTRY isn't set, a small built-in hive is used.
+//
+// The hive is a single position independent image, so a compiled hive is
+// just mapped rather than parsed. Keys and values are found with hash tables
+// keyed by parent and case folded name, so opening a key is proportional to
+// its depth and nothing is allocated after loading. Names and strings are
+// stored as UTF-16, case folding only applies to ASCII.
+
+#define REGISTRY_MAGIC "LLHIVE01"
+
+typedef struct reg_hive {
+    char magic[8];
+    uint32_t size;
+    uint32_t key_count;
+    uint32_t value_count;
+    uint32_t keys;              // Offset of REG_KEY[key_count].
+    uint32_t values;            // Offset of REG_VALUE[value_count].
+    uint32_t key_table;         // Offset of the hash table of keys.
+    uint32_t key_table_size;    // A power of two.
+    uint32_t value_table;
+    uint32_t value_table_size;
+} REG_HIVE;
+
+typedef struct reg_key {
+    uint32_t name;              // Offset of the UTF-16 name.
+    uint32_t length;            // Length of name in characters.
+    uint32_t hash;
+    uint32_t parent;            // Index of the parent key.
+    uint32_t subkeys;           // Offset of uint32_t[subkey_count] key indexes.
+    uint32_t subkey_count;
+    uint32_t value_index;       // Values of a key are consecutive.
+    uint32_t value_count;
+    uint32_t max_subkey_length;
+    uint32_t max_value_name_length;
+    uint32_t max_value_size;
+} REG_KEY;
+
+typedef struct reg_value {
+    uint32_t name;
+    uint32_t length;
+    uint32_t hash;
+    uint32_t key;               // Index of the key this belongs to.
+    uint32_t type;
+    uint32_t data;              // Offset of the data.
+    uint32_t size;              // Size of data in bytes, including terminators.
+} REG_VALUE;
+
+// Predefined keys are HKEY_CLASSES_ROOT to HKEY_CURRENT_CONFIG.
+#define REGISTRY_PREDEFINED_BASE    0x80000000
+#define REGISTRY_PREDEFINED_COUNT   6
+
+// Converts between keys and the handles given to Windows code, handles
+// for predefined keys are also accepted. Returns NULL for anything else.
+const REG_KEY *registry_from_handle(void *handle);
+void *registry_handle(const REG_KEY *key);
+
+// A key that's always empty, used for keys created at runtime.
+const REG_KEY *registry_volatile_key(void);
+
+// Open a path of backslash separated names relative to key. The path is not
+// nul terminated, length is in characters.
+const REG_KEY *registry_open(const REG_KEY *key, const uint16_t *path, size_t length);
+const REG_KEY *registry_subkey(const REG_KEY *key, uint32_t index);
+
+const REG_VALUE *registry_value(const REG_KEY *key, const uint16_t *name, size_t length);
+const REG_VALUE *registry_value_index(const REG_KEY *key, uint32_t index);
+
+const uint16_t *registry_key_name(const REG_KEY *key);
+const uint16_t *registry_value_name(const REG_VALUE *value);
+const void *registry_value_data(const REG_VALUE *value);
+
+#endif
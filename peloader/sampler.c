@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "util.h"
+#include "symbols.h"
+#include "stats.h"
+#include "sampler.h"
+
+#define SAMPLER_DEFAULT_HZ      997         // Prime, so we don't beat with anything periodic.
+#define SAMPLER_MAX_DEPTH       128
+#define SAMPLER_BUFFER_WORDS    (4 << 20)   // Each sample is a depth followed by the frames.
+
+#ifndef sigev_notify_thread_id
+# define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static DECLARE_STATS_COUNTER(Samples, "sampler.samples");
+static DECLARE_STATS_COUNTER(SamplesDropped, "sampler.dropped");
+
+static bool SamplerEnabled;
+static char *SamplerPath;
+static long SamplerHz = SAMPLER_DEFAULT_HZ;
+static uintptr_t *SampleBuffer;
+static size_t SampleUsed;
+
+// The stack of this thread, so the handler can check frame pointers.
+static __thread uintptr_t StackLow;
+static __thread uintptr_t StackHigh;
+static __thread bool ThreadSampled;
+static __thread timer_t ThreadTimer;
+
+// Only used to delete the timer when the thread exits.
+static pthread_key_t SamplerKey;
+
+static void sampler_exit(void);
+
+static void sampler_signal(int signum, siginfo_t *info, void *context)
+{
+    uintptr_t frames[SAMPLER_MAX_DEPTH];
+    mcontext_t *mcontext = &((ucontext_t *) context)->uc_mcontext;
+    uintptr_t frame;
+    size_t depth = 0;
+    size_t offset;
+
+    if (!SamplerEnabled)
+        return;
+
+#if defined(__i386__)
+    frames[depth++] = mcontext->gregs[REG_EIP];
+    frame           = mcontext->gregs[REG_EBP];
+#elif defined(__x86_64__)
+    frames[depth++] = mcontext->gregs[REG_RIP];
+    frame           = mcontext->gregs[REG_RBP];
+#endif
+
+    // Each frame is the saved frame pointer followed by the return address,
+    // and the frames must get strictly older.
+    while (depth < SAMPLER_MAX_DEPTH
+        && frame >= StackLow
+        && frame <= StackHigh - 2 * sizeof(uintptr_t)
+        && (frame & (sizeof(uintptr_t) - 1)) == 0) {
+        uintptr_t *words = (uintptr_t *) frame;
+
+        if (words[1] == 0)
+            break;
+
+        frames[depth++] = words[1];
+
+        if (words[0] <= frame)
+            break;
+
+        frame = words[0];
+    }
+
+    offset = __atomic_fetch_add(&SampleUsed, depth + 1, __ATOMIC_RELAXED);
+
+    if (offset + depth + 1 > SAMPLER_BUFFER_WORDS) {
+        stats_inc(&SamplesDropped);
+        return;
+    }
+
+    memcpy(&SampleBuffer[offset + 1], frames, depth * sizeof *frames);
+
+    // The depth is written last, a zero means the sample is incomplete.
+    __atomic_store_n(&SampleBuffer[offset], depth, __ATOMIC_RELEASE);
+
+    stats_inc(&Samples);
+}
+
+// Timers are per process, so they'd outlive the thread without this.
+static void sampler_thread_exit(void *timer)
+{
+    timer_delete(*(timer_t *) timer);
+}
+
+static void __constructor sampler_init(void)
+{
+    struct sigaction action = {
+        .sa_sigaction   = sampler_signal,
+        .sa_flags       = SA_SIGINFO | SA_RESTART,
+    };
+
+    if (getenv("LL_SAMPLE") == NULL)
+        return;
+
+    if (getenv("LL_SAMPLE_HZ"))
+        SamplerHz = MAX(strtol(getenv("LL_SAMPLE_HZ"), NULL, 0), 1);
+
+    // Only the pages we use are ever touched.
+    SampleBuffer = mmap(NULL,
+                        SAMPLER_BUFFER_WORDS * sizeof *SampleBuffer,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1,
+                        0);
+
+    if (SampleBuffer == MAP_FAILED) {
+        l_warning("failed to allocate sample buffer, sampling disabled");
+        return;
+    }
+
+    if (pthread_key_create(&SamplerKey, sampler_thread_exit) != 0) {
+        l_warning("failed to create sampler thread key, sampling disabled");
+        return;
+    }
+
+    SamplerPath    = strdup(getenv("LL_SAMPLE"));
+    SamplerEnabled = true;
+
+    sigaction(SIGPROF, &action, NULL);
+
+    // This runs before the destructors, so symbol tables are still intact.
+    atexit(sampler_exit);
+}
+
+void sampler_thread_start(void)
+{
+    struct sigevent event = {
+        .sigev_notify           = SIGEV_THREAD_ID,
+        .sigev_signo            = SIGPROF,
+        .sigev_notify_thread_id = syscall(SYS_gettid),
+    };
+    struct itimerspec interval = {
+        .it_interval.tv_sec  = 1 / SamplerHz,
+        .it_interval.tv_nsec = 1000000000 / SamplerHz % 1000000000,
+    };
+    pthread_attr_t attr;
+    void *stack;
+    size_t size;
+
+    if (!SamplerEnabled || ThreadSampled)
+        return;
+
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return;
+
+    pthread_attr_getstack(&attr, &stack, &size);
+    pthread_attr_destroy(&attr);
+
+    StackLow      = (uintptr_t) stack;
+    StackHigh     = (uintptr_t) stack + size;
+    ThreadSampled = true;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &ThreadTimer) != 0) {
+        l_warning("failed to create sampling timer, %m");
+        return;
+    }
+
+    // The key value can't be the timer itself, a timer id can be zero.
+    pthread_setspecific(SamplerKey, &ThreadTimer);
+
+    interval.it_value = interval.it_interval;
+
+    if (timer_settime(ThreadTimer, 0, &interval, NULL) != 0)
+        l_warning("failed to start sampling timer, %m");
+}
+
+// Return addresses point after the call, so look up the byte before them.
+static void frame_name(uintptr_t pc, bool leaf, char *buf, size_t size)
+{
+    const void *address = (const void *)(leaf ? pc : pc - 1);
+    const char *module;
+    const char *symbol;
+    uintptr_t rva;
+    uintptr_t offset;
+    Dl_info info;
+
+    if (symbol_from_address(address, &module, &rva, &symbol, &offset)) {
+        if (symbol) {
+            snprintf(buf, size, "%s!%s", module, symbol);
+        } else {
+            snprintf(buf, size, "%s!%#x", module, rva);
+        }
+    } else if (dladdr(address, &info) && info.dli_sname) {
+        snprintf(buf, size, "[loader]!%s", info.dli_sname);
+    } else {
+        snprintf(buf, size, "[unknown]");
+    }
+}
+
+static int compare_stacks(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+static void sampler_exit(void)
+{
+    size_t used = MIN(SampleUsed, SAMPLER_BUFFER_WORDS);
+    size_t count = 0;
+    char **stacks;
+    FILE *out;
+
+    SamplerEnabled = false;
+
+    if ((out = fopen(SamplerPath, "w")) == NULL) {
+        l_warning("failed to open %s for samples, %m", SamplerPath);
+        return;
+    }
+
+    for (size_t offset = 0; offset < used && SampleBuffer[offset]; offset += SampleBuffer[offset] + 1)
+        count++;
+
+    stacks = calloc(count + 1, sizeof *stacks);
+    count  = 0;
+
+    // Build "root;...;leaf" for each sample, then count identical stacks.
+    for (size_t offset = 0; offset < used; ) {
+        size_t depth = __atomic_load_n(&SampleBuffer[offset], __ATOMIC_ACQUIRE);
+        char *stack = NULL;
+        size_t length = 0;
+        FILE *line;
+
+        if (depth == 0 || depth > SAMPLER_MAX_DEPTH || offset + depth + 1 > used)
+            break;
+
+        if ((line = open_memstream(&stack, &length)) == NULL)
+            break;
+
+        for (size_t i = depth; i > 0; i--) {
+            char name[256];
+
+            frame_name(SampleBuffer[offset + i], i == 1, name, sizeof name);
+            fprintf(line, "%s%s", name, i > 1 ? ";" : "");
+        }
+
+        fclose(line);
+
+        stacks[count++] = stack;
+        offset         += depth + 1;
+    }
+
+    qsort(stacks, count, sizeof *stacks, compare_stacks);
+
+    for (size_t i = 0, run = 1; i < count; i++, run++) {
+        if (i + 1 < count && strcmp(stacks[i], stacks[i + 1]) == 0) {
+            free(stacks[i]);
+            continue;
+        }
+
+        fprintf(out, "%s %zu\n", stacks[i], run);
+        free(stacks[i]);
+        run = 0;
+    }
+
+    free(stacks);
+    fclose(out);
+}
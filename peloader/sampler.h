@@ -0,0 +1,19 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+// A sampling profiler for code in loaded PE images, which perf can't
+// symbolise because the images are anonymous mappings.
+//
+// Set LL_SAMPLE=<path> and every thread that runs Windows code gets a
+// timer delivering SIGPROF after each LL_SAMPLE_HZ (default 997) of cpu
+// time. The handler records EIP and walks the EBP chain, and at exit the
+// stacks are symbolised from the export tables, IDA maps and our own shim
+// names and written to <path> as collapsed stacks for flamegraph.pl.
+//
+// Frames in code built without a frame pointer are skipped, the walk stops
+// as soon as a frame points outside the thread's stack.
+
+// Start sampling the calling thread, called by setup_nt_threadinfo().
+void sampler_thread_start(void);
+
+#endif
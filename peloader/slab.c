@@ -0,0 +1,521 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include "log.h"
+#include "util.h"
+#include "slab.h"
+#include "stats.h"
+
+// A size-class slab allocator for the HeapAlloc() family.
+//
+// Windows code tends to make a huge number of small, short lived allocations
+// through the process heap. Sending those through glibc costs us a lock and a
+// fair amount of bookkeeping on every call, so instead we carve fixed size
+// objects out of 64k spans and recycle them through a per-thread free list.
+//
+// We're a 32-bit process, so the owner of every 64k granule in the address
+// space can be tracked in a flat 64k byte table. That's how we recognise our
+// own pointers, and how HeapSize() finds the size class without touching the
+// object or calling malloc_usable_size().
+
+#define SLAB_SPAN_BATCH     16                      // Spans requested from the kernel at once.
+#define SLAB_NUM_CLASSES    40
+#define SLAB_CLASS_LARGE    0xFF                    // Granule belongs to a large chunk.
+#define SLAB_LARGE_MAGIC    0x4C524745              // 'LRGE'
+#define SLAB_LARGE_CACHE    8                       // Released large chunks we hang on to.
+#define SLAB_CACHE_BYTES    8192                    // Bytes moved between thread and central lists.
+
+struct slab_large {
+    size_t      mapsize;
+    uint32_t    magic;
+    uint32_t    reserved[2];
+} __attribute__((aligned(16)));
+
+struct slab_class {
+    volatile int    lock;
+    unsigned        size;
+    unsigned        batch;
+    void           *freelist;
+    uint8_t        *bump;
+    uint8_t        *end;
+};
+
+struct slab_cache {
+    void           *head;
+    unsigned        count;
+};
+
+// Which size class owns each 64k granule, zero means not ours.
+static uint8_t SlabSpanMap[1UL << (32 - SLAB_SPAN_SHIFT)];
+
+static struct slab_class SlabClasses[SLAB_NUM_CLASSES];
+static __thread struct slab_cache ThreadCache[SLAB_NUM_CLASSES];
+static __thread bool ThreadCacheRegistered;
+
+static volatile int SpanLock;
+static uint8_t *SpanNext;
+static uint8_t *SpanEnd;
+
+static struct {
+    void   *base;
+    size_t  mapsize;
+} LargeCache[SLAB_LARGE_CACHE];
+
+static pthread_key_t ThreadCacheKey;
+static bool SlabDisabled;
+
+// Bytes currently mapped for spans and large chunks.
+static size_t SlabMapped;
+
+// Bytes in blocks handed out. Small blocks are counted per thread and folded
+// in whenever the thread cache goes to the central lists, so this lags by at
+// most a few batches per thread and costs nothing on the fast path.
+static intptr_t SlabLive;
+static __thread intptr_t ThreadLive;
+
+static inline void slab_lock(volatile int *lock)
+{
+    while (__sync_lock_test_and_set(lock, 1)) {
+        while (*lock)
+            __builtin_ia32_pause();
+    }
+}
+
+static inline void slab_unlock(volatile int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+// Classes are 16 byte steps up to 128, then four steps per power of two.
+static inline unsigned size_to_class(size_t size)
+{
+    unsigned log;
+    size_t n;
+
+    if (size <= 128)
+        return size ? (size - 1) >> 4 : 0;
+
+    n   = size - 1;
+    log = (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(n);
+
+    return 8 + (log - 7) * 4 + ((n >> (log - 2)) & 3);
+}
+
+static inline size_t class_to_size(unsigned class)
+{
+    size_t base;
+
+    if (class < 8)
+        return (class + 1) * 16;
+
+    base = 128UL << ((class - 8) / 4);
+
+    return base + ((class - 8) % 4 + 1) * (base / 4);
+}
+
+static inline unsigned span_index(const void *ptr)
+{
+    return (uintptr_t)(ptr) >> SLAB_SPAN_SHIFT;
+}
+
+static void mark_spans(uint8_t *base, size_t size, uint8_t owner)
+{
+    for (size_t i = 0; i < size; i += SLAB_SPAN_SIZE) {
+        SlabSpanMap[span_index(base + i)] = owner;
+    }
+}
+
+// Get size bytes of address space aligned to a span boundary, so that no
+// foreign allocation can ever share a granule with us.
+static void *map_aligned(size_t size)
+{
+    uint8_t *map;
+    uint8_t *base;
+
+    map = mmap(NULL,
+               size + SLAB_SPAN_SIZE,
+               PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS,
+               -1,
+               0);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    base = (uint8_t *)(((uintptr_t)(map) + SLAB_SPAN_SIZE - 1) & ~(SLAB_SPAN_SIZE - 1));
+
+    if (base != map)
+        munmap(map, base - map);
+
+    if (map + SLAB_SPAN_SIZE != base)
+        munmap(base + size, (map + SLAB_SPAN_SIZE) - base);
+
+    return base;
+}
+
+static uint8_t *span_alloc(unsigned class)
+{
+    uint8_t *span = NULL;
+
+    slab_lock(&SpanLock);
+
+    if (SpanNext == SpanEnd) {
+        if ((SpanNext = map_aligned(SLAB_SPAN_SIZE * SLAB_SPAN_BATCH)) == NULL) {
+            SpanEnd = NULL;
+            goto finished;
+        }
+        SpanEnd     = SpanNext + SLAB_SPAN_SIZE * SLAB_SPAN_BATCH;
+        __atomic_add_fetch(&SlabMapped, SLAB_SPAN_SIZE * SLAB_SPAN_BATCH, __ATOMIC_RELAXED);
+    }
+
+    span      = SpanNext;
+    SpanNext += SLAB_SPAN_SIZE;
+
+    SlabSpanMap[span_index(span)] = class + 1;
+
+finished:
+    slab_unlock(&SpanLock);
+    return span;
+}
+
+static inline void live_flush(void)
+{
+    if (ThreadLive) {
+        __atomic_add_fetch(&SlabLive, ThreadLive, __ATOMIC_RELAXED);
+        ThreadLive = 0;
+    }
+}
+
+// Move objects from the central list (or fresh spans) into this thread's
+// cache. Returns false if we're out of memory.
+static bool cache_refill(unsigned class)
+{
+    struct slab_class *sc = &SlabClasses[class];
+    struct slab_cache *tc = &ThreadCache[class];
+    unsigned count;
+
+    live_flush();
+
+    slab_lock(&sc->lock);
+
+    for (count = 0; count < sc->batch; count++) {
+        void *object;
+
+        if (sc->freelist) {
+            object       = sc->freelist;
+            sc->freelist = *(void **)(object);
+        } else {
+            if (sc->bump + sc->size > sc->end) {
+                if ((sc->bump = span_alloc(class)) == NULL) {
+                    sc->end = NULL;
+                    break;
+                }
+                sc->end = sc->bump + SLAB_SPAN_SIZE;
+            }
+            object    = sc->bump;
+            sc->bump += sc->size;
+        }
+
+        *(void **)(object) = tc->head;
+        tc->head           = object;
+    }
+
+    slab_unlock(&sc->lock);
+
+    tc->count += count;
+
+    return count != 0;
+}
+
+// Return a batch of objects from this thread's cache to the central list.
+static void cache_flush(unsigned class, unsigned count)
+{
+    struct slab_class *sc = &SlabClasses[class];
+    struct slab_cache *tc = &ThreadCache[class];
+    void *first;
+    void *last;
+
+    live_flush();
+
+    if (count == 0 || tc->head == NULL)
+        return;
+
+    first = last = tc->head;
+
+    for (tc->count--; --count && *(void **)(last); tc->count--)
+        last = *(void **)(last);
+
+    tc->head = *(void **)(last);
+
+    slab_lock(&sc->lock);
+    *(void **)(last) = sc->freelist;
+    sc->freelist     = first;
+    slab_unlock(&sc->lock);
+}
+
+// The key only exists so that a thread's cache goes back to the central lists
+// when it exits. Every thread with anything in its cache must have called
+// this, including threads that only ever free objects allocated elsewhere.
+static void thread_cache_register(void)
+{
+    if (!ThreadCacheRegistered) {
+        pthread_setspecific(ThreadCacheKey, ThreadCache);
+        ThreadCacheRegistered = true;
+    }
+}
+
+static void thread_cache_release(void *unused)
+{
+    for (unsigned class = 0; class < SLAB_NUM_CLASSES; class++) {
+        cache_flush(class, ThreadCache[class].count);
+    }
+}
+
+static void __constructor slab_init(void)
+{
+    for (unsigned class = 0; class < SLAB_NUM_CLASSES; class++) {
+        SlabClasses[class].size  = class_to_size(class);
+        SlabClasses[class].batch = SLAB_CACHE_BYTES / SlabClasses[class].size;
+
+        if (SlabClasses[class].batch < 4)
+            SlabClasses[class].batch = 4;
+    }
+
+    pthread_key_create(&ThreadCacheKey, thread_cache_release);
+
+    // Debugging tools like ASAN and Valgrind want to see every allocation.
+#if defined(__SANITIZE_ADDRESS__)
+    SlabDisabled = true;
+#else
+    SlabDisabled = getenv("LL_SLAB_DISABLE") != NULL;
+#endif
+}
+
+static void *large_alloc(size_t size)
+{
+    struct slab_large *chunk = NULL;
+    size_t mapsize;
+
+    if (size > SIZE_MAX - sizeof(struct slab_large) - SLAB_SPAN_SIZE)
+        return NULL;
+
+    mapsize = (size + sizeof(struct slab_large) + SLAB_SPAN_SIZE - 1) & ~(SLAB_SPAN_SIZE - 1);
+
+    slab_lock(&SpanLock);
+    for (unsigned i = 0; i < SLAB_LARGE_CACHE; i++) {
+        if (LargeCache[i].mapsize == mapsize) {
+            chunk                = LargeCache[i].base;
+            LargeCache[i].base   = NULL;
+            LargeCache[i].mapsize = 0;
+            break;
+        }
+    }
+    slab_unlock(&SpanLock);
+
+    if (chunk == NULL) {
+        if ((chunk = map_aligned(mapsize)) == NULL)
+            return NULL;
+        mark_spans((uint8_t *) chunk, mapsize, SLAB_CLASS_LARGE);
+
+        __atomic_add_fetch(&SlabMapped, mapsize, __ATOMIC_RELAXED);
+    }
+
+    chunk->mapsize = mapsize;
+    chunk->magic   = SLAB_LARGE_MAGIC;
+
+    __atomic_add_fetch(&SlabLive, mapsize - sizeof *chunk, __ATOMIC_RELAXED);
+
+    return chunk + 1;
+}
+
+static void large_free(struct slab_large *chunk)
+{
+    uint8_t *first = (uint8_t *)(((uintptr_t)(chunk + 1) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    if (chunk->magic != SLAB_LARGE_MAGIC) {
+        l_error("heap corruption detected, bad large chunk header @%p", chunk);
+        abort();
+    }
+
+    __atomic_sub_fetch(&SlabLive, chunk->mapsize - sizeof *chunk, __ATOMIC_RELAXED);
+
+    // Give the pages back but keep the address space, the header shares the
+    // first page with data so that one stays. This has to happen before the
+    // chunk is cached, another thread could take it straight away.
+    if (madvise(first, (uint8_t *) chunk + chunk->mapsize - first, MADV_DONTNEED) != 0)
+        l_warning("failed to release pages of large chunk @%p, %m", chunk);
+
+    // Keep a few recently released chunks around, programs often free and
+    // allocate the same large buffer over and over.
+    slab_lock(&SpanLock);
+    for (unsigned i = 0; i < SLAB_LARGE_CACHE; i++) {
+        if (LargeCache[i].base == NULL) {
+            LargeCache[i].base    = chunk;
+            LargeCache[i].mapsize = chunk->mapsize;
+            slab_unlock(&SpanLock);
+            return;
+        }
+    }
+    __atomic_sub_fetch(&SlabMapped, chunk->mapsize, __ATOMIC_RELAXED);
+    slab_unlock(&SpanLock);
+
+    mark_spans((uint8_t *) chunk, chunk->mapsize, 0);
+    munmap(chunk, chunk->mapsize);
+}
+
+size_t slab_mapped(void)
+{
+    return __atomic_load_n(&SlabMapped, __ATOMIC_RELAXED);
+}
+
+static uint64_t slab_mapped_probe(void)
+{
+    return slab_mapped();
+}
+
+static DECLARE_STATS_PROBE(SlabMappedBytes, "slab.mapped_bytes", slab_mapped_probe);
+
+size_t slab_live(void)
+{
+    intptr_t live = __atomic_load_n(&SlabLive, __ATOMIC_RELAXED);
+
+    // Frees can be folded in before the allocations they match.
+    return live > 0 ? live : 0;
+}
+
+static uint64_t heap_live_probe(void)
+{
+    return slab_live();
+}
+
+static DECLARE_STATS_PROBE(HeapLiveBytes, "heap.live_bytes", heap_live_probe);
+
+bool slab_owns(const void *ptr)
+{
+    return SlabSpanMap[span_index(ptr)] != 0;
+}
+
+void *slab_alloc(size_t size)
+{
+    struct slab_cache *tc;
+    unsigned class;
+    void *object;
+
+    if (__builtin_expect(SlabDisabled, false))
+        return malloc(size);
+
+    if (size > SLAB_MAX_SMALL)
+        return large_alloc(size);
+
+    class = size_to_class(size);
+    tc    = &ThreadCache[class];
+
+    if (__builtin_expect(tc->head == NULL, false)) {
+        thread_cache_register();
+        if (!cache_refill(class))
+            return NULL;
+    }
+
+    object      = tc->head;
+    tc->head    = *(void **)(object);
+    tc->count--;
+    ThreadLive += SlabClasses[class].size;
+
+    return object;
+}
+
+void *slab_calloc(size_t nmemb, size_t size)
+{
+    void *object;
+
+    if (size && nmemb > SIZE_MAX / size)
+        return NULL;
+
+    if ((object = slab_alloc(nmemb * size)))
+        memset(object, 0, nmemb * size);
+
+    return object;
+}
+
+void slab_free(void *ptr)
+{
+    struct slab_cache *tc;
+    unsigned owner;
+
+    if (ptr == NULL)
+        return;
+
+    owner = SlabSpanMap[span_index(ptr)];
+
+    if (owner == 0)
+        return free(ptr);
+
+    if (owner == SLAB_CLASS_LARGE)
+        return large_free((struct slab_large *)(ptr) - 1);
+
+    tc               = &ThreadCache[owner - 1];
+
+    if (__builtin_expect(tc->head == NULL, false))
+        thread_cache_register();
+
+    *(void **)(ptr)  = tc->head;
+    tc->head         = ptr;
+    ThreadLive      -= SlabClasses[owner - 1].size;
+
+    if (++tc->count > SlabClasses[owner - 1].batch * 2) {
+        cache_flush(owner - 1, SlabClasses[owner - 1].batch);
+    }
+}
+
+size_t slab_usable_size(void *ptr)
+{
+    unsigned owner;
+
+    if (ptr == NULL)
+        return 0;
+
+    owner = SlabSpanMap[span_index(ptr)];
+
+    if (owner == 0)
+        return malloc_usable_size(ptr);
+
+    if (owner == SLAB_CLASS_LARGE)
+        return ((struct slab_large *)(ptr) - 1)->mapsize - sizeof(struct slab_large);
+
+    return SlabClasses[owner - 1].size;
+}
+
+void *slab_realloc(void *ptr, size_t size)
+{
+    size_t oldsize;
+    void *object;
+
+    if (ptr == NULL)
+        return slab_alloc(size);
+
+    if (!slab_owns(ptr))
+        return realloc(ptr, size);
+
+    oldsize = slab_usable_size(ptr);
+
+    // Shrinking, or growing within the same size class is a no-op, but large
+    // chunks should give back memory if they shrink significantly.
+    if (size <= oldsize && (oldsize <= SLAB_MAX_SMALL || size > oldsize / 2))
+        return ptr;
+
+    if ((object = slab_alloc(size)) == NULL)
+        return NULL;
+
+    memcpy(object, ptr, MIN(size, oldsize));
+
+    slab_free(ptr);
+
+    return object;
+}
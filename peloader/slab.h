@@ -0,0 +1,32 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Small object allocator used by the Win32 heap shims. Blocks up to
+// SLAB_MAX_SMALL bytes are carved from size-class spans and recycled through
+// per-thread caches, anything larger gets a dedicated mapping.
+//
+// Pointers that were not allocated here (e.g. from _strdup or LocalAlloc in
+// older code) are recognised and forwarded to libc, so it's always safe to
+// call slab_free() or slab_realloc() on heap memory.
+
+#define SLAB_MAX_SMALL  (32 * 1024)
+#define SLAB_SPAN_SHIFT 16
+#define SLAB_SPAN_SIZE  (1UL << SLAB_SPAN_SHIFT)
+
+void *slab_alloc(size_t size);
+void *slab_calloc(size_t nmemb, size_t size);
+void *slab_realloc(void *ptr, size_t size);
+void slab_free(void *ptr);
+size_t slab_usable_size(void *ptr);
+bool slab_owns(const void *ptr);
+
+// Bytes of address space currently mapped by the allocator.
+size_t slab_mapped(void);
+
+// Approximate bytes in blocks that haven't been freed.
+size_t slab_live(void);
+
+#endif
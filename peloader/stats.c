@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+
+#include "log.h"
+#include "util.h"
+#include "stats.h"
+
+// Kept sorted by name, so dumping doesn't need to allocate.
+static STATS_COUNTER *StatsCounters;
+static volatile int StatsLock;
+static char *StatsPath;
+static int StatsJsonFd = -1;
+
+void stats_register(STATS_COUNTER *counter)
+{
+    STATS_COUNTER **position;
+
+    while (__sync_lock_test_and_set(&StatsLock, 1))
+        ;
+
+    for (position = &StatsCounters; *position; position = &(*position)->next) {
+        if (strcmp((*position)->name, counter->name) > 0)
+            break;
+    }
+
+    counter->next = *position;
+
+    __atomic_store_n(position, counter, __ATOMIC_RELEASE);
+    __sync_lock_release(&StatsLock);
+}
+
+static uint64_t stats_value(STATS_COUNTER *counter)
+{
+    if (counter->probe)
+        return counter->probe();
+
+    return __atomic_load_n(&counter->value, __ATOMIC_RELAXED);
+}
+
+void stats_dump(FILE *out)
+{
+    STATS_COUNTER *counter;
+
+    for (counter = StatsCounters; counter; counter = counter->next) {
+        fprintf(out, "%-32s %llu\n", counter->name, (unsigned long long) stats_value(counter));
+    }
+}
+
+static char *format_string(char *buf, const char *string)
+{
+    size_t length = strlen(string);
+
+    memcpy(buf, string, length);
+
+    return buf + length;
+}
+
+static char *format_u64(char *buf, uint64_t value)
+{
+    char digits[24];
+    char *p = digits + sizeof digits;
+
+    do {
+        *--p = '0' + value % 10;
+    } while (value /= 10);
+
+    memcpy(buf, p, digits + sizeof digits - p);
+
+    return buf + (digits + sizeof digits - p);
+}
+
+// This is called from a signal handler, so only uses write(). Counter names
+// are identifiers, they don't need escaping.
+void stats_dump_json(int fd)
+{
+    STATS_COUNTER *counter;
+    char buf[256];
+    char *p = format_string(buf, "{");
+    bool first = true;
+
+    for (counter = __atomic_load_n(&StatsCounters, __ATOMIC_ACQUIRE); counter; counter = counter->next) {
+        size_t length = strlen(counter->name) + 32;
+
+        if (length > sizeof buf)
+            continue;
+
+        // Flush what we have if this entry might not fit.
+        if (p - buf + length > sizeof buf) {
+            write(fd, buf, p - buf);
+            p = buf;
+        }
+
+        p     = format_string(p, first ? "\"" : ",\"");
+        p     = format_string(p, counter->name);
+        p     = format_string(p, "\":");
+        p     = format_u64(p, stats_value(counter));
+        first = false;
+    }
+
+    p = format_string(p, "}\n");
+
+    write(fd, buf, p - buf);
+}
+
+static void stats_signal(int signum)
+{
+    int error = errno;
+
+    stats_dump_json(StatsJsonFd);
+
+    errno = error;
+}
+
+static void stats_exit(void)
+{
+    FILE *out = stderr;
+
+    if (strcmp(StatsPath, "-") != 0 && (out = fopen(StatsPath, "w")) == NULL) {
+        l_warning("failed to open %s for statistics, %m", StatsPath);
+        return;
+    }
+
+    stats_dump(out);
+
+    if (out != stderr)
+        fclose(out);
+}
+
+static void __constructor stats_init(void)
+{
+    struct sigaction action = {
+        .sa_handler = stats_signal,
+        .sa_flags   = SA_RESTART,
+    };
+    char path[PATH_MAX];
+
+    if (getenv("LL_STATS") == NULL)
+        return;
+
+    StatsPath = strdup(getenv("LL_STATS"));
+
+    // Snapshots are appended one per line.
+    if (strcmp(StatsPath, "-") == 0) {
+        StatsJsonFd = STDERR_FILENO;
+    } else {
+        snprintf(path, sizeof path, "%s.json", StatsPath);
+
+        if ((StatsJsonFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0) {
+            l_warning("failed to open %s for statistics, %m", path);
+        }
+    }
+
+    if (StatsJsonFd >= 0)
+        sigaction(SIGUSR1, &action, NULL);
+
+    atexit(stats_exit);
+}
@@ -0,0 +1,66 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+// Named counters that subsystems bump as they work, dumped at exit when
+// LL_STATS is set to a filename (or - for stderr).
+//
+// Counters register themselves before main(), updating one is a single
+// relaxed atomic add. A gauge is a counter that also goes down, like the
+// number of open handles. A probe is read by calling a function when the
+// counters are dumped, for values that another structure already tracks.
+//
+// While LL_STATS is set, SIGUSR1 appends a JSON snapshot of every counter to
+// <LL_STATS>.json, or to stderr. The exported stats_dump_json() does the
+// same on demand, e.g. from a debugger. Snapshots are taken inside a signal
+// handler, so probes must not take locks or allocate.
+
+typedef struct stats_counter {
+    const char *name;
+    uint64_t value;
+    struct stats_counter *next;
+    uint64_t (*probe)(void);
+} STATS_COUNTER;
+
+#define DECLARE_STATS_PROBE(_var, _name, _probe)            \
+    STATS_COUNTER _var = { _name, 0, NULL, _probe };        \
+    static void __constructor __stats__ ## _var (void)      \
+    {                                                       \
+        stats_register(&_var);                              \
+    }
+
+#define DECLARE_STATS_COUNTER(_var, _name)                  \
+    DECLARE_STATS_PROBE(_var, _name, NULL)
+
+#define DECLARE_STATS_GAUGE(_var, _name)                    \
+    DECLARE_STATS_PROBE(_var, _name, NULL)
+
+void stats_register(STATS_COUNTER *counter);
+void stats_dump(FILE *out);
+void stats_dump_json(int fd);
+
+static inline void stats_add(STATS_COUNTER *counter, uint64_t value)
+{
+    __atomic_add_fetch(&counter->value, value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_sub(STATS_COUNTER *counter, uint64_t value)
+{
+    __atomic_sub_fetch(&counter->value, value, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(STATS_COUNTER *counter)
+{
+    stats_add(counter, 1);
+}
+
+static inline void stats_dec(STATS_COUNTER *counter)
+{
+    stats_sub(counter, 1);
+}
+
+#endif
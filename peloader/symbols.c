@@ -0,0 +1,342 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dlfcn.h>
+#include <libgen.h>
+
+#include "log.h"
+#include "util.h"
+#include "symbols.h"
+#include "symindex.h"
+
+#define MAX_SYMBOL_IMAGES 32
+
+struct symbol {
+    uintptr_t   address;
+    const char *name;
+};
+
+static struct {
+    char       *name;
+    uintptr_t   base;
+    size_t      size;
+} SymbolImages[MAX_SYMBOL_IMAGES];
+
+static unsigned NumSymbolImages;
+
+// Compiled symbol tables, addresses are relative to base.
+static struct {
+    const SYMINDEX *index;
+    uintptr_t       base;
+} SymbolIndexes[MAX_SYMBOL_IMAGES];
+
+static unsigned NumSymbolIndexes;
+
+static struct symbol *Symbols;
+static size_t NumSymbols;
+static size_t MaxSymbols;
+static bool SymbolsSorted;
+static volatile int SymbolLock;
+
+static void __destructor cleanup_symbols(void)
+{
+    free(Symbols);
+
+    for (unsigned i = 0; i < NumSymbolImages; i++) {
+        free(SymbolImages[i].name);
+    }
+}
+
+void symbols_add_image(const char *name, void *base, size_t size)
+{
+    char *path;
+
+    if (NumSymbolImages >= MAX_SYMBOL_IMAGES) {
+        l_warning("too many images for symbol lookup, ignoring %s", name);
+        return;
+    }
+
+    // We only want the basename, but basename() might modify its argument.
+    path = strdup(name);
+
+    SymbolImages[NumSymbolImages].name = strdup(basename(path));
+    SymbolImages[NumSymbolImages].base = (uintptr_t) base;
+    SymbolImages[NumSymbolImages].size = size;
+
+    NumSymbolImages++;
+
+    free(path);
+}
+
+bool symbols_image(unsigned index, const char **name, uintptr_t *base, size_t *size)
+{
+    if (index >= NumSymbolImages)
+        return false;
+
+    *name = SymbolImages[index].name;
+    *base = SymbolImages[index].base;
+    *size = SymbolImages[index].size;
+
+    return true;
+}
+
+void symbols_add(const char *name, void *address)
+{
+    if (NumSymbols == MaxSymbols) {
+        struct symbol *symbols;
+
+        MaxSymbols = MaxSymbols ? MaxSymbols * 2 : 1024;
+
+        if ((symbols = realloc(Symbols, MaxSymbols * sizeof *symbols)) == NULL) {
+            l_error("failed to allocate memory for %u symbols", MaxSymbols);
+            MaxSymbols = NumSymbols;
+            return;
+        }
+
+        Symbols = symbols;
+    }
+
+    Symbols[NumSymbols].address = (uintptr_t) address;
+    Symbols[NumSymbols].name    = name;
+
+    NumSymbols++;
+
+    SymbolsSorted = false;
+}
+
+void symbols_add_index(const SYMINDEX *index, void *base)
+{
+    if (NumSymbolIndexes >= MAX_SYMBOL_IMAGES) {
+        l_warning("too many symbol indexes, ignoring %u symbols", index->count);
+        return;
+    }
+
+    SymbolIndexes[NumSymbolIndexes].index = index;
+    SymbolIndexes[NumSymbolIndexes].base  = (uintptr_t) base;
+
+    NumSymbolIndexes++;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+    const struct symbol *x = a;
+    const struct symbol *y = b;
+
+    if (x->address == y->address)
+        return 0;
+
+    return x->address < y->address ? -1 : 1;
+}
+
+static void symbols_sort(void)
+{
+    while (__sync_lock_test_and_set(&SymbolLock, 1))
+        ;
+
+    if (!SymbolsSorted) {
+        qsort(Symbols, NumSymbols, sizeof *Symbols, compare_symbols);
+        SymbolsSorted = true;
+    }
+
+    __sync_lock_release(&SymbolLock);
+}
+
+// Find the last symbol at or below address.
+static const struct symbol *symbol_search(uintptr_t address)
+{
+    size_t lo = 0;
+    size_t hi = NumSymbols;
+
+    symbols_sort();
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (Symbols[mid].address <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo ? &Symbols[lo - 1] : NULL;
+}
+
+// Find the closest symbol at or below address in any index, but not below
+// floor.
+static bool symbol_index_search(uintptr_t address, uintptr_t floor, struct symbol *result)
+{
+    bool found = false;
+
+    for (unsigned i = 0; i < NumSymbolIndexes; i++) {
+        const SYMINDEX *index = SymbolIndexes[i].index;
+        uintptr_t base = SymbolIndexes[i].base;
+        ptrdiff_t position;
+
+        if (address < base || address - base > UINT32_MAX)
+            continue;
+
+        if ((position = symindex_search(index, address - base)) < 0)
+            continue;
+
+        if (base + symindex_address(index, position) < floor)
+            continue;
+
+        result->address = base + symindex_address(index, position);
+        result->name    = symindex_name(index, position);
+        floor           = result->address;
+        found           = true;
+    }
+
+    return found;
+}
+
+bool symbol_from_address(const void *address,
+                         const char **module,
+                         uintptr_t *rva,
+                         const char **symbol,
+                         uintptr_t *offset)
+{
+    const struct symbol *sym;
+    struct symbol indexed;
+    uintptr_t addr = (uintptr_t) address;
+
+    for (unsigned i = 0; i < NumSymbolImages; i++) {
+        if (addr < SymbolImages[i].base)
+            continue;
+        if (addr >= SymbolImages[i].base + SymbolImages[i].size)
+            continue;
+
+        *module = SymbolImages[i].name;
+        *rva    = addr - SymbolImages[i].base;
+        *symbol = NULL;
+        *offset = *rva;
+
+        // Only accept a symbol from the same image.
+        if ((sym = symbol_search(addr)) && sym->address >= SymbolImages[i].base) {
+            *symbol = sym->name;
+            *offset = addr - sym->address;
+        }
+
+        // An index might have something closer.
+        if (symbol_index_search(addr, *symbol ? addr - *offset + 1 : SymbolImages[i].base, &indexed)) {
+            *symbol = indexed.name;
+            *offset = addr - indexed.address;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// Produce a "module;symbol+offset" string suitable for collapsed stacks.
+int symbol_format(const void *address, char *buf, size_t size)
+{
+    const char *module;
+    const char *symbol;
+    uintptr_t rva;
+    uintptr_t offset;
+    Dl_info info;
+
+    if (symbol_from_address(address, &module, &rva, &symbol, &offset)) {
+        if (symbol) {
+            return snprintf(buf, size, "%s;%s+%#x", module, symbol, offset);
+        }
+        return snprintf(buf, size, "%s;%#x", module, rva);
+    }
+
+    // Not in a PE image, maybe it's one of ours.
+    if (dladdr(address, &info) && info.dli_sname) {
+        return snprintf(buf, size, "[loader];%s", info.dli_sname);
+    }
+
+    return snprintf(buf, size, "[unknown];%p", address);
+}
+
+// Walk the symbols of an image in address order, merging exports and any
+// index that covers it.
+struct symbol_cursor {
+    size_t          next;
+    const SYMINDEX *index;
+    uintptr_t       base;
+    size_t          position;
+};
+
+static bool symbol_cursor_next(struct symbol_cursor *cursor, uintptr_t end, struct symbol *result)
+{
+    bool exported = cursor->next < NumSymbols && Symbols[cursor->next].address < end;
+    bool indexed  = cursor->index && cursor->position < cursor->index->count
+                 && cursor->base + symindex_address(cursor->index, cursor->position) < end;
+
+    if (exported && indexed) {
+        exported = Symbols[cursor->next].address <= cursor->base + symindex_address(cursor->index, cursor->position);
+        indexed  = !exported;
+    }
+
+    if (exported) {
+        *result = Symbols[cursor->next++];
+        return true;
+    }
+
+    if (indexed) {
+        result->address = cursor->base + symindex_address(cursor->index, cursor->position);
+        result->name    = symindex_name(cursor->index, cursor->position);
+        cursor->position++;
+        return true;
+    }
+
+    return false;
+}
+
+// Each symbol extends to the next one, and gaps are attributed to the image
+// so every byte of an image has a name.
+void symbols_write_perf_map(FILE *out)
+{
+    symbols_sort();
+
+    for (unsigned i = 0; i < NumSymbolImages; i++) {
+        uintptr_t base   = SymbolImages[i].base;
+        uintptr_t end    = base + SymbolImages[i].size;
+        uintptr_t cursor = base;
+        const char *name = SymbolImages[i].name;
+        struct symbol_cursor symbols = {0};
+        struct symbol current, next;
+        bool valid;
+
+        for (symbols.next = 0; symbols.next < NumSymbols && Symbols[symbols.next].address < base; symbols.next++)
+            ;
+
+        for (unsigned j = 0; j < NumSymbolIndexes; j++) {
+            if (SymbolIndexes[j].base >= base && SymbolIndexes[j].base < end) {
+                symbols.index = SymbolIndexes[j].index;
+                symbols.base  = SymbolIndexes[j].base;
+                break;
+            }
+        }
+
+        for (valid = symbol_cursor_next(&symbols, end, &current); valid; current = next) {
+            uintptr_t limit = end;
+
+            if ((valid = symbol_cursor_next(&symbols, end, &next)))
+                limit = next.address;
+
+            // Aliases share an address, the last one gets the range.
+            if (limit == current.address)
+                continue;
+
+            if (current.address > cursor)
+                fprintf(out, "%lx %lx %s\n", (unsigned long) cursor, (unsigned long)(current.address - cursor), name);
+
+            fprintf(out, "%lx %lx %s!%s\n", (unsigned long) current.address, (unsigned long)(limit - current.address), name, current.name);
+
+            cursor = limit;
+        }
+
+        if (cursor < end)
+            fprintf(out, "%lx %lx %s\n", (unsigned long) cursor, (unsigned long)(end - cursor), name);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef __SYMBOLS_H
+#define __SYMBOLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Address to name lookups for loaded PE images, used by the profiling code.
+//
+// Images are registered by link_pe_images(), and symbols come from the export
+// table and any symbol map loaded with process_extra_exports().
+
+void symbols_add_image(const char *name, void *base, size_t size);
+void symbols_add(const char *name, void *address);
+
+// Use a compiled symbol index, addresses in it are relative to base.
+struct symindex;
+void symbols_add_index(const struct symindex *index, void *base);
+bool symbol_from_address(const void *address,
+                         const char **module,
+                         uintptr_t *rva,
+                         const char **symbol,
+                         uintptr_t *offset);
+int symbol_format(const void *address, char *buf, size_t size);
+
+// Enumerate registered images, returns false when index is past the end.
+bool symbols_image(unsigned index, const char **name, uintptr_t *base, size_t *size);
+
+// Write a perf map covering every image, see perfmap.h.
+void symbols_write_perf_map(FILE *out);
+
+#endif
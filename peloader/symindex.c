@@ -0,0 +1,232 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "symindex.h"
+
+// This file is also built into mksymidx, so only depends on libc.
+
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261;
+
+    while (*name)
+        hash = (hash ^ (uint8_t) *name++) * 16777619;
+
+    return hash;
+}
+
+static uint32_t table_size(size_t count)
+{
+    uint32_t size = 16;
+
+    while (size < count * 2)
+        size *= 2;
+
+    return size;
+}
+
+// Sort by address, keeping the input order for aliases so the result is
+// reproducible.
+static int compare_inputs(const void *a, const void *b)
+{
+    const SYMINDEX_INPUT *x = *(const SYMINDEX_INPUT **) a;
+    const SYMINDEX_INPUT *y = *(const SYMINDEX_INPUT **) b;
+
+    if (x->address != y->address)
+        return x->address < y->address ? -1 : 1;
+
+    return x < y ? -1 : x > y;
+}
+
+SYMINDEX *symindex_build(SYMINDEX_INPUT *symbols, size_t count)
+{
+    SYMINDEX_INPUT **order;
+    SYMINDEX *index;
+    uint32_t *addresses, *names, *table;
+    uint32_t tsize = table_size(count);
+    size_t size, strings;
+    char *base;
+
+    // Names are referenced by 32-bit offsets.
+    strings = sizeof(SYMINDEX) + (count * 2 + tsize) * sizeof(uint32_t);
+    size    = strings;
+
+    for (size_t i = 0; i < count; i++)
+        size += strlen(symbols[i].name) + 1;
+
+    if (size > UINT32_MAX)
+        return NULL;
+
+    if ((order = calloc(count + 1, sizeof *order)) == NULL)
+        return NULL;
+
+    if ((index = calloc(1, size)) == NULL) {
+        free(order);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        order[i] = &symbols[i];
+
+    qsort(order, count, sizeof *order, compare_inputs);
+
+    memcpy(index->magic, SYMINDEX_MAGIC, sizeof index->magic);
+
+    index->size       = size;
+    index->count      = count;
+    index->addresses  = sizeof(SYMINDEX);
+    index->names      = index->addresses + count * sizeof(uint32_t);
+    index->table      = index->names + count * sizeof(uint32_t);
+    index->table_size = tsize;
+
+    base      = (char *) index;
+    addresses = (uint32_t *)(base + index->addresses);
+    names     = (uint32_t *)(base + index->names);
+    table     = (uint32_t *)(base + index->table);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(order[i]->name) + 1;
+
+        addresses[i] = order[i]->address;
+        names[i]     = strings;
+
+        memcpy(base + strings, order[i]->name, length);
+        strings += length;
+    }
+
+    // Insert in input order, so the first definition of a name wins. The
+    // addresses have been copied, so the inputs can record where each one
+    // was sorted to.
+    for (size_t i = 0; i < count; i++)
+        order[i]->address = i;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t position = symbols[i].address;
+        const char *name  = base + names[position];
+        uint32_t slot;
+
+        for (slot = hash_name(name) & (tsize - 1); table[slot]; slot = (slot + 1) & (tsize - 1)) {
+            if (strcmp(base + names[table[slot] - 1], name) == 0)
+                break;
+        }
+
+        if (table[slot] == 0)
+            table[slot] = position + 1;
+    }
+
+    free(order);
+    return index;
+}
+
+bool symindex_parse_line(char *line, SYMINDEX_INPUT *symbol)
+{
+    unsigned long address;
+    char *end;
+
+    while (isspace((uint8_t) *line))
+        line++;
+
+    address = strtoul(line, &end, 16);
+
+    // IDA maps have a segment number first, the existing tools ignore it.
+    if (end != line && *end == ':') {
+        line    = end + 1;
+        address = strtoul(line, &end, 16);
+    }
+
+    if (end == line || !isspace((uint8_t) *end))
+        return false;
+
+    while (isspace((uint8_t) *end))
+        end++;
+
+    symbol->address = address;
+    symbol->name    = end;
+
+    // Maps made on Windows have CRLF terminators.
+    end += strcspn(end, "\r\n");
+
+    while (end > symbol->name && isspace((uint8_t) end[-1]))
+        end--;
+
+    *end = '\0';
+
+    return *symbol->name != '\0';
+}
+
+bool symindex_validate(const SYMINDEX *index, size_t size)
+{
+    const uint32_t *names;
+
+    if (size < sizeof(SYMINDEX) || memcmp(index->magic, SYMINDEX_MAGIC, sizeof index->magic) != 0)
+        return false;
+
+    if (index->size != size || ((const char *) index)[size - 1] != '\0')
+        return false;
+
+    if (index->table_size == 0 || (index->table_size & (index->table_size - 1)))
+        return false;
+
+    if (index->count > size / sizeof(uint32_t) || index->table_size > size / sizeof(uint32_t))
+        return false;
+
+    if (index->addresses > size - index->count * sizeof(uint32_t))
+        return false;
+    if (index->names > size - index->count * sizeof(uint32_t))
+        return false;
+    if (index->table > size - index->table_size * sizeof(uint32_t))
+        return false;
+
+    // The file ends with a nul, so checking each name starts inside it is
+    // enough to keep string functions inside the mapping.
+    names = (const uint32_t *)((const char *) index + index->names);
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        if (names[i] >= size)
+            return false;
+    }
+
+    return true;
+}
+
+bool symindex_find(const SYMINDEX *index, const char *name, uint32_t *address)
+{
+    const uint32_t *table = (const uint32_t *)((const char *) index + index->table);
+    uint32_t mask = index->table_size - 1;
+    uint32_t slot = hash_name(name) & mask;
+
+    // The table comes from disk and might have no empty slot, so never probe
+    // more than every slot once.
+    for (uint32_t probe = 0; probe < index->table_size && table[slot]; probe++, slot = (slot + 1) & mask) {
+        uint32_t i = table[slot] - 1;
+
+        if (i < index->count && strcmp(symindex_name(index, i), name) == 0) {
+            *address = symindex_address(index, i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ptrdiff_t symindex_search(const SYMINDEX *index, uint32_t address)
+{
+    size_t lo = 0;
+    size_t hi = index->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (symindex_address(index, mid) <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (ptrdiff_t) lo - 1;
+}
@@ -0,0 +1,60 @@
+#ifndef __SYMINDEX_H
+#define __SYMINDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A compiled symbol table for an image, created by mksymidx from an IDA map
+// or a list of addresses and names. The loader maps it and uses it in place,
+// so there's no parsing and no limit on the number of symbols.
+//
+// Symbols are sorted by address for address to name lookups, and a hash
+// table of names gives the reverse. Addresses are relative to wherever the
+// map said they were, the loader adds the image base.
+
+#define SYMINDEX_MAGIC "LLSYMIX1"
+
+typedef struct symindex {
+    char magic[8];
+    uint32_t size;
+    uint32_t count;
+    uint32_t addresses;         // Offset of uint32_t[count], sorted.
+    uint32_t names;             // Offset of uint32_t[count] name offsets.
+    uint32_t table;             // Offset of the hash table of names.
+    uint32_t table_size;        // A power of two.
+} SYMINDEX;
+
+typedef struct symindex_input {
+    uint32_t address;
+    const char *name;
+} SYMINDEX_INPUT;
+
+// Compile symbols into an index, returned in memory from malloc(). If a name
+// appears more than once, the first one wins lookups by name. The addresses
+// in symbols are overwritten.
+SYMINDEX *symindex_build(SYMINDEX_INPUT *symbols, size_t count);
+
+// Parse one line of an IDA map ("0001:00001000 name") or a plain list
+// ("00001000 name"). The name is in line, which is modified.
+bool symindex_parse_line(char *line, SYMINDEX_INPUT *symbol);
+
+// Check an index is safe to use, it may be untrusted.
+bool symindex_validate(const SYMINDEX *index, size_t size);
+
+bool symindex_find(const SYMINDEX *index, const char *name, uint32_t *address);
+
+// Find the last symbol at or below address, returns its position or -1.
+ptrdiff_t symindex_search(const SYMINDEX *index, uint32_t address);
+
+static inline uint32_t symindex_address(const SYMINDEX *index, size_t i)
+{
+    return ((const uint32_t *)((const char *) index + index->addresses))[i];
+}
+
+static inline const char *symindex_name(const SYMINDEX *index, size_t i)
+{
+    return (const char *) index + ((const uint32_t *)((const char *) index + index->names))[i];
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <x86intrin.h>
+
+#include "log.h"
+#include "util.h"
+#include "symbols.h"
+#include "trace.h"
+
+#define TRACE_DEFAULT_RECORDS   65536       // Per thread, 4MB.
+
+// Rings are never freed, a thread that exits leaves its records behind for
+// the dump.
+typedef struct trace_ring {
+    struct trace_ring *next;
+    uint32_t tid;
+    uint64_t head;                      // Records ever written.
+    TRACE_RECORD records[];
+} TRACE_RING;
+
+bool TraceEnabled;
+
+// Provided by the linker.
+extern const TRACE_SITE __start_ll_trace_sites[] __attribute__((weak));
+extern const TRACE_SITE __stop_ll_trace_sites[] __attribute__((weak));
+
+static __thread TRACE_RING *ThreadRing;
+static TRACE_RING *TraceRings;
+static size_t TraceRecords = TRACE_DEFAULT_RECORDS;
+static char *TracePath;
+static uint64_t TraceStartCycles;
+static uint64_t TraceStartNsec;
+
+static uint64_t trace_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void trace_signal(int signum)
+{
+    TraceEnabled = !TraceEnabled;
+}
+
+static void trace_exit(void);
+
+static void __constructor trace_init(void)
+{
+    struct sigaction action = {
+        .sa_handler = trace_signal,
+        .sa_flags   = SA_RESTART,
+    };
+
+    if (getenv("LL_TRACE") == NULL)
+        return;
+
+    // Round down to a power of two, so the ring index is a mask.
+    if (getenv("LL_TRACE_RECORDS")) {
+        size_t records = strtoul(getenv("LL_TRACE_RECORDS"), NULL, 0);
+
+        for (TraceRecords = 1; records >>= 1; TraceRecords <<= 1)
+            ;
+    }
+
+    TracePath        = strdup(getenv("LL_TRACE"));
+    TraceStartCycles = __rdtsc();
+    TraceStartNsec   = trace_nsec();
+    TraceEnabled     = getenv("LL_TRACE_PAUSED") == NULL;
+
+    sigaction(SIGRTMIN + 1, &action, NULL);
+
+    // This runs before the destructors, so symbol tables are still intact.
+    atexit(trace_exit);
+}
+
+static TRACE_RING *trace_ring_create(void)
+{
+    TRACE_RING *ring;
+
+    ring = mmap(NULL,
+                sizeof *ring + TraceRecords * sizeof(TRACE_RECORD),
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    ring->tid = syscall(SYS_gettid);
+
+    do {
+        ring->next = TraceRings;
+    } while (!__sync_bool_compare_and_swap(&TraceRings, ring->next, ring));
+
+    return ThreadRing = ring;
+}
+
+void trace_record(const TRACE_SITE *site, const void *caller, const void *frame)
+{
+    TRACE_RING *ring = ThreadRing;
+    TRACE_RECORD *record;
+
+    if (ring == NULL && (ring = trace_ring_create()) == NULL)
+        return;
+
+    record = &ring->records[ring->head & (TraceRecords - 1)];
+
+    record->timestamp = __rdtsc();
+    record->caller    = (uintptr_t) caller;
+    record->site      = site - __start_ll_trace_sites;
+
+#ifdef __i386__
+    // The arguments follow the saved frame pointer and return address. We
+    // don't know how many there are, but the caller's frame is above them.
+    memcpy(record->args, (const uint32_t *)(frame) + 2, sizeof record->args);
+#else
+    memset(record->args, 0, sizeof record->args);
+#endif
+
+    // Only this thread writes the ring, this orders the record before the
+    // head for the dump.
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_exit(void)
+{
+    TRACE_HEADER header = {
+        .magic          = TRACE_MAGIC,
+        .record_size    = sizeof(TRACE_RECORD),
+        .site_count     = __stop_ll_trace_sites - __start_ll_trace_sites,
+        .start_cycles   = TraceStartCycles,
+        .start_nsec     = TraceStartNsec,
+        .end_cycles     = __rdtsc(),
+        .end_nsec       = trace_nsec(),
+    };
+    const char *name;
+    uintptr_t base;
+    size_t size;
+    FILE *out;
+
+    TraceEnabled = false;
+
+    if ((out = fopen(TracePath, "w")) == NULL) {
+        l_warning("failed to open %s for trace, %m", TracePath);
+        return;
+    }
+
+    while (symbols_image(header.image_count, &name, &base, &size))
+        header.image_count++;
+
+    for (TRACE_RING *ring = TraceRings; ring; ring = ring->next)
+        header.thread_count++;
+
+    fwrite(&header, sizeof header, 1, out);
+
+    for (uint32_t i = 0; i < header.site_count; i++) {
+        fwrite(__start_ll_trace_sites[i].function, strlen(__start_ll_trace_sites[i].function) + 1, 1, out);
+    }
+
+    for (unsigned i = 0; symbols_image(i, &name, &base, &size); i++) {
+        TRACE_IMAGE image = {
+            .base = base,
+            .size = size,
+        };
+
+        fwrite(&image, sizeof image, 1, out);
+        fwrite(name, strlen(name) + 1, 1, out);
+    }
+
+    for (TRACE_RING *ring = TraceRings; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        TRACE_THREAD thread = {
+            .tid     = ring->tid,
+            .count   = MIN(head, TraceRecords),
+            .dropped = head - MIN(head, TraceRecords),
+        };
+
+        fwrite(&thread, sizeof thread, 1, out);
+
+        // The oldest record is the one the head would overwrite next.
+        for (uint64_t i = head - thread.count; i < head; i++) {
+            fwrite(&ring->records[i & (TraceRecords - 1)], sizeof(TRACE_RECORD), 1, out);
+        }
+    }
+
+    fclose(out);
+}
@@ -0,0 +1,76 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A binary trace of calls into the shims.
+//
+// Every DebugLog() is a trace point, so release builds don't lose all
+// visibility. Set LL_TRACE=<path> to record a fixed size record for each
+// one into a per-thread ring buffer, which is written to <path> at exit and
+// decoded offline by lltrace. Send SIGRTMIN+1 to pause and resume tracing,
+// LL_TRACE_PAUSED=1 starts paused. LL_TRACE_RECORDS sets the ring size.
+//
+// A disabled trace point costs a single predictable branch, nothing is
+// formatted or even evaluated.
+
+#define TRACE_MAGIC     "LLTRACE1"
+#define TRACE_ARGS      11
+
+// Each trace point has one of these in a section of its own, so the index
+// of a site is just its position in the section.
+typedef struct trace_site {
+    const char *function;
+} TRACE_SITE;
+
+typedef struct trace_record {
+    uint64_t timestamp;                 // Cycles, see TRACE_HEADER.
+    uint64_t caller;                    // Return address of the traced function.
+    uint32_t site;
+    uint32_t args[TRACE_ARGS];          // Raw stack arguments, i386 only.
+} TRACE_RECORD;
+
+// The file is a TRACE_HEADER, then site_count nul terminated function
+// names, then image_count TRACE_IMAGE each followed by a nul terminated name,
+// then thread_count TRACE_THREAD each followed by count TRACE_RECORD, oldest
+// first.
+typedef struct trace_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t site_count;
+    uint32_t image_count;
+    uint32_t thread_count;
+    uint64_t start_cycles;              // Pairs for converting cycles to time.
+    uint64_t start_nsec;
+    uint64_t end_cycles;
+    uint64_t end_nsec;
+} TRACE_HEADER;
+
+typedef struct trace_image {
+    uint64_t base;
+    uint64_t size;
+} TRACE_IMAGE;
+
+typedef struct trace_thread {
+    uint32_t tid;
+    uint32_t count;
+    uint64_t dropped;                   // Records overwritten before the dump.
+} TRACE_THREAD;
+
+extern bool TraceEnabled;
+
+void trace_record(const TRACE_SITE *site, const void *caller, const void *frame);
+
+#define TRACE_POINT() do {                                                  \
+        static const TRACE_SITE __trace_site                                \
+            __attribute__((section("ll_trace_sites"), used))                \
+            = { __FUNCTION__ };                                             \
+        if (__builtin_expect(TraceEnabled, false)) {                        \
+            trace_record(&__trace_site,                                     \
+                         __builtin_return_address(0),                       \
+                         __builtin_frame_address(0));                       \
+        }                                                                   \
+    } while (false)
+
+#endif
@@ -2,6 +2,8 @@
 #define __UTIL_H
 #pragma once
 
+#include <string.h>
+
 bool IsGdbPresent();
 
 #ifdef __linux__
@@ -21,6 +23,7 @@ bool IsGdbPresent();
 #endif
 
 #define MIN(x, y)       ((x) > (y) ? (y) : (x))
+#define MAX(x, y)       ((x) > (y) ? (x) : (y))
 
 static inline void *ZeroMemory(void *s, size_t n)
 {
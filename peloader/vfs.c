@@ -0,0 +1,237 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "util.h"
+#include "handles.h"
+#include "vfs.h"
+
+static struct {
+    int fd;
+    const uint8_t *base;
+    size_t size;
+    const VFS_ENTRY *entries;
+    uint32_t count;
+    time_t mtime;
+} Pack = { .fd = -1 };
+
+static pthread_once_t VfsOnce = PTHREAD_ONCE_INIT;
+
+// The pack is untrusted input, so check every entry once rather than on each
+// lookup.
+static bool vfs_validate(const VFS_HEADER *header, size_t size)
+{
+    const VFS_ENTRY *entries = (const VFS_ENTRY *)(header + 1);
+    const char *base = (const char *) header;
+
+    if (size < sizeof(VFS_HEADER) || memcmp(header->magic, VFS_MAGIC, sizeof header->magic) != 0)
+        return false;
+
+    if (header->count > (size - sizeof(VFS_HEADER)) / sizeof(VFS_ENTRY))
+        return false;
+
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (entries[i].name >= size || entries[i].length >= size - entries[i].name)
+            return false;
+        if (base[entries[i].name + entries[i].length] != '\0')
+            return false;
+        if (entries[i].offset > size || entries[i].size > size - entries[i].offset)
+            return false;
+        if (i && strcmp(base + entries[i - 1].name, base + entries[i].name) >= 0)
+            return false;
+    }
+
+    return true;
+}
+
+static bool vfs_mount(const char *path)
+{
+    struct stat64 buf;
+    void *base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        l_warning("failed to open vfs pack %s, %m", path);
+        return false;
+    }
+
+    if (fstat64(fd, &buf) != 0 || buf.st_size < sizeof(VFS_HEADER) || buf.st_size > MIN(VFS_MAX_SIZE, SIZE_MAX)) {
+        l_warning("vfs pack %s is not valid", path);
+        goto error;
+    }
+
+    if ((base = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        l_warning("failed to map vfs pack %s, %m", path);
+        goto error;
+    }
+
+    if (!vfs_validate(base, buf.st_size)) {
+        l_warning("vfs pack %s is corrupt", path);
+        munmap(base, buf.st_size);
+        goto error;
+    }
+
+    Pack.fd      = fd;
+    Pack.base    = base;
+    Pack.size    = buf.st_size;
+    Pack.entries = (const VFS_ENTRY *)((const VFS_HEADER *) base + 1);
+    Pack.count   = ((const VFS_HEADER *) base)->count;
+    Pack.mtime   = buf.st_mtime;
+
+    l_debug("mounted %u files from %s", Pack.count, path);
+    return true;
+
+error:
+    close(fd);
+    return false;
+}
+
+static void vfs_init(void)
+{
+    const char *path;
+
+    if ((path = getenv("LL_VFS")))
+        vfs_mount(path);
+}
+
+// Convert a Windows or host path into the form used in the index.
+static bool vfs_normalize(const char *path, char *key)
+{
+    size_t length = 0;
+
+    while (path[0] == '.' && (path[1] == '/' || path[1] == '\\'))
+        path += 2;
+
+    for (; *path; path++) {
+        char c = *path == '\\' ? '/' : *path;
+
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+
+        if (c == '/' && length && key[length - 1] == '/')
+            continue;
+
+        if (length + 1 >= VFS_MAX_PATH)
+            return false;
+
+        key[length++] = c;
+    }
+
+    key[length] = '\0';
+    return true;
+}
+
+const VFS_ENTRY *vfs_lookup(const char *path)
+{
+    char key[VFS_MAX_PATH];
+    uint32_t low, high, middle;
+    int result;
+
+    pthread_once(&VfsOnce, vfs_init);
+
+    if (Pack.count == 0 || !vfs_normalize(path, key))
+        return NULL;
+
+    for (low = 0, high = Pack.count; low < high;) {
+        middle = low + (high - low) / 2;
+        result = strcmp(key, (const char *) Pack.base + Pack.entries[middle].name);
+
+        if (result == 0)
+            return &Pack.entries[middle];
+
+        if (result < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return NULL;
+}
+
+const void *vfs_data(const VFS_ENTRY *entry)
+{
+    return Pack.base + entry->offset;
+}
+
+bool vfs_contains(const void *address)
+{
+    return (const uint8_t *) address >= Pack.base
+        && (const uint8_t *) address < Pack.base + Pack.size;
+}
+
+// Create a private view of part of a file in the pack. If the contents are
+// page aligned the pack itself is mapped, otherwise they're copied.
+void *vfs_map(const void *data, uint64_t size, uint64_t offset, size_t length, int prot, void *address)
+{
+    uint64_t position = (const uint8_t *) data - Pack.base + offset;
+    void *view;
+
+    if (position % getpagesize() == 0 && offset <= size && length <= size - offset)
+        return mmap64(address, length, prot, MAP_PRIVATE, Pack.fd, position);
+
+    view = mmap(address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (view == MAP_FAILED)
+        return MAP_FAILED;
+
+    if (offset < size)
+        memcpy(view, (const uint8_t *) data + offset, MIN(length, size - offset));
+
+    if (mprotect(view, length, prot) != 0) {
+        munmap(view, length);
+        return MAP_FAILED;
+    }
+
+    return view;
+}
+
+// Views are shared by device and inode, so every entry needs to be distinct
+// and never match a real file.
+static void vfs_fill_stat(const VFS_ENTRY *entry, struct stat64 *buf)
+{
+    memset(buf, 0, sizeof *buf);
+
+    buf->st_dev     = (dev_t) -1;
+    buf->st_ino     = entry - Pack.entries + 1;
+    buf->st_mode    = S_IFREG | 0444;
+    buf->st_nlink   = 1;
+    buf->st_size    = entry->size;
+    buf->st_blksize = getpagesize();
+    buf->st_mtime   = Pack.mtime;
+}
+
+bool vfs_stat(const char *path, struct stat64 *buf)
+{
+    const VFS_ENTRY *entry = vfs_lookup(path);
+
+    if (entry == NULL)
+        return false;
+
+    vfs_fill_stat(entry, buf);
+    return true;
+}
+
+void *vfs_open(const char *path)
+{
+    const VFS_ENTRY *entry = vfs_lookup(path);
+    struct stat64 buf;
+
+    if (entry == NULL)
+        return NULL;
+
+    vfs_fill_stat(entry, &buf);
+
+    return file_handle_create_memory(vfs_data(entry), &buf);
+}
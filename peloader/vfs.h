@@ -0,0 +1,53 @@
+#ifndef __VFS_H
+#define __VFS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A read-only pack of files, mapped once and consulted before the host
+// filesystem. Set LL_VFS to the path of a pack created by mkvfs.
+//
+// The pack is a header, an index of entries sorted by name, the names and
+// then the file contents. Names are relative paths, in lower case and using
+// '/' as the separator, so lookups are case-insensitive.
+
+#define VFS_MAGIC       "LLVFPAK1"
+#define VFS_MAX_PATH    4096
+
+// Contents of files at least this large are page aligned in the pack, so
+// that views of them can be mapped directly.
+#define VFS_PAGE_ALIGN_THRESHOLD    65536
+#define VFS_DATA_ALIGN              16
+
+// The loader maps the whole pack into a 32-bit process, and the header and
+// name offsets are 32-bit, so mkvfs refuses to build anything larger.
+#define VFS_MAX_SIZE                UINT32_MAX
+
+typedef struct vfs_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+} VFS_HEADER;
+
+typedef struct vfs_entry {
+    uint32_t name;      // Offset of the nul terminated name.
+    uint32_t length;    // Length of the name.
+    uint64_t offset;    // Offset of the contents.
+    uint64_t size;
+} VFS_ENTRY;
+
+const VFS_ENTRY *vfs_lookup(const char *path);
+const void *vfs_data(const VFS_ENTRY *entry);
+bool vfs_contains(const void *address);
+void *vfs_map(const void *data, uint64_t size, uint64_t offset, size_t length, int prot, void *address);
+
+struct stat64;
+
+// Fill in buf for the named entry, or return false if it's not in the pack.
+bool vfs_stat(const char *path, struct stat64 *buf);
+
+// Returns a file HANDLE for the named entry, or NULL if it's not in the pack.
+void *vfs_open(const char *path);
+
+#endif
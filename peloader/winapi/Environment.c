@@ -39,7 +39,8 @@ STATIC BOOL WINAPI FreeEnvironmentStringsW(PVOID lpszEnvironmentBlock)
 
 STATIC DWORD WINAPI GetEnvironmentVariableW(PWCHAR lpName, PVOID lpBuffer, DWORD nSize)
 {
-    char *AnsiName = CreateAnsiFromWide(lpName);
+    char Buffer[ANSI_BUFFER_SIZE];
+    char *AnsiName = CreateAnsiFromWideBuffer(lpName, Buffer, sizeof Buffer);
 
     DebugLog("%p [%s], %p, %u", lpName, AnsiName, lpBuffer, nSize);
 
@@ -57,14 +58,15 @@ STATIC DWORD WINAPI GetEnvironmentVariableW(PWCHAR lpName, PVOID lpBuffer, DWORD
         SetLastError(ERROR_ENVVAR_NOT_FOUND);
     }
 
-    free(AnsiName);
+    FreeAnsi(AnsiName, Buffer);
     return CountWideChars(lpBuffer);
 }
 
 // MPENGINE is very fussy about what ExpandEnvironmentStringsW returns.
 STATIC DWORD WINAPI ExpandEnvironmentStringsW(PWCHAR lpSrc, PWCHAR lpDst, DWORD nSize)
 {
-    PCHAR AnsiString = CreateAnsiFromWide(lpSrc);
+    CHAR Buffer[ANSI_BUFFER_SIZE];
+    PCHAR AnsiString = CreateAnsiFromWideBuffer(lpSrc, Buffer, sizeof Buffer);
     DWORD Result;
     struct {
         PCHAR   Src;
@@ -94,7 +96,7 @@ STATIC DWORD WINAPI ExpandEnvironmentStringsW(PWCHAR lpSrc, PWCHAR lpDst, DWORD
         }
     }
 
-    free(AnsiString);
+    FreeAnsi(AnsiString, Buffer);
 
     if (nSize < CountWideChars(lpSrc) + 1) {
         return CountWideChars(lpSrc) + 1;
@@ -105,7 +107,7 @@ STATIC DWORD WINAPI ExpandEnvironmentStringsW(PWCHAR lpSrc, PWCHAR lpDst, DWORD
     return CountWideChars(lpSrc) + 1;
 
 finish:
-    free(AnsiString);
+    FreeAnsi(AnsiString, Buffer);
     return Result;
 }
 
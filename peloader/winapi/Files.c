@@ -9,9 +9,12 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "winnt_types.h"
-#include "codealloc.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "log.h"
@@ -20,6 +23,11 @@
 #include "winstrings.h"
 #include "Files.h"
 #include "file_mapping.h"
+#include "handles.h"
+#include "IoCompletion.h"
+#include "vfs.h"
+#include "pathconv.h"
+#include "metadata.h"
 
 union size {
     int64_t size;
@@ -27,7 +35,7 @@ union size {
         int32_t low;
         int32_t high;
     };
-} Size;
+};
 
 union offset {
     int64_t offset;
@@ -37,7 +45,7 @@ union offset {
     };
 } Offset;
 
-static MappedFileViewList* MappedFileViews;
+static MappedFileViewList MappedFileViews = MAPPED_VIEW_LIST_INITIALIZER;
 
 typedef struct _CREATEFILE2_EXTENDED_PARAMETERS {
     DWORD dwSize;
@@ -48,6 +56,43 @@ typedef struct _CREATEFILE2_EXTENDED_PARAMETERS {
     HANDLE hTemplateFile;
 } CREATEFILE2_EXTENDED_PARAMETERS, *PCREATEFILE2_EXTENDED_PARAMETERS;
 
+// Open a file and wrap the descriptor in a handle.
+static HANDLE OpenFileHandle(const char *filename, int flags)
+{
+    HANDLE FileHandle;
+    int fd;
+
+    if ((fd = open(filename, flags | O_CLOEXEC, 0600)) < 0)
+        return INVALID_HANDLE_VALUE;
+
+    if ((FileHandle = file_handle_create(fd)) == NULL) {
+        close(fd);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return FileHandle;
+}
+
+// Temporary files are unlinked as soon as they're created, so they can stay
+// in memory unless they get large.
+static HANDLE OpenTempFile(const char *filename)
+{
+    const char *name = strrchr(filename, '/');
+    HANDLE FileHandle;
+
+    if ((FileHandle = file_handle_create_temporary(name ? name + 1 : filename)))
+        return FileHandle;
+
+    FileHandle = OpenFileHandle(filename, O_RDWR | O_CREAT | O_TRUNC);
+
+    // Unlink it immediately so it's cleaned up on exit.
+    unlink(filename);
+
+    metadata_invalidate(filename);
+
+    return FileHandle;
+}
+
 NTSTATUS WINAPI NtCreateFile(HANDLE *FileHandle,
                              ACCESS_MASK DesiredAccess,
                              POBJECT_ATTRIBUTES ObjectAttributes,
@@ -60,36 +105,27 @@ NTSTATUS WINAPI NtCreateFile(HANDLE *FileHandle,
                              PVOID EaBuffer,
                              ULONG EaLength)
 {
-    LPSTR filename = CreateAnsiFromWide(ObjectAttributes->name->Buffer);
+    LPSTR filename = path_translate_wide(ObjectAttributes->name->Buffer);
 
     DebugLog("%p, %#x, %p, [%s]", FileHandle, DesiredAccess, ObjectAttributes, filename);
 
-    // Translate path seperator.
-    while (strchr(filename, '\\'))
-    *strchr(filename, '\\') = '/';
-
-    // I'm just going to tolower() everything.
-    for (char *t = filename; *t; t++)
-    *t = tolower(*t);
+    if (filename == NULL) {
+        *FileHandle = NULL;
+        return STATUS_OBJECT_NAME_INVALID;
+    }
 
     switch (CreateDisposition) {
         case FILE_SUPERSEDED:
-            *FileHandle = fopen(filename, "r");
+            if ((*FileHandle = vfs_open(filename)) == NULL)
+                *FileHandle = OpenFileHandle(filename, O_RDONLY);
             break;
         case FILE_OPEN:
-            if (access(filename, F_OK) == 0){
-                *FileHandle = fopen(filename, "r+");
-            }
-            else {
-                free(filename);
-                return STATUS_NO_SUCH_FILE;
-            }
+            if ((*FileHandle = vfs_open(filename)) == NULL)
+                *FileHandle = OpenFileHandle(filename, O_RDWR);
             break;
             // This is the disposition used by CreateTempFile().
         case FILE_CREATED:
-            *FileHandle = fopen(filename, "w");
-            // Unlink it immediately so it's cleaned up on exit.
-            unlink(filename);
+            *FileHandle = OpenTempFile(filename);
             break;
         default:
             abort();
@@ -97,21 +133,50 @@ NTSTATUS WINAPI NtCreateFile(HANDLE *FileHandle,
 
     free(filename);
 
+    if (*FileHandle == INVALID_HANDLE_VALUE) {
+        *FileHandle = NULL;
+        return STATUS_NO_SUCH_FILE;
+    }
+
     return 0;
 }
 
+// The shared part of GetFileAttributesA() and GetFileAttributesW().
+static DWORD GetPathAttributes(const char *filename)
+{
+    FILE_METADATA Metadata;
+
+    if (strstr(filename, "RebootActions") || strstr(filename, "RtSigs")) {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_FILE_ATTRIBUTES;
+    }
+
+    if (!metadata_path(filename, &Metadata)) {
+        // Temporary files are never really created, but the directory needs
+        // to look like it exists.
+        if (strncasecmp(filename, "./faketemp", strlen("./faketemp")) == 0)
+            return FILE_ATTRIBUTE_DIRECTORY;
+
+        SetLastError(errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_PATH_NOT_FOUND);
+        return INVALID_FILE_ATTRIBUTES;
+    }
+
+    return FileAttributesFromMode(Metadata.mode);
+}
+
 STATIC DWORD WINAPI GetFileAttributesW(PVOID lpFileName)
 {
-    DWORD Result = FILE_ATTRIBUTE_NORMAL;
-    char *filename = CreateAnsiFromWide(lpFileName);
+    DWORD Result;
+    char *filename = path_translate_wide(lpFileName);
     DebugLog("%p [%s]", lpFileName, filename);
 
-    if (strstr(filename, "RebootActions") || strstr(filename, "RtSigs")) {
-        Result = INVALID_FILE_ATTRIBUTES;
-        goto finish;
+    if (filename == NULL) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return INVALID_FILE_ATTRIBUTES;
     }
 
-finish:
+    Result = GetPathAttributes(filename);
+
     free(filename);
     return Result;
 }
@@ -128,9 +193,11 @@ STATIC BOOL WINAPI SetFileAttributesA(LPCSTR lpFileName,
 STATIC BOOL WINAPI SetFileAttributesW(LPWSTR lpFileName,
                                DWORD dwFileAttributes)
 {
-    LPSTR lpFileNameA = CreateAnsiFromWide(lpFileName);
+    CHAR Buffer[ANSI_BUFFER_SIZE];
+    LPSTR lpFileNameA = CreateAnsiFromWideBuffer(lpFileName, Buffer, sizeof Buffer);
     DebugLog("%p [%s], %#x", lpFileName, lpFileNameA, dwFileAttributes);
 
+    FreeAnsi(lpFileNameA, Buffer);
     SetLastError(0);
 
     return true;
@@ -138,102 +205,117 @@ STATIC BOOL WINAPI SetFileAttributesW(LPWSTR lpFileName,
 
 STATIC DWORD WINAPI GetFileAttributesExW(PWCHAR lpFileName, DWORD fInfoLevelId, LPWIN32_FILE_ATTRIBUTE_DATA lpFileInformation)
 {
-    char *filename = CreateAnsiFromWide(lpFileName);
+    char *filename = path_translate_wide(lpFileName);
+    FILE_METADATA Metadata;
+    BOOL Result = FALSE;
+
     DebugLog("%p [%s], %u, %p", lpFileName, filename, fInfoLevelId, lpFileInformation);
 
     assert(fInfoLevelId == 0);
 
-    lpFileInformation->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+    if (filename == NULL) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return FALSE;
+    }
+
+    memset(lpFileInformation, 0, sizeof *lpFileInformation);
+
+    if (metadata_path(filename, &Metadata)) {
+        lpFileInformation->dwFileAttributes = FileAttributesFromMode(Metadata.mode);
+        lpFileInformation->ftCreationTime   = FileTimeFromTimespec(Metadata.creation);
+        lpFileInformation->ftLastAccessTime = FileTimeFromTimespec(Metadata.access);
+        lpFileInformation->ftLastWriteTime  = FileTimeFromTimespec(Metadata.write);
+
+        if (!S_ISDIR(Metadata.mode)) {
+            lpFileInformation->nFileSizeHigh = Metadata.size >> 32;
+            lpFileInformation->nFileSizeLow  = Metadata.size;
+        }
+
+        Result = TRUE;
+    } else if (strncasecmp(filename, "./faketemp", strlen("./faketemp")) == 0) {
+        lpFileInformation->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
+        Result = TRUE;
+    } else {
+        SetLastError(errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_PATH_NOT_FOUND);
+    }
+
     free(filename);
-    return TRUE;
+    return Result;
 }
 
 
-HANDLE WINAPI CreateFileA(PCHAR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, PVOID lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
+// Open a translated host path for CreateFileA() and CreateFileW().
+static HANDLE OpenHostFile(const char *filename, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes)
 {
-    FILE *FileHandle;
-
-    DebugLog("%p [%s], %#x, %#x, %p, %#x, %#x, %p", lpFileName, lpFileName, dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
-
-    // Translate path seperator.
-    while (strchr(lpFileName, '\\'))
-        *strchr(lpFileName, '\\') = '/';
+    HANDLE FileHandle;
 
-    // I'm just going to tolower() everything.
-    for (char *t = lpFileName; *t; t++)
-        *t = tolower(*t);
+    if (filename == NULL) {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
 
     switch (dwCreationDisposition) {
         case OPEN_EXISTING:
-            FileHandle = fopen(lpFileName, "r");
+            // Files in the pack are preferred over the host filesystem.
+            if ((FileHandle = vfs_open(filename)) == NULL)
+                FileHandle = OpenFileHandle(filename, O_RDONLY);
             break;
         case CREATE_ALWAYS:
-            FileHandle = fopen("/dev/null", "w");
+            FileHandle = OpenFileHandle("/dev/null", O_WRONLY);
             break;
         // This is the disposition used by CreateTempFile().
         case CREATE_NEW:
-            if (strstr(lpFileName, "/faketemp/")) {
-                FileHandle = fopen(lpFileName, "w");
-                // Unlink it immediately so it's cleaned up on exit.
-                unlink(lpFileName);
+            if (strcasestr(filename, "/faketemp/")) {
+                FileHandle = OpenTempFile(filename);
             } else {
-                FileHandle = fopen("/dev/null", "w");
+                FileHandle = OpenFileHandle("/dev/null", O_WRONLY);
             }
             break;
         default:
             abort();
     }
 
-    DebugLog("%s => %p", lpFileName, FileHandle);
+    // Creating or truncating a file changes what's at the path.
+    if (dwCreationDisposition != OPEN_EXISTING)
+        metadata_invalidate(filename);
+
+    // Reads and writes with an OVERLAPPED structure will be asynchronous.
+    if (FileHandle != INVALID_HANDLE_VALUE && (dwFlagsAndAttributes & FILE_FLAG_OVERLAPPED)) {
+        FILE_OBJECT *File = file_from_handle(FileHandle);
+        File->overlapped = true;
+        handle_release(&File->header);
+    }
+
+    DebugLog("%s => %p", filename, FileHandle);
 
-    FileHandle ? SetLastError(0) : SetLastError(ERROR_FILE_NOT_FOUND);
-    return FileHandle ? FileHandle : INVALID_HANDLE_VALUE;
+    FileHandle != INVALID_HANDLE_VALUE ? SetLastError(0) : SetLastError(ERROR_FILE_NOT_FOUND);
+    return FileHandle;
 }
 
-HANDLE WINAPI CreateFileW(PWCHAR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, PVOID lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
+HANDLE WINAPI CreateFileA(PCHAR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, PVOID lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
 {
-    FILE *FileHandle;
-    char *filename = CreateAnsiFromWide(lpFileName);
+    char *filename = path_translate(lpFileName);
+    HANDLE FileHandle;
 
-    DebugLog("%p [%s], %#x, %#x, %p, %#x, %#x, %p", lpFileName, filename, dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
+    DebugLog("%p [%s], %#x, %#x, %p, %#x, %#x, %p", lpFileName, lpFileName, dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
 
-    // Translate path seperator.
-    while (strchr(filename, '\\'))
-        *strchr(filename, '\\') = '/';
+    FileHandle = OpenHostFile(filename, dwCreationDisposition, dwFlagsAndAttributes);
 
-    // I'm just going to tolower() everything.
-    for (char *t = filename; *t; t++)
-        *t = tolower(*t);
+    free(filename);
+    return FileHandle;
+}
 
-    //LogMessage("%u %s", dwCreationDisposition, filename);
+HANDLE WINAPI CreateFileW(PWCHAR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, PVOID lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
+{
+    char *filename = path_translate_wide(lpFileName);
+    HANDLE FileHandle;
 
-    switch (dwCreationDisposition) {
-        case OPEN_EXISTING:
-            FileHandle = fopen(filename, "r");
-            break;
-        case CREATE_ALWAYS:
-            FileHandle = fopen("/dev/null", "w");
-            break;
-        // This is the disposition used by CreateTempFile().
-        case CREATE_NEW:
-            if (strstr(filename, "/faketemp/")) {
-                FileHandle = fopen(filename, "w");
-                // Unlink it immediately so it's cleaned up on exit.
-                unlink(filename);
-            } else {
-                FileHandle = fopen("/dev/null", "w");
-            }
-            break;
-        default:
-            abort();
-    }
+    DebugLog("%p [%s], %#x, %#x, %p, %#x, %#x, %p", lpFileName, filename, dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
 
-    DebugLog("%s => %p", filename, FileHandle);
+    FileHandle = OpenHostFile(filename, dwCreationDisposition, dwFlagsAndAttributes);
 
     free(filename);
-
-    SetLastError(ERROR_FILE_NOT_FOUND);
-    return FileHandle ? FileHandle : INVALID_HANDLE_VALUE;
+    return FileHandle;
 }
 
 HANDLE CreateFile2(PWCHAR lpFileName,
@@ -246,138 +328,318 @@ HANDLE CreateFile2(PWCHAR lpFileName,
         pCreateExParams->dwFileAttributes | pCreateExParams->dwFileFlags, pCreateExParams->hTemplateFile);
 }
 
-/**
- * TODO: handle 64 bit 
- */
+// Move the file pointer, dwMoveMethod maps onto SEEK_SET/SEEK_CUR/SEEK_END.
+static BOOL SeekFile(FILE_OBJECT *File, int64_t Distance, DWORD dwMoveMethod, uint64_t *Position)
+{
+    const struct stat64 *buf;
+    int64_t Base;
+
+    switch (dwMoveMethod) {
+        case FILE_BEGIN:
+            Base = 0;
+            break;
+        case FILE_CURRENT:
+            Base = File->offset;
+            break;
+        case FILE_END:
+            if ((buf = file_stat(File)) == NULL) {
+                SetLastError(ERROR_INVALID_HANDLE);
+                return FALSE;
+            }
+            Base = buf->st_size;
+            break;
+        default:
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+    }
+
+    if (Base + Distance < 0) {
+        SetLastError(ERROR_NEGATIVE_SEEK);
+        return FALSE;
+    }
+
+    *Position = File->offset = Base + Distance;
+    return TRUE;
+}
+
 STATIC DWORD WINAPI SetFilePointer(HANDLE hFile, LONG liDistanceToMove,  LONG *lpDistanceToMoveHigh, DWORD dwMoveMethod)
 {
-    int result;
+    FILE_OBJECT *File = file_from_handle(hFile);
+    int64_t Distance = liDistanceToMove;
+    uint64_t Position;
 
     DebugLog("%p, %#x, %p, %u", hFile, liDistanceToMove, lpDistanceToMoveHigh, dwMoveMethod);
 
-    result = fseek(hFile, liDistanceToMove, dwMoveMethod);
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return INVALID_SET_FILE_POINTER;
+    }
 
-    DWORD pos = ftell(hFile);
+    // If the high part is specified, the low part is unsigned.
+    if (lpDistanceToMoveHigh) {
+        Distance = (int64_t)(*lpDistanceToMoveHigh) << 32 | (DWORD) liDistanceToMove;
+    }
+
+    if (!SeekFile(File, Distance, dwMoveMethod, &Position)) {
+        handle_release(&File->header);
+        return INVALID_SET_FILE_POINTER;
+    }
+
+    handle_release(&File->header);
 
     if (lpDistanceToMoveHigh) {
-        *lpDistanceToMoveHigh = 0;
+        *lpDistanceToMoveHigh = Position >> 32;
     }
 
-    return pos;
+    // The result might legitimately be INVALID_SET_FILE_POINTER.
+    SetLastError(0);
+
+    return Position;
 }
 
-STATIC BOOL WINAPI SetFilePointerEx(HANDLE hFile, uint64_t liDistanceToMove,  uint64_t *lpNewFilePointer, DWORD dwMoveMethod)
+STATIC BOOL WINAPI SetFilePointerEx(HANDLE hFile, int64_t liDistanceToMove,  uint64_t *lpNewFilePointer, DWORD dwMoveMethod)
 {
-    int result;
+    FILE_OBJECT *File = file_from_handle(hFile);
+    uint64_t Position;
 
-    DebugLog("%p, %llu, %p, %u", hFile, liDistanceToMove, lpNewFilePointer, dwMoveMethod);
+    DebugLog("%p, %lld, %p, %u", hFile, liDistanceToMove, lpNewFilePointer, dwMoveMethod);
 
-    result = fseek(hFile, liDistanceToMove, dwMoveMethod);
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    if (!SeekFile(File, liDistanceToMove, dwMoveMethod, &Position)) {
+        handle_release(&File->header);
+        return FALSE;
+    }
+
+    handle_release(&File->header);
 
-    // dwMoveMethod maps onto SEEK_SET/SEEK_CUR/SEEK_END perfectly.
     if (lpNewFilePointer) {
-        *lpNewFilePointer = ftell(hFile);
+        *lpNewFilePointer = Position;
     }
 
-    // Windows is permissive here.
     return TRUE;
-    //return result != -1; 
 }
 
 STATIC BOOL WINAPI CloseHandle(HANDLE hObject)
 {
     DebugLog("%p", hObject);
-    if (hObject != (HANDLE) 'EVNT'
-     && hObject != INVALID_HANDLE_VALUE
-     && hObject != (HANDLE) 'SEMA')
-        fclose(hObject);
+
+    // Anything not in the handle table is a magic value with nothing to
+    // release, so this is always successful.
+    handle_close(hObject);
+
     return TRUE;
 }
 
 
-STATIC BOOL WINAPI ReadFile(HANDLE hFile, PVOID lpBuffer, DWORD nNumberOfBytesToRead, PDWORD lpNumberOfBytesRead, PVOID lpOverlapped)
+// A synchronous handle can still be given an OVERLAPPED structure, the
+// request uses the offset in it and completes before returning.
+static ssize_t TransferAtOffset(FILE_OBJECT *File, PVOID Buffer, DWORD Count, POVERLAPPED Overlapped, BOOL Write)
 {
-    DebugLog("%p, %p, %#x", hFile, lpBuffer, nNumberOfBytesToRead);
-    *lpNumberOfBytesRead = fread(lpBuffer, 1, nNumberOfBytesToRead, hFile);
+    uint64_t Offset = (uint64_t) Overlapped->OffsetHigh << 32 | Overlapped->Offset;
+    ssize_t Result;
+
+    Result = Write ? file_pwrite(File, Buffer, Count, Offset)
+                   : file_pread(File, Buffer, Count, Offset);
+
+    if (Result >= 0) {
+        File->offset             = Offset + Result;
+        Overlapped->Internal     = STATUS_SUCCESS;
+        Overlapped->InternalHigh = Result;
+    }
+
+    return Result;
+}
+
+STATIC BOOL WINAPI ReadFile(HANDLE hFile, PVOID lpBuffer, DWORD nNumberOfBytesToRead, PDWORD lpNumberOfBytesRead, POVERLAPPED lpOverlapped)
+{
+    FILE_OBJECT *File = file_from_handle(hFile);
+    ssize_t Result;
+    BOOL Success;
+
+    DebugLog("%p, %p, %#x, %p", hFile, lpBuffer, nNumberOfBytesToRead, lpOverlapped);
+
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    if (lpOverlapped && File->overlapped) {
+        if (lpNumberOfBytesRead)
+            *lpNumberOfBytesRead = 0;
+
+        Success = StartOverlappedIo(File, lpBuffer, nNumberOfBytesToRead, lpOverlapped, FALSE);
+        handle_release(&File->header);
+        return Success;
+    }
+
+    Result = lpOverlapped ? TransferAtOffset(File, lpBuffer, nNumberOfBytesToRead, lpOverlapped, FALSE)
+                          : file_read(File, lpBuffer, nNumberOfBytesToRead);
+
+    handle_release(&File->header);
+
+    if (Result < 0) {
+        SetLastError(ERROR_READ_FAULT);
+        return FALSE;
+    }
+
+    if (lpNumberOfBytesRead) {
+        *lpNumberOfBytesRead = Result;
+    }
+
     return TRUE;
 }
 
-STATIC BOOL WINAPI WriteFile(HANDLE hFile, PVOID lpBuffer, DWORD nNumberOfBytesToWrite, PDWORD lpNumberOfBytesWritten, PVOID lpOverlapped)
+STATIC BOOL WINAPI WriteFile(HANDLE hFile, PVOID lpBuffer, DWORD nNumberOfBytesToWrite, PDWORD lpNumberOfBytesWritten, POVERLAPPED lpOverlapped)
 {
-    DebugLog("%p, %p, %#x", hFile, lpBuffer, nNumberOfBytesToWrite);
-    *lpNumberOfBytesWritten = fwrite(lpBuffer, 1, nNumberOfBytesToWrite, hFile);
+    FILE_OBJECT *File = file_from_handle(hFile);
+    ssize_t Result;
+    BOOL Success;
+
+    DebugLog("%p, %p, %#x, %p", hFile, lpBuffer, nNumberOfBytesToWrite, lpOverlapped);
+
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    if (lpOverlapped && File->overlapped) {
+        if (lpNumberOfBytesWritten)
+            *lpNumberOfBytesWritten = 0;
+
+        Success = StartOverlappedIo(File, lpBuffer, nNumberOfBytesToWrite, lpOverlapped, TRUE);
+        handle_release(&File->header);
+        return Success;
+    }
+
+    Result = lpOverlapped ? TransferAtOffset(File, lpBuffer, nNumberOfBytesToWrite, lpOverlapped, TRUE)
+                          : file_write(File, lpBuffer, nNumberOfBytesToWrite);
+
+    metadata_invalidate_file(File);
+    handle_release(&File->header);
+
+    if (Result < 0) {
+        SetLastError(ERROR_WRITE_FAULT);
+        return FALSE;
+    }
+
+    if (lpNumberOfBytesWritten) {
+        *lpNumberOfBytesWritten = Result;
+    }
+
     return TRUE;
 }
 
 STATIC BOOL WINAPI DeleteFileW(PWCHAR lpFileName)
 {
-    char *AnsiFilename = CreateAnsiFromWide(lpFileName);
+    char Buffer[ANSI_BUFFER_SIZE];
+    char *AnsiFilename = CreateAnsiFromWideBuffer(lpFileName, Buffer, sizeof Buffer);
+
+    char *filename = path_translate_wide(lpFileName);
 
     DebugLog("%p [%s]", lpFileName, AnsiFilename);
 
-    free(AnsiFilename);
+    FreeAnsi(AnsiFilename, Buffer);
+
+    // Nothing is really deleted, but forget the path in case that changes.
+    if (filename) {
+        metadata_invalidate(filename);
+        free(filename);
+    }
+
     return TRUE;
 }
 STATIC BOOL WINAPI DeleteFileA(LPCSTR lpFileName)
 {
+    char *filename = path_translate(lpFileName);
+
     DebugLog("%p [%s]", lpFileName, lpFileName);
 
+    if (filename) {
+        metadata_invalidate(filename);
+        free(filename);
+    }
+
     return TRUE;
 }
 
 
 STATIC BOOL WINAPI GetFileSizeEx(HANDLE hFile, uint64_t *lpFileSize)
 {
-    long curpos = ftell(hFile);
+    FILE_OBJECT *File = file_from_handle(hFile);
+    const struct stat64 *buf;
 
-    fseek(hFile, 0, SEEK_END);
+    if (File == NULL || (buf = file_stat(File)) == NULL) {
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
 
-    *lpFileSize = ftell(hFile);
+    *lpFileSize = buf->st_size;
 
-    fseek(hFile, curpos, SEEK_SET);
+    handle_release(&File->header);
 
     DebugLog("%p, %p => %llu", hFile, lpFileSize, *lpFileSize);
 
-
     return TRUE;
 }
 
 STATIC DWORD WINAPI GetFileSize(HANDLE hFile, DWORD *lpFileSizeHigh)
 {
-    long curpos = ftell(hFile);
-
-    fseek(hFile, 0, SEEK_END);
-
-    size_t FileSize = ftell(hFile);
+    FILE_OBJECT *File = file_from_handle(hFile);
+    const struct stat64 *buf;
+    union size Size;
+
+    if (File == NULL || (buf = file_stat(File)) == NULL) {
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_INVALID_HANDLE);
+        return INVALID_FILE_SIZE;
+    }
 
-    Size.size = FileSize;
+    Size.size = buf->st_size;
 
-    fseek(hFile, curpos, SEEK_SET);
+    handle_release(&File->header);
 
-    DebugLog("%p => %#x", hFile, FileSize);
+    DebugLog("%p => %#llx", hFile, Size.size);
 
     if (lpFileSizeHigh != NULL)
         *lpFileSizeHigh = Size.high;
 
-    return FileSize;
+    return Size.low;
 }
 
 DWORD WINAPI GetFileAttributesA(LPCSTR lpFileName)
 {
-    DWORD Result = FILE_ATTRIBUTE_NORMAL;
-    DebugLog("%p [%s]", lpFileName, lpFileName);
+    DWORD Result;
+    char *filename = path_translate(lpFileName);
+    DebugLog("%p [%s]", lpFileName, filename);
 
-    if (strstr(lpFileName, "RebootActions") || strstr(lpFileName, "RtSigs")) {
-        Result = INVALID_FILE_ATTRIBUTES;
+    if (filename == NULL) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return INVALID_FILE_ATTRIBUTES;
     }
 
-    if(strncmp(lpFileName, ".\\FAKETEMP\\", strlen(".\\FAKETEMP\\")) == 0) {
-        Result = FILE_ATTRIBUTE_DIRECTORY;
-    }
+    Result = GetPathAttributes(filename);
 
+    free(filename);
     return Result;
 }
 
+static void MappingDestroy(HANDLE_OBJECT *Object)
+{
+    MAPPING_OBJECT *Mapping = (MAPPING_OBJECT *) Object;
+
+    if (Mapping->file)
+        handle_release(&Mapping->file->header);
+
+    free(Mapping);
+}
+
 STATIC HANDLE WINAPI CreateFileMappingA(HANDLE hFile,
                                         PVOID lpFileMappingAttributes,
                                         DWORD flProtect,
@@ -385,6 +647,11 @@ STATIC HANDLE WINAPI CreateFileMappingA(HANDLE hFile,
                                         DWORD dwMaximumSizeLow,
                                         LPCSTR lpName)
 {
+    MAPPING_OBJECT *Mapping;
+    FILE_OBJECT *File = NULL;
+    HANDLE hMap;
+    union size Size;
+
     DebugLog("%p, %#x, %#x, %#x, [%s]", hFile, flProtect, dwMaximumSizeHigh, dwMaximumSizeLow, lpName);
     assert(!lpFileMappingAttributes);
     assert(!lpName);
@@ -392,11 +659,37 @@ STATIC HANDLE WINAPI CreateFileMappingA(HANDLE hFile,
     Size.high = dwMaximumSizeHigh;
     Size.low = dwMaximumSizeLow;
 
-    // This assumes the file is only going to be accessed using memory-mapping.
-    // This will fail in case ReadFile/WriteFile is called on a mapped file.
-    fseek(hFile, Size.size, SEEK_SET);
+    // INVALID_HANDLE_VALUE means a section backed by the pagefile.
+    if (hFile != INVALID_HANDLE_VALUE && (File = file_from_handle(hFile)) == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
 
-    return hFile;
+    if (File == NULL && Size.size == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    if ((Mapping = calloc(1, sizeof *Mapping)) == NULL) {
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    // The mapping keeps the file open, even if the file handle is closed, by
+    // taking over the reference from file_from_handle().
+    Mapping->file    = File;
+    Mapping->size    = Size.size;
+    Mapping->protect = flProtect;
+
+    if ((hMap = handle_create(&Mapping->header, HANDLE_TYPE_MAPPING, MappingDestroy)) == NULL) {
+        MappingDestroy(&Mapping->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    return hMap;
 }
 
 STATIC HANDLE WINAPI CreateFileMappingW(HANDLE hFile,
@@ -406,11 +699,12 @@ STATIC HANDLE WINAPI CreateFileMappingW(HANDLE hFile,
                                         DWORD dwMaximumSizeLow,
                                         LPCWSTR lpName)
 {
-    char *name = CreateAnsiFromWide(lpName);
+    char Buffer[ANSI_BUFFER_SIZE];
+    char *name = CreateAnsiFromWideBuffer(lpName, Buffer, sizeof Buffer);
 
     HANDLE hMap = CreateFileMappingA(hFile, lpFileMappingAttributes, flProtect, dwMaximumSizeHigh, dwMaximumSizeLow, name);
 
-    free(name);
+    FreeAnsi(name, Buffer);
     return hMap;
 }
 
@@ -440,25 +734,82 @@ STATIC PVOID WINAPI MapViewOfFileEx(HANDLE hFileMappingObject,
     if (dwDesiredAccess & 0x20000000)
         access |= MAP_HUGETLB;
 
-    MappedFileView *pFileView = calloc(1, sizeof(MappedFileView));
+    MAPPING_OBJECT *Mapping = (MAPPING_OBJECT *) handle_lookup(hFileMappingObject, HANDLE_TYPE_MAPPING);
+    const struct stat64 *buf = NULL;
+    MappedFileView *pFileView;
+    PVOID Result = NULL;
+
+    if (Mapping == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+
+    if (Mapping->file && (buf = file_stat(Mapping->file)) == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        goto finished;
+    }
+
+    int fd = Mapping->file ? Mapping->file->fd : -1;
+    uint64_t limit = Mapping->size ? Mapping->size : buf->st_size;
+
+    // The view must lie within the mapping, otherwise the size below wraps.
+    if (Offset.offset > limit || dwNumberOfBytesToMap > limit - Offset.offset) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto finished;
+    }
+
+    SIZE_T size = dwNumberOfBytesToMap ? dwNumberOfBytesToMap : limit - Offset.offset;
+
+    if (size == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto finished;
+    }
+    MappedFileView Source = {
+        .size     = size,
+        .offset   = Offset.offset,
+        .prot     = access,
+        // Private writable views must not alias, but there's no reason to map
+        // the same read only range of a file more than once.
+        .reusable = !(access & PROT_WRITE) && lpBaseAddress == NULL && buf != NULL,
+    };
+
+    if (Source.reusable) {
+        Source.dev = buf->st_dev;
+        Source.ino = buf->st_ino;
+
+        if ((pFileView = AcquireMappedView(&Source, &MappedFileViews))) {
+            DebugLog("reusing existing view %p", pFileView->base);
+            Result = pFileView->base;
+            goto finished;
+        }
+    }
+
+    pFileView = calloc(1, sizeof(MappedFileView));
     if (pFileView == NULL) {
         DebugLog("[ERROR] failed to allocate view of file: %s ", strerror(errno));
-        return NULL;
+        goto finished;
     }
 
-    int fd = fileno(hFileMappingObject);
-    SIZE_T size = dwNumberOfBytesToMap ? dwNumberOfBytesToMap : ftell(hFileMappingObject) - Offset.offset;
-    pFileView->base = mmap(lpBaseAddress, size, access, MAP_PRIVATE, fd, Offset.offset);
-    pFileView->size = size;
+    *pFileView = Source;
+    // Note that pagefile backed views are not shared with each other.
+    if (Mapping->file && Mapping->file->data) {
+        pFileView->base = vfs_map(Mapping->file->data, buf->st_size, Offset.offset, size, access, lpBaseAddress);
+    } else {
+        pFileView->base = mmap64(lpBaseAddress, size, access, fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_PRIVATE, fd, Offset.offset);
+    }
     if (pFileView->base == MAP_FAILED) {
         DebugLog("[ERROR] failed to create file view mapping: %s", strerror(errno));
         free(pFileView);
-        return NULL;
+        goto finished;
     }
 
     AddMappedView(pFileView, &MappedFileViews);
 
-    return pFileView->base;
+    Result = pFileView->base;
+
+finished:
+    handle_release(&Mapping->header);
+    return Result;
 }
 
 STATIC PVOID WINAPI MapViewOfFile(HANDLE hFileMappingObject,
@@ -486,18 +837,24 @@ STATIC BOOL WINAPI UnmapViewOfFile(PVOID lpBaseAddress)
 {
     DebugLog("%p", lpBaseAddress);
 
-    MappedFileView *pFileView = SearchMappedViews(lpBaseAddress, MappedFileViews);
-    if (!pFileView) {
+    MappedFileView *pFileView;
+
+    if (!ReleaseMappedView(lpBaseAddress, &MappedFileViews, &pFileView)) {
         DebugLog("[ERROR] no file view mapping found to unmap");
         return FALSE;
     }
 
+    // Somebody else is still using this view.
+    if (pFileView == NULL)
+        return TRUE;
+
     if (munmap(pFileView->base, pFileView->size) < 0) {
         DebugLog("[ERROR] failed to unmap file view mapping %p: %s", lpBaseAddress, strerror(errno));
+        free(pFileView);
         return FALSE;
     }
 
-    DeleteMappedView(pFileView, MappedFileViews);
+    free(pFileView);
     return TRUE;
 }
 
@@ -516,7 +873,8 @@ STATIC NTSTATUS WINAPI NtQuerySymbolicLinkObject(HANDLE LinkHandle, PUNICODE_STR
 
 STATIC NTSTATUS WINAPI NtClose(HANDLE Handle)
 {
-    DebugLog("");
+    DebugLog("%p", Handle);
+    handle_close(Handle);
     return STATUS_SUCCESS;
 }
 
@@ -548,19 +906,84 @@ STATIC NTSTATUS WINAPI NtQueryVolumeInformationFile(HANDLE FileHandle,
     return 0;
 }
 
+// Files that don't exist yet still have a full path, so this can't just be
+// realpath().
+static char *GetHostFullPath(const char *filename)
+{
+    char *fullpath, *directory, *separator;
+
+    if ((fullpath = realpath(filename, NULL)))
+        return fullpath;
+
+    if (*filename == '/')
+        return strdup(filename);
+
+    if ((directory = getcwd(NULL, 0)) == NULL)
+        return NULL;
+
+    separator = directory[strlen(directory) - 1] == '/' ? "" : "/";
+
+    if (asprintf(&fullpath, "%s%s%s", directory, separator, filename) < 0)
+        fullpath = NULL;
+
+    free(directory);
+    return fullpath;
+}
+
 STATIC DWORD WINAPI GetFullPathNameW(PWCHAR lpFileName,
                                      DWORD nBufferLength,
                                      PWCHAR lpBuffer,
                                      PWCHAR *lpFilePart)
 {
-    DebugLog("");
-    return 0;
+    char *filename = path_translate_wide(lpFileName);
+    char *fullpath = NULL;
+    DWORD Length = 0;
+
+    DebugLog("%p [%s], %u, %p, %p", lpFileName, filename, nBufferLength, lpBuffer, lpFilePart);
+
+    if (filename == NULL || (fullpath = GetHostFullPath(filename)) == NULL)
+        goto finish;
+
+    Length = strlen(fullpath);
+
+    // The return value includes the terminator if the buffer is too small.
+    if (nBufferLength <= Length) {
+        Length++;
+        goto finish;
+    }
+
+    // FIXME: this assumes the host path is ASCII.
+    for (DWORD i = 0; i <= Length; i++)
+        lpBuffer[i] = (uint8_t) fullpath[i];
+
+    if (lpFilePart)
+        *lpFilePart = &lpBuffer[strrchr(fullpath, '/') + 1 - fullpath];
+
+finish:
+    free(fullpath);
+    free(filename);
+    return Length;
 }
 
 STATIC BOOL WINAPI SetEndOfFile(HANDLE hFile)
 {
-    DebugLog("");
-    return ftruncate(fileno(hFile), ftell(hFile)) != -1;
+    FILE_OBJECT *File = file_from_handle(hFile);
+    BOOL Result;
+
+    DebugLog("%p", hFile);
+
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    file_stat_invalidate(File);
+    metadata_invalidate_file(File);
+
+    Result = ftruncate64(File->fd, File->offset) != -1;
+
+    handle_release(&File->header);
+    return Result;
 }
 
 STATIC DWORD WINAPI GetFileVersionInfoSizeExW(DWORD dwFlags, PWCHAR lptstrFilename, PDWORD lpdwHandle)
@@ -600,17 +1023,26 @@ STATIC NTSTATUS WINAPI NtQueryInformationFile(HANDLE FileHandle,
                                        ULONG Length,
                                        DWORD FileInformationClass)
 {
+    FILE_OBJECT *File = file_from_handle(FileHandle);
+    const struct stat64 *buf;
+
     DebugLog("%p, %#x, %#x", FileHandle, Length, FileInformationClass);
+
+    if (File == NULL || (buf = file_stat(File)) == NULL) {
+        if (File)
+            handle_release(&File->header);
+        return STATUS_INVALID_PARAMETER;
+    }
+
     if (FileInformationClass == FileStandardInformation) {
-        fseek((FILE*)FileHandle, 0L, SEEK_END);
-        size_t FileSize = ftell((FILE*)FileHandle);
-        rewind((FILE*)FileHandle);
-        ((PFILE_STANDARD_INFORMATION) FileInformation)->AllocationSize = FileSize;
-        ((PFILE_STANDARD_INFORMATION) FileInformation)->EndOfFile = FileSize;
+        ((PFILE_STANDARD_INFORMATION) FileInformation)->AllocationSize = buf->st_size;
+        ((PFILE_STANDARD_INFORMATION) FileInformation)->EndOfFile = buf->st_size;
         ((PFILE_STANDARD_INFORMATION) FileInformation)->NumberOfLinks = 0;
         ((PFILE_STANDARD_INFORMATION) FileInformation)->DeletePending = FALSE;
-        ((PFILE_STANDARD_INFORMATION) FileInformation)->Directory = FALSE; //TODO: Check if FileHandle is a directory
+        ((PFILE_STANDARD_INFORMATION) FileInformation)->Directory = S_ISDIR(buf->st_mode);
     }
+
+    handle_release(&File->header);
     return 0;
 }
 
@@ -627,37 +1059,82 @@ STATIC BOOL WINAPI SetFileTime(HANDLE hFile,
 STATIC BOOL WINAPI GetFileTime(HANDLE hFile,
                                PFILETIME lpCreationTime,
                                PFILETIME lpLastAccessTime,
-                               PFILETIME lpLastWriteTime) // TO FIX
+                               PFILETIME lpLastWriteTime)
 {
+    FILE_OBJECT *File = file_from_handle(hFile);
+    FILE_METADATA Metadata;
+
     DebugLog("%p, %p, %p, %p", hFile, lpCreationTime, lpLastAccessTime, lpLastWriteTime);
-    lpCreationTime->dwHighDateTime = 0;
-    lpCreationTime->dwLowDateTime = 0;
-    lpLastAccessTime->dwHighDateTime = 0;
-    lpLastAccessTime->dwLowDateTime = 0;
-    lpLastWriteTime->dwLowDateTime = 0;
-    lpLastWriteTime->dwLowDateTime = 0;
 
-    return true;
+    if (File == NULL || !metadata_file(File, &Metadata)) {
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    handle_release(&File->header);
+
+    // Any of these can be NULL.
+    if (lpCreationTime)
+        *lpCreationTime = FileTimeFromTimespec(Metadata.creation);
+    if (lpLastAccessTime)
+        *lpLastAccessTime = FileTimeFromTimespec(Metadata.access);
+    if (lpLastWriteTime)
+        *lpLastWriteTime = FileTimeFromTimespec(Metadata.write);
+
+    return TRUE;
 }
 
 STATIC DWORD WINAPI GetFileType(HANDLE hFile)
 {
+    FILE_OBJECT *File = file_from_handle(hFile);
+    const struct stat64 *buf;
+    DWORD Type = FILE_TYPE_DISK;
+
     DebugLog("%p", hFile);
 
-    return FILE_TYPE_DISK;
+    if (File == NULL)
+        return FILE_TYPE_DISK;
+
+    if ((buf = file_stat(File)) != NULL) {
+        if (S_ISCHR(buf->st_mode))
+            Type = FILE_TYPE_CHAR;
+        if (S_ISFIFO(buf->st_mode) || S_ISSOCK(buf->st_mode))
+            Type = FILE_TYPE_PIPE;
+    }
+
+    handle_release(&File->header);
+    return Type;
 }
 
 STATIC DWORD WINAPI GetFullPathNameA(LPCSTR lpFileName, DWORD nBufferLength, LPSTR lpBuffer, LPSTR *lpFilePart)
 {
-    if (nBufferLength < PATH_MAX)
-        return PATH_MAX;
+    char *filename = path_translate(lpFileName);
+    char *fullpath = NULL;
+    DWORD Length = 0;
+
+    DebugLog("%p [%s], %u, %p, %p", lpFileName, filename, nBufferLength, lpBuffer, lpFilePart);
+
+    if (filename == NULL || (fullpath = GetHostFullPath(filename)) == NULL)
+        goto finish;
+
+    Length = strlen(fullpath);
+
+    if (nBufferLength <= Length) {
+        Length++;
+        goto finish;
+    }
+
+    strcpy(lpBuffer, fullpath);
 
-    char* result = realpath(lpFileName, lpBuffer);
-    if (!result)
-        return 0;
     if (lpFilePart)
-        *lpFilePart = basename(result);
-    return strlen(result);
+        *lpFilePart = strrchr(lpBuffer, '/') + 1;
+
+finish:
+    free(fullpath);
+    free(filename);
+    return Length;
 }
 
 DECLARE_CRT_EXPORT("VerQueryValueW", VerQueryValueW);
@@ -1,6 +1,9 @@
 #ifndef LOADLIBRARY_FILES_H
 #define LOADLIBRARY_FILES_H
 
+#include <time.h>
+#include <sys/stat.h>
+
 
 extern void WINAPI SetLastError(DWORD dwErrCode);
 HANDLE WINAPI CreateFileA(PCHAR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, PVOID lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile);
@@ -32,11 +35,68 @@ enum {
 #define FILE_TYPE_REMOTE 0x8000
 #define FILE_TYPE_UNKNOWN 0x0000
 
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+#define INVALID_SET_FILE_POINTER ((DWORD)-1)
+#define INVALID_FILE_SIZE ((DWORD)-1)
+
+#define ERROR_SUCCESS 0
 #define ERROR_FILE_NOT_FOUND 2
+#define ERROR_PATH_NOT_FOUND 3
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_NO_MORE_FILES 18
+#define ERROR_WRITE_FAULT 29
+#define ERROR_READ_FAULT 30
+#define ERROR_HANDLE_EOF 38
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_NEGATIVE_SEEK 131
+#define ERROR_MORE_DATA 234
+#define WAIT_TIMEOUT 258
+#define ERROR_NO_MORE_ITEMS 259
+#define ERROR_IO_INCOMPLETE 996
+#define ERROR_IO_PENDING 997
+#define ERROR_NO_UNICODE_TRANSLATION 1113
 
 #define FILE_ATTRIBUTE_NORMAL 128
 #define FILE_ATTRIBUTE_DIRECTORY 16
+#define FILE_ATTRIBUTE_READONLY 1
+
+#define FILE_FLAG_OVERLAPPED 0x40000000
 
 #define INVALID_FILE_ATTRIBUTES -1;
 
+// FILETIME counts 100ns intervals since 1601, rather than seconds since 1970.
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
+
+static inline FILETIME FileTimeFromUnix(int64_t seconds, uint32_t nanoseconds)
+{
+    uint64_t ticks = FILETIME_UNIX_EPOCH + seconds * 10000000LL + nanoseconds / 100;
+
+    return (FILETIME) {
+        .dwLowDateTime  = ticks,
+        .dwHighDateTime = ticks >> 32,
+    };
+}
+
+static inline FILETIME FileTimeFromTimespec(struct timespec time)
+{
+    return FileTimeFromUnix(time.tv_sec, time.tv_nsec);
+}
+
+static inline DWORD FileAttributesFromMode(uint32_t mode)
+{
+    if (S_ISDIR(mode))
+        return FILE_ATTRIBUTE_DIRECTORY;
+
+    // Windows only has one kind of write permission.
+    if (!(mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
+        return FILE_ATTRIBUTE_READONLY;
+
+    return FILE_ATTRIBUTE_NORMAL;
+}
+
 #endif //LOADLIBRARY_FILES_H
@@ -8,84 +8,401 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "winnt_types.h"
-#include "codealloc.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "log.h"
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "handles.h"
+#include "pathconv.h"
 #include "Files.h"
 #include "Find.h"
 
-int find_next_file_count = 0;
+// Enough for a few thousand entries per getdents64(), so even very large
+// directories only need a handful of system calls.
+#define FIND_BUFFER_SIZE (256 * 1024)
+
+enum {
+    FindExInfoStandard,
+    FindExInfoBasic,
+};
+
+enum {
+    FindExSearchNameMatch,
+    FindExSearchLimitToDirectories,
+};
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    uint16_t d_reclen;
+    uint8_t d_type;
+    char d_name[];
+};
+
+static void FindDestroy(HANDLE_OBJECT *object)
+{
+    FIND_OBJECT *find = (FIND_OBJECT *) object;
+
+    if (find->fd >= 0)
+        close(find->fd);
+
+    free(find->buffer);
+    free(find->pattern);
+    free(find);
+}
+
+static inline char FoldCase(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// Match a name against a Windows wildcard, where * is any sequence and ? is
+// any single character. Backtracking is only ever to the most recent *, so
+// this is linear for the patterns that programs actually use.
+static bool MatchWildcard(const char *pattern, const char *name)
+{
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    // *.* is the traditional way of saying everything, even without a dot.
+    if (strcmp(pattern, "*.*") == 0)
+        return true;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star   = ++pattern;
+            resume = name;
+        } else if (*pattern == '?' || FoldCase(*pattern) == FoldCase(*name)) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star;
+            name    = ++resume;
+        } else {
+            return false;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == '\0';
+}
+
+// Only the fields that can't be derived from the directory entry need a
+// statx(), and it's only issued for names that match.
+static bool FillFindData(int dirfd, const char *name, LPWIN32_FIND_DATAA lpFindFileData)
+{
+    struct statx buf;
+    size_t length = strlen(name);
+
+    if (length >= sizeof lpFindFileData->cFileName) {
+        DebugLog("skipping long name %s", name);
+        return false;
+    }
+
+    if (statx(dirfd, name, AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_BTIME, &buf) != 0) {
+        // It was removed after we read the directory.
+        return false;
+    }
+
+    memset(lpFindFileData, 0, sizeof *lpFindFileData);
+
+    lpFindFileData->dwFileAttributes = FileAttributesFromMode(buf.stx_mode);
+    lpFindFileData->ftLastAccessTime = FileTimeFromUnix(buf.stx_atime.tv_sec, buf.stx_atime.tv_nsec);
+    lpFindFileData->ftLastWriteTime  = FileTimeFromUnix(buf.stx_mtime.tv_sec, buf.stx_mtime.tv_nsec);
+
+    // Not every filesystem records a birth time.
+    if (buf.stx_mask & STATX_BTIME) {
+        lpFindFileData->ftCreationTime = FileTimeFromUnix(buf.stx_btime.tv_sec, buf.stx_btime.tv_nsec);
+    } else {
+        lpFindFileData->ftCreationTime = lpFindFileData->ftLastWriteTime;
+    }
+
+    if (!S_ISDIR(buf.stx_mode)) {
+        lpFindFileData->nFileSizeHigh = buf.stx_size >> 32;
+        lpFindFileData->nFileSizeLow  = buf.stx_size;
+    }
+
+    memcpy(lpFindFileData->cFileName, name, length + 1);
+    return true;
+}
+
+static bool FindNextEntry(FIND_OBJECT *find, LPWIN32_FIND_DATAA lpFindFileData)
+{
+    struct linux_dirent64 *entry;
+    long result;
+
+    while (find->fd >= 0) {
+        if (find->position >= find->length) {
+            result = syscall(__NR_getdents64, find->fd, find->buffer, FIND_BUFFER_SIZE);
+
+            if (result <= 0) {
+                if (result < 0)
+                    l_warning("getdents64 failed, %m");
+
+                close(find->fd);
+                find->fd = -1;
+                break;
+            }
+
+            find->position = 0;
+            find->length   = result;
+        }
+
+        entry           = (struct linux_dirent64 *)(find->buffer + find->position);
+        find->position += entry->d_reclen;
+
+        if (find->directories && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            continue;
+
+        if (!MatchWildcard(find->pattern, entry->d_name))
+            continue;
+
+        if (!FillFindData(find->fd, entry->d_name, lpFindFileData))
+            continue;
+
+        if (find->directories && !(lpFindFileData->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            continue;
+
+        return true;
+    }
+
+    return false;
+}
+
+static HANDLE FindFirst(char *filename, LPWIN32_FIND_DATAA lpFindFileData, bool directories)
+{
+    FIND_OBJECT *find;
+    char *separator;
+    const char *directory;
+    HANDLE Handle;
+    int fd;
+
+    if (filename == NULL || *filename == '\0') {
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // The wildcard is only allowed in the final component.
+    if ((separator = strrchr(filename, '/'))) {
+        *separator = '\0';
+        directory  = separator == filename ? "/" : filename;
+        filename   = separator + 1;
+    } else {
+        directory  = ".";
+    }
+
+    if ((fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        DebugLog("failed to open directory %s, %m", directory);
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if ((find = calloc(1, sizeof(FIND_OBJECT))) == NULL) {
+        close(fd);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    find->fd          = fd;
+    find->pattern     = strdup(filename);
+    find->directories = directories;
+
+    if (find->pattern == NULL) {
+        FindDestroy(&find->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    // Without a wildcard there's at most one result, so don't read the
+    // directory at all.
+    if (strpbrk(filename, "*?") == NULL) {
+        bool found = FillFindData(fd, filename, lpFindFileData);
+
+        find->fd = -1;
+        close(fd);
+
+        if (!found || (directories && !(lpFindFileData->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))) {
+            FindDestroy(&find->header);
+            SetLastError(ERROR_FILE_NOT_FOUND);
+            return INVALID_HANDLE_VALUE;
+        }
+    } else {
+        if ((find->buffer = malloc(FIND_BUFFER_SIZE)) == NULL) {
+            FindDestroy(&find->header);
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return INVALID_HANDLE_VALUE;
+        }
+
+        if (!FindNextEntry(find, lpFindFileData)) {
+            FindDestroy(&find->header);
+            SetLastError(ERROR_FILE_NOT_FOUND);
+            return INVALID_HANDLE_VALUE;
+        }
+    }
+
+    if ((Handle = handle_create(&find->header, HANDLE_TYPE_FIND, FindDestroy)) == NULL) {
+        FindDestroy(&find->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    SetLastError(0);
+    return Handle;
+}
+
+// Host names are UTF-8.
+static void WideFindData(LPWIN32_FIND_DATAW lpWide, const WIN32_FIND_DATAA *lpNarrow)
+{
+    const char *name = lpNarrow->cFileName;
+    size_t length;
+
+    lpWide->dwFileAttributes = lpNarrow->dwFileAttributes;
+    lpWide->ftCreationTime   = lpNarrow->ftCreationTime;
+    lpWide->ftLastAccessTime = lpNarrow->ftLastAccessTime;
+    lpWide->ftLastWriteTime  = lpNarrow->ftLastWriteTime;
+    lpWide->nFileSizeHigh    = lpNarrow->nFileSizeHigh;
+    lpWide->nFileSizeLow     = lpNarrow->nFileSizeLow;
+    lpWide->dwReserved0      = 0;
+    lpWide->dwReserved1      = 0;
+
+    length = string_utf8_to_utf16(name, strlen(name), lpWide->cFileName, MAX_PATH - 1, NULL);
+    length = MIN(length, MAX_PATH - 1);
+
+    lpWide->cFileName[length]       = 0;
+    lpWide->cAlternateFileName[0]   = 0;
+}
 
 HANDLE WINAPI FindFirstFileA(LPCSTR lpFileName, LPWIN32_FIND_DATAA lpFindFileData)
 {
-    DebugLog("%p [%s], %p", lpFileName, lpFileName, lpFindFileData);
+    char *filename = path_translate(lpFileName);
+    HANDLE Handle;
+
+    DebugLog("%p [%s], %p", lpFileName, filename, lpFindFileData);
+
+    Handle = FindFirst(filename, lpFindFileData, false);
+
+    free(filename);
+    return Handle;
+}
+
+HANDLE WINAPI FindFirstFileW(PWCHAR lpFileName, LPWIN32_FIND_DATAW lpFindFileData)
+{
+    char *filename = path_translate_wide(lpFileName);
+    WIN32_FIND_DATAA FindData;
+    HANDLE Handle;
+
+    DebugLog("%p [%s], %p", lpFileName, filename, lpFindFileData);
+
+    if ((Handle = FindFirst(filename, &FindData, false)) != INVALID_HANDLE_VALUE)
+        WideFindData(lpFindFileData, &FindData);
+
+    free(filename);
+    return Handle;
+}
+
+STATIC HANDLE WINAPI FindFirstFileExA(LPCSTR lpFileName,
+                                      DWORD fInfoLevelId,
+                                      LPWIN32_FIND_DATAA lpFindFileData,
+                                      DWORD fSearchOp,
+                                      PVOID lpSearchFilter,
+                                      DWORD dwAdditionalFlags)
+{
+    char *filename = path_translate(lpFileName);
+    HANDLE Handle;
+
+    DebugLog("%p [%s], %u, %p, %u, %p, %#x", lpFileName, filename, fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
 
-    return (HANDLE) "FIND";
+    Handle = FindFirst(filename, lpFindFileData, fSearchOp == FindExSearchLimitToDirectories);
+
+    free(filename);
+    return Handle;
+}
+
+STATIC HANDLE WINAPI FindFirstFileExW(PWCHAR lpFileName,
+                                      DWORD fInfoLevelId,
+                                      LPWIN32_FIND_DATAW lpFindFileData,
+                                      DWORD fSearchOp,
+                                      PVOID lpSearchFilter,
+                                      DWORD dwAdditionalFlags)
+{
+    char *filename = path_translate_wide(lpFileName);
+    WIN32_FIND_DATAA FindData;
+    HANDLE Handle;
+
+    DebugLog("%p [%s], %u, %p, %u, %p, %#x", lpFileName, filename, fInfoLevelId, lpFindFileData, fSearchOp, lpSearchFilter, dwAdditionalFlags);
+
+    Handle = FindFirst(filename, &FindData, fSearchOp == FindExSearchLimitToDirectories);
+
+    if (Handle != INVALID_HANDLE_VALUE)
+        WideFindData(lpFindFileData, &FindData);
+
+    free(filename);
+    return Handle;
 }
 
 BOOL WINAPI FindNextFileA(HANDLE hFindFile, LPWIN32_FIND_DATAA lpFindFileData)
 {
-    union size {
-        int64_t size;
-        struct {
-            int32_t low;
-            int32_t high;
-        };
-    } Size;
+    FIND_OBJECT *find = (FIND_OBJECT *) handle_lookup(hFindFile, HANDLE_TYPE_FIND);
+
     DebugLog("%p, %p", hFindFile, lpFindFileData);
 
-    char *FakeFilePath = "C:\\fake_path\\fakename.exe";
-
-    lpFindFileData->ftCreationTime.dwLowDateTime = 0x3AACDE5A;
-    lpFindFileData->ftCreationTime.dwHighDateTime = 0x01D6E798;
-    lpFindFileData->ftLastAccessTime.dwLowDateTime = 0xDCBD7A00;
-    lpFindFileData->ftLastAccessTime.dwHighDateTime = 0x01D6E8C3;
-    lpFindFileData->ftLastWriteTime.dwLowDateTime = 0xDCBD7A00;
-    lpFindFileData->ftLastWriteTime.dwHighDateTime = 0x01D6E8C3;
-    lpFindFileData->nFileSizeHigh = Size.high;
-    lpFindFileData->nFileSizeLow = Size.low;
-    lpFindFileData->dwReserved0 = 0;
-    lpFindFileData->dwReserved1 = 0;
-    memcpy(lpFindFileData->cFileName, FakeFilePath, strlen(FakeFilePath));
-    lpFindFileData->cFileName[strlen(FakeFilePath)] = 0;
-    lpFindFileData->cAlternateFileName[0] = 0;
-
-    if (find_next_file_count)
+    if (find == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
         return FALSE;
+    }
 
-    // Avoid infinite loop
-    find_next_file_count = 1;
+    if (!FindNextEntry(find, lpFindFileData)) {
+        handle_release(&find->header);
+        SetLastError(ERROR_NO_MORE_FILES);
+        return FALSE;
+    }
 
+    handle_release(&find->header);
     return TRUE;
 }
 
-BOOL WINAPI FindClose(HANDLE hFindFile) // TO FIX
+STATIC BOOL WINAPI FindNextFileW(HANDLE hFindFile, LPWIN32_FIND_DATAW lpFindFileData)
 {
-    DebugLog("%p", hFindFile);
+    WIN32_FIND_DATAA FindData;
+
+    if (!FindNextFileA(hFindFile, &FindData))
+        return FALSE;
+
+    WideFindData(lpFindFileData, &FindData);
     return TRUE;
 }
 
-HANDLE WINAPI FindFirstFileW(PWCHAR lpFileName, PVOID lpFindFileData)
+BOOL WINAPI FindClose(HANDLE hFindFile)
 {
-    char *name = CreateAnsiFromWide(lpFileName);
-
-    DebugLog("%p [%s], %p", lpFileName, name, lpFindFileData);
+    HANDLE_OBJECT *find = handle_lookup(hFindFile, HANDLE_TYPE_FIND);
 
-    free(name);
+    DebugLog("%p", hFindFile);
 
-    SetLastError(ERROR_FILE_NOT_FOUND);
+    if (find == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
 
-    return INVALID_HANDLE_VALUE;
+    handle_release(find);
+    return handle_close(hFindFile);
 }
 
 
 DECLARE_CRT_EXPORT("FindFirstFileA", FindFirstFileA);
+DECLARE_CRT_EXPORT("FindFirstFileExA", FindFirstFileExA);
 DECLARE_CRT_EXPORT("FindNextFileA", FindNextFileA);
 DECLARE_CRT_EXPORT("FindFirstFileW", FindFirstFileW);
+DECLARE_CRT_EXPORT("FindFirstFileExW", FindFirstFileExW);
+DECLARE_CRT_EXPORT("FindNextFileW", FindNextFileW);
 DECLARE_CRT_EXPORT("FindClose", FindClose);
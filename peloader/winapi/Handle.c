@@ -14,12 +14,19 @@
 #include "winexports.h"
 #include "util.h"
 #include "strings.h"
+#include "handles.h"
+#include "metadata.h"
+#include "Files.h"
 
 
 STATIC BOOL WINAPI DuplicateHandle(HANDLE hSourceProcessHandle, HANDLE hSourceHandle, HANDLE hTargetProcessHandle, PHANDLE lpTargetHandle, DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwOptions)
 {
     DebugLog("%p, %p, %p, %p, %#x, %u, %#x", hSourceProcessHandle, hSourceHandle, hTargetProcessHandle, lpTargetHandle, dwDesiredAccess, bInheritHandle, dwOptions);
 
+    // Objects we manage can be duplicated properly.
+    if ((*lpTargetHandle = handle_duplicate(hSourceHandle)))
+        return TRUE;
+
     // lol i dunno
     *lpTargetHandle = hSourceProcessHandle;
     return TRUE;
@@ -33,34 +40,31 @@ STATIC UINT WINAPI SetHandleCount(UINT handleCount)
 
 STATIC BOOL WINAPI GetFileInformationByHandle(HANDLE hFile, LPBY_HANDLE_FILE_INFORMATION lpFileInformation)
 {
-    union size {
-        int64_t size;
-        struct {
-            int32_t low;
-            int32_t high;
-        };
-    } Size;
+    FILE_OBJECT *File = file_from_handle(hFile);
+    FILE_METADATA Metadata;
 
     DebugLog("%p, %p", hFile, lpFileInformation);
-    int64_t curpos = ftell(hFile);
-    fseek(hFile, 0, SEEK_END);
-    int64_t size = ftell(hFile);
-    fseek(hFile, curpos, SEEK_SET);
-    Size.size = size;
 
-    lpFileInformation->dwFileAttributes = FILE_ATTRIBUTE_COMPRESSED;
-    lpFileInformation->ftCreationTime.dwLowDateTime = 0x3AACDE5A;
-    lpFileInformation->ftCreationTime.dwHighDateTime = 0x01D6E798;
-    lpFileInformation->ftLastAccessTime.dwLowDateTime = 0xDCBD7A00;
-    lpFileInformation->ftLastAccessTime.dwHighDateTime = 0x01D6E8C3;
-    lpFileInformation->ftLastWriteTime.dwLowDateTime = 0xDCBD7A00;
-    lpFileInformation->ftLastWriteTime.dwHighDateTime = 0x01D6E8C3;
-    lpFileInformation->dwVolumeSerialNumber = 0x01D6E8C3;
-    lpFileInformation->nFileSizeHigh = Size.high;
-    lpFileInformation->nFileSizeLow = Size.low;
-    lpFileInformation->nNumberOfLinks = 0;
-    lpFileInformation->nFileIndexHigh = 0xA;
-    lpFileInformation->nFileIndexLow = 0xB;
+    if (File == NULL)
+        return false;
+
+    if (!metadata_file(File, &Metadata)) {
+        handle_release(&File->header);
+        return false;
+    }
+
+    handle_release(&File->header);
+
+    lpFileInformation->dwFileAttributes = FileAttributesFromMode(Metadata.mode);
+    lpFileInformation->ftCreationTime = FileTimeFromTimespec(Metadata.creation);
+    lpFileInformation->ftLastAccessTime = FileTimeFromTimespec(Metadata.access);
+    lpFileInformation->ftLastWriteTime = FileTimeFromTimespec(Metadata.write);
+    lpFileInformation->dwVolumeSerialNumber = Metadata.dev;
+    lpFileInformation->nFileSizeHigh = Metadata.size >> 32;
+    lpFileInformation->nFileSizeLow = Metadata.size;
+    lpFileInformation->nNumberOfLinks = Metadata.links;
+    lpFileInformation->nFileIndexHigh = Metadata.ino >> 32;
+    lpFileInformation->nFileIndexLow = Metadata.ino;
 
     return true;
 }
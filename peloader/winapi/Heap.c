@@ -13,6 +13,7 @@
 #include "log.h"
 #include "winexports.h"
 #include "util.h"
+#include "heapprof.h"
 
 #define HEAP_ZERO_MEMORY 8
 
@@ -33,11 +34,7 @@ STATIC PVOID WINAPI HeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
 
     // DebugLog("%p, %#x, %u", hHeap, dwFlags, dwBytes);
 
-    if (dwFlags & HEAP_ZERO_MEMORY) {
-        Buffer = calloc(dwBytes, 1);
-    } else {
-        Buffer = malloc(dwBytes);
-    }
+    Buffer = heap_alloc(__builtin_return_address(0), dwBytes, dwFlags & HEAP_ZERO_MEMORY);
 
     return Buffer;
 }
@@ -46,7 +43,7 @@ STATIC BOOL WINAPI HeapFree(HANDLE hHeap, DWORD dwFlags, PVOID lpMem)
 {
     // DebugLog("%p, %#x, %p", hHeap, dwFlags, lpMem);
 
-    free(lpMem);
+    heap_free(lpMem);
 
     return TRUE;
 }
@@ -60,24 +57,24 @@ STATIC BOOL WINAPI RtlFreeHeap(PVOID HeapHandle, ULONG Flags, PVOID BaseAddress)
 {
     //DebugLog("%p, %#x, %p", HeapHandle, Flags, BaseAddress);
 
-    free(BaseAddress);
+    heap_free(BaseAddress);
 
     return TRUE;
 }
 
 STATIC SIZE_T WINAPI HeapSize(HANDLE hHeap, DWORD dwFlags, PVOID lpMem)
 {
-    return malloc_usable_size(lpMem);
+    return heap_size(lpMem);
 }
 
 STATIC PVOID WINAPI HeapReAlloc(HANDLE hHeap, DWORD dwFlags, PVOID lpMem, SIZE_T dwBytes)
 {
-    return realloc(lpMem, dwBytes);
+    return heap_realloc(__builtin_return_address(0), lpMem, dwBytes);
 }
 
 STATIC PVOID WINAPI LocalAlloc(UINT uFlags, SIZE_T uBytes)
 {
-    PVOID Buffer = malloc(uBytes);
+    PVOID Buffer = heap_alloc(__builtin_return_address(0), uBytes, false);
     assert(uFlags == 0);
 
     DebugLog("%#x, %u => %p", uFlags, uBytes, Buffer);
@@ -88,7 +85,7 @@ STATIC PVOID WINAPI LocalAlloc(UINT uFlags, SIZE_T uBytes)
 STATIC PVOID WINAPI LocalFree(PVOID hMem)
 {
     DebugLog("%p", hMem);
-    free(hMem);
+    heap_free(hMem);
     return NULL;
 }
 
@@ -116,7 +113,7 @@ STATIC PVOID WINAPI RtlAllocateHeap(PVOID HeapHandle,
 {
     // DebugLog("%p, %#x, %#x", HeapHandle, Flags, Size);
 
-    void *heapBlock = malloc(Size);
+    void *heapBlock = heap_alloc(__builtin_return_address(0), Size, Flags & HEAP_ZERO_MEMORY);
 
     return heapBlock;
 }
@@ -132,7 +129,7 @@ STATIC NTSTATUS WINAPI RtlSetHeapInformation(PVOID Heap,
 
 STATIC PVOID WINAPI GlobalAlloc(UINT uFlags, SIZE_T uBytes)
 {
-    PVOID Buffer = malloc(uBytes);
+    PVOID Buffer = heap_alloc(__builtin_return_address(0), uBytes, false);
     assert(uFlags == 0);
 
     DebugLog("%#x, %u => %p", uFlags, uBytes, Buffer);
@@ -143,14 +140,14 @@ STATIC PVOID WINAPI GlobalAlloc(UINT uFlags, SIZE_T uBytes)
 STATIC PVOID WINAPI GlobalFree(PVOID hMem)
 {
     DebugLog("%p", hMem);
-    free(hMem);
+    heap_free(hMem);
     return NULL;
 }
 
 STATIC PVOID WINAPI RtlReAllocateHeap(HANDLE hHeap, ULONG uFlags, PVOID ptr, SIZE_T size)
 {
     DebugLog("%p, %#x, %p, %#x", hHeap, uFlags, ptr, size);
-    PVOID NewHeapBlock = realloc(ptr, size);
+    PVOID NewHeapBlock = heap_realloc(__builtin_return_address(0), ptr, size);
     return NewHeapBlock;
 }
 
@@ -7,7 +7,6 @@
 #include <stdio.h>
 
 #include "winnt_types.h"
-#include "codealloc.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "log.h"
@@ -15,6 +14,7 @@
 #include "util.h"
 #include "winstrings.h"
 #include "Memory.h"
+#include "handles.h"
 
 void WINAPI RtlAcquirePebLock(void)
 {
@@ -122,22 +122,39 @@ static NTSTATUS WINAPI NtReadFile(HANDLE FileHandle,
                                   LARGE_INTEGER *ByteOffset,
                                   PULONG Key)
 {
+    FILE_OBJECT *File = file_from_handle(FileHandle);
+    ssize_t Result;
+
     DebugLog("%p, %p, %p, %#x", FileHandle, IoStatusBlock, Buffer, Length);
-    ((PIO_STATUS_BLOCK) IoStatusBlock)->Information = fread(Buffer, 1, Length, FileHandle);
+
+    if (File == NULL)
+        return STATUS_INVALID_HANDLE;
+
+    // An explicit offset also moves the file pointer.
+    if (ByteOffset) {
+        File->offset = *ByteOffset;
+    }
+
+    Result = file_read(File, Buffer, Length);
+
+    handle_release(&File->header);
+
+    if (Result < 0)
+        return STATUS_UNEXPECTED_IO_ERROR;
+
+    ((PIO_STATUS_BLOCK) IoStatusBlock)->Information = Result;
     ((PIO_STATUS_BLOCK) IoStatusBlock)->DUMMYUNIONNAME.Status = STATUS_SUCCESS;
     return 0;
 }
 
-STATIC BOOL WINAPI NtFreeVirtualMemory(HANDLE ProcessHandle,
-                                       PVOID *BaseAddress,
-                                       SIZE_T *RegionSize,
-                                       ULONG FreeType)
+STATIC NTSTATUS WINAPI NtFreeVirtualMemory(HANDLE ProcessHandle,
+                                           PVOID *BaseAddress,
+                                           SIZE_T *RegionSize,
+                                           ULONG FreeType)
 {
-    DebugLog("%p, %p, %#x", ProcessHandle, *BaseAddress, RegionSize);
+    DebugLog("%p, %p, %#x, %#x", ProcessHandle, *BaseAddress, *RegionSize, FreeType);
 
-    if (FreeType == MEM_RELEASE)
-        code_free(*BaseAddress);
-    return TRUE;
+    return FreeVirtualMemory(BaseAddress, RegionSize, FreeType);
 }
 
 static NTSTATUS WINAPI NtProtectVirtualMemory(HANDLE ProcessHandle,
@@ -146,9 +163,16 @@ static NTSTATUS WINAPI NtProtectVirtualMemory(HANDLE ProcessHandle,
                                               ULONG NewAccessProtection,
                                               ULONG *OldAccessProtection)
 {
+    NTSTATUS Status;
+    SIZE_T RegionSize = *NumberOfBytesToProtect;
+
     DebugLog("%p, %p, %#x, %#x", ProcessHandle, *BaseAddress, *NumberOfBytesToProtect, NewAccessProtection);
-    // We always allocate RXW.
-    return 0;
+
+    Status = ProtectVirtualMemory(BaseAddress, &RegionSize, NewAccessProtection, OldAccessProtection);
+
+    *NumberOfBytesToProtect = RegionSize;
+
+    return Status;
 }
 
 static NTSTATUS WINAPI NtAllocateVirtualMemory(HANDLE ProcessHandle,
@@ -158,29 +182,15 @@ static NTSTATUS WINAPI NtAllocateVirtualMemory(HANDLE ProcessHandle,
                                                ULONG AllocationType,
                                                ULONG Protect)
 {
+    NTSTATUS Status;
+
     DebugLog("%p, %p, %#x, %#x, %#x", ProcessHandle, BaseAddress, *RegionSize, AllocationType, Protect);
 
-    if (AllocationType & ~(MEM_COMMIT | MEM_RESERVE)) {
-        DebugLog("AllocationType %#x not implemnted", AllocationType);
-        return STATUS_NOT_IMPLEMENTED;
-    }
+    Status = AllocateVirtualMemory(BaseAddress, RegionSize, AllocationType, Protect);
 
-    // This VirtualAlloc() always returns PAGE_EXECUTE_READWRITE memory.
-    if (Protect & PAGE_READWRITE){
-        *BaseAddress = code_malloc(*RegionSize);
-        DebugLog("%#x bytes of memory allocated at address %p", *RegionSize, *BaseAddress);
-    }
-    else if (Protect & PAGE_EXECUTE_READWRITE) {
-        DebugLog("JIT PAGE_EXECUTE_READWRITE Allocation Requested");
-        *BaseAddress = code_malloc(*RegionSize);
-        DebugLog("%#x bytes of memory allocated at address %p", *RegionSize, *BaseAddress);
-    }
-    else {
-        DebugLog("flProtect flags %#x not implemented", Protect);
-        return STATUS_NOT_IMPLEMENTED;
-    }
+    DebugLog("%#x bytes of memory allocated at address %p", *RegionSize, *BaseAddress);
 
-    return 0;
+    return Status;
 }
 
 STATIC NTSTATUS WINAPI LdrDisableThreadCalloutsForDll(HMODULE hDll)
@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <search.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "winnt_types.h"
+#include "pe_linker.h"
+#include "ntoskernel.h"
+#include "log.h"
+#include "winexports.h"
+#include "util.h"
+#include "handles.h"
+#include "aio.h"
+#include "Files.h"
+#include "IoCompletion.h"
+
+// Protects the port and key of every file, so that a completion never races
+// with the file being associated with a different port.
+static pthread_mutex_t PortLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled whenever any overlapped request completes, for GetOverlappedResult().
+static pthread_mutex_t OverlappedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t OverlappedDone = PTHREAD_COND_INITIALIZER;
+
+static void CompletionPortDestroy(HANDLE_OBJECT *Object)
+{
+    COMPLETION_PORT *Port = (COMPLETION_PORT *) Object;
+    COMPLETION_PACKET *Packet;
+
+    while ((Packet = Port->head)) {
+        Port->head = Packet->next;
+        free(Packet);
+    }
+
+    pthread_mutex_destroy(&Port->lock);
+    pthread_cond_destroy(&Port->ready);
+    free(Port);
+}
+
+// Returns a port holding one reference, not yet in the handle table.
+COMPLETION_PORT *AllocateCompletionPort(void)
+{
+    COMPLETION_PORT *Port = calloc(1, sizeof(COMPLETION_PORT));
+
+    if (Port == NULL)
+        return NULL;
+
+    Port->header.type     = HANDLE_TYPE_COMPLETION_PORT;
+    Port->header.refcount = 1;
+    Port->header.destroy  = CompletionPortDestroy;
+    Port->tail            = &Port->head;
+
+    pthread_mutex_init(&Port->lock, NULL);
+    pthread_cond_init(&Port->ready, NULL);
+
+    return Port;
+}
+
+// Pass a NULL Port to remove an existing association.
+BOOL AssociateCompletionPort(FILE_OBJECT *File, COMPLETION_PORT *Port, ULONG_PTR Key)
+{
+    HANDLE_OBJECT *Previous;
+
+    if (Port)
+        handle_retain(&Port->header);
+
+    pthread_mutex_lock(&PortLock);
+    Previous  = File->port;
+    File->port = Port ? &Port->header : NULL;
+    File->key  = Key;
+    pthread_mutex_unlock(&PortLock);
+
+    if (Previous)
+        handle_release(Previous);
+
+    return TRUE;
+}
+
+BOOL PostCompletionPacket(COMPLETION_PORT *Port, ULONG_PTR Key, PVOID Overlapped, NTSTATUS Status, ULONG Bytes)
+{
+    COMPLETION_PACKET *Packet = malloc(sizeof(COMPLETION_PACKET));
+
+    if (Packet == NULL)
+        return FALSE;
+
+    Packet->next       = NULL;
+    Packet->key        = Key;
+    Packet->overlapped = Overlapped;
+    Packet->status     = Status;
+    Packet->bytes      = Bytes;
+
+    pthread_mutex_lock(&Port->lock);
+    *Port->tail = Packet;
+    Port->tail  = &Packet->next;
+    pthread_cond_signal(&Port->ready);
+    pthread_mutex_unlock(&Port->lock);
+
+    return TRUE;
+}
+
+static void TimeoutToDeadline(DWORD dwMilliseconds, struct timespec *Deadline)
+{
+    clock_gettime(CLOCK_REALTIME, Deadline);
+
+    Deadline->tv_sec  += dwMilliseconds / 1000;
+    Deadline->tv_nsec += (dwMilliseconds % 1000) * 1000000;
+
+    if (Deadline->tv_nsec >= 1000000000) {
+        Deadline->tv_sec  += 1;
+        Deadline->tv_nsec -= 1000000000;
+    }
+}
+
+BOOL DequeueCompletionPacket(COMPLETION_PORT *Port, COMPLETION_PACKET *Packet, DWORD dwMilliseconds)
+{
+    COMPLETION_PACKET *Head;
+    struct timespec Deadline;
+
+    if (dwMilliseconds != INFINITE)
+        TimeoutToDeadline(dwMilliseconds, &Deadline);
+
+    pthread_mutex_lock(&Port->lock);
+
+    while (Port->head == NULL) {
+        if (dwMilliseconds == INFINITE) {
+            pthread_cond_wait(&Port->ready, &Port->lock);
+        } else if (dwMilliseconds == 0
+                || pthread_cond_timedwait(&Port->ready, &Port->lock, &Deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&Port->lock);
+            return FALSE;
+        }
+    }
+
+    Head = Port->head;
+
+    if ((Port->head = Head->next) == NULL)
+        Port->tail = &Port->head;
+
+    pthread_mutex_unlock(&Port->lock);
+
+    *Packet = *Head;
+
+    free(Head);
+    return TRUE;
+}
+
+DWORD IoStatusToWinError(NTSTATUS Status)
+{
+    switch (Status) {
+        case STATUS_SUCCESS:            return 0;
+        case STATUS_END_OF_FILE:        return ERROR_HANDLE_EOF;
+        case STATUS_INVALID_HANDLE:     return ERROR_INVALID_HANDLE;
+        case STATUS_NO_MEMORY:          return ERROR_NOT_ENOUGH_MEMORY;
+        case STATUS_INVALID_PARAMETER:  return ERROR_INVALID_PARAMETER;
+    }
+
+    return ERROR_READ_FAULT;
+}
+
+// Called on an i/o thread when a request finishes.
+static void OverlappedIoComplete(AIO_REQUEST *Request)
+{
+    POVERLAPPED Overlapped = Request->context;
+    FILE_OBJECT *File = Request->file;
+    HANDLE_OBJECT *Port;
+    ULONG_PTR Key;
+    NTSTATUS Status;
+    ULONG Bytes;
+    BOOL SkipPort;
+
+    Bytes  = MAX(Request->result, 0);
+    Status = STATUS_SUCCESS;
+
+    if (Request->result < 0) {
+        Status = STATUS_UNEXPECTED_IO_ERROR;
+    } else if (Request->result == 0 && !Request->write && Request->iov.iov_len) {
+        Status = STATUS_END_OF_FILE;
+    }
+
+    // Setting the low bit of hEvent means don't queue a packet. The caller
+    // may reuse Overlapped as soon as we set Internal, so read it first.
+    //
+    // The rest of hEvent is an event Windows would signal here, but events
+    // are still stubs (CreateEvent() returns a constant and nothing can wait
+    // on one), so callers have to use a port or GetOverlappedResult().
+    SkipPort = (uintptr_t) Overlapped->hEvent & 1;
+
+    pthread_mutex_lock(&PortLock);
+
+    if ((Port = File->port))
+        handle_retain(Port);
+
+    Key = File->key;
+
+    pthread_mutex_unlock(&PortLock);
+
+    pthread_mutex_lock(&OverlappedLock);
+    Overlapped->InternalHigh = Bytes;
+    __atomic_store_n(&Overlapped->Internal, Status, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&OverlappedDone);
+    pthread_mutex_unlock(&OverlappedLock);
+
+    if (Port) {
+        if (!SkipPort && !PostCompletionPacket((COMPLETION_PORT *) Port, Key, Overlapped, Status, Bytes))
+            l_warning("failed to queue completion packet for %p", Overlapped);
+
+        handle_release(Port);
+    }
+
+    handle_release(&File->header);
+    free(Request);
+}
+
+BOOL StartOverlappedIo(FILE_OBJECT *File, PVOID Buffer, DWORD Count, POVERLAPPED Overlapped, BOOL Write)
+{
+    AIO_REQUEST *Request = calloc(1, sizeof(AIO_REQUEST));
+
+    if (Request == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    Request->file         = File;
+    Request->iov.iov_base = Buffer;
+    Request->iov.iov_len  = Count;
+    Request->offset       = (uint64_t) Overlapped->OffsetHigh << 32 | Overlapped->Offset;
+    Request->write        = Write;
+    Request->complete     = OverlappedIoComplete;
+    Request->context      = Overlapped;
+
+    Overlapped->Internal     = STATUS_PENDING;
+    Overlapped->InternalHigh = 0;
+
+    handle_retain(&File->header);
+
+    if (!aio_submit(Request)) {
+        handle_release(&File->header);
+        free(Request);
+        SetLastError(Write ? ERROR_WRITE_FAULT : ERROR_READ_FAULT);
+        return FALSE;
+    }
+
+    SetLastError(ERROR_IO_PENDING);
+    return FALSE;
+}
+
+STATIC HANDLE WINAPI CreateIoCompletionPort(HANDLE FileHandle,
+                                            HANDLE ExistingCompletionPort,
+                                            ULONG_PTR CompletionKey,
+                                            DWORD NumberOfConcurrentThreads)
+{
+    COMPLETION_PORT *Port;
+    FILE_OBJECT *File = NULL;
+    HANDLE PortHandle;
+
+    DebugLog("%p, %p, %#lx, %u", FileHandle, ExistingCompletionPort, CompletionKey, NumberOfConcurrentThreads);
+
+    if (FileHandle != INVALID_HANDLE_VALUE && (File = file_from_handle(FileHandle)) == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+
+    if (ExistingCompletionPort) {
+        Port = (COMPLETION_PORT *) handle_lookup(ExistingCompletionPort, HANDLE_TYPE_COMPLETION_PORT);
+
+        if (Port == NULL || File == NULL) {
+            if (Port)
+                handle_release(&Port->header);
+            if (File)
+                handle_release(&File->header);
+            SetLastError(Port ? ERROR_INVALID_PARAMETER : ERROR_INVALID_HANDLE);
+            return NULL;
+        }
+
+        AssociateCompletionPort(File, Port, CompletionKey);
+
+        handle_release(&Port->header);
+        handle_release(&File->header);
+        return ExistingCompletionPort;
+    }
+
+    if ((Port = AllocateCompletionPort()) == NULL) {
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    if ((PortHandle = handle_create(&Port->header, HANDLE_TYPE_COMPLETION_PORT, CompletionPortDestroy)) == NULL) {
+        handle_release(&Port->header);
+        if (File)
+            handle_release(&File->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    if (File) {
+        AssociateCompletionPort(File, Port, CompletionKey);
+        handle_release(&File->header);
+    }
+
+    return PortHandle;
+}
+
+STATIC BOOL WINAPI GetQueuedCompletionStatus(HANDLE CompletionPort,
+                                             PDWORD lpNumberOfBytesTransferred,
+                                             ULONG_PTR *lpCompletionKey,
+                                             POVERLAPPED *lpOverlapped,
+                                             DWORD dwMilliseconds)
+{
+    COMPLETION_PORT *Port = (COMPLETION_PORT *) handle_lookup(CompletionPort, HANDLE_TYPE_COMPLETION_PORT);
+    COMPLETION_PACKET Packet;
+
+    DebugLog("%p, %p, %p, %p, %u", CompletionPort, lpNumberOfBytesTransferred, lpCompletionKey, lpOverlapped, dwMilliseconds);
+
+    *lpOverlapped = NULL;
+
+    if (Port == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    // The reference from handle_lookup() keeps the port alive while we wait,
+    // in case it's closed under us.
+    if (!DequeueCompletionPacket(Port, &Packet, dwMilliseconds)) {
+        handle_release(&Port->header);
+        SetLastError(WAIT_TIMEOUT);
+        return FALSE;
+    }
+
+    handle_release(&Port->header);
+
+    *lpNumberOfBytesTransferred = Packet.bytes;
+    *lpCompletionKey            = Packet.key;
+    *lpOverlapped               = Packet.overlapped;
+
+    if (Packet.status != STATUS_SUCCESS) {
+        SetLastError(IoStatusToWinError(Packet.status));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+STATIC BOOL WINAPI PostQueuedCompletionStatus(HANDLE CompletionPort,
+                                              DWORD dwNumberOfBytesTransferred,
+                                              ULONG_PTR dwCompletionKey,
+                                              POVERLAPPED lpOverlapped)
+{
+    COMPLETION_PORT *Port = (COMPLETION_PORT *) handle_lookup(CompletionPort, HANDLE_TYPE_COMPLETION_PORT);
+
+    DebugLog("%p, %u, %#lx, %p", CompletionPort, dwNumberOfBytesTransferred, dwCompletionKey, lpOverlapped);
+
+    if (Port == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    if (!PostCompletionPacket(Port, dwCompletionKey, lpOverlapped, STATUS_SUCCESS, dwNumberOfBytesTransferred)) {
+        handle_release(&Port->header);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return FALSE;
+    }
+
+    handle_release(&Port->header);
+    return TRUE;
+}
+
+STATIC BOOL WINAPI GetOverlappedResult(HANDLE hFile,
+                                       POVERLAPPED lpOverlapped,
+                                       PDWORD lpNumberOfBytesTransferred,
+                                       BOOL bWait)
+{
+    NTSTATUS Status;
+
+    DebugLog("%p, %p, %p, %u", hFile, lpOverlapped, lpNumberOfBytesTransferred, bWait);
+
+    if ((Status = __atomic_load_n(&lpOverlapped->Internal, __ATOMIC_ACQUIRE)) == STATUS_PENDING) {
+        if (!bWait) {
+            SetLastError(ERROR_IO_INCOMPLETE);
+            return FALSE;
+        }
+
+        pthread_mutex_lock(&OverlappedLock);
+
+        while ((Status = lpOverlapped->Internal) == STATUS_PENDING)
+            pthread_cond_wait(&OverlappedDone, &OverlappedLock);
+
+        pthread_mutex_unlock(&OverlappedLock);
+    }
+
+    *lpNumberOfBytesTransferred = lpOverlapped->InternalHigh;
+
+    if (Status != STATUS_SUCCESS) {
+        SetLastError(IoStatusToWinError(Status));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+DECLARE_CRT_EXPORT("CreateIoCompletionPort", CreateIoCompletionPort);
+DECLARE_CRT_EXPORT("GetQueuedCompletionStatus", GetQueuedCompletionStatus);
+DECLARE_CRT_EXPORT("PostQueuedCompletionStatus", PostQueuedCompletionStatus);
+DECLARE_CRT_EXPORT("GetOverlappedResult", GetOverlappedResult);
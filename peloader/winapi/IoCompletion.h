@@ -0,0 +1,30 @@
+#ifndef LOADLIBRARY_IOCOMPLETION_H
+#define LOADLIBRARY_IOCOMPLETION_H
+
+#define INFINITE 0xFFFFFFFF
+
+typedef struct _OVERLAPPED {
+    ULONG_PTR Internal;         // NTSTATUS, STATUS_PENDING until complete.
+    ULONG_PTR InternalHigh;     // Bytes transferred.
+    union {
+        struct {
+            DWORD Offset;
+            DWORD OffsetHigh;
+        };
+        PVOID Pointer;
+    };
+    HANDLE hEvent;
+} OVERLAPPED, *POVERLAPPED;
+
+// Completion ports are shared by the kernel32 exports and the thread pool,
+// which delivers its I/O callbacks from a private port.
+COMPLETION_PORT *AllocateCompletionPort(void);
+BOOL AssociateCompletionPort(FILE_OBJECT *File, COMPLETION_PORT *Port, ULONG_PTR Key);
+BOOL PostCompletionPacket(COMPLETION_PORT *Port, ULONG_PTR Key, PVOID Overlapped, NTSTATUS Status, ULONG Bytes);
+BOOL DequeueCompletionPacket(COMPLETION_PORT *Port, COMPLETION_PACKET *Packet, DWORD dwMilliseconds);
+
+// Begin an asynchronous read or write at the offset in Overlapped.
+BOOL StartOverlappedIo(FILE_OBJECT *File, PVOID Buffer, DWORD Count, POVERLAPPED Overlapped, BOOL Write);
+DWORD IoStatusToWinError(NTSTATUS Status);
+
+#endif //LOADLIBRARY_IOCOMPLETION_H
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <dlfcn.h>
+#include <alloca.h>
 
 #include "winnt_types.h"
 #include "pe_linker.h"
@@ -15,25 +16,34 @@
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "pathconv.h"
 
 static HANDLE WINAPI LoadLibraryA(PCHAR lpFileName)
 {
-    // Translate path seperator.
-    while (strchr(lpFileName, '\\'))
-        *strchr(lpFileName, '\\') = '/';
+    char *name = alloca(strlen(lpFileName) + sizeof ".so");
+    char *filename;
+    HANDLE hModule;
 
-    // I'm just going to tolower() everything.
-    for (char *t = lpFileName; *t; t++)
-        *t = tolower(*t);
+    // Change the extension to so, without modifying the caller's string.
+    // Names without an extension are left alone, as they always were.
+    strcpy(name, lpFileName);
 
-    // Change the extension to so
-    for (char *t = strrchr(lpFileName, '.'), i = 0;
-        i < 4 && t && *t; t++, i++)
-        *t = ".so"[i];
+    if (strrchr(name, '.') && !strpbrk(strrchr(name, '.'), "\\/"))
+        strcpy(strrchr(name, '.'), ".so");
+
+    if ((filename = path_translate(name)) == NULL)
+        return NULL;
+
+    // Bare names are searched for by dlopen(), and those are lowercase.
+    if (strchr(filename, '/') == NULL) {
+        for (char *t = filename; *t; t++)
+            *t = tolower(*t);
+    }
+
+    if (!(hModule = dlopen(filename, RTLD_NOW)))
+        DebugLog("FIXME: Failed to load %s", filename);
 
-    HANDLE hModule = dlopen(lpFileName, RTLD_NOW);
-    if (!hModule)
-        DebugLog("FIXME: Failed to load %s", lpFileName);
+    free(filename);
     return hModule;
 }
 
@@ -5,7 +5,9 @@
 #include <stdbool.h>
 #include <search.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "winnt_types.h"
 #include "pe_linker.h"
@@ -13,44 +15,505 @@
 #include "log.h"
 #include "winexports.h"
 #include "util.h"
-#include "codealloc.h"
+#include "Memory.h"
+#include "perfmap.h"
+#include "stats.h"
 
-#define PAGE_READONLY 0x02
-#define PAGE_READWRITE 0x04
-#define PAGE_EXECUTE_READWRITE 0x40
+#define VIRTUAL_PAGE_SIZE 0x1000
+#define ALLOCATION_GRANULARITY 0x10000
 
-#define MEM_COMMIT 0x00001000
-#define MEM_RESERVE 0x00002000
+#define ROUND_DOWN(x, n) ((x) & ~((n) - 1))
+#define ROUND_UP(x, n) (((x) + (n) - 1) & ~((n) - 1))
 
-#define MEM_RELEASE 0x8000
+extern void WINAPI SetLastError(DWORD dwErrCode);
 
-STATIC PVOID WINAPI VirtualAlloc(PVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+// Every MEM_RESERVE creates a PROT_NONE mapping described by one of these,
+// pages are then committed and decommitted individually with mprotect() and
+// madvise(). Regions are kept in a tree ordered by address, so that we can
+// find the region containing any address.
+struct region {
+    uintptr_t base;
+    size_t size;
+    DWORD protect;
+    WORD *pages;    // Win32 protection of each page, or zero if not committed.
+};
+
+static void *RegionTree;
+static pthread_mutex_t RegionLock = PTHREAD_MUTEX_INITIALIZER;
+
+static DECLARE_STATS_GAUGE(ExecutableBytes, "virtual.executable_bytes");
+
+// Overlapping regions compare equal, so a lookup with a one byte region
+// finds the reservation containing that address.
+static int compare_regions(const void *a, const void *b)
+{
+    const struct region *x = a;
+    const struct region *y = b;
+
+    if (x->base + x->size <= y->base)
+        return -1;
+    if (y->base + y->size <= x->base)
+        return 1;
+    return 0;
+}
+
+static struct region *find_region(uintptr_t address)
 {
-    if (flAllocationType & ~(MEM_COMMIT | MEM_RESERVE)) {
-        DebugLog("flAllocationType %#x not implemnted", flAllocationType);
+    struct region key = {
+        .base = address,
+        .size = 1,
+    };
+    struct region **node = tfind(&key, &RegionTree, compare_regions);
+
+    return node ? *node : NULL;
+}
+
+static int page_protection(DWORD Protect)
+{
+    // We don't emulate guard or cache attributes, just the access rights.
+    switch (Protect & ~(PAGE_GUARD | PAGE_NOCACHE | PAGE_WRITECOMBINE)) {
+        case PAGE_NOACCESS:
+            return PROT_NONE;
+        case PAGE_READONLY:
+            return PROT_READ;
+        case PAGE_READWRITE:
+        case PAGE_WRITECOPY:
+            return PROT_READ | PROT_WRITE;
+        case PAGE_EXECUTE:
+        case PAGE_EXECUTE_READ:
+            return PROT_READ | PROT_EXEC;
+        case PAGE_EXECUTE_READWRITE:
+        case PAGE_EXECUTE_WRITECOPY:
+            return PROT_READ | PROT_WRITE | PROT_EXEC;
+    }
+
+    return -1;
+}
+
+static struct region *reserve_region(uintptr_t address, size_t size, DWORD Protect)
+{
+    struct region *region;
+    uint8_t *map;
+    uint8_t *base;
+
+    if ((region = calloc(1, sizeof *region)) == NULL)
         return NULL;
+
+    if ((region->pages = calloc(size / VIRTUAL_PAGE_SIZE, sizeof(WORD))) == NULL)
+        goto error;
+
+    if (address) {
+        // The caller wants a specific address, treat it as a hint and verify
+        // we got it. We never want to clobber an existing mapping.
+        base = mmap((PVOID) address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (base == MAP_FAILED)
+            goto error;
+
+        if (base != (PVOID) address) {
+            munmap(base, size);
+            goto error;
+        }
+    } else {
+        // Windows guarantees allocations are aligned to the allocation
+        // granularity, so over allocate and trim the excess.
+        map = mmap(NULL, size + ALLOCATION_GRANULARITY, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (map == MAP_FAILED)
+            goto error;
+
+        base = (uint8_t *) ROUND_UP((uintptr_t) map, ALLOCATION_GRANULARITY);
+
+        if (base != map)
+            munmap(map, base - map);
+        if (map + ALLOCATION_GRANULARITY != base)
+            munmap(base + size, map + ALLOCATION_GRANULARITY - base);
     }
 
-    // This VirtualAlloc() always returns PAGE_EXECUTE_READWRITE memory.
-    if (flProtect == PAGE_READWRITE)
-        return code_malloc(dwSize);
-    if (flProtect == PAGE_EXECUTE_READWRITE) {
-        DebugLog("JIT PAGE_EXECUTE_READWRITE Allocation Requested");
-        return code_malloc(dwSize);
+    region->base    = (uintptr_t) base;
+    region->size    = size;
+    region->protect = Protect;
+
+    if (tsearch(region, &RegionTree, compare_regions) == NULL) {
+        munmap(base, size);
+        goto error;
     }
 
-    DebugLog("flProtect flags %#x not implemented", flProtect);
+    return region;
+
+error:
+    free(region->pages);
+    free(region);
     return NULL;
 }
 
+// Zero means not committed, which isn't a valid protection.
+static bool page_executable(WORD Protect)
+{
+    return Protect && (page_protection(Protect) & PROT_EXEC);
+}
+
+static void set_protection(struct region *region, uintptr_t start, uintptr_t end, WORD Protect)
+{
+    for (uintptr_t page = start; page < end; page += VIRTUAL_PAGE_SIZE) {
+        WORD *current = &region->pages[(page - region->base) / VIRTUAL_PAGE_SIZE];
+
+        if (page_executable(*current) && !page_executable(Protect))
+            stats_sub(&ExecutableBytes, VIRTUAL_PAGE_SIZE);
+        if (!page_executable(*current) && page_executable(Protect))
+            stats_add(&ExecutableBytes, VIRTUAL_PAGE_SIZE);
+
+        *current = Protect;
+    }
+}
+
+NTSTATUS AllocateVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG AllocationType, ULONG Protect)
+{
+    struct region *region;
+    uintptr_t start;
+    uintptr_t end;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    if (AllocationType & ~(MEM_COMMIT | MEM_RESERVE | MEM_RESET | MEM_TOP_DOWN)) {
+        DebugLog("AllocationType %#x not implemented", AllocationType);
+        return STATUS_NOT_IMPLEMENTED;
+    }
+
+    if (page_protection(Protect) < 0) {
+        DebugLog("flProtect flags %#x not implemented", Protect);
+        return STATUS_INVALID_PAGE_PROTECTION;
+    }
+
+    if (*RegionSize == 0 || *RegionSize > SIZE_MAX - ALLOCATION_GRANULARITY)
+        return STATUS_INVALID_PARAMETER;
+
+    start = ROUND_DOWN((uintptr_t) *BaseAddress, VIRTUAL_PAGE_SIZE);
+    end   = ROUND_UP((uintptr_t) *BaseAddress + *RegionSize, VIRTUAL_PAGE_SIZE);
+
+    pthread_mutex_lock(&RegionLock);
+
+    if ((AllocationType & MEM_RESERVE) || *BaseAddress == NULL) {
+        start = ROUND_DOWN(start, ALLOCATION_GRANULARITY);
+
+        if ((region = reserve_region(start, end - start, Protect)) == NULL) {
+            Status = *BaseAddress ? STATUS_CONFLICTING_ADDRESSES : STATUS_NO_MEMORY;
+            goto finished;
+        }
+
+        start = region->base;
+        end   = region->base + region->size;
+    } else if ((region = find_region(start)) == NULL) {
+        Status = STATUS_MEMORY_NOT_ALLOCATED;
+        goto finished;
+    } else if (end > region->base + region->size) {
+        Status = STATUS_CONFLICTING_ADDRESSES;
+        goto finished;
+    }
+
+    if (AllocationType & MEM_RESET) {
+        // The contents are no longer interesting, but the pages stay committed.
+        madvise((PVOID) start, end - start, MADV_DONTNEED);
+    } else if (AllocationType & MEM_COMMIT) {
+        if (mprotect((PVOID) start, end - start, page_protection(Protect)) != 0) {
+            Status = STATUS_NO_MEMORY;
+            goto finished;
+        }
+
+        set_protection(region, start, end, Protect);
+    }
+
+    *BaseAddress = (PVOID) start;
+    *RegionSize  = end - start;
+
+finished:
+    pthread_mutex_unlock(&RegionLock);
+    return Status;
+}
+
+NTSTATUS FreeVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG FreeType)
+{
+    struct region *region;
+    uintptr_t start;
+    uintptr_t end;
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    // A reservation is always released whole, the size comes from the region.
+    if (FreeType == MEM_RELEASE && *RegionSize != 0)
+        return STATUS_INVALID_PARAMETER;
+
+    pthread_mutex_lock(&RegionLock);
+
+    if ((region = find_region((uintptr_t) *BaseAddress)) == NULL) {
+        Status = STATUS_MEMORY_NOT_ALLOCATED;
+        goto finished;
+    }
+
+    start = ROUND_DOWN((uintptr_t) *BaseAddress, VIRTUAL_PAGE_SIZE);
+    end   = *RegionSize
+          ? ROUND_UP((uintptr_t) *BaseAddress + *RegionSize, VIRTUAL_PAGE_SIZE)
+          : region->base + region->size;
+
+    if (end > region->base + region->size) {
+        Status = STATUS_UNABLE_TO_FREE_VM;
+        goto finished;
+    }
+
+    switch (FreeType) {
+        case MEM_RELEASE:
+            if (start != region->base) {
+                Status = STATUS_FREE_VM_NOT_AT_BASE;
+                goto finished;
+            }
+
+            munmap((PVOID) region->base, region->size);
+            tdelete(region, &RegionTree, compare_regions);
+            set_protection(region, region->base, region->base + region->size, 0);
+
+            *BaseAddress = (PVOID) region->base;
+            *RegionSize  = region->size;
+
+            free(region->pages);
+            free(region);
+            break;
+        case MEM_DECOMMIT:
+            // Discard the pages and return them to the reserved state, they
+            // will read back as zero if they're committed again.
+            madvise((PVOID) start, end - start, MADV_DONTNEED);
+            mprotect((PVOID) start, end - start, PROT_NONE);
+            set_protection(region, start, end, 0);
+
+            *BaseAddress = (PVOID) start;
+            *RegionSize  = end - start;
+            break;
+        default:
+            DebugLog("FreeType %#x not implemented", FreeType);
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+    }
+
+finished:
+    pthread_mutex_unlock(&RegionLock);
+    return Status;
+}
+
+NTSTATUS ProtectVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG NewProtect, PULONG OldProtect)
+{
+    struct region *region;
+    uintptr_t start;
+    uintptr_t end;
+    NTSTATUS Status = STATUS_SUCCESS;
+    bool Executable = false;
+
+    if (page_protection(NewProtect) < 0)
+        return STATUS_INVALID_PAGE_PROTECTION;
+
+    start = ROUND_DOWN((uintptr_t) *BaseAddress, VIRTUAL_PAGE_SIZE);
+    end   = ROUND_UP((uintptr_t) *BaseAddress + *RegionSize, VIRTUAL_PAGE_SIZE);
+
+    pthread_mutex_lock(&RegionLock);
+
+    if ((region = find_region(start)) == NULL) {
+        // This is probably an image or stack, which we always map RWX. Some
+        // code does this to patch its own IAT, we don't need to do anything.
+        DebugLog("VirtualProtect() request for unknown region %p, %#x", *BaseAddress, NewProtect);
+        *OldProtect = PAGE_EXECUTE_READWRITE;
+        goto finished;
+    }
+
+    if (end > region->base + region->size) {
+        Status = STATUS_CONFLICTING_ADDRESSES;
+        goto finished;
+    }
+
+    for (uintptr_t page = start; page < end; page += VIRTUAL_PAGE_SIZE) {
+        if (region->pages[(page - region->base) / VIRTUAL_PAGE_SIZE] == 0) {
+            Status = STATUS_NOT_COMMITTED;
+            goto finished;
+        }
+    }
+
+    *OldProtect = region->pages[(start - region->base) / VIRTUAL_PAGE_SIZE];
+
+    if (mprotect((PVOID) start, end - start, page_protection(NewProtect)) != 0) {
+        Status = STATUS_INVALID_PAGE_PROTECTION;
+        goto finished;
+    }
+
+    set_protection(region, start, end, NewProtect);
+
+    Executable = page_protection(NewProtect) & PROT_EXEC;
+
+finished:
+    *BaseAddress = (PVOID) start;
+    *RegionSize  = end - start;
+    pthread_mutex_unlock(&RegionLock);
+
+    // Code is only worth recording once it's been written, and copying it
+    // out shouldn't hold up everyone else allocating memory.
+    if (Executable)
+        perfmap_code((PVOID) start, end - start, "VirtualProtect");
+
+    return Status;
+}
+
+// Describe memory we didn't allocate by looking it up in /proc/self/maps.
+static NTSTATUS QueryHostMemory(uintptr_t address, PMEMORY_BASIC_INFORMATION Buffer)
+{
+    unsigned long start;
+    unsigned long end;
+    unsigned long last = 0;
+    char perms[8];
+    char path[2];
+    char *line = NULL;
+    size_t len = 0;
+    FILE *maps;
+
+    if ((maps = fopen("/proc/self/maps", "r")) == NULL)
+        return STATUS_INVALID_PARAMETER;
+
+    memset(Buffer, 0, sizeof *Buffer);
+
+    Buffer->BaseAddress = (PVOID) ROUND_DOWN(address, VIRTUAL_PAGE_SIZE);
+    Buffer->State       = MEM_FREE;
+    Buffer->Protect     = PAGE_NOACCESS;
+
+    while (getline(&line, &len, maps) != -1) {
+        if (sscanf(line, "%lx-%lx %7s %*x %*s %*u %1s", &start, &end, perms, path) < 3)
+            continue;
+
+        if (address < start) {
+            // Unmapped space between two mappings.
+            Buffer->RegionSize = start - ROUND_DOWN(address, VIRTUAL_PAGE_SIZE);
+            break;
+        }
+
+        if (address < end) {
+            Buffer->AllocationBase    = (PVOID) start;
+            Buffer->RegionSize        = end - ROUND_DOWN(address, VIRTUAL_PAGE_SIZE);
+            Buffer->State             = MEM_COMMIT;
+            Buffer->Type              = strchr(line, '/') ? MEM_MAPPED : MEM_PRIVATE;
+            Buffer->Protect           = perms[2] == 'x'
+                                      ? (perms[1] == 'w' ? PAGE_EXECUTE_READWRITE : PAGE_EXECUTE_READ)
+                                      : (perms[1] == 'w' ? PAGE_READWRITE
+                                      : perms[0] == 'r' ? PAGE_READONLY : PAGE_NOACCESS);
+            Buffer->AllocationProtect = Buffer->Protect;
+            break;
+        }
+
+        last = end;
+    }
+
+    free(line);
+    fclose(maps);
+
+    // Past the last mapping.
+    if (Buffer->RegionSize == 0 && address >= last)
+        Buffer->RegionSize = -ROUND_DOWN(address, VIRTUAL_PAGE_SIZE);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS QueryVirtualMemory(PVOID BaseAddress, PMEMORY_BASIC_INFORMATION Buffer)
+{
+    struct region *region;
+    uintptr_t page = ROUND_DOWN((uintptr_t) BaseAddress, VIRTUAL_PAGE_SIZE);
+    uintptr_t end;
+    WORD Protect;
+
+    pthread_mutex_lock(&RegionLock);
+
+    if ((region = find_region(page)) == NULL) {
+        pthread_mutex_unlock(&RegionLock);
+        return QueryHostMemory((uintptr_t) BaseAddress, Buffer);
+    }
+
+    Protect = region->pages[(page - region->base) / VIRTUAL_PAGE_SIZE];
+
+    // Find the run of pages with the same attributes.
+    for (end = page; end < region->base + region->size; end += VIRTUAL_PAGE_SIZE) {
+        if (region->pages[(end - region->base) / VIRTUAL_PAGE_SIZE] != Protect)
+            break;
+    }
+
+    Buffer->BaseAddress       = (PVOID) page;
+    Buffer->AllocationBase    = (PVOID) region->base;
+    Buffer->AllocationProtect = region->protect;
+    Buffer->RegionSize        = end - page;
+    Buffer->State             = Protect ? MEM_COMMIT : MEM_RESERVE;
+    Buffer->Protect           = Protect;
+    Buffer->Type              = MEM_PRIVATE;
+
+    pthread_mutex_unlock(&RegionLock);
+    return STATUS_SUCCESS;
+}
+
+static DWORD ErrorFromStatus(NTSTATUS Status)
+{
+    switch (Status) {
+        case STATUS_NO_MEMORY:
+            return ERROR_NOT_ENOUGH_MEMORY;
+        case STATUS_INVALID_PARAMETER:
+        case STATUS_INVALID_PAGE_PROTECTION:
+        case STATUS_NOT_IMPLEMENTED:
+            return ERROR_INVALID_PARAMETER;
+    }
+
+    return ERROR_INVALID_ADDRESS;
+}
+
+STATIC PVOID WINAPI VirtualAlloc(PVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+{
+    NTSTATUS Status;
+
+    DebugLog("%p, %#x, %#x, %#x", lpAddress, dwSize, flAllocationType, flProtect);
+
+    if (flProtect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) {
+        DebugLog("JIT %#x Allocation Requested", flProtect);
+    }
+
+    if ((Status = AllocateVirtualMemory(&lpAddress, &dwSize, flAllocationType, flProtect)) != STATUS_SUCCESS) {
+        SetLastError(ErrorFromStatus(Status));
+        return NULL;
+    }
+
+    return lpAddress;
+}
+
 STATIC BOOL WINAPI VirtualProtect(PVOID lpAddress, SIZE_T dwSize, DWORD flNewProtect, PDWORD lpflOldProtect)
 {
-    if (flNewProtect != PAGE_READONLY) {
-        DebugLog("unimplemented VirtualProtect() request, %#x", flNewProtect);
+    NTSTATUS Status;
+    ULONG OldProtect;
+
+    DebugLog("%p, %#x, %#x", lpAddress, dwSize, flNewProtect);
+
+    if ((Status = ProtectVirtualMemory(&lpAddress, &dwSize, flNewProtect, &OldProtect)) != STATUS_SUCCESS) {
+        SetLastError(ErrorFromStatus(Status));
+        return FALSE;
     }
+
+    if (lpflOldProtect)
+        *lpflOldProtect = OldProtect;
+
     return TRUE;
 }
 
+STATIC SIZE_T WINAPI VirtualQuery(PVOID lpAddress, PMEMORY_BASIC_INFORMATION lpBuffer, SIZE_T dwLength)
+{
+    DebugLog("%p, %p, %u", lpAddress, lpBuffer, dwLength);
+
+    if (dwLength < sizeof(MEMORY_BASIC_INFORMATION)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    if (QueryVirtualMemory(lpAddress, lpBuffer) != STATUS_SUCCESS) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    return sizeof(MEMORY_BASIC_INFORMATION);
+}
+
 STATIC BOOL WINAPI VirtualUnlock(PVOID lpAddress, SIZE_T dwSize)
 {
     return TRUE;
@@ -58,12 +521,20 @@ STATIC BOOL WINAPI VirtualUnlock(PVOID lpAddress, SIZE_T dwSize)
 
 STATIC BOOL WINAPI VirtualFree(PVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType)
 {
-    if (dwFreeType == MEM_RELEASE)
-        code_free(lpAddress);
+    NTSTATUS Status;
+
+    DebugLog("%p, %#x, %#x", lpAddress, dwSize, dwFreeType);
+
+    if ((Status = FreeVirtualMemory(&lpAddress, &dwSize, dwFreeType)) != STATUS_SUCCESS) {
+        SetLastError(ErrorFromStatus(Status));
+        return FALSE;
+    }
+
     return TRUE;
 }
 
 DECLARE_CRT_EXPORT("VirtualAlloc", VirtualAlloc);
 DECLARE_CRT_EXPORT("VirtualProtect", VirtualProtect);
+DECLARE_CRT_EXPORT("VirtualQuery", VirtualQuery);
 DECLARE_CRT_EXPORT("VirtualUnlock", VirtualUnlock);
 DECLARE_CRT_EXPORT("VirtualFree", VirtualFree);
@@ -1,13 +1,48 @@
 #ifndef LOADLIBRARY_MEMORY_H
 #define LOADLIBRARY_MEMORY_H
 
-#endif //LOADLIBRARY_MEMORY_H
-
+#define PAGE_NOACCESS 0x01
 #define PAGE_READONLY 0x02
 #define PAGE_READWRITE 0x04
+#define PAGE_WRITECOPY 0x08
+#define PAGE_EXECUTE 0x10
+#define PAGE_EXECUTE_READ 0x20
 #define PAGE_EXECUTE_READWRITE 0x40
+#define PAGE_EXECUTE_WRITECOPY 0x80
+#define PAGE_GUARD 0x100
+#define PAGE_NOCACHE 0x200
+#define PAGE_WRITECOMBINE 0x400
 
 #define MEM_COMMIT 0x00001000
 #define MEM_RESERVE 0x00002000
+#define MEM_DECOMMIT 0x00004000
+#define MEM_RELEASE 0x00008000
+#define MEM_FREE 0x00010000
+#define MEM_PRIVATE 0x00020000
+#define MEM_MAPPED 0x00040000
+#define MEM_RESET 0x00080000
+#define MEM_TOP_DOWN 0x00100000
+#define MEM_IMAGE 0x01000000
+
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_INVALID_ADDRESS 487
 
-#define MEM_RELEASE 0x8000
+typedef struct _MEMORY_BASIC_INFORMATION {
+    PVOID BaseAddress;
+    PVOID AllocationBase;
+    DWORD AllocationProtect;
+    SIZE_T RegionSize;
+    DWORD State;
+    DWORD Protect;
+    DWORD Type;
+} MEMORY_BASIC_INFORMATION, *PMEMORY_BASIC_INFORMATION;
+
+// These have the same semantics as the equivalent Nt*VirtualMemory routines,
+// and are shared by the kernel32 and ntdll exports.
+NTSTATUS AllocateVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG AllocationType, ULONG Protect);
+NTSTATUS FreeVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG FreeType);
+NTSTATUS ProtectVirtualMemory(PVOID *BaseAddress, SIZE_T *RegionSize, ULONG NewProtect, PULONG OldProtect);
+NTSTATUS QueryVirtualMemory(PVOID BaseAddress, PMEMORY_BASIC_INFORMATION Buffer);
+
+#endif //LOADLIBRARY_MEMORY_H
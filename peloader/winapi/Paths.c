@@ -48,9 +48,10 @@ STATIC DWORD WINAPI GetLogicalDrives(void)
 
 STATIC UINT WINAPI GetDriveTypeW(PWCHAR lpRootPathName)
 {
-    char *path = CreateAnsiFromWide(lpRootPathName);
+    char Buffer[ANSI_BUFFER_SIZE];
+    char *path = CreateAnsiFromWideBuffer(lpRootPathName, Buffer, sizeof Buffer);
     DebugLog("%p [%s]", lpRootPathName, path);
-    free(path);
+    FreeAnsi(path, Buffer);
     return DRIVE_FIXED;
 }
 
@@ -87,10 +88,13 @@ STATIC DWORD WINAPI RtlGetFullPathName_U(LPCWSTR lpFileName,
                                          LPWSTR lpBuffer,
                                          LPWSTR *lpFilePart)
 {
-    LPSTR lpFileNameA = CreateAnsiFromWide((PVOID)lpFileName);
+    CHAR Buffer[ANSI_BUFFER_SIZE];
+    LPSTR lpFileNameA = CreateAnsiFromWideBuffer(lpFileName, Buffer, sizeof Buffer);
 
     DebugLog("%p [%s], %d, %p, %p", lpFileName, lpFileNameA, nBufferLength, lpBuffer, lpFilePart);
 
+    FreeAnsi(lpFileNameA, Buffer);
+
     if (nBufferLength > CountWideChars(lpFileName)) {
         memcpy(lpBuffer, lpFileName, CountWideChars(lpFileName) * sizeof(WCHAR));
     }
@@ -14,7 +14,11 @@
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "registry.h"
+#include "Files.h"
 
+#define REG_CREATED_NEW_KEY     1
+#define REG_OPENED_EXISTING_KEY 2
 
 typedef struct _KEY_VALUE_BASIC_INFORMATION {
   ULONG TitleIndex;
@@ -23,6 +27,15 @@ typedef struct _KEY_VALUE_BASIC_INFORMATION {
   WCHAR Name[1];
 } KEY_VALUE_BASIC_INFORMATION, *PKEY_VALUE_BASIC_INFORMATION;
 
+typedef struct _KEY_VALUE_FULL_INFORMATION {
+  ULONG TitleIndex;
+  ULONG Type;
+  ULONG DataOffset;
+  ULONG DataLength;
+  ULONG NameLength;
+  WCHAR Name[1];
+} KEY_VALUE_FULL_INFORMATION, *PKEY_VALUE_FULL_INFORMATION;
+
 typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
   ULONG TitleIndex;
   ULONG Type;
@@ -30,31 +43,146 @@ typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
   UCHAR Data[1];
 } KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
 
-STATIC LONG WINAPI RegOpenKeyExW(HANDLE hKey, PVOID lpSubKey, DWORD ulOptions, DWORD samDesired, PHANDLE phkResult)
+// Copy out a name, lpcchName is the buffer size in characters on input and
+// the length without the terminator on output.
+static LONG CopyName(const uint16_t *Name, DWORD Length, PWCHAR lpName, PDWORD lpcchName)
+{
+    if (lpName == NULL || lpcchName == NULL || *lpcchName <= Length) {
+        if (lpcchName)
+            *lpcchName = Length + 1;
+        return ERROR_MORE_DATA;
+    }
+
+    memcpy(lpName, Name, (Length + 1) * sizeof(uint16_t));
+
+    *lpcchName = Length;
+    return ERROR_SUCCESS;
+}
+
+// Copy out value data, following the rules shared by the query and enumerate
+// functions.
+static LONG CopyData(const REG_VALUE *Value, PDWORD lpType, PBYTE lpData, PDWORD lpcbData)
 {
-    LONG Result = -1;
-    char *ansikey = CreateAnsiFromWide(lpSubKey);
-
-    DebugLog("%p, %p [%s], %#x, %#x, %p", hKey, lpSubKey, ansikey, ulOptions, samDesired, phkResult);
-
-    if (strstr(ansikey, "Explorer\\Shell Folders")) {
-        *phkResult = (HANDLE) 'REG0';
-        Result = 0;
-    } else if (strstr(ansikey, "Explorer\\User Shell Folders")) {
-        *phkResult = (HANDLE) 'REG1';
-        Result = 0;
-    } else if (strstr(ansikey, "ProfileList")) {
-        *phkResult = (HANDLE) 'REG2';
-        Result = 0;
+    LONG Result = ERROR_SUCCESS;
+
+    if (lpType)
+        *lpType = Value->type;
+
+    if (lpData) {
+        if (lpcbData == NULL)
+            return ERROR_INVALID_PARAMETER;
+
+        if (*lpcbData < Value->size) {
+            Result = ERROR_MORE_DATA;
+        } else {
+            memcpy(lpData, registry_value_data(Value), Value->size);
+        }
     }
-    free(ansikey);
+
+    if (lpcbData)
+        *lpcbData = Value->size;
+
     return Result;
 }
 
+// Fill in one of the KEY_VALUE_*_INFORMATION structures.
+static NTSTATUS FillValueInformation(const REG_VALUE *Value,
+                                     DWORD KeyValueInformationClass,
+                                     PVOID KeyValueInformation,
+                                     ULONG Length,
+                                     PULONG ResultLength)
+{
+    PKEY_VALUE_BASIC_INFORMATION Basic = KeyValueInformation;
+    PKEY_VALUE_FULL_INFORMATION Full = KeyValueInformation;
+    PKEY_VALUE_PARTIAL_INFORMATION Partial = KeyValueInformation;
+    ULONG NameLength = Value->length * sizeof(uint16_t);
+    ULONG Fixed, Required;
+
+    switch (KeyValueInformationClass) {
+        case KeyValueBasicInformation:
+            Fixed    = offsetof(KEY_VALUE_BASIC_INFORMATION, Name);
+            Required = Fixed + NameLength;
+            break;
+        case KeyValueFullInformation:
+            Fixed    = offsetof(KEY_VALUE_FULL_INFORMATION, Name);
+            Required = ((Fixed + NameLength + 3) & ~3) + Value->size;
+            break;
+        case KeyValuePartialInformation:
+            Fixed    = offsetof(KEY_VALUE_PARTIAL_INFORMATION, Data);
+            Required = Fixed + Value->size;
+            break;
+        default:
+            DebugLog("NOT SUPPORTED");
+            return STATUS_INVALID_PARAMETER;
+    }
+
+    *ResultLength = Required;
+
+    if (Length < Fixed)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    // The fixed part is returned even if there isn't room for the rest.
+    switch (KeyValueInformationClass) {
+        case KeyValueBasicInformation:
+            Basic->TitleIndex = 0;
+            Basic->Type       = Value->type;
+            Basic->NameLength = NameLength;
+
+            if (Length < Required)
+                return STATUS_BUFFER_OVERFLOW;
+
+            memcpy(Basic->Name, registry_value_name(Value), NameLength);
+            break;
+        case KeyValueFullInformation:
+            Full->TitleIndex = 0;
+            Full->Type       = Value->type;
+            Full->DataOffset = Required - Value->size;
+            Full->DataLength = Value->size;
+            Full->NameLength = NameLength;
+
+            if (Length < Required)
+                return STATUS_BUFFER_OVERFLOW;
+
+            memcpy(Full->Name, registry_value_name(Value), NameLength);
+            memcpy((PBYTE) Full + Full->DataOffset, registry_value_data(Value), Value->size);
+            break;
+        case KeyValuePartialInformation:
+            Partial->TitleIndex = 0;
+            Partial->Type       = Value->type;
+            Partial->DataLength = Value->size;
+
+            if (Length < Required)
+                return STATUS_BUFFER_OVERFLOW;
+
+            memcpy(Partial->Data, registry_value_data(Value), Value->size);
+            break;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+STATIC LONG WINAPI RegOpenKeyExW(HANDLE hKey, PVOID lpSubKey, DWORD ulOptions, DWORD samDesired, PHANDLE phkResult)
+{
+    const REG_KEY *Key = registry_from_handle(hKey);
+
+    DebugLog("%p, %p, %#x, %#x, %p", hKey, lpSubKey, ulOptions, samDesired, phkResult);
+
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    if (lpSubKey && (Key = registry_open(Key, lpSubKey, CountWideChars(lpSubKey))) == NULL)
+        return ERROR_FILE_NOT_FOUND;
+
+    *phkResult = registry_handle(Key);
+    return ERROR_SUCCESS;
+}
+
 STATIC LONG WINAPI RegCloseKey(HANDLE hKey)
 {
-    DebugLog("%p");
-    return 0;
+    DebugLog("%p", hKey);
+
+    // The hive is never freed, so there's nothing to release.
+    return registry_from_handle(hKey) ? ERROR_SUCCESS : ERROR_INVALID_HANDLE;
 }
 
 STATIC LONG WINAPI RegQueryInfoKeyW(
@@ -69,117 +197,177 @@ STATIC LONG WINAPI RegQueryInfoKeyW(
   PDWORD   lpcMaxValueNameLen,
   PDWORD   lpcMaxValueLen,
   PDWORD   lpcbSecurityDescriptor,
-  PVOID    lpftLastWriteTime)
+  PFILETIME lpftLastWriteTime)
 {
-    DebugLog("");
+    const REG_KEY *Key = registry_from_handle(hKey);
 
-    if (lpClass || lpcClass || lpReserved || lpcSubKeys || lpcMaxSubKeyLen || lpcMaxClassLen || lpcMaxValueLen || lpcbSecurityDescriptor || lpftLastWriteTime) {
-        DebugLog("NOT SUPPORTED");
-        return -1;
-    }
+    DebugLog("%p", hKey);
 
-    switch ((DWORD) hKey) {
-        case 'REG0':
-        case 'REG1':
-        case 'REG2':
-            *lpcValues = 1;
-            *lpcMaxValueNameLen = 1024;
-            break;
-        default:
-            DebugLog("NOT SUPPROTED KEY");
-            return -1;
-    }
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    // Keys don't have classes.
+    if (lpClass && lpcClass && *lpcClass)
+        lpClass[0] = 0;
+    if (lpcClass)
+        *lpcClass = 0;
+    if (lpcSubKeys)
+        *lpcSubKeys = Key->subkey_count;
+    if (lpcMaxSubKeyLen)
+        *lpcMaxSubKeyLen = Key->max_subkey_length;
+    if (lpcMaxClassLen)
+        *lpcMaxClassLen = 0;
+    if (lpcValues)
+        *lpcValues = Key->value_count;
+    if (lpcMaxValueNameLen)
+        *lpcMaxValueNameLen = Key->max_value_name_length;
+    if (lpcMaxValueLen)
+        *lpcMaxValueLen = Key->max_value_size;
+    if (lpcbSecurityDescriptor)
+        *lpcbSecurityDescriptor = 0;
+    if (lpftLastWriteTime)
+        memset(lpftLastWriteTime, 0, sizeof(FILETIME));
+
+    return ERROR_SUCCESS;
+}
+
+STATIC LONG WINAPI RegEnumKeyExW(HANDLE hKey,
+                                 DWORD dwIndex,
+                                 PWCHAR lpName,
+                                 PDWORD lpcchName,
+                                 PDWORD lpReserved,
+                                 PWCHAR lpClass,
+                                 PDWORD lpcchClass,
+                                 PFILETIME lpftLastWriteTime)
+{
+    const REG_KEY *Key = registry_from_handle(hKey);
+    const REG_KEY *Subkey;
+
+    DebugLog("%p, %u, %p, %p", hKey, dwIndex, lpName, lpcchName);
+
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    if ((Subkey = registry_subkey(Key, dwIndex)) == NULL)
+        return ERROR_NO_MORE_ITEMS;
+
+    if (lpClass && lpcchClass && *lpcchClass)
+        lpClass[0] = 0;
+    if (lpcchClass)
+        *lpcchClass = 0;
+    if (lpftLastWriteTime)
+        memset(lpftLastWriteTime, 0, sizeof(FILETIME));
+
+    return CopyName(registry_key_name(Subkey), Subkey->length, lpName, lpcchName);
+}
+
+STATIC LONG WINAPI RegEnumValueW(HANDLE hKey,
+                                 DWORD dwIndex,
+                                 PWCHAR lpValueName,
+                                 PDWORD lpcchValueName,
+                                 PDWORD lpReserved,
+                                 PDWORD lpType,
+                                 PBYTE lpData,
+                                 PDWORD lpcbData)
+{
+    const REG_KEY *Key = registry_from_handle(hKey);
+    const REG_VALUE *Value;
+    LONG Result;
+
+    DebugLog("%p, %u, %p, %p, %p, %p, %p", hKey, dwIndex, lpValueName, lpcchValueName, lpType, lpData, lpcbData);
+
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    if ((Value = registry_value_index(Key, dwIndex)) == NULL)
+        return ERROR_NO_MORE_ITEMS;
+
+    if ((Result = CopyName(registry_value_name(Value), Value->length, lpValueName, lpcchValueName)) != ERROR_SUCCESS)
+        return Result;
 
-    return 0;
+    return CopyData(Value, lpType, lpData, lpcbData);
+}
+
+STATIC LONG WINAPI RegQueryValueExW(HANDLE hKey,
+                                    PWCHAR lpValueName,
+                                    PDWORD lpReserved,
+                                    PDWORD lpType,
+                                    PBYTE lpData,
+                                    PDWORD lpcbData)
+{
+    const REG_KEY *Key = registry_from_handle(hKey);
+    const REG_VALUE *Value;
+
+    DebugLog("%p, %p, %p, %p, %p", hKey, lpValueName, lpType, lpData, lpcbData);
+
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    // A NULL name is the default value.
+    if ((Value = registry_value(Key, lpValueName, CountWideChars(lpValueName))) == NULL)
+        return ERROR_FILE_NOT_FOUND;
+
+    return CopyData(Value, lpType, lpData, lpcbData);
 }
 
 STATIC NTSTATUS WINAPI NtEnumerateValueKey(
   HANDLE                      KeyHandle,
   ULONG                       Index,
   DWORD                       KeyValueInformationClass,
-  PKEY_VALUE_BASIC_INFORMATION KeyValueInformation,
+  PVOID                       KeyValueInformation,
   ULONG                       Length,
   PULONG                      ResultLength
 ) {
+    const REG_KEY *Key = registry_from_handle(KeyHandle);
+    const REG_VALUE *Value;
+
     DebugLog("%p, %u, %u, %p, %u, %p", KeyHandle, Index, KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
 
-    if (KeyValueInformationClass != 0) {
-        DebugLog("NOT SUPPORTED");
-        return -1;
-    }
+    if (Key == NULL)
+        return STATUS_INVALID_HANDLE;
 
-    switch ((DWORD) KeyHandle) {
-        case 'REG1':
-            KeyValueInformation->Type       = REG_SZ;
-            KeyValueInformation->NameLength = sizeof(L"Common AppDatz") - 2;
-            memcpy(&KeyValueInformation->Name[0], L"Common AppData", KeyValueInformation->NameLength);
-            *ResultLength = sizeof(KEY_VALUE_BASIC_INFORMATION) + KeyValueInformation->NameLength;
-            break;
-        case 'REG0':
-            KeyValueInformation->Type       = REG_SZ;
-            KeyValueInformation->NameLength = sizeof(L"Common AppDatz") - 2;
-            memcpy(&KeyValueInformation->Name[0], L"Common AppData", KeyValueInformation->NameLength);
-            *ResultLength = sizeof(KEY_VALUE_BASIC_INFORMATION) + KeyValueInformation->NameLength;
-            break;
-        case 'REG2':
-            KeyValueInformation->Type       = REG_SZ;
-            KeyValueInformation->NameLength = sizeof(L"Common AppDatz") - 2;
-            memcpy(&KeyValueInformation->Name[0], L"Common AppData", KeyValueInformation->NameLength);
-            *ResultLength = sizeof(KEY_VALUE_BASIC_INFORMATION) + KeyValueInformation->NameLength;
-            break;
-        default:
-            DebugLog("NOT SUPPROTED KEY");
-            return -1;
-    }
+    if ((Value = registry_value_index(Key, Index)) == NULL)
+        return STATUS_NO_MORE_ENTRIES;
 
-    return 0;
+    return FillValueInformation(Value, KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
 }
 
 STATIC NTSTATUS WINAPI NtQueryValueKey(
  HANDLE                      KeyHandle,
- PVOID                       ValueName,
+ PUNICODE_STRING             ValueName,
  DWORD                       KeyValueInformationClass,
- PKEY_VALUE_PARTIAL_INFORMATION KeyValueInformation,
+ PVOID                       KeyValueInformation,
  ULONG                       Length,
  PULONG                      ResultLength
 )
 {
-    DebugLog("%p, %p, %u, %u, %u, %p", KeyHandle, ValueName, KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
+    const REG_KEY *Key = registry_from_handle(KeyHandle);
+    const REG_VALUE *Value;
 
-    if (KeyValueInformationClass != 2) {
-        DebugLog("NOT SUPPROTED");
-        return -1;
-    }
+    DebugLog("%p, %p, %u, %p, %u, %p", KeyHandle, ValueName, KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
 
-    switch ((DWORD) KeyHandle) {
-        case 'REG1':
-            KeyValueInformation->Type = REG_SZ;
-            KeyValueInformation->DataLength = sizeof(L"Common AppData") - 2;
-            memcpy(&KeyValueInformation->Data[0], L"Common AppData", KeyValueInformation->DataLength);
-            *ResultLength = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + KeyValueInformation->DataLength;
-            break;
-        case 'REG0':
-            KeyValueInformation->Type = REG_SZ;
-            KeyValueInformation->DataLength = sizeof(L"Common AppData") - 2;
-            memcpy(&KeyValueInformation->Data[0], L"Common AppData", KeyValueInformation->DataLength);
-            *ResultLength = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + KeyValueInformation->DataLength;
-            break;
-        case 'REG2':
-            KeyValueInformation->Type = REG_SZ;
-            KeyValueInformation->DataLength = sizeof(L"Common AppData") - 2;
-            memcpy(&KeyValueInformation->Data[0], L"Common AppData", KeyValueInformation->DataLength);
-            *ResultLength = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + KeyValueInformation->DataLength;
-            break;
-        default:
-            DebugLog("NOT SUPPORTED KEY");
-            return -1;
+    if (Key == NULL)
+        return STATUS_INVALID_HANDLE;
+
+    // Counted strings aren't terminated.
+    if (ValueName) {
+        Value = registry_value(Key, (const uint16_t *) ValueName->Buffer, ValueName->Length / sizeof(uint16_t));
+    } else {
+        Value = registry_value(Key, NULL, 0);
     }
 
-    return 0;
+    if (Value == NULL)
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    return FillValueInformation(Value, KeyValueInformationClass, KeyValueInformation, Length, ResultLength);
 }
 
-STATIC LONG WINAPI RegCreateKeyExW(HANDLE hKey, PVOID lpSubKey, DWORD Reserved, PVOID lpClass, DWORD dwOptions, PVOID samDesired, PVOID lpSecurityAttributes, PVOID phkResult, PDWORD lpdwDisposition)
+// The hive is read-only, so keys that don't exist are given a handle to an
+// empty key and anything written to it is discarded.
+STATIC LONG WINAPI RegCreateKeyExW(HANDLE hKey, PVOID lpSubKey, DWORD Reserved, PVOID lpClass, DWORD dwOptions, PVOID samDesired, PVOID lpSecurityAttributes, PHANDLE phkResult, PDWORD lpdwDisposition)
 {
+    const REG_KEY *Key = registry_from_handle(hKey);
+
     DebugLog("%p, %p, %#x, %p, %#x, %p, %p, %p, %p",
              hKey,
              lpSubKey,
@@ -190,14 +378,34 @@ STATIC LONG WINAPI RegCreateKeyExW(HANDLE hKey, PVOID lpSubKey, DWORD Reserved,
              lpSecurityAttributes,
              phkResult,
              lpdwDisposition);
-    return 0;
+
+    if (Key == NULL)
+        return ERROR_INVALID_HANDLE;
+
+    if (lpSubKey && (Key = registry_open(Key, lpSubKey, CountWideChars(lpSubKey))) == NULL) {
+        *phkResult = registry_handle(registry_volatile_key());
+
+        if (lpdwDisposition)
+            *lpdwDisposition = REG_CREATED_NEW_KEY;
+
+        return ERROR_SUCCESS;
+    }
+
+    *phkResult = registry_handle(Key);
+
+    if (lpdwDisposition)
+        *lpdwDisposition = REG_OPENED_EXISTING_KEY;
+
+    return ERROR_SUCCESS;
 }
 
 
 DECLARE_CRT_EXPORT("RegOpenKeyExW", RegOpenKeyExW);
 DECLARE_CRT_EXPORT("RegCloseKey", RegCloseKey);
 DECLARE_CRT_EXPORT("RegQueryInfoKeyW", RegQueryInfoKeyW);
+DECLARE_CRT_EXPORT("RegEnumKeyExW", RegEnumKeyExW);
+DECLARE_CRT_EXPORT("RegEnumValueW", RegEnumValueW);
+DECLARE_CRT_EXPORT("RegQueryValueExW", RegQueryValueExW);
 DECLARE_CRT_EXPORT("NtEnumerateValueKey", NtEnumerateValueKey);
 DECLARE_CRT_EXPORT("NtQueryValueKey", NtQueryValueKey);
 DECLARE_CRT_EXPORT("RegCreateKeyExW", RegCreateKeyExW);
-
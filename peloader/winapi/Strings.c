@@ -14,86 +14,115 @@
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "Files.h"
 
 #define MB_ERR_INVALID_CHARS 8
 #define MB_PRECOMPOSED 1
+#define WC_ERR_INVALID_CHARS 0x80
+
+#define CP_ACP 0
+#define CP_OEMCP 1
+#define CP_THREAD_ACP 3
+#define CP_UTF8 65001
+
+// GetACP() says the ANSI codepage is UTF-8, so all of these are the same.
+static bool IsUtf8CodePage(UINT CodePage)
+{
+    switch (CodePage) {
+        case CP_ACP:
+        case CP_OEMCP:
+        case CP_THREAD_ACP:
+        case CP_UTF8:
+            return true;
+    }
+
+    return false;
+}
 
 STATIC int WINAPI MultiByteToWideChar(UINT CodePage, DWORD  dwFlags, PCHAR lpMultiByteStr, int cbMultiByte, PUSHORT lpWideCharStr, int cchWideChar)
 {
-    size_t i;
+    bool Invalid = false;
+    size_t Length;
+    size_t Required;
 
-    DebugLog("%u, %#x, %p, %u, %p, %u", CodePage, dwFlags, lpMultiByteStr, cbMultiByte, lpWideCharStr, cchWideChar);
+    DebugLog("%u, %#x, %p, %d, %p, %d", CodePage, dwFlags, lpMultiByteStr, cbMultiByte, lpWideCharStr, cchWideChar);
 
     if ((dwFlags & ~(MB_ERR_INVALID_CHARS | MB_PRECOMPOSED)) != 0) {
         LogMessage("Unsupported Conversion Flags %#x", dwFlags);
     }
 
-    if (CodePage != 0 && CodePage != 65001) {
+    if (!IsUtf8CodePage(CodePage)) {
         DebugLog("Unsupported CodePage %u", CodePage);
     }
 
-    if (cbMultiByte == 0)
+    if (lpMultiByteStr == NULL || cbMultiByte == 0 || cbMultiByte < -1 || cchWideChar < 0
+     || (cchWideChar && lpWideCharStr == NULL)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return 0;
+    }
 
-    if (cbMultiByte == -1)
-        cbMultiByte = strlen(lpMultiByteStr) + 1;
-
-    if (cchWideChar == 0)
-        return cbMultiByte;
+    // -1 means nul terminated, and the terminator is included in the result.
+    Length   = cbMultiByte == -1 ? strlen(lpMultiByteStr) + 1 : cbMultiByte;
+    Required = string_utf8_to_utf16(lpMultiByteStr, Length, cchWideChar ? lpWideCharStr : NULL, cchWideChar, &Invalid);
 
-    // cbMultibyte is the number of *bytes* to process.
-    // cchWideChar is the number of output *chars* expected.
-    if (cbMultiByte > cchWideChar) {
+    if (Invalid && (dwFlags & MB_ERR_INVALID_CHARS)) {
+        SetLastError(ERROR_NO_UNICODE_TRANSLATION);
         return 0;
     }
 
-    for (i = 0; i < cbMultiByte; i++) {
-        lpWideCharStr[i] = (uint8_t) lpMultiByteStr[i];
-        if (dwFlags & MB_ERR_INVALID_CHARS) {
-            if (!isascii(lpMultiByteStr[i]) || iscntrl(lpMultiByteStr[i])) {
-                lpWideCharStr[i] = '?';
-            }
-        }
+    // A size query.
+    if (cchWideChar == 0)
+        return Required;
+
+    if (Required > cchWideChar) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
     }
 
-    return i;
+    return Required;
 }
 
 STATIC int WINAPI WideCharToMultiByte(UINT CodePage, DWORD dwFlags, PVOID lpWideCharStr, int cchWideChar, PVOID lpMultiByteStr, int cbMultiByte, PVOID lpDefaultChar, PVOID lpUsedDefaultChar)
 {
-    char *ansi = NULL;
+    bool Invalid = false;
+    size_t Length;
+    size_t Required;
 
     DebugLog("%u, %#x, %p, %d, %p, %d, %p, %p", CodePage, dwFlags, lpWideCharStr, cchWideChar, lpMultiByteStr, cbMultiByte, lpDefaultChar, lpUsedDefaultChar);
 
-    if (cchWideChar != -1) {
-        // Add a nul terminator.
-        PVOID tmpStr = calloc(cchWideChar + 1, sizeof(USHORT));
-        memcpy(tmpStr, lpWideCharStr, cchWideChar);
-        ansi = CreateAnsiFromWide(tmpStr);
-        free(tmpStr);
-    } else {
-        ansi = CreateAnsiFromWide(lpWideCharStr);
+    if (!IsUtf8CodePage(CodePage)) {
+        DebugLog("Unsupported CodePage %u", CodePage);
     }
 
-    // This really can happen
-    if (ansi == NULL) {
+    if (lpWideCharStr == NULL || cchWideChar == 0 || cchWideChar < -1 || cbMultiByte < 0
+     || (cbMultiByte && lpMultiByteStr == NULL)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return 0;
     }
 
-    DebugLog("cchWideChar == %d, Ansi: [%s]", cchWideChar, ansi);
+    // Every character can be represented in UTF-8, so the default character
+    // is never needed.
+    if (lpUsedDefaultChar) {
+        *(BOOL *) lpUsedDefaultChar = FALSE;
+    }
+
+    Length   = cchWideChar == -1 ? CountWideChars(lpWideCharStr) + 1 : cchWideChar;
+    Required = string_utf16_to_utf8(lpWideCharStr, Length, cbMultiByte ? lpMultiByteStr : NULL, cbMultiByte, &Invalid);
 
-    if (lpMultiByteStr && strlen(ansi) < cbMultiByte) {
-        strcpy(lpMultiByteStr, ansi);
-        free(ansi);
-        return strlen(lpMultiByteStr) + 1;
-    } else if (!lpMultiByteStr && cbMultiByte == 0) {
-        int len = strlen(ansi) + 1;
-        free(ansi);
-        return len;
+    if (Invalid && (dwFlags & WC_ERR_INVALID_CHARS)) {
+        SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+        return 0;
     }
 
-    free(ansi);
-    return 0;
+    if (cbMultiByte == 0)
+        return Required;
+
+    if (Required > cbMultiByte) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return 0;
+    }
+
+    return Required;
 }
 
 STATIC BOOL WINAPI GetStringTypeA(DWORD locale, DWORD dwInfoType, PUSHORT lpSrcStr, int cchSrc, PUSHORT lpCharType)
@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "winnt_types.h"
 #include "pe_linker.h"
@@ -14,6 +16,33 @@
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "handles.h"
+#include "Files.h"
+#include "IoCompletion.h"
+
+#define THREADPOOL_IO_THREADS 4
+
+typedef VOID (WINAPI *PTP_WIN32_IO_CALLBACK)(PVOID Instance,
+                                             PVOID Context,
+                                             PVOID Overlapped,
+                                             ULONG IoResult,
+                                             ULONG_PTR NumberOfBytesTransferred,
+                                             PVOID Io);
+
+typedef struct _TP_IO {
+    FILE_OBJECT *File;
+    PTP_WIN32_IO_CALLBACK Callback;
+    PVOID Context;
+    LONG Pending;       // Calls to StartThreadpoolIo() without a callback yet.
+    BOOL Closed;
+} TP_IO, *PTP_IO;
+
+// Every thread pool I/O object is associated with this port, the key is the
+// TP_IO, and a few threads wait on it to run the callbacks.
+static COMPLETION_PORT *ThreadpoolPort;
+static pthread_once_t ThreadpoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ThreadpoolIoLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ThreadpoolIoIdle = PTHREAD_COND_INITIALIZER;
 
 static __stdcall PVOID CreateThreadPoolWait(PVOID pwa)
 {
@@ -66,22 +95,157 @@ static __stdcall void WakeAllConditionVariable(PVOID ConditionVariable)
 static __stdcall PVOID CreateThreadpoolWait() { DebugLog(""); return NULL; }
 static __stdcall PVOID SetThreadpoolWait() { DebugLog(""); return NULL; }
 static __stdcall PVOID SubmitThreadpoolWork() { DebugLog(""); return NULL; }
-static __stdcall PVOID CancelThreadpoolIo() { DebugLog(""); return NULL; }
 static __stdcall PVOID CloseThreadpool() { DebugLog(""); return NULL; }
-static __stdcall PVOID CloseThreadpoolIo() { DebugLog(""); return NULL; }
 static __stdcall PVOID CloseThreadpoolWait() { DebugLog(""); return NULL; }
 static __stdcall void CloseThreadpoolWork(PVOID pwk)
 {
     DebugLog("%p", pwk);
 }
 static __stdcall PVOID CreateThreadpool() { DebugLog(""); return NULL; }
-static __stdcall PVOID CreateThreadpoolIo() { DebugLog(""); return NULL; }
 static __stdcall PVOID SetThreadpoolThreadMaximum() { DebugLog(""); return NULL; }
 static __stdcall PVOID SetThreadpoolThreadMinimum() { DebugLog(""); return NULL; }
-static __stdcall PVOID StartThreadpoolIo() { DebugLog(""); return NULL; }
-static __stdcall PVOID WaitForThreadpoolIoCallbacks() { DebugLog(""); return NULL; }
 static __stdcall PVOID WaitForThreadpoolWaitCallbacks() { DebugLog(""); return NULL; }
 
+static void ThreadpoolIoRelease(PTP_IO Io)
+{
+    BOOL Free;
+
+    pthread_mutex_lock(&ThreadpoolIoLock);
+
+    if (Io->Pending > 0)
+        Io->Pending--;
+
+    if (Io->Pending == 0)
+        pthread_cond_broadcast(&ThreadpoolIoIdle);
+
+    Free = Io->Closed && Io->Pending == 0;
+
+    pthread_mutex_unlock(&ThreadpoolIoLock);
+
+    if (Free)
+        free(Io);
+}
+
+static void *ThreadpoolIoWorker(void *Unused)
+{
+    COMPLETION_PACKET Packet;
+    PTP_IO Io;
+
+    // The callbacks are Windows code, which expects a thread information block.
+    setup_nt_threadinfo(NULL);
+
+    while (true) {
+        if (!DequeueCompletionPacket(ThreadpoolPort, &Packet, INFINITE))
+            continue;
+
+        Io = (PTP_IO) Packet.key;
+
+        Io->Callback(NULL, Io->Context, Packet.overlapped, IoStatusToWinError(Packet.status), Packet.bytes, Io);
+
+        ThreadpoolIoRelease(Io);
+    }
+
+    return NULL;
+}
+
+static void ThreadpoolIoInit(void)
+{
+    pthread_t Thread;
+
+    if ((ThreadpoolPort = AllocateCompletionPort()) == NULL)
+        return;
+
+    for (int i = 0; i < THREADPOOL_IO_THREADS; i++) {
+        if (pthread_create(&Thread, NULL, ThreadpoolIoWorker, NULL) != 0) {
+            l_warning("failed to create thread pool i/o thread");
+            break;
+        }
+
+        pthread_detach(Thread);
+    }
+}
+
+static __stdcall PTP_IO CreateThreadpoolIo(HANDLE fl, PTP_WIN32_IO_CALLBACK pfnio, PVOID pv, PVOID pcbe)
+{
+    FILE_OBJECT *File = file_from_handle(fl);
+    PTP_IO Io;
+
+    DebugLog("%p, %p, %p, %p", fl, pfnio, pv, pcbe);
+
+    pthread_once(&ThreadpoolOnce, ThreadpoolIoInit);
+
+    if (File == NULL) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+
+    if (ThreadpoolPort == NULL || (Io = calloc(1, sizeof(TP_IO))) == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        handle_release(&File->header);
+        return NULL;
+    }
+
+    // The reference from file_from_handle() is kept until CloseThreadpoolIo().
+    Io->File     = File;
+    Io->Callback = pfnio;
+    Io->Context  = pv;
+
+    AssociateCompletionPort(File, ThreadpoolPort, (ULONG_PTR) Io);
+
+    return Io;
+}
+
+// This must be called before every overlapped request on the file.
+static __stdcall void StartThreadpoolIo(PTP_IO pio)
+{
+    DebugLog("%p", pio);
+
+    pthread_mutex_lock(&ThreadpoolIoLock);
+    pio->Pending++;
+    pthread_mutex_unlock(&ThreadpoolIoLock);
+}
+
+// The request failed to start, so there will be no callback.
+static __stdcall void CancelThreadpoolIo(PTP_IO pio)
+{
+    DebugLog("%p", pio);
+
+    ThreadpoolIoRelease(pio);
+}
+
+static __stdcall void WaitForThreadpoolIoCallbacks(PTP_IO pio, BOOL fCancelPendingCallbacks)
+{
+    DebugLog("%p, %d", pio, fCancelPendingCallbacks);
+
+    // Requests already submitted can't be recalled, so wait even if asked
+    // to cancel.
+    pthread_mutex_lock(&ThreadpoolIoLock);
+
+    while (pio->Pending > 0)
+        pthread_cond_wait(&ThreadpoolIoIdle, &ThreadpoolIoLock);
+
+    pthread_mutex_unlock(&ThreadpoolIoLock);
+}
+
+// The object is freed once the outstanding callbacks have run.
+static __stdcall void CloseThreadpoolIo(PTP_IO pio)
+{
+    BOOL Free;
+
+    DebugLog("%p", pio);
+
+    pthread_mutex_lock(&ThreadpoolIoLock);
+    pio->Closed = TRUE;
+    Free = pio->Pending == 0;
+    pthread_mutex_unlock(&ThreadpoolIoLock);
+
+    AssociateCompletionPort(pio->File, NULL, 0);
+    handle_release(&pio->File->header);
+
+    if (Free)
+        free(pio);
+}
+
 static __stdcall void WaitForThreadpoolWorkCallbacks(PVOID pwk, BOOL fCancelPendingCallbacks)
 {
     DebugLog("%p %d", pwk, fCancelPendingCallbacks);
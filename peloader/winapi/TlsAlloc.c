@@ -11,6 +11,7 @@
 #include "log.h"
 #include "winexports.h"
 #include "util.h"
+#include "stats.h"
 
 #ifndef TLS_OUT_OF_INDEXES
 # define TLS_OUT_OF_INDEXES 0xFFFFFFFF
@@ -21,6 +22,14 @@ static int TlsIndex = 1;
 extern uintptr_t LocalStorage[1024];
 extern PFLS_CALLBACK_FUNCTION FlsCallbacks[1024];
 
+// Slots are never reused, so everything below TlsIndex is in use.
+static uint64_t tls_slots(void)
+{
+    return TlsIndex - 1;
+}
+
+static DECLARE_STATS_PROBE(TlsSlots, "tls.slots", tls_slots);
+
 STATIC DWORD WINAPI TlsAlloc(void)
 {
     if (TlsIndex >= ARRAY_SIZE(LocalStorage) - 1) {
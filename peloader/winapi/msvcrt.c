@@ -37,13 +37,13 @@
 #include <fpu_control.h>
 
 #include "winnt_types.h"
-#include "codealloc.h"
 #include "pe_linker.h"
 #include "ntoskernel.h"
 #include "log.h"
 #include "winexports.h"
 #include "util.h"
 #include "winstrings.h"
+#include "heapprof.h"
 
 /* fpclass constants */
 #define MSVCRT__FPCLASS_SNAN 0x0001  /* Signaling "Not a Number" */
@@ -163,12 +163,22 @@ static void _unlock(int locknum)
 
 static void * operator_new(uint32_t sz)
 {
-    return malloc(sz);
+    return heap_alloc(__builtin_return_address(0), sz, false);
 }
 
 static void operator_delete(void* ptr)
 {
-    free(ptr);
+    heap_free(ptr);
+}
+
+static void * msvcrt_malloc(size_t size)
+{
+    return heap_alloc(__builtin_return_address(0), size, false);
+}
+
+static void msvcrt_free(void *ptr)
+{
+    heap_free(ptr);
 }
 
 int __control87_2( unsigned int newval, unsigned int mask,
@@ -497,8 +507,8 @@ DECLARE_CRT_EXPORT("_lock", _lock);
 DECLARE_CRT_EXPORT("_unlock", _unlock);
 DECLARE_CRT_EXPORT("??2@YAPAXI@Z", operator_new);
 DECLARE_CRT_EXPORT("??3@YAXPAX@Z", operator_delete);
-DECLARE_CRT_EXPORT("malloc", malloc);
-DECLARE_CRT_EXPORT("free", free);
+DECLARE_CRT_EXPORT("malloc", msvcrt_malloc);
+DECLARE_CRT_EXPORT("free", msvcrt_free);
 DECLARE_CRT_EXPORT("setlocale", setlocale);
 DECLARE_CRT_EXPORT("_strdup", strdup);
 DECLARE_CRT_EXPORT("getenv", getenv);
@@ -56,13 +56,24 @@
 #define STATUS_DELETE_PENDING           0xC0000056
 #define STATUS_INSUFFICIENT_RESOURCES   0xC000009A
 #define STATUS_NOT_SUPPORTED            0xC00000BB
+#define STATUS_UNEXPECTED_IO_ERROR      0xC00000E9
 #define STATUS_INVALID_PARAMETER_2      0xC00000F0
+#define STATUS_INVALID_HANDLE           0xC0000008
 #define STATUS_NO_MEMORY                0xC0000017
+#define STATUS_CONFLICTING_ADDRESSES    0xC0000018
+#define STATUS_UNABLE_TO_FREE_VM        0xC000001A
+#define STATUS_NOT_COMMITTED            0xC000002D
+#define STATUS_INVALID_PAGE_PROTECTION  0xC0000045
+#define STATUS_FREE_VM_NOT_AT_BASE      0xC000009F
+#define STATUS_MEMORY_NOT_ALLOCATED     0xC00000A0
+#define STATUS_END_OF_FILE              0xC0000011
+#define STATUS_OBJECT_NAME_NOT_FOUND    0xC0000034
 #define STATUS_CANCELLED                0xC0000120
 #define STATUS_DEVICE_REMOVED           0xC00002B6
 #define STATUS_DEVICE_NOT_CONNECTED     0xC000009D
 
 #define STATUS_BUFFER_OVERFLOW          0x80000005
+#define STATUS_NO_MORE_ENTRIES          0x8000001A
 
 #define SL_PENDING_RETURNED             0x01
 #define SL_INVOKE_ON_CANCEL             0x20
@@ -128,6 +139,7 @@
 #define WMIUPDATE                       1
 
 #define ERROR_FILE_NOT_FOUND 2
+#define FILE_ATTRIBUTE_READONLY 1
 #define FILE_ATTRIBUTE_DIRECTORY 16
 #define FILE_ATTRIBUTE_ARCHIVE 32
 #define FILE_ATTRIBUTE_NORMAL 128
@@ -1530,6 +1542,10 @@ typedef struct _KUSER_SHARED_DATA {
 #define REG_EXPAND_SZ                   (2)
 #define REG_BINARY                      (3)
 #define REG_DWORD                       (4)
+#define REG_DWORD_BIG_ENDIAN            (5)
+#define REG_LINK                        (6)
+#define REG_MULTI_SZ                    (7)
+#define REG_QWORD                       (11)
 
 #define RTL_REGISTRY_ABSOLUTE           0
 #define RTL_REGISTRY_SERVICES           1
@@ -1877,6 +1893,19 @@ typedef struct _WIN32_FIND_DATAA {
     CHAR     cAlternateFileName[14];
 } WIN32_FIND_DATAA, *PWIN32_FIND_DATAA, *LPWIN32_FIND_DATAA;
 
+typedef struct _WIN32_FIND_DATAW {
+    DWORD    dwFileAttributes;
+    FILETIME ftCreationTime;
+    FILETIME ftLastAccessTime;
+    FILETIME ftLastWriteTime;
+    DWORD    nFileSizeHigh;
+    DWORD    nFileSizeLow;
+    DWORD    dwReserved0;
+    DWORD    dwReserved1;
+    WCHAR    cFileName[MAX_PATH];
+    WCHAR    cAlternateFileName[14];
+} WIN32_FIND_DATAW, *PWIN32_FIND_DATAW, *LPWIN32_FIND_DATAW;
+
 typedef struct _WIN32_FILE_ATTRIBUTE_DATA {
     DWORD    dwFileAttributes;
     FILETIME ftCreationTime;
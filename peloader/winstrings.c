@@ -15,44 +15,615 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 
-#include "strings.h"
+#if defined(__i386__) || defined(__x86_64__)
+# include <immintrin.h>
+#endif
 
-char *string_from_wchar(const void *wcharbuf, size_t len)
+#include "util.h"
+#include "winstrings.h"
+
+#define REPLACEMENT_CHARACTER   0xFFFD
+#define INVALID_CODEPOINT       0xFFFFFFFF
+
+// Most strings Windows code converts are ASCII, so runs of ASCII are handled
+// in blocks. These convert as many leading ASCII units as they can and return
+// how many were converted, output may be NULL to just count them.
+typedef size_t (*ascii_kernel_t)(const void *input, size_t length, void *output);
+
+// The portable versions check eight units at a time.
+static size_t widen_ascii_scalar(const void *input, size_t length, void *output)
 {
-    uint16_t *inbuf = wcharbuf;
-    uint8_t *outbuf = NULL;
-    void *buf;
-    size_t count    = 0;
+    const uint8_t *in = input;
+    uint16_t *out = output;
+    size_t i;
 
-    if (wcharbuf == NULL)
-        return NULL;
+    for (i = 0; i + 8 <= length; i += 8) {
+        uint64_t block;
+
+        memcpy(&block, in + i, sizeof block);
+
+        if (block & 0x8080808080808080ULL)
+            break;
+
+        if (out) {
+            for (size_t j = 0; j < 8; j++) {
+                out[i + j] = in[i + j];
+            }
+        }
+    }
+
+    return i;
+}
+
+static size_t narrow_ascii_scalar(const void *input, size_t length, void *output)
+{
+    const uint16_t *in = input;
+    uint8_t *out = output;
+    size_t i;
+
+    for (i = 0; i + 4 <= length; i += 4) {
+        uint64_t block;
+
+        memcpy(&block, in + i, sizeof block);
+
+        if (block & 0xFF80FF80FF80FF80ULL)
+            break;
+
+        if (out) {
+            for (size_t j = 0; j < 4; j++) {
+                out[i + j] = in[i + j];
+            }
+        }
+    }
+
+    return i;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+// SSE2 isn't part of the i386 baseline, so these are only used if the cpu
+// says it's available.
+__attribute__((target("sse2")))
+static size_t widen_ascii_sse2(const void *input, size_t length, void *output)
+{
+    const uint8_t *in = input;
+    uint16_t *out = output;
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+
+        if (_mm_movemask_epi8(block))
+            break;
+
+        if (out) {
+            _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(block, zero));
+            _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(block, zero));
+        }
+    }
 
-    buf = outbuf = malloc(len + 1);
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t narrow_ascii_sse2(const void *input, size_t length, void *output)
+{
+    const uint16_t *in = input;
+    uint8_t *out = output;
+    __m128i mask = _mm_set1_epi16(0xFF80);
+    __m128i zero = _mm_setzero_si128();
+    size_t i;
 
-    while (*outbuf++ = *inbuf++) {
-        if (++count >= len) {
-            *outbuf = '\0';
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i low  = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i high = _mm_loadu_si128((const __m128i *)(in + i + 8));
+        __m128i bits = _mm_and_si128(_mm_or_si128(low, high), mask);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(bits, zero)) != 0xFFFF)
             break;
+
+        if (out) {
+            _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(low, high));
+        }
+    }
+
+    return i;
+}
+#endif
+
+// Windows code uses 16-bit strings, glibc can't help because its wchar_t is
+// 32 bits. The scan kernels return the index of the first unit that is either
+// nul or c, or limit if there isn't one before that.
+//
+// They use aligned loads, which can read before the start of the string or
+// past the terminator but never cross into the next page, so they can't fault
+// where the scalar loop wouldn't. That only works if the string is aligned to
+// its element size, misaligned strings are handled by the scalar version.
+typedef size_t (*scan_kernel_t)(const uint16_t *s, uint16_t c, size_t limit);
+
+// The compare kernels return the difference of the first pair of units that
+// differ, optionally folding ASCII case first. Loads are unaligned, so they
+// check for page boundaries instead.
+typedef int (*compare_kernel_t)(const uint16_t *a, const uint16_t *b, bool fold);
+
+#define PAGE_SIZE_BYTES 4096
+#define NEAR_PAGE_END(p, width) (((uintptr_t)(p) & (PAGE_SIZE_BYTES - 1)) > PAGE_SIZE_BYTES - (width))
+
+static inline uint16_t fold_ascii(uint16_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static size_t wide_scan_scalar(const uint16_t *s, uint16_t c, size_t limit)
+{
+    size_t i;
+
+    for (i = 0; i < limit && s[i] && s[i] != c; i++)
+        ;
+
+    return i;
+}
+
+static int wide_compare_scalar(const uint16_t *a, const uint16_t *b, bool fold)
+{
+    uint16_t x, y;
+
+    do {
+        x = fold ? fold_ascii(*a++) : *a++;
+        y = fold ? fold_ascii(*b++) : *b++;
+    } while (x && x == y);
+
+    return x - y;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("sse2")))
+static size_t wide_scan_sse2(const uint16_t *s, uint16_t c, size_t limit)
+{
+    uintptr_t offset = (uintptr_t) s & 15;
+    const uint8_t *p = (const uint8_t *) s - offset;
+    __m128i zero = _mm_setzero_si128();
+    __m128i match = _mm_set1_epi16(c);
+    uint32_t mask = ~0U << offset;
+
+    if ((uintptr_t) s & 1)
+        return wide_scan_scalar(s, c, limit);
+
+    for (;;) {
+        __m128i block = _mm_load_si128((const __m128i *) p);
+
+        mask &= _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(block, zero),
+                                               _mm_cmpeq_epi16(block, match)));
+
+        if (mask)
+            return MIN((size_t)(p + __builtin_ctz(mask) - (const uint8_t *) s) / 2, limit);
+
+        p += 16;
+        mask = ~0U;
+
+        if ((size_t)(p - (const uint8_t *) s) / 2 >= limit)
+            return limit;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t wide_scan_avx2(const uint16_t *s, uint16_t c, size_t limit)
+{
+    uintptr_t offset = (uintptr_t) s & 31;
+    const uint8_t *p = (const uint8_t *) s - offset;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i match = _mm256_set1_epi16(c);
+    uint32_t mask = ~0U << offset;
+
+    if ((uintptr_t) s & 1)
+        return wide_scan_scalar(s, c, limit);
+
+    for (;;) {
+        __m256i block = _mm256_load_si256((const __m256i *) p);
+
+        mask &= _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi16(block, zero),
+                                                     _mm256_cmpeq_epi16(block, match)));
+
+        if (mask)
+            return MIN((size_t)(p + __builtin_ctz(mask) - (const uint8_t *) s) / 2, limit);
+
+        p += 32;
+        mask = ~0U;
+
+        if ((size_t)(p - (const uint8_t *) s) / 2 >= limit)
+            return limit;
+    }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i fold_ascii_sse2(__m128i v)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16('A' - 1)),
+                                  _mm_cmplt_epi16(v, _mm_set1_epi16('Z' + 1)));
+
+    return _mm_add_epi16(v, _mm_and_si128(upper, _mm_set1_epi16('a' - 'A')));
+}
+
+__attribute__((target("sse2")))
+static int wide_compare_sse2(const uint16_t *a, const uint16_t *b, bool fold)
+{
+    __m128i zero = _mm_setzero_si128();
+
+    for (;;) {
+        __m128i x, y;
+        uint32_t mask;
+
+        // Step over the page boundary a unit at a time.
+        if (NEAR_PAGE_END(a, 16) || NEAR_PAGE_END(b, 16)) {
+            uint16_t u = fold ? fold_ascii(*a++) : *a++;
+            uint16_t v = fold ? fold_ascii(*b++) : *b++;
+
+            if (u == 0 || u != v)
+                return u - v;
+
+            continue;
+        }
+
+        x = _mm_loadu_si128((const __m128i *) a);
+        y = _mm_loadu_si128((const __m128i *) b);
+
+        if (fold) {
+            x = fold_ascii_sse2(x);
+            y = fold_ascii_sse2(y);
+        }
+
+        // Units that are nul or differ.
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi16(x, zero),
+                                              _mm_andnot_si128(_mm_cmpeq_epi16(x, y), _mm_set1_epi16(-1))));
+
+        if (mask) {
+            size_t i = __builtin_ctz(mask) / 2;
+
+            return fold ? fold_ascii(a[i]) - fold_ascii(b[i]) : a[i] - b[i];
+        }
+
+        a += 8;
+        b += 8;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_ascii_avx2(__m256i v)
+{
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi16(v, _mm256_set1_epi16('A' - 1)),
+                                     _mm256_cmpgt_epi16(_mm256_set1_epi16('Z' + 1), v));
+
+    return _mm256_add_epi16(v, _mm256_and_si256(upper, _mm256_set1_epi16('a' - 'A')));
+}
+
+__attribute__((target("avx2")))
+static int wide_compare_avx2(const uint16_t *a, const uint16_t *b, bool fold)
+{
+    __m256i zero = _mm256_setzero_si256();
+
+    for (;;) {
+        __m256i x, y;
+        uint32_t mask;
+
+        if (NEAR_PAGE_END(a, 32) || NEAR_PAGE_END(b, 32)) {
+            uint16_t u = fold ? fold_ascii(*a++) : *a++;
+            uint16_t v = fold ? fold_ascii(*b++) : *b++;
+
+            if (u == 0 || u != v)
+                return u - v;
+
+            continue;
+        }
+
+        x = _mm256_loadu_si256((const __m256i *) a);
+        y = _mm256_loadu_si256((const __m256i *) b);
+
+        if (fold) {
+            x = fold_ascii_avx2(x);
+            y = fold_ascii_avx2(y);
+        }
+
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi16(x, zero),
+                                                    _mm256_andnot_si256(_mm256_cmpeq_epi16(x, y), _mm256_set1_epi16(-1))));
+
+        if (mask) {
+            size_t i = __builtin_ctz(mask) / 2;
+
+            return fold ? fold_ascii(a[i]) - fold_ascii(b[i]) : a[i] - b[i];
+        }
+
+        a += 16;
+        b += 16;
+    }
+}
+#endif
+
+static ascii_kernel_t WidenAscii = widen_ascii_scalar;
+static ascii_kernel_t NarrowAscii = narrow_ascii_scalar;
+static scan_kernel_t WideScan = wide_scan_scalar;
+static compare_kernel_t WideCompare = wide_compare_scalar;
+
+static void __constructor select_kernels(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) {
+        WidenAscii  = widen_ascii_sse2;
+        NarrowAscii = narrow_ascii_sse2;
+        WideScan    = wide_scan_sse2;
+        WideCompare = wide_compare_sse2;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        WideScan    = wide_scan_avx2;
+        WideCompare = wide_compare_avx2;
+    }
+#endif
+}
+
+size_t wide_strlen(const uint16_t *s)
+{
+    return WideScan(s, 0, SIZE_MAX);
+}
+
+size_t wide_strnlen(const uint16_t *s, size_t n)
+{
+    return WideScan(s, 0, n);
+}
+
+uint16_t *wide_strchr(const uint16_t *s, uint16_t c)
+{
+    s += WideScan(s, c, SIZE_MAX);
+
+    return *s == c ? (uint16_t *) s : NULL;
+}
+
+int wide_strcmp(const uint16_t *a, const uint16_t *b)
+{
+    return WideCompare(a, b, false);
+}
+
+int wide_stricmp(const uint16_t *a, const uint16_t *b)
+{
+    return WideCompare(a, b, true);
+}
+
+// Decode one UTF-8 sequence, returning the number of bytes used. Invalid
+// input consumes the longest prefix that could have been valid, so each bad
+// sequence becomes exactly one replacement character.
+static size_t decode_utf8(const uint8_t *input, size_t length, uint32_t *codepoint)
+{
+    uint8_t lower = 0x80;
+    uint8_t upper = 0xBF;
+    uint32_t c = input[0];
+    size_t need;
+
+    if (c < 0x80) {
+        *codepoint = c;
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        need = 1;
+        c &= 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        need = 2;
+        lower = c == 0xE0 ? 0xA0 : 0x80;    // Overlong.
+        upper = c == 0xED ? 0x9F : 0xBF;    // Surrogates.
+        c &= 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        need = 3;
+        lower = c == 0xF0 ? 0x90 : 0x80;    // Overlong.
+        upper = c == 0xF4 ? 0x8F : 0xBF;    // Above U+10FFFF.
+        c &= 0x07;
+    } else {
+        *codepoint = INVALID_CODEPOINT;
+        return 1;
+    }
+
+    for (size_t i = 1; i <= need; i++) {
+        if (i >= length || input[i] < lower || input[i] > upper) {
+            *codepoint = INVALID_CODEPOINT;
+            return i;
+        }
+
+        c = c << 6 | (input[i] & 0x3F);
+        lower = 0x80;
+        upper = 0xBF;
+    }
+
+    *codepoint = c;
+    return need + 1;
+}
+
+size_t string_utf8_to_utf16(const char *input, size_t length, uint16_t *output, size_t size, bool *invalid)
+{
+    const uint8_t *in = (const uint8_t *) input;
+    size_t i = 0;
+    size_t count = 0;
+    bool full = output == NULL;
+
+    while (i < length) {
+        uint32_t c;
+        size_t units;
+
+        if (in[i] < 0x80) {
+            size_t ascii;
+
+            // Stop writing at the end of the output, but keep counting.
+            if (full) {
+                ascii = WidenAscii(in + i, length - i, NULL);
+            } else {
+                ascii = WidenAscii(in + i, MIN(length - i, size - count), output + count);
+            }
+
+            if (ascii) {
+                i += ascii;
+                count += ascii;
+                continue;
+            }
+        }
+
+        i += decode_utf8(in + i, length - i, &c);
+
+        if (c == INVALID_CODEPOINT) {
+            c = REPLACEMENT_CHARACTER;
+
+            if (invalid)
+                *invalid = true;
+        }
+
+        units = c >= 0x10000 ? 2 : 1;
+
+        if (!full && count + units > size)
+            full = true;
+
+        if (!full) {
+            if (units == 2) {
+                output[count + 0] = 0xD800 + ((c - 0x10000) >> 10);
+                output[count + 1] = 0xDC00 + ((c - 0x10000) & 0x3FF);
+            } else {
+                output[count] = c;
+            }
+        }
+
+        count += units;
+    }
+
+    return count;
+}
+
+size_t string_utf16_to_utf8(const uint16_t *input, size_t length, char *output, size_t size, bool *invalid)
+{
+    uint8_t *out = (uint8_t *) output;
+    size_t i = 0;
+    size_t count = 0;
+    bool full = output == NULL;
+
+    while (i < length) {
+        uint32_t c = input[i++];
+        size_t bytes;
+
+        if (c < 0x80) {
+            size_t ascii;
+
+            if (full) {
+                ascii = NarrowAscii(input + i - 1, length - i + 1, NULL);
+            } else {
+                ascii = NarrowAscii(input + i - 1, MIN(length - i + 1, size - count), out + count);
+            }
+
+            if (ascii) {
+                i += ascii - 1;
+                count += ascii;
+                continue;
+            }
+        }
+
+        if (c >= 0xD800 && c <= 0xDBFF && i < length && input[i] >= 0xDC00 && input[i] <= 0xDFFF) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (input[i++] - 0xDC00);
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            c = REPLACEMENT_CHARACTER;
+
+            if (invalid)
+                *invalid = true;
         }
+
+        bytes = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+
+        if (!full && count + bytes > size)
+            full = true;
+
+        if (!full) {
+            switch (bytes) {
+                case 1:
+                    out[count] = c;
+                    break;
+                case 2:
+                    out[count + 0] = 0xC0 | c >> 6;
+                    out[count + 1] = 0x80 | (c & 0x3F);
+                    break;
+                case 3:
+                    out[count + 0] = 0xE0 | c >> 12;
+                    out[count + 1] = 0x80 | (c >> 6 & 0x3F);
+                    out[count + 2] = 0x80 | (c & 0x3F);
+                    break;
+                case 4:
+                    out[count + 0] = 0xF0 | c >> 18;
+                    out[count + 1] = 0x80 | (c >> 12 & 0x3F);
+                    out[count + 2] = 0x80 | (c >> 6 & 0x3F);
+                    out[count + 3] = 0x80 | (c & 0x3F);
+                    break;
+            }
+        }
+
+        count += bytes;
     }
 
+    return count;
+}
+
+// Convert at most len characters, stopping at a nul terminator.
+char *string_from_wchar(const void *wcharbuf, size_t len)
+{
+    const uint16_t *inbuf = wcharbuf;
+    size_t length;
+    size_t size;
+    char *buf;
+
+    if (wcharbuf == NULL)
+        return NULL;
+
+    length = wide_strnlen(inbuf, len);
+
+    size = string_utf16_to_utf8(inbuf, length, NULL, 0, NULL);
+
+    if ((buf = malloc(size + 1)) == NULL)
+        return NULL;
+
+    string_utf16_to_utf8(inbuf, length, buf, size, NULL);
+
+    buf[size] = '\0';
+
     return buf;
 }
 
 size_t CountWideChars(const void *wcharbuf)
 {
-    size_t i = 0;
-    const uint16_t *p = wcharbuf;
+    if (!wcharbuf) return 0;
 
-    if (!p) return 0;
+    return wide_strlen(wcharbuf);
+}
 
-    while (*p++)
-        i++;
+char *CreateAnsiFromWideBuffer(const void *wcharbuf, char *buffer, size_t size)
+{
+    size_t length;
+    size_t required;
+    char *ansi;
 
-    return i;
+    if (wcharbuf == NULL)
+        return NULL;
+
+    length   = CountWideChars(wcharbuf);
+    required = string_utf16_to_utf8(wcharbuf, length, buffer, size ? size - 1 : 0, NULL);
+
+    if (required < size) {
+        buffer[required] = '\0';
+        return buffer;
+    }
+
+    if ((ansi = malloc(required + 1)) == NULL)
+        return NULL;
+
+    string_utf16_to_utf8(wcharbuf, length, ansi, required, NULL);
+
+    ansi[required] = '\0';
+
+    return ansi;
 }
-char * CreateAnsiFromWide(void *wcharbuf)
+
+char * CreateAnsiFromWide(const void *wcharbuf)
 {
-    return string_from_wchar(wcharbuf, CountWideChars(wcharbuf) * 2);
+    return CreateAnsiFromWideBuffer(wcharbuf, NULL, 0);
 }
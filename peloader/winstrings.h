@@ -1,8 +1,45 @@
 #ifndef __STRINGS_H
 #define __STRINGS_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Convert between UTF-16 and UTF-8. Unpaired surrogates and malformed UTF-8
+// are replaced with U+FFFD, and *invalid (if not NULL) is set when that
+// happens. Lengths are in units of the input and output type, and neither
+// string needs to be nul terminated.
+//
+// These return the number of units needed for the whole input, but never
+// write more than size units, so passing a NULL output is a size query. A
+// sequence that doesn't fit is not written partially.
+size_t string_utf16_to_utf8(const uint16_t *input, size_t length, char *output, size_t size, bool *invalid);
+size_t string_utf8_to_utf16(const char *input, size_t length, uint16_t *output, size_t size, bool *invalid);
+
+// Functions for nul terminated 16-bit strings. Case folding only applies to
+// ASCII.
+size_t wide_strlen(const uint16_t *s);
+size_t wide_strnlen(const uint16_t *s, size_t n);
+uint16_t *wide_strchr(const uint16_t *s, uint16_t c);
+int wide_strcmp(const uint16_t *a, const uint16_t *b);
+int wide_stricmp(const uint16_t *a, const uint16_t *b);
+
 size_t CountWideChars(const void *wcharbuf);
 char * CreateAnsiFromWide(const void *wcharbuf);
 char *string_from_wchar(const void *wcharbuf, size_t len);
 
+// Most names are short enough to convert on the stack, this returns buffer
+// if the result fits, otherwise a string from malloc(). Release the result
+// with FreeAnsi().
+#define ANSI_BUFFER_SIZE 256
+
+char *CreateAnsiFromWideBuffer(const void *wcharbuf, char *buffer, size_t size);
+
+static inline void FreeAnsi(char *ansi, const char *buffer)
+{
+    if (ansi != buffer)
+        free(ansi);
+}
+
 #endif